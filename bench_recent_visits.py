@@ -0,0 +1,63 @@
+"""Compare calls/second of the ctypes and CFFI backends of recent_visits.py.
+
+Usage: python3 bench_recent_visits.py [visits_per_user] [seconds_per_case]
+"""
+import itertools
+import os
+import sys
+import tempfile
+import time
+
+import recent_visits
+
+
+def rate(fn, seconds: float) -> float:
+    """Return how many times per second fn can be called."""
+    calls = 0
+    start = time.perf_counter()
+    deadline = start + seconds
+    while True:
+        for _ in range(100):
+            fn()
+        calls += 100
+        now = time.perf_counter()
+        if now >= deadline:
+            return calls / (now - start)
+
+
+def bench_backend(cls, visits_per_user: int, seconds: float) -> dict:
+    with tempfile.TemporaryDirectory() as tmp:
+        with cls(os.path.join(tmp, "bench.dat"), visits_per_user) as vm:
+            for i in range(visits_per_user):
+                vm.add_visit(1, i + 1, f"https://example.com/page/{i}", f"Example page {i}")
+
+            # New visit IDs evict the oldest visit, so the data set stays the same size.
+            ids = itertools.count(visits_per_user + 1)
+            results = {
+                "add_visit": rate(lambda: vm.add_visit(1, next(ids), "https://example.com/page/x", "Example page x"),
+                                  seconds),
+                "get_recent_visits": rate(lambda: vm.get_recent_visits(1), seconds),
+                "get_recent_visits_unknown_user": rate(lambda: vm.get_recent_visits(2), seconds),
+            }
+    return results
+
+
+def main():
+    visits_per_user = int(sys.argv[1]) if len(sys.argv) > 1 else 100
+    seconds = float(sys.argv[2]) if len(sys.argv) > 2 else 1.0
+
+    backends = [("ctypes", recent_visits.CtypesVisitManager)]
+    if recent_visits.clib is not None:
+        backends.append(("cffi", recent_visits.CffiVisitManager))
+    else:
+        print("_recent_visits_cffi is not built; run `make python` to include the CFFI backend")
+
+    results = {name: bench_backend(cls, visits_per_user, seconds) for name, cls in backends}
+
+    print(f"{'operation':<32}" + "".join(f"{name + ' calls/s':>18}" for name, _ in backends))
+    for op in results["ctypes"]:
+        print(f"{op:<32}" + "".join(f"{results[name][op]:>18,.0f}" for name, _ in backends))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,46 @@
+// Helpers shared by the benchmark and workload tools.
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Fast deterministic random number generator (xorshift64*). state must not be 0.
+static inline uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform random double in [0, 1)
+static inline double next_random_double(uint64_t* state) {
+    return (double)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Monotonic clock in nanoseconds
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of sorted samples, p in [0, 1]
+static inline uint64_t percentile(const uint64_t* sorted, size_t count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t idx = (size_t)(p * (double)(count - 1) + 0.5);
+    return sorted[idx];
+}
+
+#endif /* BENCH_UTIL_H */
@@ -0,0 +1,417 @@
+// Benchmark driver for the VisitManager C API.
+//
+// Sweeps user count, max_visits and string sizes and, for every combination,
+// measures Create (load), GetRecentVisits, AddVisit, Delete, Clear and Free.
+// Each combination runs in a forked child so that the reported peak RSS
+// belongs to that combination only. Results are printed one JSON object per
+// line (or CSV with --csv).
+//
+// Mutating calls persist the whole manager, so their phases stop after
+// --seconds even when fewer than --ops operations were run.
+#ifdef BUILD_BENCH
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bench_util.h"
+#include "recent_visits.h"
+
+#define MAX_SWEEP 16
+
+typedef struct {
+    size_t values[MAX_SWEEP];
+    size_t count;
+} Sweep;
+
+typedef struct {
+    Sweep users;         // Number of users preloaded
+    Sweep max_visits;    // max_visits passed to VisitManagerCreate
+    Sweep url_lens;      // URL length in bytes; text is half as long
+    size_t visits;       // Visits preloaded per user (capped at max_visits)
+    size_t ops;          // Operations per measured phase
+    double seconds;      // Time budget per measured phase
+    uint64_t seed;       // Random seed
+    const char* dir;     // Directory for the snapshot files
+    bool csv;            // Print CSV instead of JSON lines
+} BenchConfig;
+
+// Parameters of one benchmark run
+typedef struct {
+    size_t users;
+    size_t max_visits;
+    size_t url_len;
+    size_t text_len;
+    size_t visits;
+} BenchCase;
+
+// Helper function to fill buf with len printable characters derived from id
+static void fill_string(char* buf, size_t len, const char* prefix, uint64_t id) {
+    int n = snprintf(buf, len + 1, "%s%llu/", prefix, (unsigned long long)id);
+    for (size_t i = n < 0 ? 0 : (size_t)n; i < len; i++) {
+        buf[i] = (char)('a' + (id + i) % 26);
+    }
+    buf[len] = '\0';
+}
+
+// Helper function to write count items of size bytes. Returns false on a short write.
+static bool write_items(FILE* file, const void* data, size_t size, size_t count) {
+    return fwrite(data, size, count, file) == count;
+}
+
+// Write a snapshot in the current (version 3) VisitManager file format so large data sets can be
+// loaded without paying for one full serialization per AddVisit. Like the snapshots the library
+// writes, every URL is stored once in the string dictionary and visits refer to it by ID, while
+// titles are stored inline.
+static bool write_snapshot(const char* path, const BenchCase* bc) {
+    static const char magic[8] = {'R', 'V', 'S', 'N', 'A', 'P', 'S', 'H'};
+    const uint32_t version     = 3;
+    const uint32_t flags       = 0;
+    const uint32_t literal     = 0x80000000u;  // Marks a string stored inline rather than by ID
+    const double half_life     = 0;
+    const uint32_t score_count = 0;
+
+    uint64_t url_count = (uint64_t)bc->users * bc->visits;
+    if (url_count > UINT32_MAX) {
+        errno = EOVERFLOW;
+        return false;
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    char* url  = malloc(bc->url_len + 1);
+    char* text = malloc(bc->text_len + 1);
+    if (!url || !text) {
+        free(url);
+        free(text);
+        fclose(file);
+        return false;
+    }
+
+    struct timespec base;
+    timespec_get(&base, TIME_UTC);
+    base.tv_sec -= 86400;
+
+    bool ok = write_items(file, magic, 1, sizeof(magic)) && write_items(file, &version, sizeof(uint32_t), 1) &&
+              write_items(file, &flags, sizeof(uint32_t), 1) && write_items(file, &half_life, sizeof(double), 1) &&
+              write_items(file, &bc->max_visits, sizeof(size_t), 1) &&
+              write_items(file, &url_count, sizeof(uint64_t), 1);
+
+    // The dictionary: URL i * visits + j belongs to visit j of user i.
+    uint32_t url_len = (uint32_t)bc->url_len;
+    for (uint64_t i = 0; i < url_count && ok; i++) {
+        fill_string(url, bc->url_len, "https://example.com/", i);
+        ok = write_items(file, &url_len, sizeof(uint32_t), 1) && write_items(file, url, 1, bc->url_len);
+    }
+
+    size_t user_count = bc->users;
+    ok                = ok && write_items(file, &user_count, sizeof(size_t), 1);
+    for (size_t i = 0; i < bc->users && ok; i++) {
+        uint32_t user_id = (uint32_t)i + 1;
+        ok = write_items(file, &user_id, sizeof(uint32_t), 1) && write_items(file, &bc->visits, sizeof(size_t), 1);
+
+        for (size_t j = 0; j < bc->visits && ok; j++) {
+            uint32_t visit_id = (uint32_t)j + 1;
+            uint32_t url_ref  = (uint32_t)(i * bc->visits + j);
+            uint32_t text_ref = literal | (uint32_t)bc->text_len;
+            int64_t tv_sec    = (int64_t)base.tv_sec + (int64_t)j;
+            int64_t tv_nsec   = (int64_t)(i % 1000000000);
+            fill_string(text, bc->text_len, "Title ", j);
+
+            ok = write_items(file, &visit_id, sizeof(uint32_t), 1) &&
+                 write_items(file, &url_ref, sizeof(uint32_t), 1) && write_items(file, &text_ref, sizeof(uint32_t), 1) &&
+                 write_items(file, text, 1, bc->text_len) &&
+                 write_items(file, &tv_sec, sizeof(int64_t), 1) && write_items(file, &tv_nsec, sizeof(int64_t), 1);
+        }
+        ok = ok && write_items(file, &score_count, sizeof(uint32_t), 1);
+    }
+
+    free(url);
+    free(text);
+    return fclose(file) == 0 && ok;
+}
+
+// Latencies of one measured phase
+typedef struct {
+    uint64_t* samples;
+    size_t count;
+    size_t capacity;
+    uint64_t start;
+    uint64_t elapsed;
+} Phase;
+
+static void phase_begin(Phase* phase) {
+    phase->count = 0;
+    phase->start = now_ns();
+}
+
+// Record one latency. Returns false once the phase is out of ops or time.
+static bool phase_record(Phase* phase, uint64_t latency, const BenchConfig* config) {
+    phase->samples[phase->count++] = latency;
+    uint64_t elapsed = now_ns() - phase->start;
+    return phase->count < phase->capacity && (double)elapsed < config->seconds * 1e9;
+}
+
+static void phase_report(Phase* phase, const char* op, const BenchCase* bc, const BenchConfig* config) {
+    phase->elapsed = now_ns() - phase->start;
+    qsort(phase->samples, phase->count, sizeof(uint64_t), compare_u64);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double seconds = (double)phase->elapsed / 1e9;
+    double rate    = seconds > 0 ? (double)phase->count / seconds : 0;
+    uint64_t p50   = percentile(phase->samples, phase->count, 0.50);
+    uint64_t p99   = percentile(phase->samples, phase->count, 0.99);
+    uint64_t p999  = percentile(phase->samples, phase->count, 0.999);
+
+    if (config->csv) {
+        printf("%s,%zu,%zu,%zu,%zu,%zu,%.6f,%.1f,%llu,%llu,%llu,%ld\n", op, bc->users, bc->max_visits, bc->url_len,
+               bc->visits, phase->count, seconds, rate, (unsigned long long)p50, (unsigned long long)p99,
+               (unsigned long long)p999, usage.ru_maxrss);
+    } else {
+        printf("{\"op\":\"%s\",\"users\":%zu,\"max_visits\":%zu,\"url_len\":%zu,\"visits_per_user\":%zu,"
+               "\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+               "\"p999_ns\":%llu,\"peak_rss_kb\":%ld}\n",
+               op, bc->users, bc->max_visits, bc->url_len, bc->visits, phase->count, seconds, rate,
+               (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999, usage.ru_maxrss);
+    }
+    fflush(stdout);
+}
+
+// Run all phases of one benchmark case. Returns the process exit status.
+static int run_case(const BenchCase* bc, const BenchConfig* config) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_visit_manager_%ld.dat", config->dir, (long)getpid());
+
+    if (!write_snapshot(path, bc)) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    Phase phase = {.capacity = config->ops > 0 ? config->ops : 1};
+    phase.samples = malloc(phase.capacity * sizeof(uint64_t));
+    char* url     = malloc(bc->url_len + 1);
+    char* text    = malloc(bc->text_len + 1);
+    if (!phase.samples || !url || !text) {
+        free(phase.samples);
+        free(url);
+        free(text);
+        remove(path);
+        return 1;
+    }
+
+    uint64_t rng = config->seed ^ (bc->users * 0x9E3779B97F4A7C15ULL) ^ bc->max_visits ^ (bc->url_len << 32);
+    if (rng == 0) {
+        rng = 1;
+    }
+
+    // Create (load from the snapshot)
+    phase_begin(&phase);
+    uint64_t t0           = now_ns();
+    VisitManager* manager = VisitManagerCreate(path, bc->max_visits);
+    phase_record(&phase, now_ns() - t0, config);
+    if (!manager) {
+        fprintf(stderr, "VisitManagerCreate failed\n");
+        remove(path);
+        return 1;
+    }
+    phase_report(&phase, "create", bc, config);
+
+    // GetRecentVisits on random users
+    phase_begin(&phase);
+    for (;;) {
+        uint32_t user_id = (uint32_t)(next_random(&rng) % bc->users) + 1;
+        size_t count;
+        t0 = now_ns();
+        VisitManagerGetRecentVisits(manager, user_id, &count);
+        if (!phase_record(&phase, now_ns() - t0, config)) {
+            break;
+        }
+    }
+    phase_report(&phase, "get_recent_visits", bc, config);
+
+    // AddVisit with fresh visit IDs on random users
+    uint32_t next_visit_id = (uint32_t)bc->visits + 1;
+    phase_begin(&phase);
+    for (;;) {
+        uint32_t user_id = (uint32_t)(next_random(&rng) % bc->users) + 1;
+        fill_string(url, bc->url_len, "https://example.org/", next_visit_id);
+        fill_string(text, bc->text_len, "New ", next_visit_id);
+        t0 = now_ns();
+        VisitManagerAddVisitN(manager, user_id, next_visit_id++, url, bc->url_len, text, bc->text_len);
+        if (!phase_record(&phase, now_ns() - t0, config)) {
+            break;
+        }
+    }
+    phase_report(&phase, "add_visit", bc, config);
+
+    // Delete one preloaded visit of a random user
+    phase_begin(&phase);
+    for (;;) {
+        uint32_t user_id  = (uint32_t)(next_random(&rng) % bc->users) + 1;
+        uint32_t visit_id = (uint32_t)(next_random(&rng) % (bc->visits > 0 ? bc->visits : 1)) + 1;
+        t0                = now_ns();
+        VisitManagerDelete(manager, user_id, &visit_id, 1);
+        if (!phase_record(&phase, now_ns() - t0, config)) {
+            break;
+        }
+    }
+    phase_report(&phase, "delete", bc, config);
+
+    // Clear random users
+    phase_begin(&phase);
+    for (;;) {
+        uint32_t user_id = (uint32_t)(next_random(&rng) % bc->users) + 1;
+        t0               = now_ns();
+        VisitManagerClear(manager, user_id);
+        if (!phase_record(&phase, now_ns() - t0, config)) {
+            break;
+        }
+    }
+    phase_report(&phase, "clear", bc, config);
+
+    // Free
+    phase_begin(&phase);
+    t0 = now_ns();
+    VisitManagerFree(manager);
+    phase_record(&phase, now_ns() - t0, config);
+    phase_report(&phase, "free", bc, config);
+
+    free(phase.samples);
+    free(url);
+    free(text);
+    remove(path);
+    return 0;
+}
+
+// Parse a comma separated list of sizes such as "1000,10000,1e6".
+static bool parse_sweep(const char* arg, Sweep* sweep) {
+    sweep->count = 0;
+    while (*arg) {
+        char* end;
+        double value = strtod(arg, &end);
+        if (end == arg || value < 1 || sweep->count == MAX_SWEEP) {
+            return false;
+        }
+        sweep->values[sweep->count++] = (size_t)value;
+        arg                           = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') {
+            return false;
+        }
+    }
+    return sweep->count > 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --users LIST       user counts to sweep (default 1000,10000,100000; up to 1e7)\n"
+            "  --max-visits LIST  max_visits values to sweep (default 10,100)\n"
+            "  --url-len LIST     URL lengths to sweep, text is half as long (default 32,256)\n"
+            "  --visits N         visits preloaded per user (default 5)\n"
+            "  --ops N            operations per phase (default 100000)\n"
+            "  --seconds S        time budget per phase (default 2)\n"
+            "  --seed N           random seed (default 42)\n"
+            "  --dir PATH         directory for snapshot files (default $TMPDIR or /tmp)\n"
+            "  --csv              print CSV instead of JSON lines\n",
+            prog);
+}
+
+int main(int argc, char** argv) {
+    const char* tmpdir = getenv("TMPDIR");
+    BenchConfig config = {
+        .users      = {{1000, 10000, 100000}, 3},
+        .max_visits = {{10, 100}, 2},
+        .url_lens   = {{32, 256}, 2},
+        .visits     = 5,
+        .ops        = 100000,
+        .seconds    = 2,
+        .seed       = 42,
+        .dir        = tmpdir ? tmpdir : "/tmp",
+        .csv        = false,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg   = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok           = true;
+
+        if (strcmp(arg, "--csv") == 0) {
+            config.csv = true;
+            continue;
+        } else if (!value) {
+            ok = false;
+        } else if (strcmp(arg, "--users") == 0) {
+            ok = parse_sweep(value, &config.users);
+        } else if (strcmp(arg, "--max-visits") == 0) {
+            ok = parse_sweep(value, &config.max_visits);
+        } else if (strcmp(arg, "--url-len") == 0) {
+            ok = parse_sweep(value, &config.url_lens);
+        } else if (strcmp(arg, "--visits") == 0) {
+            config.visits = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--ops") == 0) {
+            config.ops = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--seconds") == 0) {
+            config.seconds = strtod(value, NULL);
+        } else if (strcmp(arg, "--seed") == 0) {
+            config.seed = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--dir") == 0) {
+            config.dir = value;
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            usage(argv[0]);
+            return 2;
+        }
+        i++;
+    }
+
+    if (config.csv) {
+        printf("op,users,max_visits,url_len,visits_per_user,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns,"
+               "peak_rss_kb\n");
+        fflush(stdout);
+    }
+
+    int status = 0;
+    for (size_t u = 0; u < config.users.count; u++) {
+        for (size_t m = 0; m < config.max_visits.count; m++) {
+            for (size_t l = 0; l < config.url_lens.count; l++) {
+                BenchCase bc = {
+                    .users      = config.users.values[u],
+                    .max_visits = config.max_visits.values[m],
+                    .url_len    = config.url_lens.values[l],
+                    .text_len   = config.url_lens.values[l] / 2,
+                    .visits     = config.visits,
+                };
+                if (bc.visits > bc.max_visits) {
+                    bc.visits = bc.max_visits;
+                }
+
+                // Run each case in its own process so peak RSS is per case.
+                pid_t pid = fork();
+                if (pid == 0) {
+                    _exit(run_case(&bc, &config));
+                }
+
+                int child_status = 1;
+                if (pid < 0 || waitpid(pid, &child_status, 0) < 0 || !WIFEXITED(child_status) ||
+                    WEXITSTATUS(child_status) != 0) {
+                    fprintf(stderr, "benchmark case users=%zu max_visits=%zu url_len=%zu failed\n", bc.users,
+                            bc.max_visits, bc.url_len);
+                    status = 1;
+                }
+            }
+        }
+    }
+
+    return status;
+}
+
+#endif /* BUILD_BENCH */
@@ -3,18 +3,44 @@
 // It is used to interface with the C code in the recent_visits.c file.
 package cffi
 
+// #cgo LDFLAGS: -lm
 // #include "recent_visits.h"
+//
+// // cgo can not tell that the opaque VisitManager holds no Go pointers, so it boxes a
+// // *C.VisitManager argument for a pointer check on every call. Hot paths pass it as an
+// // integer through wrappers like this one instead.
+// static size_t packRecentVisits(uintptr_t manager, uint32_t user_id, void* buf, size_t buf_size,
+//                                size_t* count) {
+//     return VisitManagerPackRecentVisits((VisitManager*)manager, user_id, buf, buf_size, count);
+// }
 import "C"
 import (
+	"encoding/binary"
 	"fmt"
+	"math"
+	"sync"
 	"time"
 	"unsafe"
 )
 
 // VisitManager represents a manager for tracking recent visits.
+//
+// The C manager and the scratch state below are not safe for concurrent use, so
+// every method holds mu: a VisitManager may be shared between goroutines, but
+// its calls run one at a time.
 type VisitManager struct {
+	// Serializes calls into the C manager and use of buf and count
+	mu sync.Mutex
+
 	// Pointer to the C struct that manages recent visits
 	ptr *C.VisitManager
+
+	// Scratch buffer reused across calls that return packed visits
+	buf []byte
+
+	// Visit count written by the packing calls. A local would escape to the heap
+	// when its address is passed to C, costing an allocation per call.
+	count C.size_t
 }
 
 // Visit represents a single visit and contains the visit ID, URL, text, and time of the visit.
@@ -41,6 +67,8 @@ func NewVisitManager(file string, maxVisitsPerUser int) (*VisitManager, error) {
 
 // Close releases the resources of the VisitManager.
 func (vm *VisitManager) Close() {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
 	if vm.ptr != nil {
 		C.VisitManagerFree(vm.ptr)
 		vm.ptr = nil
@@ -49,46 +77,296 @@ func (vm *VisitManager) Close() {
 
 // AddVisit adds a visit for a user.
 func (vm *VisitManager) AddVisit(userID, visitID uint32, url, text string) bool {
-	cURL := C.CString(url)
-	defer C.free(unsafe.Pointer(cURL))
-	cText := C.CString(text)
-	defer C.free(unsafe.Pointer(cText))
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	// The C side copies both strings before returning, so the Go string data can be
+	// passed directly without a C.CString allocation and copy.
+	return bool(C.VisitManagerAddVisitN(vm.ptr, C.uint32_t(userID), C.uint32_t(visitID),
+		stringData(url), C.size_t(len(url)), stringData(text), C.size_t(len(text))))
+}
 
-	// Call the C function to add a visit
-	return bool(C.VisitManagerAddVisit(vm.ptr, C.uint32_t(userID), C.uint32_t(visitID), cURL, cText))
+// stringData returns a pointer to the bytes of s for a length-delimited C call.
+func stringData(s string) *C.char {
+	return (*C.char)(unsafe.Pointer(unsafe.StringData(s)))
+}
+
+// Layout of C.PackedVisit, used to decode packed buffers without further cgo calls.
+var (
+	packedVisitSize    = int(unsafe.Sizeof(C.PackedVisit{}))
+	packedURLOffset    = int(unsafe.Offsetof(C.PackedVisit{}.url_offset))
+	packedURLLen       = int(unsafe.Offsetof(C.PackedVisit{}.url_len))
+	packedTextOffset   = int(unsafe.Offsetof(C.PackedVisit{}.text_offset))
+	packedTextLen      = int(unsafe.Offsetof(C.PackedVisit{}.text_len))
+	packedTimeSec      = int(unsafe.Offsetof(C.PackedVisit{}.tv_sec))
+	packedTimeNsec     = int(unsafe.Offsetof(C.PackedVisit{}.tv_nsec))
+	packedVisitIDField = int(unsafe.Offsetof(C.PackedVisit{}.visit_id))
+)
+
+// packRecentVisits fills vm.buf with the packed recent visits of a user and
+// returns the used part of the buffer and the number of visits in it.
+func (vm *VisitManager) packRecentVisits(userID uint32) ([]byte, int, error) {
+	for {
+		var bufPtr unsafe.Pointer
+		if len(vm.buf) > 0 {
+			bufPtr = unsafe.Pointer(&vm.buf[0])
+		}
+
+		needed := uint64(C.packRecentVisits(C.uintptr_t(uintptr(unsafe.Pointer(vm.ptr))), C.uint32_t(userID), bufPtr,
+			C.size_t(len(vm.buf)), &vm.count))
+		count := int(vm.count)
+		if count == 0 {
+			return nil, 0, nil
+		}
+		if needed > math.MaxUint32 {
+			return nil, 0, fmt.Errorf("recent visits of user %d do not fit in a packed buffer", userID)
+		}
+		if needed <= uint64(len(vm.buf)) {
+			return vm.buf[:needed], count, nil
+		}
+
+		// Grow with some headroom and retry; the C side wrote nothing.
+		vm.buf = make([]byte, needed+needed/2)
+	}
+}
+
+// packedVisitHeader returns the header of the i-th visit in a packed buffer.
+func packedVisitHeader(buf []byte, i int) []byte {
+	return buf[i*packedVisitSize : (i+1)*packedVisitSize]
+}
+
+// packedVisitStrings returns the URL and text bytes of a packed visit header.
+func packedVisitStrings(buf, h []byte) (url, text []byte) {
+	ne := binary.NativeEndian
+	urlOff, urlLen := ne.Uint32(h[packedURLOffset:]), ne.Uint32(h[packedURLLen:])
+	textOff, textLen := ne.Uint32(h[packedTextOffset:]), ne.Uint32(h[packedTextLen:])
+	return buf[urlOff : urlOff+urlLen], buf[textOff : textOff+textLen]
+}
+
+// packedVisitMeta returns the visit ID and time of a packed visit header.
+func packedVisitMeta(h []byte) (uint32, time.Time) {
+	ne := binary.NativeEndian
+	sec, nsec := int64(ne.Uint64(h[packedTimeSec:])), int64(ne.Uint64(h[packedTimeNsec:]))
+	return ne.Uint32(h[packedVisitIDField:]), time.Unix(sec, nsec)
 }
 
 // GetRecentVisits returns recent visits for a user.
 func (vm *VisitManager) GetRecentVisits(userID uint32) ([]Visit, error) {
-	var count C.size_t
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	// A single cgo call packs all visits and their strings into vm.buf,
+	// which is then decoded in pure Go.
+	buf, count, err := vm.packRecentVisits(userID)
+	if err != nil || count == 0 {
+		return nil, err // No visits found
+	}
+
+	visits := make([]Visit, count)
+	for i := range visits {
+		h := packedVisitHeader(buf, i)
+		url, text := packedVisitStrings(buf, h)
+		visitID, t := packedVisitMeta(h)
+		visits[i] = Visit{
+			VisitID: visitID,
+			URL:     string(url),
+			Text:    string(text),
+			Time:    t,
+		}
+	}
+
+	return visits, nil
+}
+
+// GetRecentVisitsMulti returns the recent visits of several users, in the order of userIDs,
+// with one cgo call for the whole batch. The C side interleaves the user lookups so their
+// cache misses overlap. Users without visits get a nil slice.
+func (vm *VisitManager) GetRecentVisitsMulti(userIDs []uint32) ([][]Visit, error) {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	if len(userIDs) == 0 {
+		return nil, nil
+	}
+
+	counts := make([]C.size_t, len(userIDs))
+	var needed uint64
+	for {
+		var bufPtr unsafe.Pointer
+		if len(vm.buf) > 0 {
+			bufPtr = unsafe.Pointer(&vm.buf[0])
+		}
+
+		needed = uint64(C.VisitManagerGetRecentVisitsMulti(vm.ptr, (*C.uint32_t)(unsafe.Pointer(&userIDs[0])),
+			C.size_t(len(userIDs)), bufPtr, C.size_t(len(vm.buf)), &counts[0]))
+		if needed > math.MaxUint32 {
+			return nil, fmt.Errorf("recent visits of %d users do not fit in a packed buffer", len(userIDs))
+		}
+		if needed <= uint64(len(vm.buf)) {
+			break
+		}
+
+		// Grow with some headroom and retry; the C side wrote nothing.
+		vm.buf = make([]byte, needed+needed/2)
+	}
+
+	total := 0
+	for _, count := range counts {
+		total += int(count)
+	}
+
+	// All strings follow the headers, so one conversion backs every URL and text.
+	buf := vm.buf[:needed]
+	base := total * packedVisitSize
+	strs := string(buf[base:])
+	result := make([][]Visit, len(userIDs))
+	visits := make([]Visit, total)
+	next := 0
+	for i, count := range counts {
+		if count == 0 {
+			continue
+		}
+		result[i] = visits[next : next+int(count) : next+int(count)]
+		for j := range result[i] {
+			h := packedVisitHeader(buf, next+j)
+			ne := binary.NativeEndian
+			urlOff, urlLen := int(ne.Uint32(h[packedURLOffset:]))-base, int(ne.Uint32(h[packedURLLen:]))
+			textOff, textLen := int(ne.Uint32(h[packedTextOffset:]))-base, int(ne.Uint32(h[packedTextLen:]))
+			visitID, t := packedVisitMeta(h)
+			result[i][j] = Visit{
+				VisitID: visitID,
+				URL:     strs[urlOff : urlOff+urlLen],
+				Text:    strs[textOff : textOff+textLen],
+				Time:    t,
+			}
+		}
+		next += int(count)
+	}
+	return result, nil
+}
 
-	// The pointer is owned by the manager and must not be freed here.
-	visitPtrs := C.VisitManagerGetRecentVisits(vm.ptr, C.uint32_t(userID), &count)
-	if visitPtrs == nil || count == 0 {
-		return nil, nil // No visits found
+// PrefixSearch returns up to limit visits whose URL starts with prefix, one per distinct
+// URL (its newest visit), in URL order. Repeated searches between changes to the user's
+// visits cost a binary search each.
+func (vm *VisitManager) PrefixSearch(userID uint32, prefix string, limit int) []Visit {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	if limit <= 0 {
+		return nil
 	}
 
-	// Convert the C array into a Go slice of *C.Visit
-	// Each visit is assumed to be a C.Visit struct in a contiguous block
-	visitsC := (*[1 << 30]*C.Visit)(unsafe.Pointer(visitPtrs))[:count:count]
+	// As in GetRecentVisitsMulti, one conversion of the packed strings backs every URL and text.
+	buf, count := vm.packPrefixSearch(userID, prefix, limit)
+	if count == 0 {
+		return nil
+	}
 
-	// Convert each *C.Visit to a Go Visit
+	base := count * packedVisitSize
+	strs := string(buf[base:])
 	visits := make([]Visit, count)
 	for i := range visits {
-		cVisit := visitsC[i]
+		h := packedVisitHeader(buf, i)
+		ne := binary.NativeEndian
+		urlOff, urlLen := int(ne.Uint32(h[packedURLOffset:]))-base, int(ne.Uint32(h[packedURLLen:]))
+		textOff, textLen := int(ne.Uint32(h[packedTextOffset:]))-base, int(ne.Uint32(h[packedTextLen:]))
+		visitID, t := packedVisitMeta(h)
 		visits[i] = Visit{
-			VisitID: uint32(cVisit.visit_id),
-			URL:     C.GoString(cVisit.url),
-			Text:    C.GoString(cVisit.text),
-			Time:    time.Unix(int64(cVisit.time.tv_sec), int64(cVisit.time.tv_nsec)),
+			VisitID: visitID,
+			URL:     strs[urlOff : urlOff+urlLen],
+			Text:    strs[textOff : textOff+textLen],
+			Time:    t,
 		}
 	}
+	return visits
+}
 
-	return visits, nil
+// packPrefixSearch fills vm.buf with the packed prefix search results of a user and
+// returns the used part of the buffer and the number of visits in it.
+func (vm *VisitManager) packPrefixSearch(userID uint32, prefix string, limit int) ([]byte, int) {
+	for {
+		var bufPtr unsafe.Pointer
+		if len(vm.buf) > 0 {
+			bufPtr = unsafe.Pointer(&vm.buf[0])
+		}
+
+		// The prefix is passed by length, so the Go string data needs no C copy.
+		needed := uint64(C.VisitManagerPackPrefixSearch(vm.ptr, C.uint32_t(userID), stringData(prefix),
+			C.size_t(len(prefix)), C.size_t(limit), bufPtr, C.size_t(len(vm.buf)), &vm.count))
+		count := int(vm.count)
+		if count == 0 || needed > math.MaxUint32 {
+			return nil, 0
+		}
+		if needed <= uint64(len(vm.buf)) {
+			return vm.buf[:needed], count
+		}
+
+		// Grow with some headroom and retry; the C side wrote nothing.
+		vm.buf = make([]byte, needed+needed/2)
+	}
+}
+
+// StringArena is a reusable byte buffer that backs the strings returned by
+// GetRecentVisitsInto. Strings handed out by an arena are only valid until its
+// next Reset, after which their bytes are overwritten.
+type StringArena struct {
+	buf []byte
+}
+
+// Reset makes the whole arena available again. Strings previously returned from
+// it must no longer be used.
+func (a *StringArena) Reset() {
+	a.buf = a.buf[:0]
+}
+
+// reserve makes sure n more bytes fit without reallocating. A new backing array
+// is started rather than copying, so strings already handed out stay valid.
+func (a *StringArena) reserve(n int) {
+	if cap(a.buf)-len(a.buf) >= n {
+		return
+	}
+	a.buf = make([]byte, 0, max(2*cap(a.buf), n))
+}
+
+// add copies b into the arena and returns a string that aliases the copy.
+func (a *StringArena) add(b []byte) string {
+	if len(b) == 0 {
+		return ""
+	}
+	start := len(a.buf)
+	a.buf = append(a.buf, b...)
+	return unsafe.String(&a.buf[start], len(b))
+}
+
+// GetRecentVisitsInto is like GetRecentVisits but reuses dst for the result and
+// backs URL and text strings with arena instead of allocating them. The result
+// is dst[:0] with the visits appended; it stays valid until arena is reset.
+func (vm *VisitManager) GetRecentVisitsInto(userID uint32, dst []Visit, arena *StringArena) ([]Visit, error) {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	dst = dst[:0]
+	buf, count, err := vm.packRecentVisits(userID)
+	if err != nil || count == 0 {
+		return dst, err
+	}
+
+	// Everything after the headers is string bytes, so a single reservation suffices.
+	arena.reserve(len(buf) - count*packedVisitSize)
+	for i := 0; i < count; i++ {
+		h := packedVisitHeader(buf, i)
+		url, text := packedVisitStrings(buf, h)
+		visitID, t := packedVisitMeta(h)
+		dst = append(dst, Visit{
+			VisitID: visitID,
+			URL:     arena.add(url),
+			Text:    arena.add(text),
+			Time:    t,
+		})
+	}
+
+	return dst, nil
 }
 
 // DeleteVisits deletes the specified visits for a user.
 func (vm *VisitManager) DeleteVisits(userID uint32, visitIDs []uint32) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
 	if len(visitIDs) == 0 {
 		return true
 	}
@@ -98,7 +376,474 @@ func (vm *VisitManager) DeleteVisits(userID uint32, visitIDs []uint32) bool {
 	return bool(C.VisitManagerDelete(vm.ptr, C.uint32_t(userID), cVisitIDs, C.size_t(len(visitIDs))))
 }
 
-// ClearUser clears all visits for a user.
+// ClearUser clears all visits for a user and removes the user.
 func (vm *VisitManager) ClearUser(userID uint32) {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
 	C.VisitManagerClear(vm.ptr, C.uint32_t(userID))
 }
+
+// VisitPredicate selects the visits deleted by DeleteWhere: those matching every criterion set.
+type VisitPredicate struct {
+	Before   time.Time // Visits made before this time, unless zero
+	Host     string    // Visits to this host or its subdomains, ignoring case, unless empty
+	VisitIDs []uint32  // Visits with one of these IDs, of any user, unless empty
+}
+
+// DeleteWhere deletes the visits of all users that match p and persists once. It returns the
+// number of visits deleted; 0 when p sets no criterion.
+func (vm *VisitManager) DeleteWhere(p VisitPredicate) int {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	// The predicate holds C copies of the host and IDs, as C must not keep Go pointers in Go memory.
+	var cPredicate C.VisitPredicate
+	if !p.Before.IsZero() {
+		cPredicate.flags |= C.VISIT_MANAGER_DELETE_BEFORE
+		cPredicate.before_ns = C.int64_t(p.Before.UnixNano())
+	}
+	if p.Host != "" {
+		cPredicate.flags |= C.VISIT_MANAGER_DELETE_HOST
+		cPredicate.host = C.CString(p.Host)
+		defer C.free(unsafe.Pointer(cPredicate.host))
+	}
+	if len(p.VisitIDs) > 0 {
+		cIDs := (*C.uint32_t)(C.malloc(C.size_t(len(p.VisitIDs)) * C.sizeof_uint32_t))
+		defer C.free(unsafe.Pointer(cIDs))
+		copy(unsafe.Slice((*uint32)(unsafe.Pointer(cIDs)), len(p.VisitIDs)), p.VisitIDs)
+		cPredicate.flags |= C.VISIT_MANAGER_DELETE_VISIT_IDS
+		cPredicate.visit_ids = cIDs
+		cPredicate.visit_id_count = C.size_t(len(p.VisitIDs))
+	}
+	return int(C.VisitManagerDeleteWhere(vm.ptr, &cPredicate))
+}
+
+// Compact releases memory held for growth: users without visits, unused visit
+// capacity, oversized indexes and dead records in the spill file.
+func (vm *VisitManager) Compact() bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerCompact(vm.ptr))
+}
+
+// Op identifies an operation timed by the VisitManager statistics.
+type Op int
+
+const (
+	OpAddVisit        Op = C.VISIT_MANAGER_OP_ADD_VISIT
+	OpGetRecentVisits Op = C.VISIT_MANAGER_OP_GET_RECENT_VISITS
+	OpDelete          Op = C.VISIT_MANAGER_OP_DELETE
+	OpClear           Op = C.VISIT_MANAGER_OP_CLEAR
+	OpSerialize       Op = C.VISIT_MANAGER_OP_SERIALIZE
+
+	opCount = C.VISIT_MANAGER_OP_COUNT
+)
+
+var opNames = [opCount]string{"add_visit", "get_recent_visits", "delete", "clear", "serialize"}
+
+// String returns the name of the operation.
+func (op Op) String() string {
+	if op < 0 || op >= opCount {
+		return fmt.Sprintf("Op(%d)", int(op))
+	}
+	return opNames[op]
+}
+
+// OpStats holds the counters and latency histogram of one operation.
+type OpStats struct {
+	Count    uint64        // Number of calls
+	Failures uint64        // Calls that reported failure
+	Total    time.Duration // Sum of call latencies
+	Max      time.Duration // Slowest call
+
+	raw C.VisitManagerOpStats
+}
+
+// Percentile returns the latency at percentile p (0-100), accurate to the
+// histogram bucket (at most 12.5% above the true value).
+func (s *OpStats) Percentile(p float64) time.Duration {
+	return time.Duration(C.VisitManagerStatsPercentile(&s.raw, C.double(p)))
+}
+
+// Stats holds the statistics of every operation, indexed by Op.
+type Stats struct {
+	Ops [opCount]OpStats
+}
+
+// Stats returns the operation counters and latency histograms of the manager.
+// ok is false when the C library was built without VISIT_MANAGER_STATS, which
+// the rvstats build tag turns on (see stats.go).
+func (vm *VisitManager) Stats() (stats *Stats, ok bool) {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	var cStats C.VisitManagerStats
+	if !bool(C.VisitManagerGetStats(vm.ptr, &cStats)) {
+		return nil, false
+	}
+
+	stats = &Stats{}
+	for i := range stats.Ops {
+		raw := cStats.ops[i]
+		stats.Ops[i] = OpStats{
+			Count:    uint64(raw.count),
+			Failures: uint64(raw.failures),
+			Total:    time.Duration(raw.total_ns),
+			Max:      time.Duration(raw.max_ns),
+			raw:      raw,
+		}
+	}
+	return stats, true
+}
+
+// ResetStats resets all operation counters and histograms to zero.
+func (vm *VisitManager) ResetStats() {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	C.VisitManagerResetStats(vm.ptr)
+}
+
+// SetInternTitles stores the titles of visits added from now on once per distinct title,
+// like URLs. It pays off when many visits share a title.
+func (vm *VisitManager) SetInternTitles(intern bool) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerSetInternTitles(vm.ptr, C.bool(intern)))
+}
+
+// SetDedupUrls keeps at most one visit per URL for each user. A revisit replaces the
+// earlier visit and moves it to the front instead of pushing out another page.
+func (vm *VisitManager) SetDedupUrls(dedup bool) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerSetDedupUrls(vm.ptr, C.bool(dedup)))
+}
+
+// SetFrecencyHalfLife keeps a frecency score per URL in each user's history: its visit
+// count with every visit weighing half as much each halfLife. Zero disables scoring.
+func (vm *VisitManager) SetFrecencyHalfLife(halfLife time.Duration) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerSetFrecencyHalfLife(vm.ptr, C.double(halfLife.Seconds())))
+}
+
+// ScoredURL is one URL ranked by TopByScore.
+type ScoredURL struct {
+	URL        string
+	VisitCount uint32  // Visits while the URL has been in the user's history
+	Score      float64 // Visits weighted by age
+}
+
+// TopByScore returns up to k of the user's URLs with the highest frecency, best first.
+// It is empty unless a half-life was set with SetFrecencyHalfLife.
+func (vm *VisitManager) TopByScore(userID uint32, k int) []ScoredURL {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	if k <= 0 {
+		return nil
+	}
+
+	results := make([]C.ScoredUrl, k)
+	n := int(C.VisitManagerGetTopByScore(vm.ptr, C.uint32_t(userID), C.size_t(k), &results[0]))
+	scored := make([]ScoredURL, n)
+	for i := range scored {
+		scored[i] = ScoredURL{
+			URL:        C.GoString(results[i].url),
+			VisitCount: uint32(results[i].visit_count),
+			Score:      float64(results[i].score),
+		}
+	}
+	return scored
+}
+
+// SetTextIndex keeps an inverted index from the words of visit titles to the visits, across
+// all users, for SearchText and SearchTextAll. It is stored with the snapshot.
+func (vm *VisitManager) SetTextIndex(enabled bool) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerSetTextIndex(vm.ptr, C.bool(enabled)))
+}
+
+// SearchText returns the IDs of up to limit of the user's visits whose title contains every
+// word of query, in increasing order. Words match case-insensitively.
+func (vm *VisitManager) SearchText(userID uint32, query string, limit int) []uint32 {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	if limit <= 0 {
+		return nil
+	}
+
+	cQuery := C.CString(query)
+	defer C.free(unsafe.Pointer(cQuery))
+
+	ids := make([]uint32, limit)
+	n := int(C.VisitManagerSearchText(vm.ptr, C.uint32_t(userID), cQuery, C.size_t(limit),
+		(*C.uint32_t)(unsafe.Pointer(&ids[0]))))
+	return ids[:n]
+}
+
+// Flags of Search
+const (
+	SearchURL        = C.VISIT_MANAGER_SEARCH_URL         // Search URLs
+	SearchText       = C.VISIT_MANAGER_SEARCH_TEXT        // Search titles
+	SearchIgnoreCase = C.VISIT_MANAGER_SEARCH_IGNORE_CASE // ASCII case-insensitive
+)
+
+// Search returns the IDs of up to limit of the user's visits, newest first, whose URL or
+// title contains needle. The scan runs inside C and is vectorized on CPUs with AVX2.
+// flags combines SearchURL, SearchText (both when neither is given) and SearchIgnoreCase.
+func (vm *VisitManager) Search(userID uint32, needle string, flags uint32, limit int) []uint32 {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	if limit <= 0 {
+		return nil
+	}
+
+	// The needle is passed by length, so its bytes need no C copy.
+	ids := make([]uint32, limit)
+	n := int(C.VisitManagerSearch(vm.ptr, C.uint32_t(userID), stringData(needle), C.size_t(len(needle)),
+		C.uint32_t(flags), C.size_t(limit), (*C.uint32_t)(unsafe.Pointer(&ids[0]))))
+	return ids[:n]
+}
+
+// VisitRef identifies one visit matched by SearchTextAll.
+type VisitRef struct {
+	UserID  uint32
+	VisitID uint32
+}
+
+// SearchTextAll is SearchText across all users, ordered by user ID and then visit ID.
+func (vm *VisitManager) SearchTextAll(query string, limit int) []VisitRef {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	if limit <= 0 {
+		return nil
+	}
+
+	cQuery := C.CString(query)
+	defer C.free(unsafe.Pointer(cQuery))
+
+	results := make([]C.VisitRef, limit)
+	n := int(C.VisitManagerSearchTextAll(vm.ptr, cQuery, C.size_t(limit), &results[0]))
+	refs := make([]VisitRef, n)
+	for i := range refs {
+		refs[i] = VisitRef{UserID: uint32(results[i].user_id), VisitID: uint32(results[i].visit_id)}
+	}
+	return refs
+}
+
+// SetTimeIndex keeps a reference to every visit of every user in one-minute buckets, so that
+// GetWindow costs in proportion to the visits it returns. Snapshots record the setting and the
+// index is rebuilt on load.
+func (vm *VisitManager) SetTimeIndex(enabled bool) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerSetTimeIndex(vm.ptr, C.bool(enabled)))
+}
+
+// TimedVisitRef identifies one visit returned by GetWindow.
+type TimedVisitRef struct {
+	UserID  uint32
+	VisitID uint32
+	Time    time.Time
+}
+
+// GetWindow returns the visits of all users with start <= time < end, oldest first. It is
+// empty unless the time index is on.
+func (vm *VisitManager) GetWindow(start, end time.Time) []TimedVisitRef {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	startNs, endNs := C.int64_t(start.UnixNano()), C.int64_t(end.UnixNano())
+	results := make([]C.TimedVisitRef, 256)
+	for {
+		n := int(C.VisitManagerGetWindow(vm.ptr, startNs, endNs, &results[0], C.size_t(len(results))))
+		if n > len(results) {
+			results = make([]C.TimedVisitRef, n)
+			continue
+		}
+
+		refs := make([]TimedVisitRef, n)
+		for i := range refs {
+			r := &results[i]
+			refs[i] = TimedVisitRef{UserID: uint32(r.user_id), VisitID: uint32(r.visit_id),
+				Time: time.Unix(0, int64(r.timestamp_ns))}
+		}
+		return refs
+	}
+}
+
+// SetReverseURLIndex keeps, for every URL, the set of users who visited it, so that
+// UsersForURL needs no scan of the users. Snapshots record the setting and the index is
+// rebuilt on load.
+func (vm *VisitManager) SetReverseURLIndex(enabled bool) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerSetReverseUrlIndex(vm.ptr, C.bool(enabled)))
+}
+
+// UsersForURL returns the IDs of the users with a visit to url, in increasing order. It is
+// empty unless the reverse URL index is on.
+func (vm *VisitManager) UsersForURL(url string) []uint32 {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	cURL := C.CString(url)
+	defer C.free(unsafe.Pointer(cURL))
+
+	userIDs := make([]uint32, 64)
+	for {
+		n := int(C.VisitManagerUsersForUrl(vm.ptr, cURL, (*C.uint32_t)(unsafe.Pointer(&userIDs[0])),
+			C.size_t(len(userIDs))))
+		if n > len(userIDs) {
+			userIDs = make([]uint32, n)
+			continue
+		}
+		return userIDs[:n]
+	}
+}
+
+// SetTTL drops visits once they are older than ttl; zero keeps them until evicted. Expired
+// visits are found through the time index, which stays on while a TTL is set. Each AddVisit
+// drops a small batch of them first; Expire sweeps the rest.
+func (vm *VisitManager) SetTTL(ttl time.Duration) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerSetTTL(vm.ptr, C.double(ttl.Seconds())))
+}
+
+// Expire drops up to limit visits older than the TTL, or all of them when limit is 0, oldest
+// first, and persists once. It returns the number dropped.
+func (vm *VisitManager) Expire(limit int) int {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return int(C.VisitManagerExpire(vm.ptr, C.size_t(limit)))
+}
+
+// LatestVisit is one visit of the site-wide timeline returned by GetLatestVisits.
+type LatestVisit struct {
+	UserID uint32
+	Visit
+}
+
+// GetLatestVisits returns the n most recent visits across all users, newest first. The C
+// side merges the users' time-ordered visits and copies strings for the results only.
+func (vm *VisitManager) GetLatestVisits(n int) ([]LatestVisit, error) {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	if n <= 0 {
+		return nil, nil
+	}
+
+	rows := make([]C.ExportedVisit, n)
+	var count, stringBytes C.size_t
+	for {
+		var bufPtr *C.char
+		if len(vm.buf) > 0 {
+			bufPtr = (*C.char)(unsafe.Pointer(&vm.buf[0]))
+		}
+		if C.VisitManagerGetLatestVisits(vm.ptr, C.size_t(n), &rows[0], bufPtr, C.size_t(len(vm.buf)), &count,
+			&stringBytes) {
+			break
+		}
+		if uint64(stringBytes) <= uint64(len(vm.buf)) {
+			return nil, fmt.Errorf("failed to merge the latest %d visits", n)
+		}
+
+		// Grow with some headroom and retry; the C side wrote nothing.
+		vm.buf = make([]byte, stringBytes+stringBytes/2)
+	}
+
+	strs := string(vm.buf[:stringBytes])
+	visits := make([]LatestVisit, int(count))
+	for i := range visits {
+		row := &rows[i]
+		urlOff, textOff := int(row.url_offset), int(row.text_offset)
+		visits[i] = LatestVisit{
+			UserID: uint32(row.user_id),
+			Visit: Visit{
+				VisitID: uint32(row.visit_id),
+				URL:     strs[urlOff : urlOff+int(row.url_len)],
+				Text:    strs[textOff : textOff+int(row.text_len)],
+				Time:    time.Unix(0, int64(row.timestamp_ns)),
+			},
+		}
+	}
+	return visits, nil
+}
+
+// SetMemoryBudget limits the bytes of per-user data kept in memory. Beyond the budget the
+// least recently accessed users are spilled to disk and reloaded on their next access.
+// A budget of 0 disables spilling. It returns false if the budget could not be met.
+//
+// With a budget set, any call may free the visits of another user, which is safe for the
+// Go API because it copies visits out before returning.
+func (vm *VisitManager) SetMemoryBudget(bytes uint64) bool {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	return bool(C.VisitManagerSetMemoryBudget(vm.ptr, C.size_t(bytes)))
+}
+
+// MemoryUsage reports the memory held by a VisitManager by category. Byte
+// counts are requested sizes and exclude allocator overhead.
+type MemoryUsage struct {
+	ManagerBytes         uint64 // Manager struct, path and statistics shards
+	UserTableBytes       uint64 // User array and hash indexes
+	UserBytes            uint64 // Per-user headers
+	VisitArrayBytes      uint64 // Per-user arrays of visit pointers, URL, prefix and score indexes
+	VisitBytes           uint64 // Visit records, including short inline texts
+	StringBytes          uint64 // Interned strings and heap texts
+	TextIndexBytes       uint64 // Text index words and posting lists
+	TimeIndexBytes       uint64 // Time index buckets and visit references
+	ReverseURLIndexBytes uint64 // Reverse URL index hash table and user sets
+	TotalBytes           uint64 // Sum of the above
+
+	UserCount     uint64 // Number of users
+	VisitCount    uint64 // Number of visits
+	CapacitySlack uint64 // Allocated but unused visit slots
+	DeletedSlack  uint64 // Slack left behind by deleted, cleared or evicted visits
+
+	SpilledUserCount uint64 // Users moved to the spill file (not in UserCount)
+	SpillFileBytes   uint64 // Size of the spill file
+	InternedStrings  uint64 // Distinct URLs (and titles, if interned)
+	TextTerms        uint64 // Distinct words in the text index
+	TimeBuckets      uint64 // Non-empty minutes in the time index
+	IndexedURLs      uint64 // URLs in the reverse URL index
+
+	// Users by visit count: index 0 counts users without visits,
+	// index i users with [2^(i-1), 2^i) visits.
+	VisitCountHistogram [C.VISIT_MANAGER_COUNT_BUCKETS]uint64
+}
+
+// Memory returns the current memory usage of the manager. It is O(1) and
+// cheap enough to call from a monitoring loop.
+func (vm *VisitManager) Memory() MemoryUsage {
+	vm.mu.Lock()
+	defer vm.mu.Unlock()
+	var m C.VisitManagerMemory
+	C.VisitManagerGetMemory(vm.ptr, &m)
+
+	usage := MemoryUsage{
+		ManagerBytes:         uint64(m.manager_bytes),
+		UserTableBytes:       uint64(m.user_table_bytes),
+		UserBytes:            uint64(m.user_bytes),
+		VisitArrayBytes:      uint64(m.visit_array_bytes),
+		VisitBytes:           uint64(m.visit_bytes),
+		StringBytes:          uint64(m.string_bytes),
+		TextIndexBytes:       uint64(m.text_index_bytes),
+		TimeIndexBytes:       uint64(m.time_index_bytes),
+		ReverseURLIndexBytes: uint64(m.reverse_url_index_bytes),
+		TotalBytes:           uint64(m.total_bytes),
+		UserCount:            uint64(m.user_count),
+		VisitCount:           uint64(m.visit_count),
+		CapacitySlack:        uint64(m.capacity_slack),
+		DeletedSlack:         uint64(m.deleted_slack),
+
+		SpilledUserCount: uint64(m.spilled_user_count),
+		SpillFileBytes:   uint64(m.spill_file_bytes),
+		InternedStrings:  uint64(m.interned_strings),
+		TextTerms:        uint64(m.text_terms),
+		TimeBuckets:      uint64(m.time_buckets),
+		IndexedURLs:      uint64(m.indexed_urls),
+	}
+	for i := range usage.VisitCountHistogram {
+		usage.VisitCountHistogram[i] = uint64(m.visit_count_histogram[i])
+	}
+	return usage
+}
@@ -0,0 +1,187 @@
+package cffi
+
+import (
+	"fmt"
+	"path/filepath"
+	"sync"
+	"testing"
+)
+
+// newTestManager returns a manager with visitCount visits for user 1.
+func newTestManager(tb testing.TB, visitCount int) *VisitManager {
+	tb.Helper()
+
+	vm, err := NewVisitManager(filepath.Join(tb.TempDir(), "rv.dat"), visitCount)
+	if err != nil {
+		tb.Fatal(err)
+	}
+	tb.Cleanup(vm.Close)
+
+	for i := 0; i < visitCount; i++ {
+		url := fmt.Sprintf("https://example.com/page/%d", i)
+		text := fmt.Sprintf("Example page %d", i)
+		if !vm.AddVisit(1, uint32(i+1), url, text) {
+			tb.Fatalf("AddVisit(%d) failed", i+1)
+		}
+	}
+	return vm
+}
+
+func TestGetRecentVisitsInto(t *testing.T) {
+	vm := newTestManager(t, 10)
+
+	want, err := vm.GetRecentVisits(1)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	var arena StringArena
+	got, err := vm.GetRecentVisitsInto(1, nil, &arena)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if len(got) != len(want) {
+		t.Fatalf("got %d visits, want %d", len(got), len(want))
+	}
+	for i := range want {
+		if got[i].VisitID != want[i].VisitID || got[i].URL != want[i].URL ||
+			got[i].Text != want[i].Text || !got[i].Time.Equal(want[i].Time) {
+			t.Errorf("visit %d: got %+v, want %+v", i, got[i], want[i])
+		}
+	}
+
+	// Unknown users yield an empty result.
+	got, err = vm.GetRecentVisitsInto(2, got, &arena)
+	if err != nil || len(got) != 0 {
+		t.Fatalf("unknown user: got %d visits, err %v", len(got), err)
+	}
+}
+
+func TestGetRecentVisitsIntoAllocs(t *testing.T) {
+	vm := newTestManager(t, 100)
+
+	// The first call sizes the scratch buffer, the arena and dst; later calls reuse them.
+	var arena StringArena
+	visits, err := vm.GetRecentVisitsInto(1, nil, &arena)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	allocs := testing.AllocsPerRun(100, func() {
+		arena.Reset()
+		visits, err = vm.GetRecentVisitsInto(1, visits, &arena)
+	})
+	if err != nil {
+		t.Fatal(err)
+	}
+	if allocs != 0 {
+		t.Errorf("steady-state GetRecentVisitsInto made %v allocations per call, want 0", allocs)
+	}
+}
+
+func TestPrefixSearch(t *testing.T) {
+	vm := newTestManager(t, 20)
+
+	// Pages 1 and 10-19 start with "page/1"; the search returns them in URL order.
+	pages := []int{1, 10, 11, 12, 13}
+	got := vm.PrefixSearch(1, "https://example.com/page/1", len(pages))
+	if len(got) != len(pages) {
+		t.Fatalf("got %d visits, want %d", len(got), len(pages))
+	}
+	for i, page := range pages {
+		want := Visit{
+			VisitID: uint32(page + 1),
+			URL:     fmt.Sprintf("https://example.com/page/%d", page),
+			Text:    fmt.Sprintf("Example page %d", page),
+		}
+		if got[i].VisitID != want.VisitID || got[i].URL != want.URL || got[i].Text != want.Text {
+			t.Errorf("visit %d: got %+v, want %+v", i, got[i], want)
+		}
+	}
+
+	if got := vm.PrefixSearch(1, "https://other.example.com/", 5); len(got) != 0 {
+		t.Errorf("unmatched prefix: got %d visits", len(got))
+	}
+	if got := vm.PrefixSearch(1, "", 100); len(got) != 20 {
+		t.Errorf("empty prefix: got %d visits, want 20", len(got))
+	}
+}
+
+func TestSearch(t *testing.T) {
+	vm := newTestManager(t, 20)
+
+	// Page 7 has one match in its URL; the needle is passed by length.
+	if got := vm.Search(1, "page/7", SearchURL, 10); len(got) != 1 || got[0] != 8 {
+		t.Errorf("Search(page/7) = %v, want [8]", got)
+	}
+	if got := vm.Search(1, "EXAMPLE PAGE 1", SearchText|SearchIgnoreCase, 20); len(got) != 11 {
+		t.Errorf("case-insensitive search got %d visits, want 11", len(got))
+	}
+	if got := vm.Search(1, "", 0, 100); len(got) != 20 {
+		t.Errorf("empty needle got %d visits, want 20", len(got))
+	}
+	if got := vm.Search(1, "page\x00", 0, 10); len(got) != 0 {
+		t.Errorf("needle with a NUL byte got %d visits, want 0", len(got))
+	}
+}
+
+func TestConcurrentUse(t *testing.T) {
+	vm := newTestManager(t, 50)
+
+	// Readers and a writer share the manager; run with -race to check the locking.
+	var wg sync.WaitGroup
+	for g := 0; g < 4; g++ {
+		wg.Add(1)
+		go func(g int) {
+			defer wg.Done()
+			var arena StringArena
+			var visits []Visit
+			for i := 0; i < 200; i++ {
+				arena.Reset()
+				var err error
+				if visits, err = vm.GetRecentVisitsInto(1, visits, &arena); err != nil || len(visits) == 0 {
+					t.Errorf("goroutine %d: got %d visits, err %v", g, len(visits), err)
+					return
+				}
+				if got := vm.PrefixSearch(1, "https://example.com/page/", 5); len(got) != 5 {
+					t.Errorf("goroutine %d: prefix search got %d visits, want 5", g, len(got))
+					return
+				}
+			}
+		}(g)
+	}
+	for i := 0; i < 50; i++ {
+		vm.AddVisit(2, uint32(i+1), fmt.Sprintf("https://example.org/%d", i), "Other page")
+	}
+	wg.Wait()
+}
+
+func BenchmarkGetRecentVisits(b *testing.B) {
+	vm := newTestManager(b, 100)
+
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if _, err := vm.GetRecentVisits(1); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+func BenchmarkGetRecentVisitsInto(b *testing.B) {
+	vm := newTestManager(b, 100)
+
+	var arena StringArena
+	var visits []Visit
+
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		arena.Reset()
+
+		var err error
+		if visits, err = vm.GetRecentVisitsInto(1, visits, &arena); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
@@ -1,506 +1,5170 @@
 #include "recent_visits.h"
 #include <assert.h>
+#include <math.h>
+#include <sys/types.h>
+#include <unistd.h>
 
-// Internal structure to store visits per user
+// VisitManagerSearch has an AVX2 scan, used when the CPU supports it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VISIT_MANAGER_AVX2
+#endif
+
+// Linear sub-buckets per power of two in latency histograms (2^3 = 8)
+#define STATS_SUB_BITS 3
+
+#ifdef VISIT_MANAGER_STATS
+
+// Number of statistics shards. Each thread records into one shard picked round-robin,
+// so threads rarely share cache lines.
+#define STATS_SHARDS 16
+
+// Statistics recorded by the threads mapped to one shard
+typedef struct {
+    VisitManagerOpStats ops[VISIT_MANAGER_OP_COUNT];
+} StatsShard;
+
+#endif /* VISIT_MANAGER_STATS */
+
+// Visit pointers stored in the user header itself. Users with this many visits or fewer
+// need no separate visit array; larger arrays start here and double up to max_visits.
+#define USER_INLINE_VISITS 4
+
+// Bytes of inline text storage per visit, sized so a VisitRecord is an 88-byte allocation
+#define VISIT_INLINE_CHARS 40
+
+// VisitRecord flag: the text points into the intern table
+#define VISIT_TEXT_INTERNED 1
+
+// Internal visit record. The public Visit comes first, so a VisitRecord* is handed out as a
+// Visit*. The URL always points into the intern table. The text is interned when title
+// interning is on; otherwise it is stored in inline_chars (with its terminator) when it fits
+// and in its own heap block if not. Records with an interned text omit inline_chars.
+typedef struct {
+    Visit visit;
+    uint8_t flags;
+    uint32_t text_len;  // Bytes of the text excluding the terminator, wherever it is stored
+    char inline_chars[VISIT_INLINE_CHARS];
+} VisitRecord;
+
+// A distinct string shared by every visit that uses it. Visits point at chars.
+typedef struct {
+    uint32_t hash;
+    uint32_t refcount;
+    uint32_t len;  // Bytes excluding the terminator
+    uint32_t id;   // Position in the snapshot dictionary while a snapshot is written
+    char chars[];
+} InternedString;
+
+// Longest URL or text accepted. Snapshot string references use the top bit to mark literals.
+#define MAX_STRING_LEN 0x7fffffffu
+#define STRING_LITERAL 0x80000000u
+
+// Snapshots start with this magic since format 2. Format 1 files start with max_visits.
+static const char SNAPSHOT_MAGIC[8] = {'R', 'V', 'S', 'N', 'A', 'P', 'S', 'H'};
+#define SNAPSHOT_VERSION 3
+
+// Snapshot flag: the text index follows the users
+#define SNAPSHOT_TEXT_INDEX 1
+
+// Snapshot flag: the time index is on. It is rebuilt from the visits on load.
+#define SNAPSHOT_TIME_INDEX 2
+
+// Snapshot flag: the reverse URL index is on. It is rebuilt from the visits on load.
+#define SNAPSHOT_REVERSE_URL_INDEX 4
+
+// Snapshot flag: a TTL is set. It follows the frecency half-life as a double.
+#define SNAPSHOT_TTL 8
+
+// Spill files with more dead bytes than live ones are compacted once they reach this size
+#define SPILL_COMPACT_MIN_BYTES (1u << 20)
+
+// Frecency of one URL in a user's history. key is log(sum of exp(lambda * t)) over the times t
+// of its visits, so comparing keys ranks URLs by decayed visit count at any moment and a visit
+// only ever raises its own URL's key.
+typedef struct {
+    char* url;             // Interned; the entry holds a reference
+    double key;
+    uint32_t visit_count;  // Visits recorded while the URL has been in the user's history
+    uint32_t held;         // Visits to the URL currently in the user's history
+    uint32_t slot;         // Position of this entry in ScoreTable.positions
+} UrlScore;
+
+// Per-user frecency scores: a max-heap by key and a hash table from URL to heap position
+typedef struct {
+    UrlScore* heap;
+    uint32_t* positions;  // Open-addressed by interned URL: heap position + 1, 0 when empty
+    size_t count;
+    size_t heap_capacity;
+    size_t position_capacity;  // Power of two
+    double half_life;          // Half-life the keys were computed with
+} ScoreTable;
+
+// Longest word indexed by the text index; longer runs of word characters are cut to this length
+#define TERM_MAX_LEN 64
+
+// Most posting changes a term buffers before merging them into its compressed list
+#define TERM_PENDING_MAX 256
+
+// Posting keys per block of a term's postings that a skip entry lets decoding start at
+#define TERM_SKIP_KEYS 128
+
+// Where a block of compressed postings starts: the key before the block, which its first gap
+// is relative to, and the byte offset of that gap
+typedef struct {
+    uint64_t base;
+    uint32_t offset;
+    uint32_t index;  // Keys before the block
+} PostingSkip;
+
+// One word of the text index. Postings are the keys (user_id << 32 | visit_id) of the visits
+// whose text contains the word, sorted and stored as LEB128 varints of the gap to the previous
+// key. A skip entry marks the start of every block of TERM_SKIP_KEYS keys but the first, so a
+// search for one user decodes from that user's block on. Changes since the last merge wait in
+// pending: additions first, then removals.
+typedef struct {
+    uint32_t hash;
+    uint32_t len;
+    uint8_t* postings;
+    uint32_t posting_bytes;
+    uint32_t posting_count;  // Keys in postings, before pending changes
+    PostingSkip* skips;
+    uint32_t skip_count;
+    uint64_t* pending;
+    uint16_t pending_adds;
+    uint16_t pending_removes;
+    uint16_t pending_capacity;
+    char chars[];
+} TextTerm;
+
+// Span of one time index bucket in nanoseconds: a minute
+#define TIME_BUCKET_NS 60000000000LL
+
+// Most visits past the TTL that each AddVisit drops before adding its own
+#define TTL_ADD_BATCH 16
+
+// Visits of all users whose times fall in one TIME_BUCKET_NS span, sorted by time. Removed
+// visits stay in place, marked in dead, until they make up half of the bucket.
+typedef struct {
+    int64_t key;  // floor(timestamp_ns / TIME_BUCKET_NS)
+    TimedVisitRef* refs;
+    uint64_t* dead;  // Bitmap over refs; bits from count on are zero
+    uint32_t count;  // References, including dead ones
+    uint32_t dead_count;
+    uint32_t capacity;
+} TimeBucket;
+
+// Most user IDs a container of the reverse URL index lists before it becomes a bitmap. As in
+// roaring bitmaps, past this count the bitmap is the smaller of the two.
+#define USER_SET_ARRAY_MAX 4096
+
+// Words of a container bitmap: one bit for each user ID with the container's upper 16 bits
+#define USER_SET_BITMAP_WORDS 1024
+
+// The users of a URL whose IDs share their upper 16 bits: the lower 16 bits as a sorted array,
+// or as a bitmap once there are more than USER_SET_ARRAY_MAX of them
+typedef struct {
+    void* values;       // uint16_t[capacity], or uint64_t[USER_SET_BITMAP_WORDS] when capacity is 0
+    uint32_t count;     // User IDs held
+    uint16_t key;       // Upper 16 bits of the user IDs
+    uint16_t capacity;  // Slots of the array, 0 for a bitmap
+} UserContainer;
+
+// The users who visited one URL, in the reverse URL index. The set holds a reference to the
+// interned URL, which keeps it alive while only spilled users have visits to it.
+typedef struct {
+    char* url;                  // Interned; sets are found by comparing these pointers
+    UserContainer* containers;  // Sorted by key; NULL in an empty slot
+    uint32_t container_count;
+    uint32_t user_count;
+} UrlUsers;
+
+// A word of a text or query, lowercased in VisitManager.token_text
 typedef struct {
+    const char* chars;
+    uint32_t len;
+    uint32_t hash;
+} TextToken;
+
+// Internal structure to store visits per user
+typedef struct UserVisits {
     uint32_t user_id;
-    Visit** visits;
+    uint32_t high_water;  // Most visits held at once, for VisitManagerMemory.deleted_slack
+    Visit** visits;       // inline_visits or a heap array of capacity pointers
     size_t visit_count;
     size_t capacity;
+    size_t slot;                   // Position in VisitManager.users
+    struct UserVisits* lru_prev;  // More recently used neighbour
+    struct UserVisits* lru_next;  // Less recently used neighbour
+    Visit** url_index;            // Hash table of visits by interned URL, in dedup mode only
+    size_t url_index_capacity;    // Power of two, 0 without an index
+    ScoreTable* scores;           // Frecency of the user's URLs, while a half-life is set
+    Visit** prefix_index;         // Visits sorted by URL for prefix search, built on demand
+    size_t prefix_count;
+    size_t prefix_capacity;
+    bool prefix_valid;            // prefix_index is built and kept in step with the visits
+    bool ordered;                 // visits are sorted newest first and kept that way
+    uint32_t unindexed_visits;    // Visits left out of url_index, as a newer visit has their URL
+    Visit* inline_visits[USER_INLINE_VISITS];
 } UserVisits;
 
+// Location of a spilled user's record in the spill file. Empty slots have length 0.
+typedef struct {
+    uint32_t user_id;
+    uint32_t length;
+    uint64_t offset;
+    struct timespec newest;  // Time of the user's newest visit, for VisitManagerGetLatestVisits
+    uint32_t visit_count;    // Visits in the record, for VisitManagerExport
+    uint32_t string_bytes;   // Bytes of their URLs and texts, for VisitManagerExport
+} SpillEntry;
+
 // Internal structure of the VisitManager
 struct VisitManager {
     UserVisits** users;
     size_t user_count;
     size_t user_capacity;
+    UserVisits** user_index;     // Open-addressed hash table of resident users by ID
+    size_t user_index_capacity;  // Power of two
+    UserVisits* lru_head;        // Most recently used resident user
+    UserVisits* lru_tail;        // Least recently used resident user
+    size_t memory_budget;        // Resident per-user bytes allowed; 0 means unlimited
+    char* spill_path;
+    FILE* spill_file;             // Opened on first spill
+    SpillEntry* spill_index;      // Open-addressed hash table of spilled users by ID
+    size_t spill_index_capacity;  // Power of two
+    size_t spill_count;           // Number of spilled users
+    uint64_t spill_bytes;         // End of the spill file, including dead records
+    uint64_t spill_live_bytes;    // Bytes of records still referenced by spill_index
+    InternedString** intern_table;  // Open-addressed hash table of interned strings
+    size_t intern_capacity;         // Power of two
+    size_t intern_count;
+    bool intern_titles;       // Intern the text of new visits as well as the URL
+    bool dedup_urls;          // A revisited URL replaces the user's earlier visit to it
+    double frecency_half_life;  // Seconds for a visit's weight to halve; 0 disables scores
+    double frecency_lambda;     // ln(2) / frecency_half_life
+    double ttl;                 // Seconds a visit is kept; 0 keeps visits until evicted
+    bool text_index;            // Keep the word postings of every visit's text in text_terms
+    TextTerm** text_terms;      // Open-addressed hash table of indexed words
+    size_t text_term_capacity;  // Power of two
+    size_t text_term_count;
+    char* token_text;           // Lowercased copy of the text being tokenized
+    size_t token_text_capacity;
+    TextToken* tokens;          // Distinct words of that text
+    size_t token_capacity;
+    bool time_index;            // Keep a reference to every visit in time_buckets
+    TimeBucket* time_buckets;   // Non-empty buckets, sorted by key
+    size_t time_bucket_count;
+    size_t time_bucket_capacity;
+    bool reverse_url_index;     // Keep the users of every URL in url_users
+    UrlUsers* url_users;        // Open-addressed hash table of URL user sets by interned URL
+    size_t url_users_capacity;  // Power of two
+    size_t url_users_count;
+    char* scratch;            // Buffer for strings read from files
+    size_t scratch_capacity;
     size_t max_visits;
     char* path;
+#ifdef VISIT_MANAGER_STATS
+    StatsShard* stats[STATS_SHARDS];  // Allocated on first use by a thread
+#endif
+    VisitManagerMemory memory;  // Maintained incrementally; totals filled in on read
 };
 
-// Helper function to find user entry or return NULL if not found
-static UserVisits* find_user(VisitManager* manager, uint32_t user_id) {
-    for (size_t i = 0; i < manager->user_count; i++) {
-        if (manager->users[i]->user_id == user_id) {
-            return manager->users[i];
-        }
-    }
-    return NULL;
-}
-
-// Helper function to create and initialize a new user entry
-static UserVisits* create_user(uint32_t user_id, size_t initial_capacity) {
-    UserVisits* user = (UserVisits*)malloc(sizeof(UserVisits));
-    if (!user) {
-        return NULL;
-    }
+#ifdef VISIT_MANAGER_STATS
 
-    user->visits = (Visit**)malloc(initial_capacity * sizeof(Visit*));
-    if (!user->visits) {
-        free(user);
-        return NULL;
+// Helper function to map a latency to its log-linear histogram bucket
+static size_t latency_bucket(uint64_t ns) {
+    if (ns < (1u << STATS_SUB_BITS)) {
+        return (size_t)ns;
     }
 
-    user->user_id     = user_id;
-    user->visit_count = 0;
-    user->capacity    = initial_capacity;
+    unsigned shift = 63 - (unsigned)__builtin_clzll(ns) - STATS_SUB_BITS;
+    size_t bucket  = ((size_t)(shift + 1) << STATS_SUB_BITS) + ((ns >> shift) & ((1u << STATS_SUB_BITS) - 1));
+    return bucket < VISIT_MANAGER_LATENCY_BUCKETS ? bucket : VISIT_MANAGER_LATENCY_BUCKETS - 1;
+}
 
-    return user;
+static uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
-// Helper function to free visit memory
-static void free_visit(Visit* visit) {
-    if (visit) {
-        free(visit->url);
-        free(visit->text);
-        free(visit);
+// Helper function to get the statistics shard of the calling thread
+static StatsShard* stats_shard(VisitManager* manager) {
+    static unsigned next_slot;
+    static _Thread_local unsigned slot = UINT32_MAX;
+    if (slot == UINT32_MAX) {
+        slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % STATS_SHARDS;
     }
-}
 
-// Helper function to free user and user visits memory.
-static void free_user_visits(UserVisits* user) {
-    if (user) {
-        for (size_t i = 0; i < user->visit_count; i++) {
-            free_visit(user->visits[i]);
+    StatsShard* shard = __atomic_load_n(&manager->stats[slot], __ATOMIC_ACQUIRE);
+    if (!shard) {
+        StatsShard* fresh = (StatsShard*)calloc(1, sizeof(StatsShard));
+        if (!fresh) {
+            return NULL;
+        }
+
+        // Another thread mapped to the same slot may have won the race.
+        if (__atomic_compare_exchange_n(&manager->stats[slot], &shard, fresh, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            shard = fresh;
+        } else {
+            free(fresh);
         }
-        free(user->visits);
-        free(user);
     }
+    return shard;
 }
 
-// Helper function to create a new visit
-static Visit* create_visit(uint32_t visit_id, const char* url, const char* text) {
-    Visit* visit = (Visit*)malloc(sizeof(Visit));
-    if (!visit) {
-        return NULL;
+// Helper function to record one timed operation
+static void stats_record(VisitManager* manager, VisitManagerOp op, uint64_t start, bool ok) {
+    uint64_t ns       = stats_now() - start;
+    StatsShard* shard = stats_shard(manager);
+    if (!shard) {
+        return;
     }
 
-    visit->visit_id = visit_id;
-
-    visit->url = strdup(url);
-    if (!visit->url) {
-        free(visit);
-        return NULL;
+    VisitManagerOpStats* s = &shard->ops[op];
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->latency_buckets[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+    if (!ok) {
+        __atomic_fetch_add(&s->failures, 1, __ATOMIC_RELAXED);
     }
 
-    visit->text = strdup(text);
-    if (!visit->text) {
-        free(visit->url);
-        free(visit);
-        return NULL;
+    uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, true, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED)) {
     }
-
-    // Set current time
-    timespec_get(&visit->time, TIME_UTC);
-    // clock_gettime(CLOCK_REALTIME, &visit->time);
-    return visit;
 }
 
-// Helper function for serialization
-static void serialize_manager(VisitManager* manager) {
-    FILE* file = fopen(manager->path, "wb");
-    if (!file) {
-        return;
-    }
+#define STATS_BEGIN() uint64_t stats_start_ = stats_now()
+#define STATS_END(manager, op, ok) stats_record((manager), (op), stats_start_, (ok))
 
-    // Write max_visits
-    fwrite(&manager->max_visits, sizeof(size_t), 1, file);
+#else
 
-    // Write user count
-    fwrite(&manager->user_count, sizeof(size_t), 1, file);
+#define STATS_BEGIN() ((void)0)
+#define STATS_END(manager, op, ok) ((void)(ok))
 
-    // Write each user
-    for (size_t i = 0; i < manager->user_count; i++) {
-        UserVisits* user = manager->users[i];
+#endif /* VISIT_MANAGER_STATS */
 
-        // Write user ID
-        fwrite(&user->user_id, sizeof(uint32_t), 1, file);
+// Helper function to hash a user ID into a table with a power-of-two capacity
+static size_t hash_user_id(uint32_t user_id, size_t capacity) {
+    uint32_t h = user_id * 0x9E3779B1u;
+    return (size_t)(h ^ (h >> 16)) & (capacity - 1);
+}
 
-        // Write visit count
-        fwrite(&user->visit_count, sizeof(size_t), 1, file);
+// Helper function to check whether home lies cyclically in (i, j]. Used to decide if an entry
+// may move back to i when deleting from a linear-probing table.
+static bool probe_between(size_t home, size_t i, size_t j) {
+    return i <= j ? (home > i && home <= j) : (home > i || home <= j);
+}
 
-        // Write each visit
-        for (size_t j = 0; j < user->visit_count; j++) {
-            Visit* visit = user->visits[j];
+// Helper function to get the smallest hash table capacity that keeps count entries at most half full
+static size_t index_capacity_for(size_t count) {
+    size_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    return capacity;
+}
 
-            // Write visit ID
-            fwrite(&visit->visit_id, sizeof(uint32_t), 1, file);
+// Helper function to find the index slot holding a user ID, or the empty slot where it belongs
+static size_t user_index_slot(const VisitManager* manager, uint32_t user_id) {
+    size_t mask = manager->user_index_capacity - 1;
+    size_t i    = hash_user_id(user_id, manager->user_index_capacity);
+    while (manager->user_index[i] && manager->user_index[i]->user_id != user_id) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
 
-            // Write URL length and URL
-            size_t url_len = strlen(visit->url) + 1;
-            fwrite(&url_len, sizeof(size_t), 1, file);
-            fwrite(visit->url, 1, url_len, file);
+// Helper function to rehash the user index into a table of new_capacity slots (a power of two)
+static bool resize_user_index(VisitManager* manager, size_t new_capacity) {
+    UserVisits** old_index = manager->user_index;
+    size_t old_capacity    = manager->user_index_capacity;
 
-            // Write text length and text
-            size_t text_len = strlen(visit->text) + 1;
-            fwrite(&text_len, sizeof(size_t), 1, file);
-            fwrite(visit->text, 1, text_len, file);
+    UserVisits** new_index = (UserVisits**)calloc(new_capacity, sizeof(UserVisits*));
+    if (!new_index) {
+        return false;
+    }
 
-            // Write timestamp
-            fwrite(&visit->time, sizeof(struct timespec), 1, file);
+    manager->user_index          = new_index;
+    manager->user_index_capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_index[i]) {
+            new_index[user_index_slot(manager, old_index[i]->user_id)] = old_index[i];
         }
     }
-
-    fclose(file);
+    free(old_index);
+    return true;
 }
 
-// Helper function for deserialization
-static VisitManager* deserialize_manager(const char* path, size_t max_visits) {
-    FILE* file = fopen(path, "rb");
-    if (!file) {
-        return NULL;
+// Helper function to add a user to the hash index, keeping the load factor at most 1/2
+static bool index_user(VisitManager* manager, UserVisits* user) {
+    if ((manager->user_count + 1) * 2 > manager->user_index_capacity &&
+        !resize_user_index(manager, manager->user_index_capacity > 0 ? manager->user_index_capacity * 2 : 16)) {
+        return false;
     }
 
-    VisitManager* manager = (VisitManager*)malloc(sizeof(VisitManager));
-    if (!manager) {
-        fclose(file);
-        return NULL;
-    }
+    manager->user_index[user_index_slot(manager, user->user_id)] = user;
+    return true;
+}
 
-    manager->path = strdup(path);
-    if (!manager->path) {
-        free(manager);
-        fclose(file);
-        return NULL;
+// Helper function to remove a user from the hash index
+static void unindex_user(VisitManager* manager, uint32_t user_id) {
+    size_t mask = manager->user_index_capacity - 1;
+    size_t i    = user_index_slot(manager, user_id);
+    if (!manager->user_index[i]) {
+        return;
     }
 
-    // Read max_visits from file but use the provided value
-    size_t stored_max_visits;
-    if (fread(&stored_max_visits, sizeof(size_t), 1, file) != 1) {
-        free(manager->path);
-        free(manager);
-        fclose(file);
-        return NULL;
+    // Backward-shift deletion keeps every remaining entry reachable from its home slot.
+    for (size_t j = (i + 1) & mask; manager->user_index[j]; j = (j + 1) & mask) {
+        size_t home = hash_user_id(manager->user_index[j]->user_id, manager->user_index_capacity);
+        if (!probe_between(home, i, j)) {
+            manager->user_index[i] = manager->user_index[j];
+            i                      = j;
+        }
     }
-    manager->max_visits = max_visits;
+    manager->user_index[i] = NULL;
+}
 
-    // Read user count
-    if (fread(&manager->user_count, sizeof(size_t), 1, file) != 1) {
-        free(manager->path);
-        free(manager);
-        fclose(file);
-        return NULL;
+// Helper function to find the spill index slot holding a user ID, or the empty slot where it belongs
+static size_t spill_index_slot(const VisitManager* manager, uint32_t user_id) {
+    size_t mask = manager->spill_index_capacity - 1;
+    size_t i    = hash_user_id(user_id, manager->spill_index_capacity);
+    while (manager->spill_index[i].length && manager->spill_index[i].user_id != user_id) {
+        i = (i + 1) & mask;
     }
+    return i;
+}
 
-    // Allocate users array
-    manager->user_capacity = manager->user_count > 0 ? manager->user_count : 10;
-    manager->users         = (UserVisits**)malloc(manager->user_capacity * sizeof(UserVisits*));
-    if (!manager->users) {
-        free(manager->path);
-        free(manager);
-        fclose(file);
+// Helper function to get the spill entry of a user or NULL if the user is not spilled
+static SpillEntry* find_spill_entry(VisitManager* manager, uint32_t user_id) {
+    if (manager->spill_count == 0) {
         return NULL;
     }
 
-    // Read each user
-    for (size_t i = 0; i < manager->user_count; i++) {
-        uint32_t user_id;
-        if (fread(&user_id, sizeof(uint32_t), 1, file) != 1) {
-            goto cleanup;
-        }
+    SpillEntry* entry = &manager->spill_index[spill_index_slot(manager, user_id)];
+    return entry->length ? entry : NULL;
+}
 
-        size_t visit_count;
-        if (fread(&visit_count, sizeof(size_t), 1, file) != 1) {
-            goto cleanup;
-        }
+// Helper function to rehash the spill index into a table of new_capacity slots (a power of two)
+static bool resize_spill_index(VisitManager* manager, size_t new_capacity) {
+    SpillEntry* old_index = manager->spill_index;
+    size_t old_capacity   = manager->spill_index_capacity;
 
-        // Create user
-        UserVisits* user = create_user(user_id, visit_count > 0 ? visit_count : 10);
-        if (!user) {
-            goto cleanup;
-        }
+    SpillEntry* new_index = (SpillEntry*)calloc(new_capacity, sizeof(SpillEntry));
+    if (!new_index) {
+        return false;
+    }
 
-        manager->users[i] = user;
+    manager->spill_index          = new_index;
+    manager->spill_index_capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_index[i].length) {
+            new_index[spill_index_slot(manager, old_index[i].user_id)] = old_index[i];
+        }
+    }
+    free(old_index);
+    return true;
+}
 
-        // Read each visit
-        for (size_t j = 0; j < visit_count; j++) {
-            Visit* visit = (Visit*)malloc(sizeof(Visit));
-            if (!visit) {
-                goto cleanup;
-            }
+// Helper function to record where a spilled user's record lives, keeping the load factor at most 1/2
+static bool add_spill_entry(VisitManager* manager, SpillEntry entry) {
+    if ((manager->spill_count + 1) * 2 > manager->spill_index_capacity &&
+        !resize_spill_index(manager, manager->spill_index_capacity > 0 ? manager->spill_index_capacity * 2 : 16)) {
+        return false;
+    }
 
-            // Read visit ID
-            if (fread(&visit->visit_id, sizeof(uint32_t), 1, file) != 1) {
-                free(visit);
-                goto cleanup;
-            }
+    manager->spill_index[spill_index_slot(manager, entry.user_id)] = entry;
+    manager->spill_count++;
+    manager->spill_live_bytes += entry.length;
+    return true;
+}
 
-            // Read URL
-            size_t url_len;
-            if (fread(&url_len, sizeof(size_t), 1, file) != 1) {
-                free(visit);
-                goto cleanup;
-            }
+// Helper function to forget the spill record of a user. The record becomes dead space.
+static void remove_spill_entry(VisitManager* manager, uint32_t user_id) {
+    size_t mask = manager->spill_index_capacity - 1;
+    size_t i    = spill_index_slot(manager, user_id);
+    if (!manager->spill_index[i].length) {
+        return;
+    }
 
-            visit->url = (char*)malloc(url_len);
-            if (!visit->url) {
-                free(visit);
-                goto cleanup;
-            }
+    manager->spill_count--;
+    manager->spill_live_bytes -= manager->spill_index[i].length;
 
-            if (fread(visit->url, 1, url_len, file) != url_len) {
-                free(visit->url);
-                free(visit);
-                goto cleanup;
-            }
+    for (size_t j = (i + 1) & mask; manager->spill_index[j].length; j = (j + 1) & mask) {
+        size_t home = hash_user_id(manager->spill_index[j].user_id, manager->spill_index_capacity);
+        if (!probe_between(home, i, j)) {
+            manager->spill_index[i] = manager->spill_index[j];
+            i                       = j;
+        }
+    }
+    manager->spill_index[i].length = 0;
+}
 
-            // Read text
-            size_t text_len;
-            if (fread(&text_len, sizeof(size_t), 1, file) != 1) {
-                free(visit->url);
-                free(visit);
-                goto cleanup;
-            }
+// Helper function to create and initialize a new user entry.
+// Capacities up to USER_INLINE_VISITS use the inline array.
+static UserVisits* create_user(uint32_t user_id, size_t initial_capacity) {
+    UserVisits* user = (UserVisits*)calloc(1, sizeof(UserVisits));
+    if (!user) {
+        return NULL;
+    }
 
-            visit->text = (char*)malloc(text_len);
-            if (!visit->text) {
-                free(visit->url);
-                free(visit);
-                goto cleanup;
-            }
+    if (initial_capacity <= USER_INLINE_VISITS) {
+        user->visits     = user->inline_visits;
+        initial_capacity = USER_INLINE_VISITS;
+    } else {
+        user->visits = (Visit**)malloc(initial_capacity * sizeof(Visit*));
+        if (!user->visits) {
+            free(user);
+            return NULL;
+        }
+    }
 
-            if (fread(visit->text, 1, text_len, file) != text_len) {
-                free(visit->text);
-                free(visit->url);
-                free(visit);
-                goto cleanup;
-            }
+    user->user_id     = user_id;
+    user->high_water  = 0;
+    user->visit_count = 0;
+    user->capacity    = initial_capacity;
+    user->ordered     = true;
 
-            // Read timestamp
-            if (fread(&visit->time, sizeof(struct timespec), 1, file) != 1) {
-                free(visit->text);
-                free(visit->url);
-                free(visit);
-                goto cleanup;
-            }
+    return user;
+}
 
-            // Add visit to user
-            if (j < max_visits) {
-                user->visits[j] = visit;
-                user->visit_count++;
-            } else {
-                // Skip if beyond max_visits
-                free_visit(visit);
-            }
-        }
+// Helper function to hash a string (32-bit FNV-1a)
+static uint32_t hash_string(const char* str, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)str[i];
+        h *= 16777619u;
     }
+    return h;
+}
 
-    fclose(file);
-    return manager;
+// Helper function to get the interned string owning chars
+static InternedString* interned_header(const char* chars) {
+    return (InternedString*)(chars - offsetof(InternedString, chars));
+}
 
-cleanup:
-    // Handle deserialization failure
-    for (size_t i = 0; i < manager->user_count; i++) {
-        if (manager->users[i]) {
-            free_user_visits(manager->users[i]);
+// Helper function to find the intern table slot holding a string, or the empty slot where it belongs
+static size_t intern_slot(const VisitManager* manager, const char* str, size_t len, uint32_t hash) {
+    size_t mask = manager->intern_capacity - 1;
+    size_t i    = hash & mask;
+    for (InternedString* entry; (entry = manager->intern_table[i]); i = (i + 1) & mask) {
+        if (entry->hash == hash && entry->len == len && memcmp(entry->chars, str, len) == 0) {
+            break;
         }
     }
-
-    free(manager->users);
-    free(manager->path);
-    free(manager);
-    fclose(file);
-    return NULL;
+    return i;
 }
 
-VisitManager* VisitManagerCreate(const char* path, size_t max_visits) {
-    VisitManager* manager = NULL;
+// Helper function to rehash the intern table into a table of new_capacity slots (a power of two)
+static bool resize_intern_table(VisitManager* manager, size_t new_capacity) {
+    InternedString** old_table = manager->intern_table;
+    size_t old_capacity        = manager->intern_capacity;
 
-    // Try to deserialize if file exists
-    FILE* file = fopen(path, "rb");
-    if (file) {
-        fclose(file);
-        manager = deserialize_manager(path, max_visits);
+    InternedString** new_table = (InternedString**)calloc(new_capacity, sizeof(InternedString*));
+    if (!new_table) {
+        return false;
     }
 
-    // Create new manager if deserialization failed or file doesn't exist
-    if (!manager) {
-        manager = (VisitManager*)malloc(sizeof(VisitManager));
-        if (!manager) {
-            return NULL;
+    manager->intern_table    = new_table;
+    manager->intern_capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        InternedString* entry = old_table[i];
+        if (entry) {
+            size_t j = entry->hash & (new_capacity - 1);
+            while (new_table[j]) {
+                j = (j + 1) & (new_capacity - 1);
+            }
+            new_table[j] = entry;
         }
+    }
+    free(old_table);
+    return true;
+}
+
+// Helper function to get a counted reference to the interned copy of len bytes of str.
+// Returns the null-terminated shared characters, or NULL if out of memory.
+static char* intern_string(VisitManager* manager, const char* str, size_t len) {
+    if ((manager->intern_count + 1) * 2 > manager->intern_capacity &&
+        !resize_intern_table(manager, manager->intern_capacity > 0 ? manager->intern_capacity * 2 : 64)) {
+        return NULL;
+    }
 
-        manager->path = strdup(path);
-        if (!manager->path) {
-            free(manager);
+    uint32_t hash         = hash_string(str, len);
+    size_t slot           = intern_slot(manager, str, len, hash);
+    InternedString* entry = manager->intern_table[slot];
+    if (!entry) {
+        entry = (InternedString*)malloc(sizeof(InternedString) + len + 1);
+        if (!entry) {
             return NULL;
         }
 
-        manager->max_visits    = max_visits;
-        manager->user_count    = 0;
-        manager->user_capacity = 10;  // Initial capacity
-
-        manager->users = (UserVisits**)malloc(manager->user_capacity * sizeof(UserVisits*));
-        if (!manager->users) {
-            free(manager->path);
-            free(manager);
-            return NULL;
+        entry->hash     = hash;
+        entry->refcount = 0;
+        entry->len      = (uint32_t)len;
+        entry->id       = 0;
+        if (len > 0) {
+            memcpy(entry->chars, str, len);
         }
+        entry->chars[len] = '\0';
+
+        manager->intern_table[slot] = entry;
+        manager->intern_count++;
+        manager->memory.string_bytes += sizeof(InternedString) + len + 1;
+        manager->memory.interned_strings++;
     }
 
-    return manager;
+    entry->refcount++;
+    return entry->chars;
 }
 
-void VisitManagerFree(VisitManager* manager) {
-    if (!manager) {
+// Helper function to drop a reference taken by intern_string, freeing the string with the last one
+static void release_string(VisitManager* manager, char* chars) {
+    InternedString* entry = interned_header(chars);
+    if (--entry->refcount > 0) {
         return;
     }
 
-    // Free all user visits
-    for (size_t i = 0; i < manager->user_count; i++) {
-        free_user_visits(manager->users[i]);
+    size_t mask = manager->intern_capacity - 1;
+    size_t i    = entry->hash & mask;
+    while (manager->intern_table[i] != entry) {
+        i = (i + 1) & mask;
     }
 
-    // Free remaining manager resources
-    free(manager->users);
-    free(manager->path);
-    free(manager);
+    // Backward-shift deletion, as for the user index.
+    for (size_t j = (i + 1) & mask; manager->intern_table[j]; j = (j + 1) & mask) {
+        size_t home = manager->intern_table[j]->hash & mask;
+        if (!probe_between(home, i, j)) {
+            manager->intern_table[i] = manager->intern_table[j];
+            i                        = j;
+        }
+    }
+    manager->intern_table[i] = NULL;
+
+    manager->intern_count--;
+    manager->memory.string_bytes -= sizeof(InternedString) + entry->len + 1;
+    manager->memory.interned_strings--;
+    free(entry);
 }
 
-bool VisitManagerAddVisit(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url,
-                          const char* text) {
-    if (!manager || !url || !text) {
-        return false;
-    }
+// Helper function to get the flags of a visit record. Byte arithmetic keeps this valid for
+// records allocated without inline_chars.
+static uint8_t* visit_flags(const Visit* visit) {
+    return (uint8_t*)visit + offsetof(VisitRecord, flags);
+}
+
+// Helper function to check whether the text of a visit is interned
+static bool has_interned_text(const Visit* visit) {
+    return *visit_flags(visit) & VISIT_TEXT_INTERNED;
+}
+
+// Helper function to check whether the text of a visit lives in its inline storage
+static bool has_inline_text(const Visit* visit) {
+    return !has_interned_text(visit) && visit->text == ((const VisitRecord*)visit)->inline_chars;
+}
+
+// Helper function to get the length of the URL of a visit
+static size_t visit_url_len(const Visit* visit) {
+    return interned_header(visit->url)->len;
+}
+
+// Helper function to get the length of the text of a visit
+static size_t visit_text_len(const Visit* visit) {
+    return ((const VisitRecord*)visit)->text_len;
+}
+
+// Helper function to get the allocation size of a visit record
+static size_t visit_record_size(const Visit* visit) {
+    return has_interned_text(visit) ? offsetof(VisitRecord, inline_chars) : sizeof(VisitRecord);
+}
+
+// Helper function to allocate a visit without strings. Records whose text will be interned
+// are allocated without inline storage.
+static Visit* alloc_visit(bool intern_text) {
+    Visit* visit = (Visit*)calloc(1, intern_text ? offsetof(VisitRecord, inline_chars) : sizeof(VisitRecord));
+    if (visit && intern_text) {
+        *visit_flags(visit) = VISIT_TEXT_INTERNED;
+    }
+    return visit;
+}
+
+// Helper function to set the URL of a new visit to an interned copy of len bytes of url
+static bool set_visit_url(VisitManager* manager, Visit* visit, const char* url, size_t len) {
+    visit->url = intern_string(manager, url, len);
+    return visit->url != NULL;
+}
+
+// Helper function to set the text of a new visit to a copy of len bytes of text
+static bool set_visit_text(VisitManager* manager, Visit* visit, const char* text, size_t len) {
+    ((VisitRecord*)visit)->text_len = (uint32_t)len;
+    if (has_interned_text(visit)) {
+        visit->text = intern_string(manager, text, len);
+        return visit->text != NULL;
+    }
+
+    VisitRecord* record = (VisitRecord*)visit;
+    visit->text         = len < VISIT_INLINE_CHARS ? record->inline_chars : (char*)malloc(len + 1);
+    if (!visit->text) {
+        return false;
+    }
+
+    if (len > 0) {
+        memcpy(visit->text, text, len);
+    }
+    visit->text[len] = '\0';
+    return true;
+}
+
+// Helper function to free visit memory and release its interned strings
+static void free_visit(VisitManager* manager, Visit* visit) {
+    if (visit) {
+        if (visit->url) {
+            release_string(manager, visit->url);
+        }
+        if (visit->text) {
+            if (has_interned_text(visit)) {
+                release_string(manager, visit->text);
+            } else if (!has_inline_text(visit)) {
+                free(visit->text);
+            }
+        }
+        free(visit);
+    }
+}
+
+// Helper function to free a score table and release its URLs
+static void free_scores(VisitManager* manager, ScoreTable* table) {
+    if (table) {
+        for (size_t i = 0; i < table->count; i++) {
+            release_string(manager, table->heap[i].url);
+        }
+        free(table->heap);
+        free(table->positions);
+        free(table);
+    }
+}
+
+// Helper function to free user and user visits memory.
+static void free_user_visits(VisitManager* manager, UserVisits* user) {
+    if (user) {
+        free_scores(manager, user->scores);
+        for (size_t i = 0; i < user->visit_count; i++) {
+            free_visit(manager, user->visits[i]);
+        }
+        if (user->visits != user->inline_visits) {
+            free(user->visits);
+        }
+        free(user->url_index);
+        free(user->prefix_index);
+        free(user);
+    }
+}
+
+// Helper function to create a new visit
+static Visit* create_visit(VisitManager* manager, uint32_t visit_id, const char* url, size_t url_len,
+                           const char* text, size_t text_len) {
+    Visit* visit = alloc_visit(manager->intern_titles);
+    if (!visit) {
+        return NULL;
+    }
+
+    visit->visit_id = visit_id;
+
+    if (!set_visit_url(manager, visit, url, url_len) || !set_visit_text(manager, visit, text, text_len)) {
+        free_visit(manager, visit);
+        return NULL;
+    }
+
+    // Set current time
+    timespec_get(&visit->time, TIME_UTC);
+    // clock_gettime(CLOCK_REALTIME, &visit->time);
+    return visit;
+}
+
+// Helper function to map a per-user visit count to its histogram bucket
+static size_t count_bucket(size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t bucket = 64 - (size_t)__builtin_clzll((unsigned long long)count);
+    return bucket < VISIT_MANAGER_COUNT_BUCKETS ? bucket : VISIT_MANAGER_COUNT_BUCKETS - 1;
+}
+
+// Helper function to account for the memory of a visit (sign is 1 or -1).
+// Interned strings are accounted by the intern table and inline text is part of the record,
+// so only a heap text counts as string bytes here.
+static void account_visit(VisitManager* manager, const Visit* visit, int sign) {
+    size_t string_bytes = 0;
+    if (!has_interned_text(visit) && !has_inline_text(visit)) {
+        string_bytes = visit_text_len(visit) + 1;
+    }
+
+    if (sign > 0) {
+        manager->memory.string_bytes += string_bytes;
+        manager->memory.visit_bytes += visit_record_size(visit);
+    } else {
+        manager->memory.string_bytes -= string_bytes;
+        manager->memory.visit_bytes -= visit_record_size(visit);
+    }
+}
+
+// Helper function to account for a user entering (sign 1) or leaving (sign -1) the manager
+static void account_user(VisitManager* manager, const UserVisits* user, int sign) {
+    VisitManagerMemory* memory = &manager->memory;
+    size_t slack               = user->high_water - user->visit_count;
+    size_t array_bytes         = user->visits == user->inline_visits ? 0 : user->capacity * sizeof(Visit*);
+    array_bytes += (user->url_index_capacity + user->prefix_capacity) * sizeof(Visit*);
+    if (user->scores) {
+        array_bytes += sizeof(ScoreTable) + user->scores->heap_capacity * sizeof(UrlScore) +
+                       user->scores->position_capacity * sizeof(uint32_t);
+    }
+    if (sign > 0) {
+        memory->user_count++;
+        memory->user_bytes += sizeof(UserVisits);
+        memory->visit_array_bytes += array_bytes;
+        memory->visit_count += user->visit_count;
+        memory->capacity_slack += user->capacity - user->visit_count;
+        memory->deleted_slack += slack;
+        memory->visit_count_histogram[count_bucket(user->visit_count)]++;
+    } else {
+        memory->user_count--;
+        memory->user_bytes -= sizeof(UserVisits);
+        memory->visit_array_bytes -= array_bytes;
+        memory->visit_count -= user->visit_count;
+        memory->capacity_slack -= user->capacity - user->visit_count;
+        memory->deleted_slack -= slack;
+        memory->visit_count_histogram[count_bucket(user->visit_count)]--;
+    }
+}
+
+// Helper function to change the visit count of a user, keeping the memory counters in sync
+static void set_visit_count(VisitManager* manager, UserVisits* user, size_t count) {
+    account_user(manager, user, -1);
+    user->visit_count = count;
+    if (count > user->high_water) {
+        user->high_water = (uint32_t)count;
+    }
+    account_user(manager, user, 1);
+}
+
+// Helper function to replace the visit array of a user, keeping the memory counters in sync
+static void set_visit_array(VisitManager* manager, UserVisits* user, Visit** visits, size_t capacity) {
+    account_user(manager, user, -1);
+    user->visits   = visits;
+    user->capacity = capacity;
+    if (user->high_water > capacity) {
+        user->high_water = (uint32_t)capacity;
+    }
+    account_user(manager, user, 1);
+}
+
+// Helper function to account for and free a visit removed from a user
+static void release_visit(VisitManager* manager, Visit* visit) {
+    account_visit(manager, visit, -1);
+    free_visit(manager, visit);
+}
+
+// Helper function to resize a user's visit array to capacity, which must hold all its visits.
+// Capacities up to USER_INLINE_VISITS move the visits back into the user header.
+static bool resize_visits(VisitManager* manager, UserVisits* user, size_t capacity) {
+    bool is_inline = user->visits == user->inline_visits;
+    if (capacity <= USER_INLINE_VISITS) {
+        if (!is_inline) {
+            memcpy(user->inline_visits, user->visits, user->visit_count * sizeof(Visit*));
+            free(user->visits);
+        }
+        set_visit_array(manager, user, user->inline_visits, USER_INLINE_VISITS);
+        return true;
+    }
+
+    Visit** new_visits;
+    if (is_inline) {
+        new_visits = (Visit**)malloc(capacity * sizeof(Visit*));
+        if (new_visits) {
+            memcpy(new_visits, user->inline_visits, user->visit_count * sizeof(Visit*));
+        }
+    } else {
+        new_visits = (Visit**)realloc(user->visits, capacity * sizeof(Visit*));
+    }
+    if (!new_visits) {
+        return false;
+    }
+
+    set_visit_array(manager, user, new_visits, capacity);
+    return true;
+}
+
+// Helper function to halve the visit array of a user that uses at most a quarter of it
+static void shrink_user(VisitManager* manager, UserVisits* user) {
+    if (user->capacity > USER_INLINE_VISITS && user->visit_count * 4 <= user->capacity) {
+        // Failing to shrink only leaves extra capacity behind.
+        resize_visits(manager, user, user->visit_count * 2);
+    }
+}
+
+static void sort_visits(Visit* visits[], size_t visit_count);
+static int compare_visits(const void* a, const void* b);
+
+// Helper function to sort a user's visits newest first, unless they already are
+static void order_visits(UserVisits* user) {
+    if (!user->ordered) {
+        sort_visits(user->visits, user->visit_count);
+        user->ordered = true;
+    }
+}
+
+// Helper function to find the URL index slot holding the visit to an interned URL, or the
+// empty slot where it belongs
+static size_t url_index_slot(const UserVisits* user, const char* url) {
+    size_t mask = user->url_index_capacity - 1;
+    size_t i    = interned_header(url)->hash & mask;
+    while (user->url_index[i] && user->url_index[i]->url != url) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Helper function to make a visit the one indexed for its URL
+static void index_url(UserVisits* user, Visit* visit) {
+    user->url_index[url_index_slot(user, visit->url)] = visit;
+}
+
+// Helper function to rebuild the URL index of a user with new_capacity slots (a power of two).
+// Visits are inserted oldest first, so the newest visit to a repeated URL is the one indexed.
+static bool resize_url_index(VisitManager* manager, UserVisits* user, size_t new_capacity) {
+    Visit** new_index = (Visit**)calloc(new_capacity, sizeof(Visit*));
+    if (!new_index) {
+        return false;
+    }
+
+    account_user(manager, user, -1);
+    free(user->url_index);
+    user->url_index          = new_index;
+    user->url_index_capacity = new_capacity;
+    user->unindexed_visits   = 0;
+    for (size_t i = user->visit_count; i-- > 0;) {
+        size_t slot = url_index_slot(user, user->visits[i]->url);
+        if (user->url_index[slot]) {
+            user->unindexed_visits++;
+        }
+        user->url_index[slot] = user->visits[i];
+    }
+    account_user(manager, user, 1);
+    return true;
+}
+
+// Helper function to give a user a URL index. While a user has one, its visit array is kept
+// newest first, so the oldest visit is always the last.
+static bool build_url_index(VisitManager* manager, UserVisits* user) {
+    order_visits(user);
+    return resize_url_index(manager, user, index_capacity_for(user->visit_count + 1));
+}
+
+// Helper function to free the URL index of a user
+static void free_url_index(VisitManager* manager, UserVisits* user) {
+    account_user(manager, user, -1);
+    free(user->url_index);
+    user->url_index          = NULL;
+    user->url_index_capacity = 0;
+    user->unindexed_visits   = 0;
+    account_user(manager, user, 1);
+}
+
+// Helper function to remove a visit from the URL index of its user. Another visit to the same
+// URL (left from before dedup mode was enabled) takes its place; without any, none is searched.
+static void unindex_url(UserVisits* user, const Visit* visit) {
+    size_t mask = user->url_index_capacity - 1;
+    size_t i    = url_index_slot(user, visit->url);
+    if (user->url_index[i] != visit) {
+        user->unindexed_visits--;
+        return;
+    }
+
+    // Backward-shift deletion, as for the user index.
+    for (size_t j = (i + 1) & mask; user->url_index[j]; j = (j + 1) & mask) {
+        size_t home = interned_header(user->url_index[j]->url)->hash & mask;
+        if (!probe_between(home, i, j)) {
+            user->url_index[i] = user->url_index[j];
+            i                  = j;
+        }
+    }
+    user->url_index[i] = NULL;
+
+    for (size_t k = 0; k < user->visit_count && user->unindexed_visits > 0; k++) {
+        if (user->visits[k] != visit && user->visits[k]->url == visit->url) {
+            index_url(user, user->visits[k]);
+            user->unindexed_visits--;
+            break;
+        }
+    }
+}
+
+// Helper function to get lambda * t for a visit time, the key of a single visit at that time
+static double score_time(const VisitManager* manager, const struct timespec* time) {
+    return manager->frecency_lambda * ((double)time->tv_sec + (double)time->tv_nsec * 1e-9);
+}
+
+// Helper function to compute log(exp(a) + exp(b)) without overflow
+static double log_add(double a, double b) {
+    if (a < b) {
+        double t = a;
+        a        = b;
+        b        = t;
+    }
+    return b == -INFINITY ? a : a + log1p(exp(b - a));
+}
+
+// Helper function to find the position slot of an interned URL, or the empty slot where it belongs
+static size_t score_slot(const ScoreTable* table, const char* url) {
+    size_t mask = table->position_capacity - 1;
+    size_t i    = interned_header(url)->hash & mask;
+    while (table->positions[i] && table->heap[table->positions[i] - 1].url != url) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Helper function to store an entry at heap position i and point its slot there
+static void set_score(ScoreTable* table, size_t i, UrlScore entry) {
+    table->heap[i]               = entry;
+    table->positions[entry.slot] = (uint32_t)i + 1;
+}
+
+// Helper function to move the heap entry at i up to its place
+static void sift_score_up(ScoreTable* table, size_t i) {
+    UrlScore entry = table->heap[i];
+    while (i > 0 && table->heap[(i - 1) / 2].key < entry.key) {
+        set_score(table, i, table->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    set_score(table, i, entry);
+}
+
+// Helper function to move the heap entry at i down to its place
+static void sift_score_down(ScoreTable* table, size_t i) {
+    UrlScore entry = table->heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= table->count) {
+            break;
+        }
+        if (child + 1 < table->count && table->heap[child + 1].key > table->heap[child].key) {
+            child++;
+        }
+        if (table->heap[child].key <= entry.key) {
+            break;
+        }
+        set_score(table, i, table->heap[child]);
+        i = child;
+    }
+    set_score(table, i, entry);
+}
+
+// Helper function to restore the heap order of a score table after entries were added
+// without sifting
+static void heapify_scores(ScoreTable* table) {
+    for (size_t i = table->count / 2; i-- > 0;) {
+        sift_score_down(table, i);
+    }
+}
+
+// Helper function to resize the heap and position table of a score table, rehashing every entry.
+// Keeping both sizes cannot fail.
+static bool resize_scores(ScoreTable* table, size_t heap_capacity, size_t position_capacity) {
+    if (heap_capacity != table->heap_capacity) {
+        UrlScore* heap = (UrlScore*)realloc(table->heap, heap_capacity * sizeof(UrlScore));
+        if (!heap) {
+            return false;
+        }
+        table->heap          = heap;
+        table->heap_capacity = heap_capacity;
+    }
+
+    if (position_capacity != table->position_capacity) {
+        uint32_t* positions = (uint32_t*)calloc(position_capacity, sizeof(uint32_t));
+        if (!positions) {
+            return false;
+        }
+        free(table->positions);
+        table->positions         = positions;
+        table->position_capacity = position_capacity;
+    } else {
+        memset(table->positions, 0, position_capacity * sizeof(uint32_t));
+    }
+
+    for (size_t i = 0; i < table->count; i++) {
+        size_t slot            = score_slot(table, table->heap[i].url);
+        table->heap[i].slot    = (uint32_t)slot;
+        table->positions[slot] = (uint32_t)i + 1;
+    }
+    return true;
+}
+
+// Helper function to allocate an empty score table with room for capacity URLs
+static ScoreTable* alloc_scores(const VisitManager* manager, size_t capacity) {
+    ScoreTable* table = (ScoreTable*)calloc(1, sizeof(ScoreTable));
+    if (!table) {
+        return NULL;
+    }
+
+    table->half_life = manager->frecency_half_life;
+    if (!resize_scores(table, capacity > 0 ? capacity : 1, index_capacity_for(capacity))) {
+        free(table->heap);
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+// Helper function to add visits to the score of a URL, creating its entry (and taking a
+// reference to the URL) if needed. The table must have room for a new entry. Returns the heap
+// position of the entry; the caller restores the heap order.
+static size_t add_score(ScoreTable* table, char* url, double key, uint32_t visit_count, uint32_t held) {
+    size_t slot = score_slot(table, url);
+    if (!table->positions[slot]) {
+        interned_header(url)->refcount++;
+        UrlScore entry = {.url = url, .key = -INFINITY, .slot = (uint32_t)slot};
+        set_score(table, table->count++, entry);
+    }
+
+    UrlScore* entry = &table->heap[table->positions[slot] - 1];
+    entry->key      = log_add(entry->key, key);
+    entry->visit_count += visit_count;
+    entry->held += held;
+    return table->positions[slot] - 1;
+}
+
+// Helper function to score the visits a user holds from scratch
+static bool build_scores(VisitManager* manager, UserVisits* user) {
+    ScoreTable* table = alloc_scores(manager, user->visit_count + 1);
+    if (!table) {
+        return false;
+    }
+
+    for (size_t i = 0; i < user->visit_count; i++) {
+        add_score(table, user->visits[i]->url, score_time(manager, &user->visits[i]->time), 1, 1);
+    }
+    heapify_scores(table);
+
+    account_user(manager, user, -1);
+    user->scores = table;
+    account_user(manager, user, 1);
+    return true;
+}
+
+// Helper function to free the score table of a resident user
+static void drop_scores(VisitManager* manager, UserVisits* user) {
+    account_user(manager, user, -1);
+    free_scores(manager, user->scores);
+    user->scores = NULL;
+    account_user(manager, user, 1);
+}
+
+// Helper function to score a visit the user now holds. On failure the table is dropped, to be
+// rebuilt from the user's visits when next needed.
+static void record_score(VisitManager* manager, UserVisits* user, const Visit* visit) {
+    ScoreTable* table = user->scores;
+    if (table->count >= table->heap_capacity || (table->count + 1) * 2 > table->position_capacity) {
+        account_user(manager, user, -1);
+        size_t heap_capacity = table->count < table->heap_capacity ? table->heap_capacity : table->heap_capacity * 2;
+        bool ok              = resize_scores(table, heap_capacity, index_capacity_for(table->count + 1));
+        account_user(manager, user, 1);
+        if (!ok) {
+            drop_scores(manager, user);
+            return;
+        }
+    }
+
+    sift_score_up(table, add_score(table, visit->url, score_time(manager, &visit->time), 1, 1));
+}
+
+// Helper function to remove the score entry at heap position i and release its URL
+static void remove_score_at(VisitManager* manager, ScoreTable* table, size_t i) {
+    UrlScore removed = table->heap[i];
+
+    // Backward-shift deletion of its slot, as for the user index.
+    size_t mask = table->position_capacity - 1;
+    size_t slot = removed.slot;
+    for (size_t j = (slot + 1) & mask; table->positions[j]; j = (j + 1) & mask) {
+        UrlScore* moved = &table->heap[table->positions[j] - 1];
+        size_t home     = interned_header(moved->url)->hash & mask;
+        if (!probe_between(home, slot, j)) {
+            table->positions[slot] = table->positions[j];
+            moved->slot            = (uint32_t)slot;
+            slot                   = j;
+        }
+    }
+    table->positions[slot] = 0;
+
+    // Fill the hole with the last entry.
+    if (i < --table->count) {
+        set_score(table, i, table->heap[table->count]);
+        sift_score_up(table, i);
+        sift_score_down(table, i);
+    }
+    release_string(manager, removed.url);
+}
+
+// Helper function to note that a user no longer holds a visit to url. The URL's score is
+// dropped with its last visit.
+static void unhold_score(VisitManager* manager, UserVisits* user, const char* url) {
+    ScoreTable* table = user->scores;
+    uint32_t position = table->positions[score_slot(table, url)];
+    if (position && --table->heap[position - 1].held == 0) {
+        remove_score_at(manager, table, position - 1);
+    }
+}
+
+// Comparison function for qsort ordering Visit pointers by URL, newest first within a URL. URLs
+// are compared by their bytes and interned lengths, the order compare_url_prefix searches in.
+static int compare_visit_urls(const void* a, const void* b) {
+    const Visit* visit1 = *(Visit* const*)a;
+    const Visit* visit2 = *(Visit* const*)b;
+    if (visit1->url != visit2->url) {
+        size_t len1 = visit_url_len(visit1);
+        size_t len2 = visit_url_len(visit2);
+        int cmp     = memcmp(visit1->url, visit2->url, len1 < len2 ? len1 : len2);
+        return cmp != 0 ? cmp : (len1 < len2 ? -1 : len1 > len2);
+    }
+    return compare_visits(a, b);
+}
+
+// Helper function to sort a user's visits by URL into its prefix index
+static bool build_prefix_index(VisitManager* manager, UserVisits* user) {
+    if (user->visit_count > user->prefix_capacity || !user->prefix_index) {
+        size_t capacity = user->visit_count > 0 ? user->visit_count : 1;
+        Visit** index   = (Visit**)realloc(user->prefix_index, capacity * sizeof(Visit*));
+        if (!index) {
+            return false;
+        }
+
+        account_user(manager, user, -1);
+        user->prefix_index    = index;
+        user->prefix_capacity = capacity;
+        account_user(manager, user, 1);
+    }
+
+    memcpy(user->prefix_index, user->visits, user->visit_count * sizeof(Visit*));
+    qsort(user->prefix_index, user->visit_count, sizeof(Visit*), compare_visit_urls);
+    user->prefix_count = user->visit_count;
+    user->prefix_valid = true;
+    return true;
+}
+
+// Helper function to find the first position of a user's prefix index not ordered before visit
+static size_t prefix_lower_bound(const UserVisits* user, Visit* const* visit) {
+    size_t low = 0, high = user->prefix_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (compare_visit_urls(&user->prefix_index[mid], visit) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Helper function to add a new visit to a built prefix index, so that adding a visit costs a
+// binary search and a move rather than a rebuild. If the index cannot grow it is rebuilt later.
+static void insert_prefix_entry(VisitManager* manager, UserVisits* user, Visit* visit) {
+    if (!user->prefix_valid) {
+        return;
+    }
+
+    if (user->prefix_count >= user->prefix_capacity) {
+        size_t capacity = user->prefix_capacity * 2;
+        Visit** index   = (Visit**)realloc(user->prefix_index, capacity * sizeof(Visit*));
+        if (!index) {
+            user->prefix_valid = false;
+            return;
+        }
+
+        account_user(manager, user, -1);
+        user->prefix_index    = index;
+        user->prefix_capacity = capacity;
+        account_user(manager, user, 1);
+    }
+
+    size_t i = prefix_lower_bound(user, &visit);
+    memmove(&user->prefix_index[i + 1], &user->prefix_index[i], (user->prefix_count - i) * sizeof(Visit*));
+    user->prefix_index[i] = visit;
+    user->prefix_count++;
+}
+
+// Helper function to remove a visit leaving a user from its built prefix index
+static void remove_prefix_entry(UserVisits* user, Visit* visit) {
+    if (!user->prefix_valid) {
+        return;
+    }
+
+    size_t i = prefix_lower_bound(user, &visit);
+    while (i < user->prefix_count && user->prefix_index[i] != visit) {
+        i++;
+    }
+    if (i == user->prefix_count) {
+        user->prefix_valid = false;
+        return;
+    }
+    memmove(&user->prefix_index[i], &user->prefix_index[i + 1], (user->prefix_count - i - 1) * sizeof(Visit*));
+    user->prefix_count--;
+}
+
+// Helper function to check whether a byte belongs to a word. Bytes of multi-byte UTF-8
+// characters count as word bytes, so non-ASCII words are indexed whole.
+static bool is_word_byte(uint8_t c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+// Comparison function for qsort ordering tokens by hash, then bytes
+static int compare_tokens(const void* a, const void* b) {
+    const TextToken* token1 = (const TextToken*)a;
+    const TextToken* token2 = (const TextToken*)b;
+    if (token1->hash != token2->hash) {
+        return token1->hash < token2->hash ? -1 : 1;
+    }
+    if (token1->len != token2->len) {
+        return token1->len < token2->len ? -1 : 1;
+    }
+    return memcmp(token1->chars, token2->chars, token1->len);
+}
+
+// Helper function to split len bytes of text into its distinct lowercase words, stored in
+// manager->tokens. Returns the number of words, or SIZE_MAX if out of memory.
+static size_t tokenize(VisitManager* manager, const char* text, size_t len) {
+    if (len > manager->token_text_capacity) {
+        char* token_text = (char*)realloc(manager->token_text, len);
+        if (!token_text) {
+            return SIZE_MAX;
+        }
+        manager->token_text          = token_text;
+        manager->token_text_capacity = len;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < len;) {
+        if (!is_word_byte((uint8_t)text[i])) {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < len && is_word_byte((uint8_t)text[i])) {
+            char c                   = text[i];
+            manager->token_text[i++] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+        }
+
+        if (count >= manager->token_capacity) {
+            size_t capacity   = manager->token_capacity > 0 ? manager->token_capacity * 2 : 16;
+            TextToken* tokens = (TextToken*)realloc(manager->tokens, capacity * sizeof(TextToken));
+            if (!tokens) {
+                return SIZE_MAX;
+            }
+            manager->tokens         = tokens;
+            manager->token_capacity = capacity;
+        }
+
+        TextToken* token = &manager->tokens[count++];
+        token->chars     = &manager->token_text[start];
+        token->len       = (uint32_t)(i - start < TERM_MAX_LEN ? i - start : TERM_MAX_LEN);
+        token->hash      = hash_string(token->chars, token->len);
+    }
+
+    // A word repeated in the text is indexed once.
+    if (count > 1) {
+        qsort(manager->tokens, count, sizeof(TextToken), compare_tokens);
+    }
+    size_t distinct = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (distinct == 0 || compare_tokens(&manager->tokens[distinct - 1], &manager->tokens[i]) != 0) {
+            manager->tokens[distinct++] = manager->tokens[i];
+        }
+    }
+    return distinct;
+}
+
+// Helper function to find the term table slot holding a word, or the empty slot where it belongs
+static size_t term_slot(const VisitManager* manager, const TextToken* token) {
+    size_t mask = manager->text_term_capacity - 1;
+    size_t i    = token->hash & mask;
+    for (TextTerm* term; (term = manager->text_terms[i]); i = (i + 1) & mask) {
+        if (term->hash == token->hash && term->len == token->len &&
+            memcmp(term->chars, token->chars, token->len) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+// Helper function to rehash the term table into a table of new_capacity slots (a power of two)
+static bool resize_term_table(VisitManager* manager, size_t new_capacity) {
+    TextTerm** old_table = manager->text_terms;
+    size_t old_capacity  = manager->text_term_capacity;
+
+    TextTerm** new_table = (TextTerm**)calloc(new_capacity, sizeof(TextTerm*));
+    if (!new_table) {
+        return false;
+    }
+
+    manager->text_terms         = new_table;
+    manager->text_term_capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        TextTerm* term = old_table[i];
+        if (term) {
+            size_t j = term->hash & (new_capacity - 1);
+            while (new_table[j]) {
+                j = (j + 1) & (new_capacity - 1);
+            }
+            new_table[j] = term;
+        }
+    }
+    free(old_table);
+    return true;
+}
+
+// Helper function to account for the memory of a term (sign is 1 or -1)
+static void account_term(VisitManager* manager, const TextTerm* term, int sign) {
+    size_t bytes = sizeof(TextTerm) + term->len + 1 + term->posting_bytes + term->skip_count * sizeof(PostingSkip) +
+                   term->pending_capacity * sizeof(uint64_t);
+    if (sign > 0) {
+        manager->memory.text_index_bytes += bytes;
+    } else {
+        manager->memory.text_index_bytes -= bytes;
+    }
+}
+
+// Helper function to find the term of a word, adding an empty one if create is set.
+// Returns NULL if the word is not indexed or out of memory.
+static TextTerm* find_term(VisitManager* manager, const TextToken* token, bool create) {
+    if (manager->text_term_count == 0 && !create) {
+        return NULL;
+    }
+    if (create && (manager->text_term_count + 1) * 2 > manager->text_term_capacity &&
+        !resize_term_table(manager, manager->text_term_capacity > 0 ? manager->text_term_capacity * 2 : 64)) {
+        return NULL;
+    }
+
+    size_t slot    = term_slot(manager, token);
+    TextTerm* term = manager->text_terms[slot];
+    if (term || !create) {
+        return term;
+    }
+
+    term = (TextTerm*)calloc(1, sizeof(TextTerm) + token->len + 1);
+    if (!term) {
+        return NULL;
+    }
+    term->hash = token->hash;
+    term->len  = token->len;
+    memcpy(term->chars, token->chars, token->len);
+
+    manager->text_terms[slot] = term;
+    manager->text_term_count++;
+    manager->memory.text_terms++;
+    account_term(manager, term, 1);
+    return term;
+}
+
+// Helper function to remove a term from the term table and free it
+static void remove_term(VisitManager* manager, TextTerm* term) {
+    size_t mask = manager->text_term_capacity - 1;
+    size_t i    = term->hash & mask;
+    while (manager->text_terms[i] != term) {
+        i = (i + 1) & mask;
+    }
+
+    // Backward-shift deletion, as for the user index.
+    for (size_t j = (i + 1) & mask; manager->text_terms[j]; j = (j + 1) & mask) {
+        size_t home = manager->text_terms[j]->hash & mask;
+        if (!probe_between(home, i, j)) {
+            manager->text_terms[i] = manager->text_terms[j];
+            i                      = j;
+        }
+    }
+    manager->text_terms[i] = NULL;
+
+    manager->text_term_count--;
+    manager->memory.text_terms--;
+    account_term(manager, term, -1);
+    free(term->postings);
+    free(term->skips);
+    free(term->pending);
+    free(term);
+}
+
+// Helper function to free the text index and turn it off
+static void free_text_index(VisitManager* manager) {
+    for (size_t i = 0; i < manager->text_term_capacity; i++) {
+        TextTerm* term = manager->text_terms[i];
+        if (term) {
+            free(term->postings);
+            free(term->skips);
+            free(term->pending);
+            free(term);
+        }
+    }
+    free(manager->text_terms);
+    manager->text_terms              = NULL;
+    manager->text_term_capacity      = 0;
+    manager->text_term_count         = 0;
+    manager->memory.text_terms       = 0;
+    manager->memory.text_index_bytes = 0;
+    manager->text_index              = false;
+}
+
+// Helper function to get the bytes of value as a LEB128 varint
+static size_t varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// Helper function to write value as a LEB128 varint. Returns the end of the bytes written.
+static uint8_t* put_varint(uint8_t* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// Helper function to read a LEB128 varint that ends before end. Returns the byte after it, or
+// NULL if it is truncated or too long.
+static const uint8_t* get_varint(const uint8_t* in, const uint8_t* end, uint64_t* value) {
+    *value = 0;
+    for (unsigned shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return in;
+        }
+    }
+    return NULL;
+}
+
+// Comparison function for qsort ordering posting keys
+static int compare_keys(const void* a, const void* b) {
+    uint64_t key1 = *(const uint64_t*)a;
+    uint64_t key2 = *(const uint64_t*)b;
+    return key1 < key2 ? -1 : key1 > key2;
+}
+
+// Helper function to build the skip entries of a term's postings, checking on the way that they
+// decode to posting_count increasing keys. Returns false if they do not. Without memory for the
+// entries the term has none, and is decoded from the start.
+static bool build_skips(VisitManager* manager, TextTerm* term) {
+    account_term(manager, term, -1);
+    free(term->skips);
+    term->skips      = NULL;
+    term->skip_count = 0;
+    if (term->posting_count > TERM_SKIP_KEYS) {
+        term->skips = (PostingSkip*)malloc((term->posting_count - 1) / TERM_SKIP_KEYS * sizeof(PostingSkip));
+    }
+
+    const uint8_t* in  = term->postings;
+    const uint8_t* end = term->postings + term->posting_bytes;
+    uint64_t key       = 0;
+    bool valid         = true;
+    for (uint32_t i = 0; i < term->posting_count && valid; i++) {
+        if (term->skips && i > 0 && i % TERM_SKIP_KEYS == 0) {
+            PostingSkip* skip = &term->skips[term->skip_count++];
+            skip->base        = key;
+            skip->offset      = (uint32_t)(in - term->postings);
+            skip->index       = i;
+        }
+
+        uint64_t gap;
+        valid = (in = get_varint(in, end, &gap)) && (i == 0 || gap > 0) && key + gap >= key;
+        key += gap;
+    }
+    account_term(manager, term, 1);
+    return valid && in == end;
+}
+
+// Helper function to double the capacity of a key buffer. Returns false if out of memory.
+static bool grow_keys(uint64_t** keys, size_t* capacity) {
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    uint64_t* new_keys  = (uint64_t*)realloc(*keys, new_capacity * sizeof(uint64_t));
+    if (!new_keys) {
+        return false;
+    }
+    *keys     = new_keys;
+    *capacity = new_capacity;
+    return true;
+}
+
+// Helper function to find the first of n sorted keys that is not less than key
+static size_t lower_bound_key(const uint64_t* keys, size_t n, uint64_t key) {
+    size_t low = 0, high = n;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (keys[mid] < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Helper function to write the sorted posting keys of a term between first and last, with its
+// pending changes applied, to *keys, which holds *capacity keys and grows as needed. Decoding
+// starts at the block holding first. Returns the number of keys written, or SIZE_MAX if out of
+// memory.
+static size_t decode_term(TextTerm* term, uint64_t first, uint64_t last, uint64_t** keys, size_t* capacity) {
+    uint64_t* adds    = term->pending;
+    uint64_t* removes = term->pending + term->pending_adds;
+    if (term->pending) {
+        qsort(adds, term->pending_adds, sizeof(uint64_t), compare_keys);
+        qsort(removes, term->pending_removes, sizeof(uint64_t), compare_keys);
+    }
+
+    // The last block whose keys all follow a key before first is where decoding starts.
+    size_t low = 0, high = term->skip_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (term->skips[mid].base < first) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    const uint8_t* in = term->postings;
+    uint64_t key      = 0;
+    uint32_t i        = 0;
+    if (low > 0) {
+        in += term->skips[low - 1].offset;
+        key = term->skips[low - 1].base;
+        i   = term->skips[low - 1].index;
+    }
+
+    // Merge the compressed keys, less removed ones, with the additions.
+    const uint8_t* end = term->postings + term->posting_bytes;
+    size_t count       = 0;
+    size_t a           = lower_bound_key(adds, term->pending_adds, first);
+    size_t r           = lower_bound_key(removes, term->pending_removes, first);
+    size_t n           = term->posting_count;
+    for (;; i++) {
+        if (i < n) {
+            uint64_t gap;
+            in = get_varint(in, end, &gap);
+            key += gap;
+            if (key < first) {
+                continue;
+            }
+        }
+
+        // Once past the compressed keys in range, the remaining additions up to last follow.
+        bool done = i >= n || key > last;
+        while (a < term->pending_adds && adds[a] <= last && (done || adds[a] < key)) {
+            if (count == *capacity && !grow_keys(keys, capacity)) {
+                return SIZE_MAX;
+            }
+            (*keys)[count++] = adds[a++];
+        }
+        if (done) {
+            break;
+        }
+
+        while (r < term->pending_removes && removes[r] < key) {
+            r++;
+        }
+        if (r < term->pending_removes && removes[r] == key) {
+            r++;
+            continue;
+        }
+        if (count == *capacity && !grow_keys(keys, capacity)) {
+            return SIZE_MAX;
+        }
+        (*keys)[count++] = key;
+    }
+    return count;
+}
+
+// Helper function to apply the pending changes of a term to its compressed postings.
+// A term left without postings is removed.
+static bool merge_term(VisitManager* manager, TextTerm* term) {
+    size_t capacity = term->posting_count + term->pending_adds + 1;
+    uint64_t* keys  = (uint64_t*)malloc(capacity * sizeof(uint64_t));
+    if (!keys) {
+        return false;
+    }
+
+    size_t count = decode_term(term, 0, UINT64_MAX, &keys, &capacity);
+    if (count == SIZE_MAX) {
+        free(keys);
+        return false;
+    }
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += varint_size(keys[i] - (i > 0 ? keys[i - 1] : 0));
+    }
+    if (count == 0) {
+        free(keys);
+        remove_term(manager, term);
+        return true;
+    }
+
+    uint8_t* postings = (uint8_t*)malloc(bytes);
+    if (!postings || bytes > UINT32_MAX) {
+        free(postings);
+        free(keys);
+        return false;
+    }
+
+    uint8_t* out = postings;
+    for (size_t i = 0; i < count; i++) {
+        out = put_varint(out, keys[i] - (i > 0 ? keys[i - 1] : 0));
+    }
+    free(keys);
+
+    account_term(manager, term, -1);
+    free(term->postings);
+    free(term->pending);
+    term->postings         = postings;
+    term->posting_bytes    = (uint32_t)bytes;
+    term->posting_count    = (uint32_t)count;
+    term->pending          = NULL;
+    term->pending_adds     = 0;
+    term->pending_removes  = 0;
+    term->pending_capacity = 0;
+    account_term(manager, term, 1);
+    build_skips(manager, term);
+    return true;
+}
+
+// Helper function to add (add true) or remove the posting key of a term. A change cancels an
+// opposite pending one; the rest are buffered and merged once they are a sizeable fraction of
+// the postings, which keeps the cost of a change low for common words.
+static bool change_posting(VisitManager* manager, TextTerm* term, uint64_t key, bool add) {
+    uint64_t* pending = term->pending;
+    size_t adds       = term->pending_adds;
+    size_t changes    = adds + term->pending_removes;
+
+    // Look for the opposite change: a removal when adding, an addition when removing.
+    size_t i = add ? adds : 0, end = add ? changes : adds;
+    while (i < end && pending[i] != key) {
+        i++;
+    }
+
+    if (i < end) {
+        if (add) {
+            pending[i] = pending[changes - 1];
+            term->pending_removes--;
+        } else {
+            pending[i]        = pending[adds - 1];
+            pending[adds - 1] = pending[changes - 1];
+            term->pending_adds--;
+        }
+    } else {
+        if (changes >= term->pending_capacity) {
+            size_t capacity    = term->pending_capacity > 0 ? term->pending_capacity * 2 : 4;
+            uint64_t* resized = (uint64_t*)realloc(pending, capacity * sizeof(uint64_t));
+            if (!resized) {
+                return false;
+            }
+            account_term(manager, term, -1);
+            term->pending          = pending = resized;
+            term->pending_capacity = (uint16_t)capacity;
+            account_term(manager, term, 1);
+        }
+        if (add) {
+            pending[changes] = pending[adds];
+            pending[adds]    = key;
+            term->pending_adds++;
+        } else {
+            pending[changes] = key;
+            term->pending_removes++;
+        }
+    }
+
+    changes = term->pending_adds + term->pending_removes;
+    if (changes >= TERM_PENDING_MAX || changes * 8 > term->posting_count ||
+        (changes == 0 && term->posting_count == 0)) {
+        return merge_term(manager, term);
+    }
+    return true;
+}
+
+// Helper function to add (add true) or remove the postings of the words of a visit's text.
+// If memory runs out the text index no longer matches the visits, so it is dropped.
+static void index_text(VisitManager* manager, uint32_t user_id, const Visit* visit, bool add) {
+    if (!manager->text_index) {
+        return;
+    }
+
+    size_t count = tokenize(manager, visit->text, visit_text_len(visit));
+    bool ok      = count != SIZE_MAX;
+    uint64_t key = (uint64_t)user_id << 32 | visit->visit_id;
+    for (size_t i = 0; ok && i < count; i++) {
+        TextTerm* term = find_term(manager, &manager->tokens[i], add);
+        if (term) {
+            ok = change_posting(manager, term, key, add);
+        } else {
+            ok = !add;
+        }
+    }
+
+    if (!ok) {
+        free_text_index(manager);
+    }
+}
+
+// Helper function to get the time of a visit in nanoseconds since the Unix epoch
+static int64_t visit_time_ns(const Visit* visit) {
+    return (int64_t)visit->time.tv_sec * 1000000000 + visit->time.tv_nsec;
+}
+
+// Helper function to get the key of the time index bucket holding a time
+static int64_t time_bucket_key(int64_t time_ns) {
+    int64_t key = time_ns / TIME_BUCKET_NS;
+    return key * TIME_BUCKET_NS > time_ns ? key - 1 : key;
+}
+
+// Helper function to get the bytes of a time index bucket's references and bitmap
+static size_t time_bucket_bytes(size_t capacity) {
+    return capacity * sizeof(TimedVisitRef) + (capacity + 63) / 64 * sizeof(uint64_t);
+}
+
+// Helper function to check whether the reference at position i of a bucket was removed
+static bool time_ref_dead(const TimeBucket* bucket, size_t i) {
+    return bucket->dead[i / 64] >> (i % 64) & 1;
+}
+
+// Helper function to find the position of the first bucket with a key of at least key
+static size_t time_bucket_position(const VisitManager* manager, int64_t key) {
+    size_t low = 0, high = manager->time_bucket_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (manager->time_buckets[mid].key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Helper function to find the position of the first reference in a bucket at or after time_ns
+static size_t time_ref_position(const TimeBucket* bucket, int64_t time_ns) {
+    size_t low = 0, high = bucket->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (bucket->refs[mid].timestamp_ns < time_ns) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Helper function to resize the arrays of a bucket to capacity references, at least its count
+static bool resize_time_bucket(VisitManager* manager, TimeBucket* bucket, size_t capacity) {
+    size_t words     = (capacity + 63) / 64;
+    size_t old_words = (bucket->capacity + 63) / 64;
+
+    // A failed shrink leaves the larger array in place, which is still valid.
+    TimedVisitRef* refs = (TimedVisitRef*)realloc(bucket->refs, capacity * sizeof(TimedVisitRef));
+    if (refs) {
+        bucket->refs = refs;
+    } else if (capacity > bucket->capacity) {
+        return false;
+    }
+    uint64_t* dead = (uint64_t*)realloc(bucket->dead, words * sizeof(uint64_t));
+    if (dead) {
+        bucket->dead = dead;
+    } else if (words > old_words) {
+        return false;
+    }
+    if (words > old_words) {
+        memset(bucket->dead + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    }
+
+    manager->memory.time_index_bytes -= time_bucket_bytes(bucket->capacity);
+    manager->memory.time_index_bytes += time_bucket_bytes(capacity);
+    bucket->capacity = (uint32_t)capacity;
+    return true;
+}
+
+// Helper function to drop the dead references of a bucket, shrinking it when mostly empty
+static void compact_time_bucket(VisitManager* manager, TimeBucket* bucket) {
+    size_t live = 0;
+    for (size_t i = 0; i < bucket->count; i++) {
+        if (!time_ref_dead(bucket, i)) {
+            bucket->refs[live++] = bucket->refs[i];
+        }
+    }
+    memset(bucket->dead, 0, (bucket->count + 63) / 64 * sizeof(uint64_t));
+    bucket->count      = (uint32_t)live;
+    bucket->dead_count = 0;
+
+    if (bucket->capacity > 8 && live * 4 <= bucket->capacity) {
+        // Failing to shrink only leaves extra capacity behind.
+        resize_time_bucket(manager, bucket, live > 4 ? live * 2 : 8);
+    }
+}
+
+// Helper function to free the bucket at position p of the time index
+static void remove_time_bucket(VisitManager* manager, size_t p) {
+    TimeBucket* bucket = &manager->time_buckets[p];
+    manager->memory.time_index_bytes -= time_bucket_bytes(bucket->capacity);
+    free(bucket->refs);
+    free(bucket->dead);
+    memmove(bucket, bucket + 1, (manager->time_bucket_count - p - 1) * sizeof(TimeBucket));
+    manager->time_bucket_count--;
+    manager->memory.time_buckets--;
+}
+
+// Helper function to free the time index and turn it off
+static void free_time_index(VisitManager* manager) {
+    for (size_t i = 0; i < manager->time_bucket_count; i++) {
+        free(manager->time_buckets[i].refs);
+        free(manager->time_buckets[i].dead);
+    }
+    free(manager->time_buckets);
+    manager->time_buckets            = NULL;
+    manager->time_bucket_count       = 0;
+    manager->time_bucket_capacity    = 0;
+    manager->memory.time_buckets     = 0;
+    manager->memory.time_index_bytes = 0;
+    manager->time_index              = false;
+}
+
+// Helper function to add a reference to its bucket of the time index, creating the bucket if
+// needed. References arrive in time order except when the clock steps back.
+static bool add_time_ref(VisitManager* manager, TimedVisitRef ref) {
+    int64_t key = time_bucket_key(ref.timestamp_ns);
+    size_t p    = time_bucket_position(manager, key);
+    if (p == manager->time_bucket_count || manager->time_buckets[p].key != key) {
+        TimeBucket bucket = {.key = key};
+        if (!resize_time_bucket(manager, &bucket, 8)) {
+            free(bucket.refs);
+            return false;
+        }
+        if (manager->time_bucket_count == manager->time_bucket_capacity) {
+            size_t new_capacity = manager->time_bucket_capacity > 0 ? manager->time_bucket_capacity * 2 : 16;
+            TimeBucket* buckets = (TimeBucket*)realloc(manager->time_buckets, new_capacity * sizeof(TimeBucket));
+            if (!buckets) {
+                manager->memory.time_index_bytes -= time_bucket_bytes(bucket.capacity);
+                free(bucket.refs);
+                free(bucket.dead);
+                return false;
+            }
+            manager->time_buckets         = buckets;
+            manager->time_bucket_capacity = new_capacity;
+        }
+
+        memmove(&manager->time_buckets[p + 1], &manager->time_buckets[p],
+                (manager->time_bucket_count - p) * sizeof(TimeBucket));
+        manager->time_buckets[p] = bucket;
+        manager->time_bucket_count++;
+        manager->memory.time_buckets++;
+    }
+
+    // A full bucket with many dead references is compacted rather than grown.
+    TimeBucket* bucket = &manager->time_buckets[p];
+    if (bucket->count == bucket->capacity && bucket->dead_count * 4 >= bucket->count) {
+        compact_time_bucket(manager, bucket);
+    }
+    if (bucket->count == bucket->capacity && !resize_time_bucket(manager, bucket, (size_t)bucket->capacity * 2)) {
+        return false;
+    }
+
+    // An out of order reference is inserted after dropping the dead ones, so the bitmap need
+    // not shift with it.
+    size_t i = bucket->count;
+    if (i > 0 && bucket->refs[i - 1].timestamp_ns > ref.timestamp_ns) {
+        if (bucket->dead_count > 0) {
+            compact_time_bucket(manager, bucket);
+        }
+        i = time_ref_position(bucket, ref.timestamp_ns + 1);
+        memmove(&bucket->refs[i + 1], &bucket->refs[i], (bucket->count - i) * sizeof(TimedVisitRef));
+    }
+    bucket->refs[i] = ref;
+    bucket->count++;
+    return true;
+}
+
+// Helper function to mark the time index reference to a visit dead
+static void remove_time_ref(VisitManager* manager, uint32_t user_id, const Visit* visit) {
+    int64_t time_ns = visit_time_ns(visit);
+    size_t p        = time_bucket_position(manager, time_bucket_key(time_ns));
+    if (p == manager->time_bucket_count || manager->time_buckets[p].key != time_bucket_key(time_ns)) {
+        return;
+    }
+
+    TimeBucket* bucket = &manager->time_buckets[p];
+    for (size_t i = time_ref_position(bucket, time_ns); i < bucket->count && bucket->refs[i].timestamp_ns == time_ns;
+         i++) {
+        const TimedVisitRef* ref = &bucket->refs[i];
+        if (ref->user_id == user_id && ref->visit_id == visit->visit_id && !time_ref_dead(bucket, i)) {
+            bucket->dead[i / 64] |= (uint64_t)1 << (i % 64);
+            bucket->dead_count++;
+            if (bucket->dead_count == bucket->count) {
+                remove_time_bucket(manager, p);
+            } else if (bucket->dead_count * 2 > bucket->count) {
+                compact_time_bucket(manager, bucket);
+            }
+            return;
+        }
+    }
+}
+
+// Helper function to add (add true) or remove a visit in the time index. If memory runs out the
+// time index no longer matches the visits, so it is dropped.
+static void index_time(VisitManager* manager, uint32_t user_id, const Visit* visit, bool add) {
+    if (!manager->time_index) {
+        return;
+    }
+    if (!add) {
+        remove_time_ref(manager, user_id, visit);
+        return;
+    }
+
+    TimedVisitRef ref = {.user_id = user_id, .visit_id = visit->visit_id, .timestamp_ns = visit_time_ns(visit)};
+    if (!add_time_ref(manager, ref)) {
+        free_time_index(manager);
+    }
+}
+
+// Helper function to get the bytes of the values of a reverse URL index container
+static size_t container_bytes(const UserContainer* container) {
+    return container->capacity > 0 ? container->capacity * sizeof(uint16_t) : USER_SET_BITMAP_WORDS * sizeof(uint64_t);
+}
+
+// Helper function to free the reverse URL index and turn it off
+static void free_reverse_url_index(VisitManager* manager) {
+    for (size_t i = 0; i < manager->url_users_capacity; i++) {
+        UrlUsers* set = &manager->url_users[i];
+        for (size_t j = 0; j < set->container_count; j++) {
+            free(set->containers[j].values);
+        }
+        free(set->containers);
+        if (set->url) {
+            release_string(manager, set->url);
+        }
+    }
+    free(manager->url_users);
+    manager->url_users                      = NULL;
+    manager->url_users_capacity             = 0;
+    manager->url_users_count                = 0;
+    manager->memory.indexed_urls            = 0;
+    manager->memory.reverse_url_index_bytes = 0;
+    manager->reverse_url_index              = false;
+}
+
+// Helper function to find the reverse URL index slot holding an interned URL, or the empty slot
+// where it belongs
+static size_t url_users_slot(const VisitManager* manager, const char* url) {
+    size_t mask = manager->url_users_capacity - 1;
+    size_t i    = interned_header(url)->hash & mask;
+    while (manager->url_users[i].containers && manager->url_users[i].url != url) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Helper function to rehash the reverse URL index into new_capacity slots (a power of two)
+static bool resize_url_users(VisitManager* manager, size_t new_capacity) {
+    UrlUsers* old_sets  = manager->url_users;
+    size_t old_capacity = manager->url_users_capacity;
+
+    UrlUsers* new_sets = (UrlUsers*)calloc(new_capacity, sizeof(UrlUsers));
+    if (!new_sets) {
+        return false;
+    }
+
+    manager->url_users          = new_sets;
+    manager->url_users_capacity = new_capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_sets[i].containers) {
+            new_sets[url_users_slot(manager, old_sets[i].url)] = old_sets[i];
+        }
+    }
+    free(old_sets);
+    return true;
+}
+
+// Helper function to find the position of the first container of a set with a key of at least key
+static size_t container_position(const UrlUsers* set, uint16_t key) {
+    size_t low = 0, high = set->container_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (set->containers[mid].key < key) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Helper function to find the position of the first value of an array container of at least value
+static size_t container_value_position(const UserContainer* container, uint16_t value) {
+    const uint16_t* values = (const uint16_t*)container->values;
+    size_t low = 0, high = container->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (values[mid] < value) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Helper function to resize the values of an array container to capacity slots
+static bool resize_container(VisitManager* manager, UserContainer* container, size_t capacity) {
+    uint16_t* values = (uint16_t*)realloc(container->values, capacity * sizeof(uint16_t));
+    if (!values) {
+        return false;
+    }
+
+    manager->memory.reverse_url_index_bytes -= container_bytes(container);
+    container->values   = values;
+    container->capacity = (uint16_t)capacity;
+    manager->memory.reverse_url_index_bytes += container_bytes(container);
+    return true;
+}
+
+// Helper function to turn an array container into a bitmap, or a bitmap container back into an
+// array of its values
+static bool convert_container(VisitManager* manager, UserContainer* container) {
+    void* converted;
+    if (container->capacity > 0) {
+        uint64_t* bits = (uint64_t*)calloc(USER_SET_BITMAP_WORDS, sizeof(uint64_t));
+        if (!bits) {
+            return false;
+        }
+        const uint16_t* values = (const uint16_t*)container->values;
+        for (size_t i = 0; i < container->count; i++) {
+            bits[values[i] / 64] |= (uint64_t)1 << (values[i] % 64);
+        }
+        converted = bits;
+    } else {
+        uint16_t* values = (uint16_t*)malloc(container->count * sizeof(uint16_t));
+        if (!values) {
+            return false;
+        }
+        const uint64_t* bits = (const uint64_t*)container->values;
+        size_t count         = 0;
+        for (size_t w = 0; w < USER_SET_BITMAP_WORDS; w++) {
+            for (uint64_t word = bits[w]; word; word &= word - 1) {
+                values[count++] = (uint16_t)(w * 64 + (size_t)__builtin_ctzll(word));
+            }
+        }
+        converted = values;
+    }
+
+    manager->memory.reverse_url_index_bytes -= container_bytes(container);
+    free(container->values);
+    container->values   = converted;
+    container->capacity = container->capacity > 0 ? 0 : (uint16_t)container->count;
+    manager->memory.reverse_url_index_bytes += container_bytes(container);
+    return true;
+}
+
+// Helper function to add a user to the set of an interned URL, creating the set if needed
+static bool add_url_user(VisitManager* manager, char* url, uint32_t user_id) {
+    if ((manager->url_users_count + 1) * 2 > manager->url_users_capacity &&
+        !resize_url_users(manager, manager->url_users_capacity > 0 ? manager->url_users_capacity * 2 : 64)) {
+        return false;
+    }
+
+    UrlUsers* set = &manager->url_users[url_users_slot(manager, url)];
+    uint16_t key  = (uint16_t)(user_id >> 16);
+    size_t p      = container_position(set, key);
+    if (p == set->container_count || set->containers[p].key != key) {
+        uint16_t* values = (uint16_t*)malloc(4 * sizeof(uint16_t));
+        if (!values) {
+            return false;
+        }
+        UserContainer* containers =
+            (UserContainer*)realloc(set->containers, (set->container_count + 1) * sizeof(UserContainer));
+        if (!containers) {
+            free(values);
+            return false;
+        }
+
+        if (set->container_count == 0) {
+            set->url = url;
+            interned_header(url)->refcount++;
+            manager->url_users_count++;
+            manager->memory.indexed_urls++;
+        }
+        memmove(&containers[p + 1], &containers[p], (set->container_count - p) * sizeof(UserContainer));
+        containers[p]   = (UserContainer){.values = values, .count = 0, .key = key, .capacity = 4};
+        set->containers = containers;
+        set->container_count++;
+        manager->memory.reverse_url_index_bytes += sizeof(UserContainer) + 4 * sizeof(uint16_t);
+    }
+
+    // A full array holds USER_SET_ARRAY_MAX values, as capacities double from 4.
+    UserContainer* container = &set->containers[p];
+    uint16_t value           = (uint16_t)user_id;
+    if (container->capacity > 0) {
+        size_t i = container_value_position(container, value);
+        if (i < container->count && ((uint16_t*)container->values)[i] == value) {
+            return true;
+        }
+        if (container->count == USER_SET_ARRAY_MAX) {
+            if (!convert_container(manager, container)) {
+                return false;
+            }
+        } else if (container->count == container->capacity &&
+                   !resize_container(manager, container, container->capacity * 2)) {
+            return false;
+        }
+        if (container->capacity > 0) {
+            uint16_t* values = (uint16_t*)container->values;
+            memmove(&values[i + 1], &values[i], (container->count - i) * sizeof(uint16_t));
+            values[i] = value;
+        }
+    }
+    if (container->capacity == 0) {
+        uint64_t* bits = (uint64_t*)container->values;
+        if (bits[value / 64] >> (value % 64) & 1) {
+            return true;
+        }
+        bits[value / 64] |= (uint64_t)1 << (value % 64);
+    }
+    container->count++;
+    set->user_count++;
+    return true;
+}
+
+// Helper function to remove a user from the set of an interned URL, dropping the set with its last
+// user. Shrinking that fails leaves the larger arrays in place.
+static void remove_url_user(VisitManager* manager, const char* url, uint32_t user_id) {
+    if (manager->url_users_count == 0) {
+        return;
+    }
+
+    size_t slot   = url_users_slot(manager, url);
+    UrlUsers* set = &manager->url_users[slot];
+    uint16_t key  = (uint16_t)(user_id >> 16);
+    size_t p      = container_position(set, key);
+    if (p == set->container_count || set->containers[p].key != key) {
+        return;
+    }
+
+    UserContainer* container = &set->containers[p];
+    uint16_t value           = (uint16_t)user_id;
+    if (container->capacity > 0) {
+        uint16_t* values = (uint16_t*)container->values;
+        size_t i         = container_value_position(container, value);
+        if (i == container->count || values[i] != value) {
+            return;
+        }
+        memmove(&values[i], &values[i + 1], (container->count - i - 1) * sizeof(uint16_t));
+        container->count--;
+        if (container->count > 0 && container->capacity > 4 && container->count * 4 <= container->capacity) {
+            resize_container(manager, container, container->capacity / 2);
+        }
+    } else {
+        uint64_t* bits = (uint64_t*)container->values;
+        if (!(bits[value / 64] >> (value % 64) & 1)) {
+            return;
+        }
+        bits[value / 64] &= ~((uint64_t)1 << (value % 64));
+        container->count--;
+        if (container->count == USER_SET_ARRAY_MAX) {
+            convert_container(manager, container);
+        }
+    }
+    set->user_count--;
+    if (container->count > 0) {
+        return;
+    }
+
+    // Drop the emptied container, and the set once it has none.
+    manager->memory.reverse_url_index_bytes -= container_bytes(container) + sizeof(UserContainer);
+    free(container->values);
+    memmove(&set->containers[p], &set->containers[p + 1], (set->container_count - p - 1) * sizeof(UserContainer));
+    set->container_count--;
+    if (set->container_count > 0) {
+        UserContainer* containers =
+            (UserContainer*)realloc(set->containers, set->container_count * sizeof(UserContainer));
+        if (containers) {
+            set->containers = containers;
+        }
+        return;
+    }
+
+    // Backward-shift deletion, as for the user index.
+    char* set_url = set->url;
+    free(set->containers);
+    size_t mask = manager->url_users_capacity - 1;
+    size_t i    = slot;
+    for (size_t j = (i + 1) & mask; manager->url_users[j].containers; j = (j + 1) & mask) {
+        size_t home = interned_header(manager->url_users[j].url)->hash & mask;
+        if (!probe_between(home, i, j)) {
+            manager->url_users[i] = manager->url_users[j];
+            i                     = j;
+        }
+    }
+    manager->url_users[i] = (UrlUsers){0};
+    manager->url_users_count--;
+    manager->memory.indexed_urls--;
+    release_string(manager, set_url);
+}
+
+// Helper function to add (add true) or remove a user of a URL in the reverse URL index. If memory
+// runs out the reverse URL index no longer matches the visits, so it is dropped.
+static void index_url_user(VisitManager* manager, uint32_t user_id, char* url, bool add) {
+    if (!manager->reverse_url_index) {
+        return;
+    }
+    if (!add) {
+        remove_url_user(manager, url, user_id);
+        return;
+    }
+
+    if (!add_url_user(manager, url, user_id)) {
+        free_reverse_url_index(manager);
+    }
+}
+
+// Helper function to check whether a user has a visit to url, as one leaves its visits
+static bool has_url_visit(const UserVisits* user, const char* url) {
+    if (user->url_index) {
+        return user->url_index[url_index_slot(user, url)] != NULL;
+    }
+    for (size_t i = 0; i < user->visit_count; i++) {
+        if (user->visits[i]->url == url) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Helper function to remove the visit at position i from a user and free it. Ordered users and
+// users with a URL index keep their order; others move the last visit into the gap.
+static void remove_visit_at(VisitManager* manager, UserVisits* user, size_t i) {
+    Visit* visit = user->visits[i];
+    size_t last  = user->visit_count - 1;
+    if (user->url_index) {
+        unindex_url(user, visit);
+    }
+    if (user->url_index || user->ordered) {
+        memmove(&user->visits[i], &user->visits[i + 1], (last - i) * sizeof(Visit*));
+    } else if (i < last) {
+        user->visits[i] = user->visits[last];
+    }
+    if (user->scores) {
+        unhold_score(manager, user, visit->url);
+    }
+    remove_prefix_entry(user, visit);
+    index_text(manager, user->user_id, visit, false);
+    index_time(manager, user->user_id, visit, false);
+
+    set_visit_count(manager, user, last);
+    if (manager->reverse_url_index && !has_url_visit(user, visit->url)) {
+        index_url_user(manager, user->user_id, visit->url, false);
+    }
+    release_visit(manager, visit);
+}
+
+// Helper function to get the bytes of per-user data held in memory, as limited by the budget
+static size_t resident_bytes(const VisitManager* manager) {
+    const VisitManagerMemory* memory = &manager->memory;
+    return memory->user_bytes + memory->visit_array_bytes + memory->visit_bytes + memory->string_bytes;
+}
+
+// Helper function to unlink a user from the LRU list
+static void lru_unlink(VisitManager* manager, UserVisits* user) {
+    if (user->lru_prev) {
+        user->lru_prev->lru_next = user->lru_next;
+    } else {
+        manager->lru_head = user->lru_next;
+    }
+
+    if (user->lru_next) {
+        user->lru_next->lru_prev = user->lru_prev;
+    } else {
+        manager->lru_tail = user->lru_prev;
+    }
+
+    user->lru_prev = NULL;
+    user->lru_next = NULL;
+}
+
+// Helper function to make a user the most recently used
+static void lru_push_front(VisitManager* manager, UserVisits* user) {
+    user->lru_prev = NULL;
+    user->lru_next = manager->lru_head;
+    if (manager->lru_head) {
+        manager->lru_head->lru_prev = user;
+    } else {
+        manager->lru_tail = user;
+    }
+    manager->lru_head = user;
+}
+
+// Helper function to make a user resident: store, index and account for it and its visits.
+// The user becomes the most recently used.
+static bool insert_user(VisitManager* manager, UserVisits* user) {
+    if (manager->user_count >= manager->user_capacity) {
+        // Resize users array if needed
+        size_t new_capacity    = manager->user_capacity * 2;
+        UserVisits** new_users = (UserVisits**)realloc(manager->users, new_capacity * sizeof(UserVisits*));
+        if (!new_users) {
+            return false;
+        }
+        manager->users         = new_users;
+        manager->user_capacity = new_capacity;
+    }
+
+    if (!index_user(manager, user)) {
+        return false;
+    }
+
+    user->slot                            = manager->user_count;
+    manager->users[manager->user_count++] = user;
+    lru_push_front(manager, user);
+
+    user->high_water = (uint32_t)user->visit_count;
+    account_user(manager, user, 1);
+    for (size_t i = 0; i < user->visit_count; i++) {
+        account_visit(manager, user->visits[i], 1);
+    }
+    return true;
+}
+
+// Helper function to undo insert_user. The caller owns the user afterwards.
+static void remove_user(VisitManager* manager, UserVisits* user) {
+    unindex_user(manager, user->user_id);
+    lru_unlink(manager, user);
+
+    for (size_t i = 0; i < user->visit_count; i++) {
+        account_visit(manager, user->visits[i], -1);
+    }
+    account_user(manager, user, -1);
+
+    // Move the last user into the freed slot.
+    UserVisits* last           = manager->users[--manager->user_count];
+    manager->users[user->slot] = last;
+    last->slot                 = user->slot;
+}
+
+// Helper function to remove a resident user from the manager and free it
+static void drop_user(VisitManager* manager, UserVisits* user) {
+    remove_user(manager, user);
+    free_user_visits(manager, user);
+}
+
+// Helper function to write a string reference: the dictionary ID of an interned string when
+// use_dictionary is set, and otherwise the string itself as a literal
+static void write_string_ref(FILE* file, const char* str, size_t len, bool interned, bool use_dictionary) {
+    if (interned && use_dictionary) {
+        fwrite(&interned_header(str)->id, sizeof(uint32_t), 1, file);
+        return;
+    }
+
+    uint32_t ref = STRING_LITERAL | (uint32_t)len;
+    fwrite(&ref, sizeof(uint32_t), 1, file);
+    fwrite(str, 1, len, file);
+}
+
+// Helper function to write one user record: user ID, visit count and the visits. Snapshots
+// reference interned strings by dictionary ID; spill records are self-contained.
+static void write_user(FILE* file, const UserVisits* user, bool use_dictionary) {
+    // Write user ID
+    fwrite(&user->user_id, sizeof(uint32_t), 1, file);
+
+    // Write visit count
+    fwrite(&user->visit_count, sizeof(size_t), 1, file);
+
+    // Write each visit
+    for (size_t j = 0; j < user->visit_count; j++) {
+        Visit* visit = user->visits[j];
+
+        // Write visit ID
+        fwrite(&visit->visit_id, sizeof(uint32_t), 1, file);
+
+        // Write URL and text
+        write_string_ref(file, visit->url, visit_url_len(visit), true, use_dictionary);
+        write_string_ref(file, visit->text, visit_text_len(visit), has_interned_text(visit), use_dictionary);
+
+        // Write timestamp
+        int64_t tv_sec  = (int64_t)visit->time.tv_sec;
+        int64_t tv_nsec = (int64_t)visit->time.tv_nsec;
+        fwrite(&tv_sec, sizeof(int64_t), 1, file);
+        fwrite(&tv_nsec, sizeof(int64_t), 1, file);
+    }
+
+    // Write frecency scores, if kept, with the half-life they were computed with
+    uint32_t score_count = user->scores ? (uint32_t)user->scores->count : 0;
+    fwrite(&score_count, sizeof(uint32_t), 1, file);
+    if (score_count > 0) {
+        fwrite(&user->scores->half_life, sizeof(double), 1, file);
+        for (size_t i = 0; i < score_count; i++) {
+            const UrlScore* entry = &user->scores->heap[i];
+            write_string_ref(file, entry->url, interned_header(entry->url)->len, true, use_dictionary);
+            fwrite(&entry->visit_count, sizeof(uint32_t), 1, file);
+            fwrite(&entry->key, sizeof(double), 1, file);
+        }
+    }
+}
+
+// Helper function to read len bytes into the manager's scratch buffer
+static char* read_scratch(VisitManager* manager, FILE* file, size_t len) {
+    if (len + 1 > manager->scratch_capacity) {
+        size_t capacity = manager->scratch_capacity > 0 ? manager->scratch_capacity : 256;
+        while (capacity < len + 1) {
+            capacity *= 2;
+        }
+
+        char* scratch = (char*)realloc(manager->scratch, capacity);
+        if (!scratch) {
+            return NULL;
+        }
+        manager->scratch          = scratch;
+        manager->scratch_capacity = capacity;
+    }
+
+    if (fread(manager->scratch, 1, len, file) != len) {
+        return NULL;
+    }
+    manager->scratch[len] = '\0';
+    return manager->scratch;
+}
+
+// Helper function to read a string reference written by write_string_ref. A dictionary
+// reference sets *entry; a literal is read into the scratch buffer and sets *entry to NULL.
+// Either way *str and *len describe the string until the next read.
+static bool read_string_ref(VisitManager* manager, FILE* file, InternedString** dictionary, size_t dictionary_count,
+                            InternedString** entry, const char** str, size_t* len) {
+    uint32_t ref;
+    if (fread(&ref, sizeof(uint32_t), 1, file) != 1) {
+        return false;
+    }
+
+    if (ref & STRING_LITERAL) {
+        *entry = NULL;
+        *len   = ref & ~STRING_LITERAL;
+        *str   = read_scratch(manager, file, *len);
+        return *str != NULL;
+    }
+
+    if (ref >= dictionary_count) {
+        return false;
+    }
+    *entry = dictionary[ref];
+    *str   = (*entry)->chars;
+    *len   = (*entry)->len;
+    return true;
+}
+
+// Helper function to read one visit written by write_user. Returns NULL on failure.
+static Visit* read_visit(VisitManager* manager, FILE* file, InternedString** dictionary, size_t dictionary_count) {
+    Visit* visit = alloc_visit(manager->intern_titles);
+    if (!visit) {
+        return NULL;
+    }
+
+    // Read visit ID
+    if (fread(&visit->visit_id, sizeof(uint32_t), 1, file) != 1) {
+        goto fail;
+    }
+
+    // Read URL. Dictionary strings are interned already and only gain a reference.
+    InternedString* entry;
+    const char* str;
+    size_t len;
+    if (!read_string_ref(manager, file, dictionary, dictionary_count, &entry, &str, &len)) {
+        goto fail;
+    }
+    if (entry) {
+        entry->refcount++;
+        visit->url = entry->chars;
+    } else if (!set_visit_url(manager, visit, str, len)) {
+        goto fail;
+    }
+
+    // Read text
+    if (!read_string_ref(manager, file, dictionary, dictionary_count, &entry, &str, &len) ||
+        !set_visit_text(manager, visit, str, len)) {
+        goto fail;
+    }
+
+    // Read timestamp
+    int64_t tv_sec, tv_nsec;
+    if (fread(&tv_sec, sizeof(int64_t), 1, file) != 1 || fread(&tv_nsec, sizeof(int64_t), 1, file) != 1) {
+        goto fail;
+    }
+    visit->time.tv_sec  = (time_t)tv_sec;
+    visit->time.tv_nsec = (long)tv_nsec;
+    return visit;
+
+fail:
+    free_visit(manager, visit);
+    return NULL;
+}
+
+// Helper function to read one visit of a format 1 snapshot, where strings are stored with
+// their terminators and the timestamp is a raw struct timespec. Returns NULL on failure.
+static Visit* read_legacy_visit(VisitManager* manager, FILE* file) {
+    Visit* visit = alloc_visit(manager->intern_titles);
+    if (!visit) {
+        return NULL;
+    }
+
+    // Read visit ID
+    if (fread(&visit->visit_id, sizeof(uint32_t), 1, file) != 1) {
+        goto fail;
+    }
+
+    // Read URL
+    size_t url_len;
+    const char* url;
+    if (fread(&url_len, sizeof(size_t), 1, file) != 1 || url_len == 0 ||
+        !(url = read_scratch(manager, file, url_len)) || !set_visit_url(manager, visit, url, strlen(url))) {
+        goto fail;
+    }
+
+    // Read text
+    size_t text_len;
+    const char* text;
+    if (fread(&text_len, sizeof(size_t), 1, file) != 1 || text_len == 0 ||
+        !(text = read_scratch(manager, file, text_len)) || !set_visit_text(manager, visit, text, strlen(text))) {
+        goto fail;
+    }
+
+    // Read timestamp
+    if (fread(&visit->time, sizeof(struct timespec), 1, file) != 1) {
+        goto fail;
+    }
+    return visit;
+
+fail:
+    free_visit(manager, visit);
+    return NULL;
+}
+
+// Helper function to read the frecency scores that follow the visits of a user record. Scores
+// computed with another half-life than the manager's are skipped, to be rebuilt when needed.
+static bool read_scores(VisitManager* manager, FILE* file, InternedString** dictionary, size_t dictionary_count,
+                        UserVisits* user) {
+    uint32_t score_count;
+    if (fread(&score_count, sizeof(uint32_t), 1, file) != 1) {
+        return false;
+    }
+    if (score_count == 0) {
+        return true;
+    }
+
+    double half_life;
+    if (fread(&half_life, sizeof(double), 1, file) != 1) {
+        return false;
+    }
+
+    ScoreTable* table = NULL;
+    if (manager->frecency_lambda > 0 && half_life == manager->frecency_half_life) {
+        table = alloc_scores(manager, (size_t)score_count + user->visit_count);
+        if (!table) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < score_count; i++) {
+        InternedString* entry;
+        const char* str;
+        size_t len;
+        uint32_t visit_count;
+        double key;
+        if (!read_string_ref(manager, file, dictionary, dictionary_count, &entry, &str, &len) ||
+            fread(&visit_count, sizeof(uint32_t), 1, file) != 1 || fread(&key, sizeof(double), 1, file) != 1) {
+            free_scores(manager, table);
+            return false;
+        }
+        if (!table) {
+            continue;
+        }
+
+        // add_score takes its own reference to the URL.
+        char* url = entry ? entry->chars : intern_string(manager, str, len);
+        if (!url) {
+            free_scores(manager, table);
+            return false;
+        }
+        add_score(table, url, key, visit_count, 0);
+        if (!entry) {
+            release_string(manager, url);
+        }
+    }
+    if (!table) {
+        return true;
+    }
+
+    // Count the visits the user still holds. A visit without a score counts once; URLs whose
+    // visits were all dropped (max_visits may have shrunk) lose their score.
+    for (size_t i = 0; i < user->visit_count; i++) {
+        Visit* visit      = user->visits[i];
+        uint32_t position = table->positions[score_slot(table, visit->url)];
+        if (position) {
+            table->heap[position - 1].held++;
+        } else {
+            add_score(table, visit->url, score_time(manager, &visit->time), 1, 1);
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        if (table->heap[i].held > 0) {
+            table->heap[kept++] = table->heap[i];
+        } else {
+            release_string(manager, table->heap[i].url);
+        }
+    }
+    table->count = kept;
+    resize_scores(table, table->heap_capacity, table->position_capacity);
+    heapify_scores(table);
+
+    user->scores = table;
+    return true;
+}
+
+// Helper function to read one user record, keeping at most max_visits visits. version is the
+// format of the record: 1 has its own visit layout and scores were added in 3. Returns NULL on
+// failure.
+static UserVisits* read_user(VisitManager* manager, FILE* file, InternedString** dictionary,
+                             size_t dictionary_count, uint32_t version) {
+    uint32_t user_id;
+    if (fread(&user_id, sizeof(uint32_t), 1, file) != 1) {
+        return NULL;
+    }
+
+    size_t visit_count;
+    if (fread(&visit_count, sizeof(size_t), 1, file) != 1) {
+        return NULL;
+    }
+
+    // Create user
+    size_t max_visits = manager->max_visits;
+    UserVisits* user  = create_user(user_id, visit_count < max_visits ? visit_count : max_visits);
+    if (!user) {
+        return NULL;
+    }
+
+    // Read each visit
+    for (size_t j = 0; j < visit_count; j++) {
+        Visit* visit = version == 1 ? read_legacy_visit(manager, file)
+                                    : read_visit(manager, file, dictionary, dictionary_count);
+        if (!visit) {
+            free_user_visits(manager, user);
+            return NULL;
+        }
+
+        // Add visit to user
+        if (j < max_visits) {
+            // A record written from an ordered user reads back ordered.
+            if (user->visit_count > 0 && compare_visits(&user->visits[user->visit_count - 1], &visit) > 0) {
+                user->ordered = false;
+            }
+            user->visits[user->visit_count++] = visit;
+        } else {
+            // Skip if beyond max_visits
+            free_visit(manager, visit);
+        }
+    }
+
+    // Read frecency scores
+    if (version >= 3 && !read_scores(manager, file, dictionary, dictionary_count, user)) {
+        free_user_visits(manager, user);
+        return NULL;
+    }
+
+    return user;
+}
+
+// Helper function to copy length bytes at offset of the spill file to out
+static bool copy_spill_bytes(VisitManager* manager, uint64_t offset, uint64_t length, FILE* out, uint64_t out_offset) {
+    char buf[8192];
+    while (length > 0) {
+        size_t chunk = length < sizeof(buf) ? (size_t)length : sizeof(buf);
+        if (fseek(manager->spill_file, (long)offset, SEEK_SET) != 0 ||
+            fread(buf, 1, chunk, manager->spill_file) != chunk) {
+            return false;
+        }
+
+        // out may be the spill file itself, so position it before every write.
+        if (out == manager->spill_file && fseek(out, (long)out_offset, SEEK_SET) != 0) {
+            return false;
+        }
+        if (fwrite(buf, 1, chunk, out) != chunk) {
+            return false;
+        }
+
+        offset += chunk;
+        out_offset += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+// Comparison function for qsort. The elements are SpillEntry pointers, ordered by offset.
+static int compare_spill_offsets(const void* a, const void* b) {
+    uint64_t offset1 = (*(SpillEntry* const*)a)->offset;
+    uint64_t offset2 = (*(SpillEntry* const*)b)->offset;
+    return offset1 < offset2 ? -1 : offset1 > offset2;
+}
+
+// Helper function to drop dead records from the spill file by sliding live records down in place
+static bool compact_spill_file(VisitManager* manager) {
+    if (!manager->spill_file || manager->spill_bytes == manager->spill_live_bytes) {
+        return true;
+    }
+
+    SpillEntry** entries = (SpillEntry**)malloc((manager->spill_count + 1) * sizeof(SpillEntry*));
+    if (!entries) {
+        return false;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < manager->spill_index_capacity; i++) {
+        if (manager->spill_index[i].length) {
+            entries[count++] = &manager->spill_index[i];
+        }
+    }
+    qsort(entries, count, sizeof(SpillEntry*), compare_spill_offsets);
+
+    // Records only move towards the start of the file, so copying front to back is safe.
+    uint64_t end = 0;
+    bool ok      = true;
+    for (size_t i = 0; i < count && ok; i++) {
+        if (entries[i]->offset != end) {
+            ok = copy_spill_bytes(manager, entries[i]->offset, entries[i]->length, manager->spill_file, end);
+            if (ok) {
+                entries[i]->offset = end;
+            }
+        }
+        end += entries[i]->length;
+    }
+    free(entries);
+
+    if (!ok || fflush(manager->spill_file) != 0 || ftruncate(fileno(manager->spill_file), (off_t)end) != 0) {
+        clearerr(manager->spill_file);
+        return false;
+    }
+
+    manager->spill_bytes = end;
+    return true;
+}
+
+// Helper function to compact the spill file once it is empty or mostly dead records
+static void maybe_compact_spill_file(VisitManager* manager) {
+    if (manager->spill_count == 0 || (manager->spill_bytes >= SPILL_COMPACT_MIN_BYTES &&
+                                      manager->spill_bytes - manager->spill_live_bytes > manager->spill_live_bytes)) {
+        compact_spill_file(manager);
+    }
+}
+
+// Helper function to append the record of a user to the spill file and describe it in *entry.
+// The caller keeps the entry and then moves spill_bytes past the record.
+static bool write_spill_record(VisitManager* manager, UserVisits* user, SpillEntry* entry) {
+    if (!manager->spill_file) {
+        manager->spill_file = fopen(manager->spill_path, "w+b");
+        if (!manager->spill_file) {
+            return false;
+        }
+    }
+
+    FILE* file      = manager->spill_file;
+    uint64_t offset = manager->spill_bytes;
+    if (fseek(file, (long)offset, SEEK_SET) != 0) {
+        return false;
+    }
+
+    // Ordered users read back without a sort, and their newest visit comes first.
+    order_visits(user);
+    write_user(file, user, false);
+    long end = ftell(file);
+    if (fflush(file) != 0 || ferror(file) || end < 0 || (uint64_t)end - offset > UINT32_MAX) {
+        // Whatever was written lies past spill_bytes and will be overwritten.
+        clearerr(file);
+        return false;
+    }
+
+    // The strings are part of the record, so their bytes fit in its 32-bit length.
+    *entry = (SpillEntry){.user_id     = user->user_id,
+                          .length      = (uint32_t)((uint64_t)end - offset),
+                          .offset      = offset,
+                          .visit_count = (uint32_t)user->visit_count};
+    if (user->visit_count > 0) {
+        entry->newest = user->visits[0]->time;
+    }
+    for (size_t i = 0; i < user->visit_count; i++) {
+        entry->string_bytes += (uint32_t)(visit_url_len(user->visits[i]) + visit_text_len(user->visits[i]));
+    }
+    return true;
+}
+
+// Helper function to write a resident user to the spill file and free it
+static bool spill_user(VisitManager* manager, UserVisits* user) {
+    SpillEntry entry;
+    if (!write_spill_record(manager, user, &entry) || !add_spill_entry(manager, entry)) {
+        return false;
+    }
+
+    manager->spill_bytes = entry.offset + entry.length;
+    drop_user(manager, user);
+    return true;
+}
+
+// Helper function to spill least recently used users until the budget is met.
+// The most recently used user always stays resident.
+static bool enforce_budget(VisitManager* manager) {
+    while (manager->memory_budget > 0 && resident_bytes(manager) > manager->memory_budget &&
+           manager->lru_tail != manager->lru_head) {
+        // Empty users have nothing worth keeping.
+        if (manager->lru_tail->visit_count == 0) {
+            drop_user(manager, manager->lru_tail);
+        } else if (!spill_user(manager, manager->lru_tail)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper function to read the record of a spilled user, leaving it spilled. The caller owns the
+// returned user, which is not in the user table.
+static UserVisits* read_spilled_user(VisitManager* manager, const SpillEntry* entry) {
+    if (fseek(manager->spill_file, (long)entry->offset, SEEK_SET) != 0) {
+        return NULL;
+    }
+
+    UserVisits* user = read_user(manager, manager->spill_file, NULL, 0, SNAPSHOT_VERSION);
+    if (!user) {
+        clearerr(manager->spill_file);
+    }
+    return user;
+}
+
+// Helper function to load a spilled user back into memory. Returns NULL if the user is not
+// spilled or can not be loaded, in which case it stays spilled.
+static UserVisits* unspill_user(VisitManager* manager, uint32_t user_id) {
+    SpillEntry* entry = find_spill_entry(manager, user_id);
+    if (!entry) {
+        return NULL;
+    }
+
+    UserVisits* user = read_spilled_user(manager, entry);
+    if (!user) {
+        return NULL;
+    }
+
+    if (user->user_id != user_id || !insert_user(manager, user)) {
+        free_user_visits(manager, user);
+        return NULL;
+    }
+
+    remove_spill_entry(manager, user_id);
+    maybe_compact_spill_file(manager);
+    enforce_budget(manager);
+    return user;
+}
+
+// Helper function to find user entry or return NULL if not found.
+// Spilled users are loaded back; the user found becomes the most recently used.
+static UserVisits* find_user(VisitManager* manager, uint32_t user_id) {
+    UserVisits* user = NULL;
+    if (manager->user_count > 0) {
+        user = manager->user_index[user_index_slot(manager, user_id)];
+    }
+
+    if (!user) {
+        return unspill_user(manager, user_id);
+    }
+
+    if (user != manager->lru_head) {
+        lru_unlink(manager, user);
+        lru_push_front(manager, user);
+    }
+    return user;
+}
+
+// Helper function to write the text index at the end of a snapshot: every term with its
+// compressed postings and pending changes as held in memory, so loading needs no merging.
+static void write_text_index(const VisitManager* manager, FILE* file) {
+    uint64_t term_count = manager->text_term_count;
+    fwrite(&term_count, sizeof(uint64_t), 1, file);
+
+    for (size_t i = 0; i < manager->text_term_capacity; i++) {
+        const TextTerm* term = manager->text_terms[i];
+        if (term) {
+            fwrite(&term->len, sizeof(uint32_t), 1, file);
+            fwrite(term->chars, 1, term->len, file);
+            fwrite(&term->posting_count, sizeof(uint32_t), 1, file);
+            fwrite(&term->posting_bytes, sizeof(uint32_t), 1, file);
+            fwrite(term->postings, 1, term->posting_bytes, file);
+            fwrite(&term->pending_adds, sizeof(uint16_t), 1, file);
+            fwrite(&term->pending_removes, sizeof(uint16_t), 1, file);
+            if (term->pending) {
+                fwrite(term->pending, sizeof(uint64_t), term->pending_adds + term->pending_removes, file);
+            }
+        }
+    }
+}
+
+// Helper function for serialization
+static bool write_manager(VisitManager* manager) {
+    FILE* file = fopen(manager->path, "wb");
+    if (!file) {
+        return false;
+    }
+
+    // Write magic, format version and flags
+    uint32_t version = SNAPSHOT_VERSION;
+    uint32_t flags   = manager->text_index ? SNAPSHOT_TEXT_INDEX : 0;
+    if (manager->time_index) {
+        flags |= SNAPSHOT_TIME_INDEX;
+    }
+    if (manager->reverse_url_index) {
+        flags |= SNAPSHOT_REVERSE_URL_INDEX;
+    }
+    if (manager->ttl > 0) {
+        flags |= SNAPSHOT_TTL;
+    }
+    fwrite(SNAPSHOT_MAGIC, 1, sizeof(SNAPSHOT_MAGIC), file);
+    fwrite(&version, sizeof(uint32_t), 1, file);
+    fwrite(&flags, sizeof(uint32_t), 1, file);
+
+    // Write the frecency half-life of the scores stored with each user
+    fwrite(&manager->frecency_half_life, sizeof(double), 1, file);
+    if (manager->ttl > 0) {
+        fwrite(&manager->ttl, sizeof(double), 1, file);
+    }
+
+    // Write max_visits
+    fwrite(&manager->max_visits, sizeof(size_t), 1, file);
+
+    // Write the dictionary of interned strings once; visits refer to them by position.
+    uint64_t dictionary_count = manager->intern_count;
+    fwrite(&dictionary_count, sizeof(uint64_t), 1, file);
+
+    uint32_t id = 0;
+    for (size_t i = 0; i < manager->intern_capacity; i++) {
+        InternedString* entry = manager->intern_table[i];
+        if (entry) {
+            entry->id = id++;
+            fwrite(&entry->len, sizeof(uint32_t), 1, file);
+            fwrite(entry->chars, 1, entry->len, file);
+        }
+    }
+
+    // Write user count, including spilled users. Users without visits are not written.
+    size_t user_count = manager->spill_count;
+    for (size_t i = 0; i < manager->user_count; i++) {
+        if (manager->users[i]->visit_count > 0) {
+            user_count++;
+        }
+    }
+    fwrite(&user_count, sizeof(size_t), 1, file);
+
+    // Write each user
+    for (size_t i = 0; i < manager->user_count; i++) {
+        if (manager->users[i]->visit_count > 0) {
+            write_user(file, manager->users[i], true);
+        }
+    }
+
+    // Spill records use the same format with literal strings, so they are copied verbatim.
+    bool ok = true;
+    for (size_t i = 0; i < manager->spill_index_capacity && ok; i++) {
+        SpillEntry* entry = &manager->spill_index[i];
+        if (entry->length) {
+            ok = copy_spill_bytes(manager, entry->offset, entry->length, file, 0);
+        }
+    }
+
+    if (manager->text_index) {
+        write_text_index(manager, file);
+    }
+
+    return fclose(file) == 0 && ok;
+}
+
+// Helper function to persist the manager to its path
+static bool serialize_manager(VisitManager* manager) {
+    STATS_BEGIN();
+    bool ok = write_manager(manager);
+    STATS_END(manager, VISIT_MANAGER_OP_SERIALIZE, ok);
+    return ok;
+}
+
+// Helper function to allocate an empty manager
+static VisitManager* alloc_manager(const char* path, size_t max_visits, size_t user_capacity) {
+    VisitManager* manager = (VisitManager*)calloc(1, sizeof(VisitManager));
+    if (!manager) {
+        return NULL;
+    }
+
+    manager->path       = strdup(path);
+    manager->spill_path = (char*)malloc(strlen(path) + sizeof(".spill"));
+    manager->users      = (UserVisits**)malloc(user_capacity * sizeof(UserVisits*));
+    if (!manager->path || !manager->spill_path || !manager->users) {
+        free(manager->path);
+        free(manager->spill_path);
+        free(manager->users);
+        free(manager);
+        return NULL;
+    }
+
+    sprintf(manager->spill_path, "%s.spill", path);
+    manager->max_visits    = max_visits;
+    manager->user_count    = 0;
+    manager->user_capacity = user_capacity;
+    return manager;
+}
+
+// Helper function to read the string dictionary of a snapshot. Every entry is interned and
+// holds one reference until release_dictionary.
+static InternedString** read_dictionary(VisitManager* manager, FILE* file, size_t* count) {
+    uint64_t dictionary_count;
+    if (fread(&dictionary_count, sizeof(uint64_t), 1, file) != 1 || dictionary_count > SIZE_MAX / sizeof(void*)) {
+        return NULL;
+    }
+
+    InternedString** dictionary = (InternedString**)malloc((dictionary_count + 1) * sizeof(InternedString*));
+    if (!dictionary) {
+        return NULL;
+    }
+
+    for (*count = 0; *count < dictionary_count; (*count)++) {
+        uint32_t len;
+        const char* str;
+        char* chars;
+        if (fread(&len, sizeof(uint32_t), 1, file) != 1 || len > MAX_STRING_LEN ||
+            !(str = read_scratch(manager, file, len)) || !(chars = intern_string(manager, str, len))) {
+            return dictionary;
+        }
+        dictionary[*count] = interned_header(chars);
+    }
+    return dictionary;
+}
+
+// Helper function to drop the references held by a dictionary from read_dictionary
+static void release_dictionary(VisitManager* manager, InternedString** dictionary, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        release_string(manager, dictionary[i]->chars);
+    }
+    free(dictionary);
+}
+
+// Helper function to read the text index written by write_text_index. On failure the index
+// is left partially read for the caller to free.
+static bool read_text_index(VisitManager* manager, FILE* file) {
+    uint64_t term_count;
+    if (fread(&term_count, sizeof(uint64_t), 1, file) != 1) {
+        return false;
+    }
+
+    manager->text_index = true;
+    for (uint64_t i = 0; i < term_count; i++) {
+        char chars[TERM_MAX_LEN];
+        TextToken token;
+        if (fread(&token.len, sizeof(uint32_t), 1, file) != 1 || token.len == 0 || token.len > TERM_MAX_LEN ||
+            fread(chars, 1, token.len, file) != token.len) {
+            return false;
+        }
+        token.chars = chars;
+        token.hash  = hash_string(chars, token.len);
+
+        // Every word is stored once.
+        TextTerm* term;
+        if (find_term(manager, &token, false) || !(term = find_term(manager, &token, true))) {
+            return false;
+        }
+
+        uint32_t posting_count, posting_bytes;
+        uint16_t pending_adds, pending_removes;
+        if (fread(&posting_count, sizeof(uint32_t), 1, file) != 1 ||
+            fread(&posting_bytes, sizeof(uint32_t), 1, file) != 1) {
+            return false;
+        }
+
+        account_term(manager, term, -1);
+        term->postings      = (uint8_t*)malloc(posting_bytes > 0 ? posting_bytes : 1);
+        term->posting_bytes = posting_bytes;
+        term->posting_count = posting_count;
+        account_term(manager, term, 1);
+        if (!term->postings || fread(term->postings, 1, posting_bytes, file) != posting_bytes ||
+            !build_skips(manager, term)) {
+            return false;
+        }
+
+        if (fread(&pending_adds, sizeof(uint16_t), 1, file) != 1 ||
+            fread(&pending_removes, sizeof(uint16_t), 1, file) != 1 ||
+            pending_adds + pending_removes >= TERM_PENDING_MAX ||
+            (posting_count == 0 && pending_adds == 0)) {
+            return false;
+        }
+
+        size_t changes = pending_adds + pending_removes;
+        if (changes > 0) {
+            account_term(manager, term, -1);
+            term->pending          = (uint64_t*)malloc(changes * sizeof(uint64_t));
+            term->pending_capacity = term->pending ? (uint16_t)changes : 0;
+            account_term(manager, term, 1);
+            if (!term->pending || fread(term->pending, sizeof(uint64_t), changes, file) != changes) {
+                return false;
+            }
+            term->pending_adds    = pending_adds;
+            term->pending_removes = pending_removes;
+        }
+    }
+    return true;
+}
+
+// Helper function for deserialization. Reads snapshots of format 2 onwards and the legacy
+// format 1, which has no magic and stores every string in full.
+static VisitManager* deserialize_manager(const char* path, size_t max_visits) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    // Format 1 starts directly with max_visits.
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    uint32_t version = 1;
+    uint32_t flags   = 0;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+        rewind(file);
+    } else {
+        if (fread(&version, sizeof(uint32_t), 1, file) != 1 || fread(&flags, sizeof(uint32_t), 1, file) != 1 ||
+            version < 2 || version > SNAPSHOT_VERSION) {
+            fclose(file);
+            return NULL;
+        }
+    }
+
+    // Format 3 records the frecency half-life the stored scores were computed with.
+    double half_life = 0;
+    if (version >= 3 && (fread(&half_life, sizeof(double), 1, file) != 1 || !(half_life >= 0))) {
+        fclose(file);
+        return NULL;
+    }
+    double ttl = 0;
+    if ((flags & SNAPSHOT_TTL) && (fread(&ttl, sizeof(double), 1, file) != 1 || !(ttl > 0) || isinf(ttl))) {
+        fclose(file);
+        return NULL;
+    }
+
+    // Read max_visits from file but use the provided value
+    size_t stored_max_visits;
+    if (fread(&stored_max_visits, sizeof(size_t), 1, file) != 1) {
+        fclose(file);
+        return NULL;
+    }
+
+    VisitManager* manager = alloc_manager(path, max_visits, 10);
+    if (!manager) {
+        fclose(file);
+        return NULL;
+    }
+    VisitManagerSetFrecencyHalfLife(manager, half_life);
+
+    InternedString** dictionary = NULL;
+    size_t dictionary_count     = 0;
+    if (version >= 2) {
+        dictionary = read_dictionary(manager, file, &dictionary_count);
+        if (!dictionary) {
+            goto cleanup;
+        }
+    }
+
+    // Read user count
+    size_t user_count;
+    if (fread(&user_count, sizeof(size_t), 1, file) != 1) {
+        goto cleanup;
+    }
+
+    // Read each user
+    for (size_t i = 0; i < user_count; i++) {
+        UserVisits* user = read_user(manager, file, dictionary, dictionary_count, version);
+        if (!user) {
+            goto cleanup;
+        }
+
+        // Older snapshots may still hold users without visits.
+        if (user->visit_count == 0) {
+            free_user_visits(manager, user);
+            continue;
+        }
+
+        if (!insert_user(manager, user)) {
+            free_user_visits(manager, user);
+            goto cleanup;
+        }
+    }
+
+    // The text index follows the users. It is rebuilt from the visits instead when it can not
+    // be read or some of the visits it covers were dropped for max_visits.
+    if ((flags & SNAPSHOT_TEXT_INDEX) && (max_visits < stored_max_visits || !read_text_index(manager, file))) {
+        free_text_index(manager);
+        VisitManagerSetTextIndex(manager, true);
+    }
+    if (flags & SNAPSHOT_TIME_INDEX) {
+        VisitManagerSetTimeIndex(manager, true);
+    }
+    if (flags & SNAPSHOT_REVERSE_URL_INDEX) {
+        VisitManagerSetReverseUrlIndex(manager, true);
+    }
+    if (ttl > 0) {
+        VisitManagerSetTTL(manager, ttl);
+    }
+
+    if (dictionary) {
+        release_dictionary(manager, dictionary, dictionary_count);
+    }
+    fclose(file);
+    return manager;
+
+cleanup:
+    // Handle deserialization failure
+    if (dictionary) {
+        release_dictionary(manager, dictionary, dictionary_count);
+    }
+    VisitManagerFree(manager);
+    fclose(file);
+    return NULL;
+}
+
+VisitManager* VisitManagerCreate(const char* path, size_t max_visits) {
+    VisitManager* manager = NULL;
+
+    // Try to deserialize if file exists
+    FILE* file = fopen(path, "rb");
+    if (file) {
+        fclose(file);
+        manager = deserialize_manager(path, max_visits);
+    }
+
+    // Create new manager if deserialization failed or file doesn't exist
+    if (!manager) {
+        manager = alloc_manager(path, max_visits, 10);  // Initial capacity
+    }
+
+    return manager;
+}
+
+void VisitManagerFree(VisitManager* manager) {
+    if (!manager) {
+        return;
+    }
+
+    // Free all user visits
+    for (size_t i = 0; i < manager->user_count; i++) {
+        free_user_visits(manager, manager->users[i]);
+    }
+
+    // The spill file only caches users already covered by the snapshot.
+    if (manager->spill_file) {
+        fclose(manager->spill_file);
+        remove(manager->spill_path);
+    }
+
+    // Free remaining manager resources
+#ifdef VISIT_MANAGER_STATS
+    for (size_t i = 0; i < STATS_SHARDS; i++) {
+        free(manager->stats[i]);
+    }
+#endif
+    free_text_index(manager);
+    free_time_index(manager);
+    free_reverse_url_index(manager);
+    free(manager->token_text);
+    free(manager->tokens);
+    free(manager->scratch);
+    free(manager->intern_table);
+    free(manager->spill_index);
+    free(manager->user_index);
+    free(manager->users);
+    free(manager->spill_path);
+    free(manager->path);
+    free(manager);
+}
+
+bool VisitManagerSetInternTitles(VisitManager* manager, bool intern_titles) {
+    if (!manager) {
+        return false;
+    }
+
+    manager->intern_titles = intern_titles;
+    return true;
+}
+
+bool VisitManagerSetDedupUrls(VisitManager* manager, bool dedup_urls) {
+    if (!manager) {
+        return false;
+    }
+
+    // URL indexes are built on a user's next visit in dedup mode; without it they are dropped.
+    manager->dedup_urls = dedup_urls;
+    if (!dedup_urls) {
+        for (size_t i = 0; i < manager->user_count; i++) {
+            if (manager->users[i]->url_index) {
+                free_url_index(manager, manager->users[i]);
+            }
+        }
+    }
+    return true;
+}
+
+bool VisitManagerSetFrecencyHalfLife(VisitManager* manager, double half_life) {
+    if (!manager || !(half_life >= 0) || isinf(half_life)) {
+        return false;
+    }
+    if (half_life == manager->frecency_half_life) {
+        return true;
+    }
+
+    // Keys depend on the half-life, so existing scores are rebuilt from the visits when needed.
+    for (size_t i = 0; i < manager->user_count; i++) {
+        if (manager->users[i]->scores) {
+            drop_scores(manager, manager->users[i]);
+        }
+    }
+    manager->frecency_half_life = half_life;
+    manager->frecency_lambda    = half_life > 0 ? log(2.0) / half_life : 0;
+    return true;
+}
+
+// Helper function to add a heap position to the candidate heap of VisitManagerGetTopByScore
+static void push_candidate(const ScoreTable* table, uint32_t* candidates, size_t* count, uint32_t position) {
+    size_t i = (*count)++;
+    while (i > 0 && table->heap[candidates[(i - 1) / 2]].key < table->heap[position].key) {
+        candidates[i] = candidates[(i - 1) / 2];
+        i             = (i - 1) / 2;
+    }
+    candidates[i] = position;
+}
+
+// Helper function to take the best heap position from the candidate heap
+static uint32_t pop_candidate(const ScoreTable* table, uint32_t* candidates, size_t* count) {
+    uint32_t best = candidates[0];
+    uint32_t last = candidates[--(*count)];
+    size_t i      = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= *count) {
+            break;
+        }
+        if (child + 1 < *count && table->heap[candidates[child + 1]].key > table->heap[candidates[child]].key) {
+            child++;
+        }
+        if (table->heap[candidates[child]].key <= table->heap[last].key) {
+            break;
+        }
+        candidates[i] = candidates[child];
+        i             = child;
+    }
+    candidates[i] = last;
+    return best;
+}
+
+size_t VisitManagerGetTopByScore(VisitManager* manager, uint32_t user_id, size_t k, ScoredUrl* results) {
+    if (!manager || !results || k == 0 || manager->frecency_lambda <= 0) {
+        return 0;
+    }
+
+    UserVisits* user = find_user(manager, user_id);
+    if (!user || (!user->scores && !build_scores(manager, user))) {
+        return 0;
+    }
+
+    ScoreTable* table = user->scores;
+    if (k > table->count) {
+        k = table->count;
+    }
+    if (k == 0) {
+        return 0;
+    }
+
+    // Walk the score heap best first: the candidates are the children of every entry taken so
+    // far, so k entries cost O(k log k) regardless of how many URLs the user has.
+    uint32_t* candidates = (uint32_t*)malloc((k + 1) * sizeof(uint32_t));
+    if (!candidates) {
+        return 0;
+    }
+
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    double now_key = score_time(manager, &now);
+
+    size_t candidate_count = 0;
+    push_candidate(table, candidates, &candidate_count, 0);
+    for (size_t n = 0; n < k; n++) {
+        uint32_t position = pop_candidate(table, candidates, &candidate_count);
+        UrlScore* entry   = &table->heap[position];
+        results[n].url         = entry->url;
+        results[n].visit_count = entry->visit_count;
+        results[n].score       = exp(entry->key - now_key);
+
+        for (size_t child = 2 * (size_t)position + 1; child <= 2 * (size_t)position + 2; child++) {
+            if (child < table->count) {
+                push_candidate(table, candidates, &candidate_count, (uint32_t)child);
+            }
+        }
+    }
+
+    free(candidates);
+    return k;
+}
+
+// Helper function to add the visit texts of a spilled user to the text index, reading the
+// user's record without loading it back
+static bool index_spilled_user(VisitManager* manager, const SpillEntry* entry) {
+    UserVisits* user = read_spilled_user(manager, entry);
+    if (!user) {
+        return false;
+    }
+
+    for (size_t i = 0; i < user->visit_count; i++) {
+        index_text(manager, user->user_id, user->visits[i], true);
+    }
+    free_user_visits(manager, user);
+    return manager->text_index;
+}
+
+bool VisitManagerSetTextIndex(VisitManager* manager, bool text_index) {
+    if (!manager) {
+        return false;
+    }
+    if (text_index == manager->text_index) {
+        return true;
+    }
+    if (!text_index) {
+        free_text_index(manager);
+        return true;
+    }
+
+    // Index the visits held, including those of spilled users. index_text turns the index off
+    // if it runs out of memory.
+    manager->text_index = true;
+    for (size_t i = 0; i < manager->user_count && manager->text_index; i++) {
+        UserVisits* user = manager->users[i];
+        for (size_t j = 0; j < user->visit_count; j++) {
+            index_text(manager, user->user_id, user->visits[j], true);
+        }
+    }
+    for (size_t i = 0; i < manager->spill_index_capacity && manager->text_index; i++) {
+        const SpillEntry* entry = &manager->spill_index[i];
+        if (entry->length && !index_spilled_user(manager, entry)) {
+            free_text_index(manager);
+        }
+    }
+    return manager->text_index;
+}
+
+// Helper function to find the visits whose text contains every word of query, as posting keys
+// between first and last. Returns a sorted array for the caller to free, or NULL when nothing
+// matches.
+static uint64_t* search_text(VisitManager* manager, const char* query, uint64_t first, uint64_t last,
+                             size_t* count) {
+    *count = 0;
+    if (!manager->text_index) {
+        return NULL;
+    }
+
+    size_t token_count = tokenize(manager, query, strlen(query));
+    if (token_count == 0 || token_count == SIZE_MAX) {
+        return NULL;
+    }
+
+    TextTerm** terms = (TextTerm**)malloc(token_count * sizeof(TextTerm*));
+    if (!terms) {
+        return NULL;
+    }
+
+    // Start from the word with the fewest postings; the others can only narrow it down.
+    size_t rarest = 0;
+    for (size_t i = 0; i < token_count; i++) {
+        terms[i] = find_term(manager, &manager->tokens[i], false);
+        if (!terms[i]) {
+            free(terms);
+            return NULL;
+        }
+        if (terms[i]->posting_count + terms[i]->pending_adds <
+            terms[rarest]->posting_count + terms[rarest]->pending_adds) {
+            rarest = i;
+        }
+    }
+
+    // Each list is decoded only over the key range, from the skip entry before it.
+    size_t match_capacity = 0, key_capacity = 0;
+    uint64_t* matches     = NULL;
+    uint64_t* keys        = NULL;
+    size_t match_count    = decode_term(terms[rarest], first, last, &matches, &match_capacity);
+    for (size_t t = 0; t < token_count && match_count > 0 && match_count != SIZE_MAX; t++) {
+        if (t == rarest) {
+            continue;
+        }
+
+        // Intersect the sorted lists.
+        size_t key_count = decode_term(terms[t], first, last, &keys, &key_capacity);
+        if (key_count == SIZE_MAX) {
+            match_count = SIZE_MAX;
+            break;
+        }
+        size_t j    = 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < match_count; i++) {
+            while (j < key_count && keys[j] < matches[i]) {
+                j++;
+            }
+            if (j < key_count && keys[j] == matches[i]) {
+                matches[kept++] = matches[i];
+            }
+        }
+        match_count = kept;
+    }
+    free(keys);
+    free(terms);
+
+    if (match_count == 0 || match_count == SIZE_MAX) {
+        free(matches);
+        return NULL;
+    }
+    *count = match_count;
+    return matches;
+}
+
+size_t VisitManagerSearchText(VisitManager* manager, uint32_t user_id, const char* query, size_t limit,
+                              uint32_t* visit_ids) {
+    if (!manager || !query || (!visit_ids && limit > 0)) {
+        return 0;
+    }
+
+    size_t count;
+    uint64_t* matches = search_text(manager, query, (uint64_t)user_id << 32, (uint64_t)user_id << 32 | UINT32_MAX,
+                                    &count);
+    if (count > limit) {
+        count = limit;
+    }
+    for (size_t i = 0; i < count; i++) {
+        visit_ids[i] = (uint32_t)matches[i];
+    }
+    free(matches);
+    return count;
+}
+
+size_t VisitManagerSearchTextAll(VisitManager* manager, const char* query, size_t limit, VisitRef* results) {
+    if (!manager || !query || (!results && limit > 0)) {
+        return 0;
+    }
+
+    size_t count;
+    uint64_t* matches = search_text(manager, query, 0, UINT64_MAX, &count);
+    if (count > limit) {
+        count = limit;
+    }
+    for (size_t i = 0; i < count; i++) {
+        results[i].user_id  = (uint32_t)(matches[i] >> 32);
+        results[i].visit_id = (uint32_t)matches[i];
+    }
+    free(matches);
+    return count;
+}
+
+// Comparison function for qsort. The elements are TimedVisitRefs, ordered by time.
+static int compare_time_refs(const void* a, const void* b) {
+    int64_t time1 = ((const TimedVisitRef*)a)->timestamp_ns;
+    int64_t time2 = ((const TimedVisitRef*)b)->timestamp_ns;
+    return (time1 > time2) - (time1 < time2);
+}
+
+// Helper function to append references to the visits of a user to *refs, growing it as needed
+static bool collect_time_refs(const UserVisits* user, TimedVisitRef** refs, size_t* count, size_t* capacity) {
+    if (*count + user->visit_count > *capacity) {
+        size_t new_capacity  = (*count + user->visit_count) * 2;
+        TimedVisitRef* grown = (TimedVisitRef*)realloc(*refs, new_capacity * sizeof(TimedVisitRef));
+        if (!grown) {
+            return false;
+        }
+        *refs     = grown;
+        *capacity = new_capacity;
+    }
+
+    for (size_t i = 0; i < user->visit_count; i++) {
+        TimedVisitRef* ref = &(*refs)[(*count)++];
+        ref->user_id       = user->user_id;
+        ref->visit_id      = user->visits[i]->visit_id;
+        ref->timestamp_ns  = visit_time_ns(user->visits[i]);
+    }
+    return true;
+}
+
+bool VisitManagerSetTimeIndex(VisitManager* manager, bool time_index) {
+    if (!manager) {
+        return false;
+    }
+    if (time_index == manager->time_index) {
+        return true;
+    }
+    if (!time_index) {
+        if (manager->ttl > 0) {
+            return false;
+        }
+        free_time_index(manager);
+        return true;
+    }
+
+    // Gather the visits held, including those of spilled users, and sort them once so that the
+    // buckets fill in order.
+    TimedVisitRef* refs = NULL;
+    size_t count        = 0;
+    size_t capacity     = 0;
+    bool ok             = true;
+    for (size_t i = 0; i < manager->user_count && ok; i++) {
+        ok = collect_time_refs(manager->users[i], &refs, &count, &capacity);
+    }
+    for (size_t i = 0; i < manager->spill_index_capacity && ok; i++) {
+        if (manager->spill_index[i].length) {
+            UserVisits* user = read_spilled_user(manager, &manager->spill_index[i]);
+            ok               = user && collect_time_refs(user, &refs, &count, &capacity);
+            if (user) {
+                free_user_visits(manager, user);
+            }
+        }
+    }
+    if (count > 1) {
+        qsort(refs, count, sizeof(TimedVisitRef), compare_time_refs);
+    }
+
+    manager->time_index = true;
+    for (size_t i = 0; i < count && ok; i++) {
+        ok = add_time_ref(manager, refs[i]);
+    }
+    free(refs);
+
+    // Fit the buckets, which grew by doubling as they filled. Failing only leaves capacity behind.
+    for (size_t i = 0; i < manager->time_bucket_count && ok; i++) {
+        TimeBucket* bucket = &manager->time_buckets[i];
+        if (bucket->count > 8 && bucket->count < bucket->capacity) {
+            resize_time_bucket(manager, bucket, bucket->count);
+        }
+    }
+    if (!ok) {
+        free_time_index(manager);
+    }
+    return ok;
+}
+
+size_t VisitManagerGetWindow(VisitManager* manager, int64_t start_ns, int64_t end_ns, TimedVisitRef* refs,
+                             size_t capacity) {
+    if (!manager || !manager->time_index || start_ns >= end_ns || (!refs && capacity > 0)) {
+        return 0;
+    }
+
+    // Only the buckets overlapping the window are visited, each from its first matching time.
+    size_t found = 0;
+    int64_t last = time_bucket_key(end_ns - 1);
+    for (size_t p = time_bucket_position(manager, time_bucket_key(start_ns));
+         p < manager->time_bucket_count && manager->time_buckets[p].key <= last; p++) {
+        const TimeBucket* bucket = &manager->time_buckets[p];
+        for (size_t i = time_ref_position(bucket, start_ns); i < bucket->count && bucket->refs[i].timestamp_ns < end_ns;
+             i++) {
+            if (!time_ref_dead(bucket, i)) {
+                if (found < capacity) {
+                    refs[found] = bucket->refs[i];
+                }
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+// Helper function to add a user to the sets of the URLs it visited
+static bool index_url_users(VisitManager* manager, const UserVisits* user) {
+    for (size_t i = 0; i < user->visit_count; i++) {
+        if (!add_url_user(manager, user->visits[i]->url, user->user_id)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VisitManagerSetReverseUrlIndex(VisitManager* manager, bool reverse_url_index) {
+    if (!manager) {
+        return false;
+    }
+    if (reverse_url_index == manager->reverse_url_index) {
+        return true;
+    }
+    if (!reverse_url_index) {
+        free_reverse_url_index(manager);
+        return true;
+    }
+
+    // Index the visits held, including those of spilled users, which stay spilled.
+    manager->reverse_url_index = true;
+    bool ok                    = true;
+    for (size_t i = 0; i < manager->user_count && ok; i++) {
+        ok = index_url_users(manager, manager->users[i]);
+    }
+    for (size_t i = 0; i < manager->spill_index_capacity && ok; i++) {
+        if (manager->spill_index[i].length) {
+            UserVisits* user = read_spilled_user(manager, &manager->spill_index[i]);
+            ok               = user && index_url_users(manager, user);
+            if (user) {
+                free_user_visits(manager, user);
+            }
+        }
+    }
+    if (!ok) {
+        free_reverse_url_index(manager);
+    }
+    return ok;
+}
+
+// Helper function to copy up to capacity of the user IDs in a URL's set, in ascending order.
+// Returns the number copied.
+static size_t list_url_users(const UrlUsers* set, uint32_t* user_ids, size_t capacity) {
+    size_t found = 0;
+    for (size_t c = 0; c < set->container_count && found < capacity; c++) {
+        const UserContainer* container = &set->containers[c];
+        uint32_t high                  = (uint32_t)container->key << 16;
+        if (container->capacity > 0) {
+            const uint16_t* values = (const uint16_t*)container->values;
+            for (size_t i = 0; i < container->count && found < capacity; i++) {
+                user_ids[found++] = high | values[i];
+            }
+            continue;
+        }
+        const uint64_t* bits = (const uint64_t*)container->values;
+        for (size_t w = 0; w < USER_SET_BITMAP_WORDS && found < capacity; w++) {
+            for (uint64_t word = bits[w]; word && found < capacity; word &= word - 1) {
+                user_ids[found++] = high | (uint32_t)(w * 64 + (size_t)__builtin_ctzll(word));
+            }
+        }
+    }
+    return found;
+}
+
+size_t VisitManagerUsersForUrl(VisitManager* manager, const char* url, uint32_t* user_ids, size_t capacity) {
+    if (!manager || !url || !manager->reverse_url_index || manager->url_users_count == 0 ||
+        (!user_ids && capacity > 0)) {
+        return 0;
+    }
+
+    // Every indexed URL is interned, as its set holds a reference to it.
+    size_t len = strlen(url);
+    if (manager->intern_count == 0) {
+        return 0;
+    }
+    InternedString* interned = manager->intern_table[intern_slot(manager, url, len, hash_string(url, len))];
+    if (!interned) {
+        return 0;
+    }
+
+    const UrlUsers* set = &manager->url_users[url_users_slot(manager, interned->chars)];
+    list_url_users(set, user_ids, capacity);
+    return set->user_count;
+}
+
+static size_t visit_index(const UserVisits* user, uint32_t visit_id, int64_t time_ns);
+
+// Comparison function for qsort ordering TimedVisitRefs by user, oldest first within a user
+static int compare_refs_by_user(const void* a, const void* b) {
+    const TimedVisitRef* ref1 = (const TimedVisitRef*)a;
+    const TimedVisitRef* ref2 = (const TimedVisitRef*)b;
+    if (ref1->user_id != ref2->user_id) {
+        return ref1->user_id < ref2->user_id ? -1 : 1;
+    }
+    return ref1->timestamp_ns < ref2->timestamp_ns ? -1 : ref1->timestamp_ns > ref2->timestamp_ns;
+}
+
+// Helper function to get a user whose visits are about to be removed without loading it back if
+// spilled. A spilled user's record is read into a copy, which is accounted for as if resident so
+// that the memory counters come out even, and *entry is set to its spill entry (NULL for a
+// resident user). Returns NULL if the user is unknown or its record can not be read.
+static UserVisits* begin_user_edit(VisitManager* manager, uint32_t user_id, SpillEntry** entry) {
+    *entry           = NULL;
+    UserVisits* user = NULL;
+    if (manager->user_count > 0) {
+        user = manager->user_index[user_index_slot(manager, user_id)];
+    }
+    if (user) {
+        return user;
+    }
+
+    *entry = find_spill_entry(manager, user_id);
+    user   = *entry ? read_spilled_user(manager, *entry) : NULL;
+    if (!user) {
+        return NULL;
+    }
+    user->high_water = (uint32_t)user->visit_count;
+    account_user(manager, user, 1);
+    for (size_t i = 0; i < user->visit_count; i++) {
+        account_visit(manager, user->visits[i], 1);
+    }
+    return user;
+}
+
+// Helper function to finish removing visits from a user got with begin_user_edit. A resident user
+// is reclaimed when empty; a spilled one has its record rewritten without the removed visits, and
+// keeps its place in the LRU list either way.
+static void end_user_edit(VisitManager* manager, UserVisits* user, SpillEntry* entry, size_t removed) {
+    if (!entry) {
+        // Reclaim the user or the unused part of its visit array.
+        if (user->visit_count == 0) {
+            drop_user(manager, user);
+        } else if (removed > 0) {
+            shrink_user(manager, user);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < user->visit_count; i++) {
+        account_visit(manager, user->visits[i], -1);
+    }
+    account_user(manager, user, -1);
+
+    // The old record becomes dead space once replaced or forgotten.
+    SpillEntry updated;
+    if (removed == 0) {
+        free_user_visits(manager, user);
+    } else if (user->visit_count == 0) {
+        remove_spill_entry(manager, entry->user_id);
+        maybe_compact_spill_file(manager);
+        free_user_visits(manager, user);
+    } else if (write_spill_record(manager, user, &updated)) {
+        manager->spill_live_bytes += updated.length;
+        manager->spill_live_bytes -= entry->length;
+        manager->spill_bytes       = updated.offset + updated.length;
+        *entry                     = updated;
+        maybe_compact_spill_file(manager);
+        free_user_visits(manager, user);
+    } else if (insert_user(manager, user)) {
+        // The old record still holds the removed visits, so the user is kept in memory instead.
+        remove_spill_entry(manager, entry->user_id);
+        maybe_compact_spill_file(manager);
+    } else {
+        free_user_visits(manager, user);
+    }
+}
+
+// Helper function to remove the visits of one user that refs name. The user is not loaded back
+// if spilled, and its place in the LRU list is kept. Returns the number of visits removed.
+static size_t expire_user_visits(VisitManager* manager, const TimedVisitRef* refs, size_t count) {
+    SpillEntry* entry;
+    UserVisits* user = begin_user_edit(manager, refs[0].user_id, &entry);
+    if (!user) {
+        return 0;
+    }
+
+    size_t expired = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t j = visit_index(user, refs[i].visit_id, refs[i].timestamp_ns);
+        if (j != SIZE_MAX) {
+            remove_visit_at(manager, user, j);
+            expired++;
+        }
+    }
+    end_user_edit(manager, user, entry, expired);
+    return expired;
+}
+
+// Helper function to drop up to limit visits (all when limit is 0) that are older than the TTL,
+// oldest first. Returns the number dropped; the caller persists the change. Spilled users stay
+// spilled and no user moves in the LRU list, so the sweep needs no budget enforcement.
+static size_t expire_visits(VisitManager* manager, size_t limit) {
+    if (manager->ttl == 0 || (!manager->time_index && !VisitManagerSetTimeIndex(manager, true))) {
+        return 0;
+    }
+
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    int64_t ttl_ns = manager->ttl < 9e9 ? (int64_t)(manager->ttl * 1e9) : INT64_MAX;
+    int64_t cutoff = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec - ttl_ns;
+    size_t max     = limit > 0 ? limit : SIZE_MAX;
+
+    // Collect the expired references first, as dropping the visits changes the buckets.
+    TimedVisitRef* refs = NULL;
+    size_t count        = 0;
+    size_t capacity     = 0;
+    int64_t last        = time_bucket_key(cutoff);
+    for (size_t p = 0; p < manager->time_bucket_count && manager->time_buckets[p].key <= last && count < max; p++) {
+        const TimeBucket* bucket = &manager->time_buckets[p];
+        for (size_t i = 0; i < bucket->count && bucket->refs[i].timestamp_ns < cutoff && count < max; i++) {
+            if (time_ref_dead(bucket, i)) {
+                continue;
+            }
+            if (count == capacity) {
+                size_t new_capacity  = capacity > 0 ? capacity * 2 : 64;
+                TimedVisitRef* grown = (TimedVisitRef*)realloc(refs, new_capacity * sizeof(TimedVisitRef));
+                if (!grown) {
+                    break;
+                }
+                refs     = grown;
+                capacity = new_capacity;
+            }
+            refs[count++] = bucket->refs[i];
+        }
+    }
+
+    // Group the references by user, so that a spilled record is read and rewritten once.
+    if (count > 1) {
+        qsort(refs, count, sizeof(TimedVisitRef), compare_refs_by_user);
+    }
+    size_t expired = 0;
+    for (size_t i = 0, end; i < count; i = end) {
+        for (end = i + 1; end < count && refs[end].user_id == refs[i].user_id;) {
+            end++;
+        }
+        expired += expire_user_visits(manager, &refs[i], end - i);
+    }
+
+    free(refs);
+    return expired;
+}
+
+bool VisitManagerSetTTL(VisitManager* manager, double ttl) {
+    if (!manager || !(ttl >= 0) || isinf(ttl)) {
+        return false;
+    }
+
+    // Expiry finds visits through the time index, which stays on while a TTL is set.
+    if (ttl > 0 && !VisitManagerSetTimeIndex(manager, true)) {
+        return false;
+    }
+    manager->ttl = ttl;
+    return true;
+}
+
+size_t VisitManagerExpire(VisitManager* manager, size_t limit) {
+    if (!manager) {
+        return 0;
+    }
+
+    size_t expired = expire_visits(manager, limit);
+    if (expired > 0) {
+        serialize_manager(manager);
+    }
+    return expired;
+}
+
+bool VisitManagerSetMemoryBudget(VisitManager* manager, size_t budget) {
+    if (!manager) {
+        return false;
+    }
+
+    manager->memory_budget = budget;
+    return enforce_budget(manager);
+}
+
+static bool add_visit(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url, size_t url_len,
+                      const char* text, size_t text_len, bool* added);
+
+bool VisitManagerAddVisit(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url,
+                          const char* text) {
+    if (!manager || !url || !text) {
+        return false;
+    }
+
+    return VisitManagerAddVisitN(manager, user_id, visit_id, url, strlen(url), text, strlen(text));
+}
+
+bool VisitManagerAddVisitN(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url,
+                           size_t url_len, const char* text, size_t text_len) {
+    if (!manager || (!url && url_len > 0) || (!text && text_len > 0) || url_len > MAX_STRING_LEN ||
+        text_len > MAX_STRING_LEN) {
+        return false;
+    }
+
+    STATS_BEGIN();
+    // Visits past the TTL are dropped a batch at a time and persisted with the new visit, or on
+    // their own when it is not added.
+    size_t expired = expire_visits(manager, TTL_ADD_BATCH);
+    bool added     = false;
+    bool ok        = add_visit(manager, user_id, visit_id, url, url_len, text, text_len, &added);
+    if (added || expired > 0) {
+        serialize_manager(manager);
+    }
+    STATS_END(manager, VISIT_MANAGER_OP_ADD_VISIT, ok);
+    return ok;
+}
+
+// Helper function to free a new visit that could not be added to a user
+static void discard_visit(VisitManager* manager, UserVisits* user, Visit* visit) {
+    if (user->scores) {
+        unhold_score(manager, user, visit->url);
+    }
+    free_visit(manager, visit);
+}
+
+// Helper function to find the position of a user's visit by ID and time, or SIZE_MAX. The
+// visits of an ordered user are sorted newest first, so a binary search finds the first one
+// as new, and only visits with the same time are scanned.
+static size_t visit_index(const UserVisits* user, uint32_t visit_id, int64_t time_ns) {
+    size_t i = 0;
+    if (user->ordered) {
+        size_t high = user->visit_count;
+        while (i < high) {
+            size_t mid = i + (high - i) / 2;
+            if (visit_time_ns(user->visits[mid]) > time_ns) {
+                i = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+    }
+    for (; i < user->visit_count; i++) {
+        int64_t visit_ns = visit_time_ns(user->visits[i]);
+        if (user->visits[i]->visit_id == visit_id && visit_ns == time_ns) {
+            return i;
+        }
+        if (user->ordered && visit_ns < time_ns) {
+            break;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Helper function implementing VisitManagerAddVisitN. *added is set once the visit is added; the
+// caller persists it.
+static bool add_visit(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url, size_t url_len,
+                      const char* text, size_t text_len, bool* added) {
+    // Find or create user entry
+    UserVisits* user = find_user(manager, user_id);
+    if (!user) {
+        // A spilled user that could not be loaded must not be shadowed by a new entry.
+        if (find_spill_entry(manager, user_id)) {
+            return false;
+        }
 
-    // Find or create user entry
-    UserVisits* user = find_user(manager, user_id);
-    if (!user) {
         // User not found, create new user entry
-        if (manager->user_count >= manager->user_capacity) {
-            // Resize users array if needed
-            size_t new_capacity    = manager->user_capacity * 2;
-            UserVisits** new_users = (UserVisits**)realloc(manager->users, new_capacity * sizeof(UserVisits*));
-            if (!new_users) {
+        user = create_user(user_id, USER_INLINE_VISITS);
+        if (!user) {
+            return false;
+        }
+
+        if (!insert_user(manager, user)) {
+            free_user_visits(manager, user);
+            return false;
+        }
+    }
+
+    // If visit already exists, ignore it. Visit IDs have no index, so this scans the user's
+    // visits, at most max_visits of them; like the memmove of an ordered insert below, that is
+    // small next to persisting the manager after the add.
+    for (size_t i = 0; i < user->visit_count; i++) {
+        if (user->visits[i]->visit_id == visit_id) {
+            return true;  // No need to report failure
+        }
+    }
+
+    // Score the user's history before the new visit joins it.
+    if (manager->frecency_lambda > 0 && !user->scores && !build_scores(manager, user)) {
+        return false;
+    }
+
+    // In dedup mode the user's visits are kept newest first with at most one visit per URL.
+    if (manager->dedup_urls && !user->url_index && !build_url_index(manager, user)) {
+        return false;
+    }
+
+    // Create new visit
+    Visit* visit = create_visit(manager, visit_id, url, url_len, text, text_len);
+    if (!visit) {
+        return false;
+    }
+
+    // Score the new visit first, so that a URL that stays in the history keeps its entry when an
+    // earlier visit to it is replaced or evicted below.
+    if (user->scores) {
+        record_score(manager, user, visit);
+    }
+
+    // A revisited URL replaces the earlier visit and moves to the front.
+    Visit* previous = user->url_index ? user->url_index[url_index_slot(user, visit->url)] : NULL;
+    if (previous) {
+        size_t i = visit_index(user, previous->visit_id, visit_time_ns(previous));
+        if (compare_visits(&visit, &user->visits[0]) > 0) {
+            user->ordered = false;
+        }
+        memmove(&user->visits[1], &user->visits[0], i * sizeof(Visit*));
+        user->visits[0] = visit;
+        index_url(user, visit);
+        if (user->scores) {
+            unhold_score(manager, user, previous->url);
+        }
+        remove_prefix_entry(user, previous);
+        insert_prefix_entry(manager, user, visit);
+        index_text(manager, user_id, previous, false);
+        index_text(manager, user_id, visit, true);
+        index_time(manager, user_id, previous, false);
+        index_time(manager, user_id, visit, true);
+        release_visit(manager, previous);
+        account_visit(manager, visit, 1);
+
+        enforce_budget(manager);
+        *added = true;
+        return true;
+    }
+
+    // Check if we need to make room (remove oldest visit)
+    if (user->visit_count >= manager->max_visits) {
+        // Find the oldest visit: the last one when ordered, otherwise by scanning
+        size_t oldest_idx = user->visit_count - 1;
+        if (!user->ordered) {
+            struct timespec oldest_time = user->visits[0]->time;
+            oldest_idx                  = 0;
+
+            for (size_t i = 1; i < user->visit_count; i++) {
+                if (user->visits[i]->time.tv_sec < oldest_time.tv_sec ||
+                    (user->visits[i]->time.tv_sec == oldest_time.tv_sec &&
+                     user->visits[i]->time.tv_nsec < oldest_time.tv_nsec)) {
+                    oldest_idx  = i;
+                    oldest_time = user->visits[i]->time;
+                }
+            }
+        }
+
+        // Free oldest visit
+        remove_visit_at(manager, user, oldest_idx);
+    }
+
+    // Check if we need to resize visits array
+    if (user->visit_count >= user->capacity) {
+        size_t new_capacity = user->capacity * 2;
+        if (new_capacity > manager->max_visits) {
+            new_capacity = manager->max_visits;
+        }
+
+        if (!resize_visits(manager, user, new_capacity)) {
+            discard_visit(manager, user, visit);
+            return false;
+        }
+    }
+
+    // Add the new visit, in front for ordered users. One older than the newest held, when the
+    // clock steps back, leaves the user unordered.
+    if (user->url_index && (user->visit_count + 1) * 2 > user->url_index_capacity &&
+        !resize_url_index(manager, user, user->url_index_capacity * 2)) {
+        discard_visit(manager, user, visit);
+        return false;
+    }
+    if (user->visit_count > 0 && compare_visits(&visit, &user->visits[0]) > 0) {
+        user->ordered = false;
+    }
+    if (user->url_index || user->ordered) {
+        memmove(&user->visits[1], &user->visits[0], user->visit_count * sizeof(Visit*));
+        user->visits[0] = visit;
+        if (user->url_index) {
+            index_url(user, visit);
+        }
+    } else {
+        user->visits[user->visit_count] = visit;
+    }
+    insert_prefix_entry(manager, user, visit);
+    index_text(manager, user_id, visit, true);
+    index_time(manager, user_id, visit, true);
+    index_url_user(manager, user_id, visit->url, true);
+    set_visit_count(manager, user, user->visit_count + 1);
+    account_visit(manager, visit, 1);
+
+    // Keep resident users within the memory budget. A failed spill leaves them resident.
+    enforce_budget(manager);
+    *added = true;
+
+    return true;
+}
+
+// Helper function to order two visit times, newer first
+static int compare_times(const struct timespec* time1, const struct timespec* time2) {
+    // Compare timestamps (newer first)
+    if (time1->tv_sec > time2->tv_sec) {
+        return -1;  // time1 is newer, so it should come first
+    } else if (time1->tv_sec < time2->tv_sec) {
+        return 1;  // time2 is newer, so it should come first
+    } else {
+        if (time1->tv_nsec > time2->tv_nsec) {
+            return -1;  // time1 is newer
+        } else if (time1->tv_nsec < time2->tv_nsec) {
+            return 1;  // time2 is newer
+        } else {
+            return 0;  // times are equal
+        }
+    }
+}
+
+// Comparison function for qsort. The elements are Visit pointers.
+static int compare_visits(const void* a, const void* b) {
+    return compare_times(&(*(Visit* const*)a)->time, &(*(Visit* const*)b)->time);
+}
+
+// Function to sort the visits by time (newest first)
+static void sort_visits(Visit* visits[], size_t visit_count) {
+    qsort(visits, visit_count, sizeof(Visit*), compare_visits);
+}
+
+static Visit** get_recent_visits(VisitManager* manager, uint32_t user_id, size_t* count);
+
+Visit** VisitManagerGetRecentVisits(VisitManager* manager, uint32_t user_id, size_t* count) {
+    if (!manager || !count) {
+        return NULL;
+    }
+
+    STATS_BEGIN();
+    Visit** visits = get_recent_visits(manager, user_id, count);
+    STATS_END(manager, VISIT_MANAGER_OP_GET_RECENT_VISITS, true);
+    return visits;
+}
+
+// Helper function implementing VisitManagerGetRecentVisits
+static Visit** get_recent_visits(VisitManager* manager, uint32_t user_id, size_t* count) {
+    // Find user
+    UserVisits* user = find_user(manager, user_id);
+    if (!user) {
+        *count = 0;
+        return NULL;
+    }
+
+    // Sort visits by time (newest first), unless they are kept in that order.
+    order_visits(user);
+    *count = user->visit_count;
+    return user->visits;
+}
+
+// Helper function to compare a URL with a prefix of prefix_len bytes: negative when the URL sorts
+// before every URL starting with the prefix, zero when it starts with it, positive otherwise
+static int compare_url_prefix(const char* url, const char* prefix, size_t prefix_len) {
+    size_t url_len = interned_header(url)->len;
+    int    cmp     = memcmp(url, prefix, url_len < prefix_len ? url_len : prefix_len);
+    return cmp != 0 ? cmp : (url_len < prefix_len ? -1 : 0);
+}
+
+// Helper function to find the user's URL-sorted visits starting with prefix. Returns the first
+// of them in the prefix index, with *end set past the last, or NULL when there are none.
+static Visit** find_prefix_matches(VisitManager* manager, uint32_t user_id, const char* prefix, size_t prefix_len,
+                                   Visit*** end) {
+    UserVisits* user = find_user(manager, user_id);
+    if (!user || (!user->prefix_valid && !build_prefix_index(manager, user))) {
+        return NULL;
+    }
+
+    // Binary search for the first URL not less than the prefix; matches follow it.
+    Visit** index = user->prefix_index;
+    size_t low = 0, high = user->prefix_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (compare_url_prefix(index[mid]->url, prefix, prefix_len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    high = low;
+    while (high < user->prefix_count && compare_url_prefix(index[high]->url, prefix, prefix_len) == 0) {
+        high++;
+    }
+    *end = index + high;
+    return index + low;
+}
+
+size_t VisitManagerPrefixSearch(VisitManager* manager, uint32_t user_id, const char* prefix, size_t limit,
+                                Visit** results) {
+    if (!manager || !prefix || !results || limit == 0) {
+        return 0;
+    }
+
+    Visit** end;
+    Visit** match = find_prefix_matches(manager, user_id, prefix, strlen(prefix), &end);
+    if (!match) {
+        return 0;
+    }
+
+    // Interned URLs compare equal by pointer; the first visit of each URL is its newest.
+    size_t count = 0;
+    for (; match < end && count < limit; match++) {
+        if (count == 0 || results[count - 1]->url != (*match)->url) {
+            results[count++] = *match;
+        }
+    }
+    return count;
+}
+
+// Helper function to lowercase an ASCII letter
+static char ascii_lower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+}
+
+// Helper function to check whether the n bytes at p match needle, which is lowercased when
+// ignore_case is set
+static bool match_at(const char* p, const char* needle, size_t n, bool ignore_case) {
+    if (!ignore_case) {
+        return memcmp(p, needle, n) == 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (ascii_lower(p[i]) != needle[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper function to find needle in len bytes of haystack, one position at a time
+static bool contains_scalar(const char* haystack, size_t len, const char* needle, size_t n, bool ignore_case) {
+    for (size_t i = 0; i + n <= len; i++) {
+        if (match_at(haystack + i, needle, n, ignore_case)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef VISIT_MANAGER_AVX2
+// Helper function to lowercase the ASCII letters of 32 bytes. Bytes from 0x80 are negative as
+// signed chars, so they fall outside 'A'..'Z'.
+__attribute__((target("avx2"))) static __m256i lower_avx2(__m256i bytes) {
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), bytes));
+    return _mm256_or_si256(bytes, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+// Helper function to get the mask of the 32 positions from p where the first and the last byte
+// of an n-byte needle both match
+__attribute__((target("avx2"))) static uint32_t candidates_avx2(const char* p, size_t n, __m256i first, __m256i last,
+                                                                bool ignore_case) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i*)p);
+    __m256i block_last  = _mm256_loadu_si256((const __m256i*)(p + n - 1));
+    if (ignore_case) {
+        block_first = lower_avx2(block_first);
+        block_last  = lower_avx2(block_last);
+    }
+    return (uint32_t)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+}
+
+// Helper function to check the candidate positions in mask, counted from haystack + base
+static bool match_candidates(const char* haystack, size_t base, uint32_t mask, const char* needle, size_t n,
+                             bool ignore_case) {
+    for (; mask; mask &= mask - 1) {
+        if (match_at(haystack + base + __builtin_ctz(mask), needle, n, ignore_case)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Helper function to check the positions from i on that are too close to the end of haystack
+// for a full block, where the needle can start at end positions in all. Kept out of line so the
+// main loop of contains_avx2 compiles as tightly as without it.
+__attribute__((target("avx2"), noinline)) static bool contains_tail_avx2(const char* haystack, size_t len, size_t i,
+                                                                        const char* needle, size_t n,
+                                                                        bool ignore_case) {
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last  = _mm256_set1_epi8(needle[n - 1]);
+    size_t end          = len - n + 1;
+
+    // With a block's worth of positions, one more block ends at the last position, overlapping
+    // the positions already checked.
+    if (end >= 32) {
+        size_t start  = end - 32;
+        uint32_t mask = candidates_avx2(haystack + start, n, first, last, ignore_case);
+        return match_candidates(haystack, start, mask & (uint32_t)(UINT64_MAX << (i - start)), needle, n,
+                                ignore_case);
+    }
+
+    // Otherwise a short needle scans a copy padded to a full block.
+    if (n <= 32) {
+        char padded[64];
+        memcpy(padded, haystack, len);
+        memset(padded + len, 0, sizeof(padded) - len);
+        uint32_t mask = candidates_avx2(padded, n, first, last, ignore_case);
+        return match_candidates(haystack, 0, mask & (uint32_t)((1ULL << end) - 1), needle, n, ignore_case);
+    }
+    return contains_scalar(haystack, len, needle, n, ignore_case);
+}
+
+// Helper function to find needle in len bytes of haystack, 32 positions at a time: a position
+// is only compared in full when the first and last bytes of the needle both match there.
+__attribute__((target("avx2"))) static bool contains_avx2(const char* haystack, size_t len, const char* needle,
+                                                          size_t n, bool ignore_case) {
+    if (n == 0 || len < n) {
+        return n == 0;
+    }
+
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last  = _mm256_set1_epi8(needle[n - 1]);
+    size_t i            = 0;
+    for (; i + n - 1 + 32 <= len; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(haystack + i));
+        __m256i block_last  = _mm256_loadu_si256((const __m256i*)(haystack + i + n - 1));
+        if (ignore_case) {
+            block_first = lower_avx2(block_first);
+            block_last  = lower_avx2(block_last);
+        }
+
+        __m256i matches = _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last));
+        for (uint32_t mask = (uint32_t)_mm256_movemask_epi8(matches); mask; mask &= mask - 1) {
+            if (match_at(haystack + i + __builtin_ctz(mask), needle, n, ignore_case)) {
+                return true;
+            }
+        }
+    }
+
+    // Positions too close to the end for a full block
+    return i + n <= len && contains_tail_avx2(haystack, len, i, needle, n, ignore_case);
+}
+#endif
+
+size_t VisitManagerSearch(VisitManager* manager, uint32_t user_id, const char* needle, size_t needle_len,
+                          uint32_t flags, size_t limit, uint32_t* visit_ids) {
+    if (!manager || (!needle && needle_len > 0) || (!visit_ids && limit > 0)) {
+        return 0;
+    }
+
+    size_t visit_count;
+    Visit** visits = get_recent_visits(manager, user_id, &visit_count);
+    if (visit_count == 0 || limit == 0) {
+        return 0;
+    }
+
+    // Compare against a lowercased needle; haystack bytes are lowered as they are scanned.
+    bool ignore_case = flags & VISIT_MANAGER_SEARCH_IGNORE_CASE;
+    size_t n         = needle_len;
+    char* lowered    = NULL;
+    if (ignore_case && n > 0) {
+        lowered = (char*)malloc(n);
+        if (!lowered) {
+            return 0;
+        }
+        for (size_t i = 0; i < n; i++) {
+            lowered[i] = ascii_lower(needle[i]);
+        }
+        needle = lowered;
+    }
+
+    bool (*contains)(const char*, size_t, const char*, size_t, bool) = contains_scalar;
+#ifdef VISIT_MANAGER_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        contains = contains_avx2;
+    }
+#endif
+
+    bool search_url  = flags & VISIT_MANAGER_SEARCH_URL || !(flags & VISIT_MANAGER_SEARCH_TEXT);
+    bool search_text = flags & VISIT_MANAGER_SEARCH_TEXT || !(flags & VISIT_MANAGER_SEARCH_URL);
+    size_t count     = 0;
+    for (size_t i = 0; i < visit_count && count < limit; i++) {
+        const Visit* visit = visits[i];
+        if ((search_url && contains(visit->url, visit_url_len(visit), needle, n, ignore_case)) ||
+            (search_text && contains(visit->text, visit_text_len(visit), needle, n, ignore_case))) {
+            visit_ids[count++] = visit->visit_id;
+        }
+    }
+
+    free(lowered);
+    return count;
+}
+
+// Helper function to get the bytes of the strings of visits in a packed buffer
+static size_t packed_string_bytes(Visit** visits, size_t count) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        bytes += visit_url_len(visits[i]) + visit_text_len(visits[i]);
+    }
+    return bytes;
+}
+
+// Helper function to write the PackedVisit headers of visits to buf from header_offset, and
+// their strings from *offset, which is advanced past them
+static void write_packed_visits(Visit** visits, size_t count, uint8_t* buf, size_t header_offset, size_t* offset) {
+    for (size_t i = 0; i < count; i++) {
+        Visit* visit      = visits[i];
+        size_t url_len    = visit_url_len(visit);
+        size_t text_len   = visit_text_len(visit);
+        PackedVisit entry = {
+            .visit_id    = visit->visit_id,
+            .url_offset  = (uint32_t)*offset,
+            .url_len     = (uint32_t)url_len,
+            .text_offset = (uint32_t)(*offset + url_len),
+            .text_len    = (uint32_t)text_len,
+            .tv_sec      = (int64_t)visit->time.tv_sec,
+            .tv_nsec     = (int64_t)visit->time.tv_nsec,
+        };
+
+        // buf may not be suitably aligned for PackedVisit.
+        memcpy(buf + header_offset + i * sizeof(PackedVisit), &entry, sizeof(entry));
+        memcpy(buf + *offset, visit->url, url_len);
+        memcpy(buf + *offset + url_len, visit->text, text_len);
+        *offset += url_len + text_len;
+    }
+}
+
+// Helper function to pack visits into buf. Returns the number of bytes needed.
+static size_t pack_visits(Visit** visits, size_t count, uint8_t* buf, size_t buf_size) {
+    size_t needed = count * sizeof(PackedVisit) + packed_string_bytes(visits, count);
+
+    // Offsets are 32-bit, so larger results can not be represented.
+    if (needed > UINT32_MAX || needed > buf_size || !buf) {
+        return needed;
+    }
+
+    size_t offset = count * sizeof(PackedVisit);
+    write_packed_visits(visits, count, buf, 0, &offset);
+    return needed;
+}
+
+size_t VisitManagerPackRecentVisits(VisitManager* manager, uint32_t user_id, void* buf, size_t buf_size,
+                                    size_t* count) {
+    if (!manager || !count) {
+        return 0;
+    }
+
+    size_t visit_count = 0;
+    Visit** visits     = VisitManagerGetRecentVisits(manager, user_id, &visit_count);
+    *count             = visit_count;
+    if (!visits || visit_count == 0) {
+        return 0;
+    }
+
+    return pack_visits(visits, visit_count, (uint8_t*)buf, buf_size);
+}
+
+size_t VisitManagerPackPrefixSearch(VisitManager* manager, uint32_t user_id, const char* prefix, size_t prefix_len,
+                                    size_t limit, void* buf, size_t buf_size, size_t* count) {
+    if (!manager || !count) {
+        return 0;
+    }
+
+    *count = 0;
+    if ((!prefix && prefix_len > 0) || limit == 0) {
+        return 0;
+    }
+
+    Visit** end;
+    Visit** match = find_prefix_matches(manager, user_id, prefix ? prefix : "", prefix_len, &end);
+    if (!match) {
+        return 0;
+    }
+
+    // Size the distinct URLs first, so nothing is written unless all of them fit.
+    size_t needed = 0;
+    Visit* last   = NULL;
+    for (Visit** v = match; v < end && *count < limit; v++) {
+        if (!last || last->url != (*v)->url) {
+            last    = *v;
+            needed += sizeof(PackedVisit) + visit_url_len(last) + visit_text_len(last);
+            (*count)++;
+        }
+    }
+
+    // Offsets are 32-bit, so larger results can not be represented.
+    if (needed > UINT32_MAX || needed > buf_size || !buf) {
+        return needed;
+    }
+
+    size_t offset = *count * sizeof(PackedVisit);
+    size_t packed = 0;
+    last          = NULL;
+    for (Visit** v = match; packed < *count; v++) {
+        if (!last || last->url != (*v)->url) {
+            last = *v;
+            write_packed_visits(v, 1, (uint8_t*)buf, packed++ * sizeof(PackedVisit), &offset);
+        }
+    }
+    return needed;
+}
+
+// Helper function to find the users of a batch. Resident users become the most recently used.
+// Spilled users are read into copies, marked in copied for the caller to free, and stay
+// spilled, so reading one never spills another user of the batch; unknown ones are NULL.
+static void find_users(VisitManager* manager, const uint32_t* user_ids, size_t n, UserVisits** users,
+                       bool* copied) {
+    for (size_t i = 0; i < n; i++) {
+        users[i]  = manager->user_count > 0 ? manager->user_index[user_index_slot(manager, user_ids[i])] : NULL;
+        copied[i] = false;
+        if (users[i]) {
+            if (users[i] != manager->lru_head) {
+                lru_unlink(manager, users[i]);
+                lru_push_front(manager, users[i]);
+            }
+            continue;
+        }
+
+        SpillEntry* entry = manager->spill_count > 0 ? find_spill_entry(manager, user_ids[i]) : NULL;
+        if (entry && (users[i] = read_spilled_user(manager, entry)) && users[i]->user_id != user_ids[i]) {
+            free_user_visits(manager, users[i]);
+            users[i] = NULL;
+        }
+        copied[i] = users[i] != NULL;
+    }
+}
+
+size_t VisitManagerGetRecentVisitsMulti(VisitManager* manager, const uint32_t* user_ids, size_t n, void* buf,
+                                        size_t buf_size, size_t* counts) {
+    if (!manager || !user_ids || !counts || n == 0) {
+        return 0;
+    }
+
+    UserVisits** users = (UserVisits**)malloc(n * (sizeof(UserVisits*) + sizeof(bool)));
+    if (!users) {
+        memset(counts, 0, n * sizeof(size_t));
+        return 0;
+    }
+    bool* copied = (bool*)(users + n);
+    find_users(manager, user_ids, n, users, copied);
+
+    // Size the result, sorting each user's visits newest first.
+    size_t visit_total = 0, needed = 0;
+    for (size_t i = 0; i < n; i++) {
+        UserVisits* user = users[i];
+        counts[i]        = user ? user->visit_count : 0;
+        if (!user) {
+            continue;
+        }
+        order_visits(user);
+        visit_total += user->visit_count;
+        needed += packed_string_bytes(user->visits, user->visit_count);
+    }
+    needed += visit_total * sizeof(PackedVisit);
+
+    // Headers of all users come first, in batch order, then the strings.
+    if (needed <= UINT32_MAX && needed <= buf_size && buf) {
+        size_t header_offset = 0, offset = visit_total * sizeof(PackedVisit);
+        for (size_t i = 0; i < n; i++) {
+            if (users[i]) {
+                write_packed_visits(users[i]->visits, counts[i], (uint8_t*)buf, header_offset, &offset);
+                header_offset += counts[i] * sizeof(PackedVisit);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (copied[i]) {
+            free_user_visits(manager, users[i]);
+        }
+    }
+    free(users);
+    return needed;
+}
+
+// Helper function to write a visit as an export row, appending its strings at *offset
+static void export_visit(uint32_t user_id, const Visit* visit, ExportedVisit* out, char* strings, size_t* offset) {
+    size_t url_len  = visit_url_len(visit);
+    size_t text_len = visit_text_len(visit);
+
+    out->user_id      = user_id;
+    out->visit_id     = visit->visit_id;
+    out->timestamp_ns = visit_time_ns(visit);
+    out->url_offset   = *offset;
+    out->url_len      = (uint32_t)url_len;
+    memcpy(strings + *offset, visit->url, url_len);
+    *offset += url_len;
+
+    out->text_offset = *offset;
+    out->text_len    = (uint32_t)text_len;
+    memcpy(strings + *offset, visit->text, text_len);
+    *offset += text_len;
+}
+
+// Helper function to get the user to export at position i if it is resident. Spilled users are
+// not loaded back, so an export does not churn the LRU or evict the users it has yet to export.
+static UserVisits* export_user(VisitManager* manager, const uint32_t* user_ids, size_t i) {
+    if (!user_ids) {
+        return manager->users[i];
+    }
+    return manager->user_count > 0 ? manager->user_index[user_index_slot(manager, user_ids[i])] : NULL;
+}
+
+bool VisitManagerExport(VisitManager* manager, const uint32_t* user_ids, size_t user_count, ExportedVisit* visits,
+                        size_t visit_capacity, char* strings, size_t string_capacity, size_t* visit_count,
+                        size_t* string_bytes) {
+    if (!manager || !visit_count || !string_bytes) {
+        return false;
+    }
+
+    if (!user_ids && manager->spill_count > 0) {
+        // Spilled users are exported by ID, like requested ones.
+        uint32_t* all_ids = (uint32_t*)malloc((manager->user_count + manager->spill_count) * sizeof(uint32_t));
+        if (!all_ids) {
+            return false;
+        }
+
+        size_t n = 0;
+        for (size_t i = 0; i < manager->user_count; i++) {
+            all_ids[n++] = manager->users[i]->user_id;
+        }
+        for (size_t i = 0; i < manager->spill_index_capacity; i++) {
+            if (manager->spill_index[i].length) {
+                all_ids[n++] = manager->spill_index[i].user_id;
+            }
+        }
+
+        bool ok = VisitManagerExport(manager, all_ids, n, visits, visit_capacity, strings, string_capacity,
+                                     visit_count, string_bytes);
+        free(all_ids);
+        return ok;
+    }
+
+    if (!user_ids) {
+        user_count = manager->user_count;
+    }
+
+    // Size the export first so nothing is written when it does not fit. Spill entries hold the
+    // sizes of spilled users, so each of those is read once, to be written.
+    size_t total_visits  = 0;
+    size_t total_strings = 0;
+    for (size_t i = 0; i < user_count; i++) {
+        UserVisits* user = export_user(manager, user_ids, i);
+        if (!user) {
+            const SpillEntry* entry = user_ids ? find_spill_entry(manager, user_ids[i]) : NULL;
+            if (entry) {
+                total_visits += entry->visit_count;
+                total_strings += entry->string_bytes;
+            }
+            continue;
+        }
+
+        total_visits += user->visit_count;
+        for (size_t j = 0; j < user->visit_count; j++) {
+            total_strings += visit_url_len(user->visits[j]) + visit_text_len(user->visits[j]);
+        }
+    }
+
+    *visit_count  = total_visits;
+    *string_bytes = total_strings;
+    if (total_visits > visit_capacity || total_strings > string_capacity || (total_visits > 0 && !visits) ||
+        (total_strings > 0 && !strings)) {
+        return false;
+    }
+
+    size_t row    = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < user_count; i++) {
+        UserVisits* user = export_user(manager, user_ids, i);
+        bool spilled     = false;
+        if (!user) {
+            const SpillEntry* entry = user_ids ? find_spill_entry(manager, user_ids[i]) : NULL;
+            if (!entry) {
+                continue;
+            }
+            if (!(user = read_spilled_user(manager, entry))) {
                 return false;
             }
-            manager->users         = new_users;
-            manager->user_capacity = new_capacity;
+            spilled = true;
+        }
+
+        order_visits(user);
+        for (size_t j = 0; j < user->visit_count; j++) {
+            export_visit(user->user_id, user->visits[j], &visits[row++], strings, &offset);
+        }
+        if (spilled) {
+            free_user_visits(manager, user);
+        }
+    }
+
+    return true;
+}
+
+// A user's visits, newest first, as merged by VisitManagerGetLatestVisits
+typedef struct {
+    Visit** visits;
+    size_t count;
+    size_t next;  // Position of the next visit to merge
+    uint32_t user_id;
+} VisitStream;
+
+// Helper function to check whether the next visit of stream a is newer than that of stream b
+static bool stream_newer(const VisitStream* a, const VisitStream* b) {
+    return compare_visits(&a->visits[a->next], &b->visits[b->next]) < 0;
+}
+
+// Helper function to move the stream at position i down a max-heap ordered by stream_newer
+static void sift_stream(VisitStream* heap, size_t count, size_t i) {
+    VisitStream stream = heap[i];
+    for (size_t child = 2 * i + 1; child < count; child = 2 * i + 1) {
+        if (child + 1 < count && stream_newer(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+        if (!stream_newer(&heap[child], &stream)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i       = child;
+    }
+    heap[i] = stream;
+}
+
+// Helper function to merge the newest n visits of the streams, newest first, into latest and
+// their user IDs into user_ids. The streams are reordered and consumed. Returns the number merged.
+static size_t merge_streams(VisitStream* heap, size_t count, size_t n, Visit** latest, uint32_t* user_ids) {
+    for (size_t i = count / 2; i-- > 0;) {
+        sift_stream(heap, count, i);
+    }
+
+    size_t found = 0;
+    while (found < n && count > 0) {
+        VisitStream* top  = &heap[0];
+        user_ids[found]   = top->user_id;
+        latest[found++]   = top->visits[top->next++];
+        if (top->next == top->count) {
+            *top = heap[--count];
+        }
+        sift_stream(heap, count, 0);
+    }
+    return found;
+}
+
+// Helper function to add the visits of a user to the streams, if it has any
+static void add_stream(VisitStream* streams, size_t* count, UserVisits* user) {
+    if (user->visit_count > 0) {
+        order_visits(user);
+        streams[(*count)++] = (VisitStream){user->visits, user->visit_count, 0, user->user_id};
+    }
+}
+
+// The newest visits found so far by VisitManagerGetLatestVisits, newest first. Visits taken from
+// the records of spilled users are owned, and freed with the result.
+typedef struct {
+    Visit** visits;
+    uint32_t* user_ids;
+    bool* owned;
+    size_t count;
+    size_t n;  // Most visits kept
+} LatestVisits;
+
+// Helper function to take the visit at position i from a user read with read_spilled_user into
+// position j of the result. The user can then be freed without it.
+static void take_latest_visit(LatestVisits* latest, size_t j, UserVisits* user, size_t i) {
+    latest->visits[j]   = user->visits[i];
+    latest->user_ids[j] = user->user_id;
+    latest->owned[j]    = true;
+    user->visits[i]     = NULL;
+}
+
+// Helper function to find the newest visits through the time index, walking it from its newest
+// bucket. Visits of spilled users are taken from their records, each read once.
+static bool latest_from_time_index(VisitManager* manager, LatestVisits* latest) {
+    TimedVisitRef* refs = (TimedVisitRef*)malloc(latest->n * sizeof(TimedVisitRef));
+    uint64_t* spilled   = (uint64_t*)malloc(latest->n * sizeof(uint64_t));
+    size_t* positions   = (size_t*)malloc(latest->n * sizeof(size_t));
+    bool ok             = refs && spilled && positions;
+
+    size_t found = 0;
+    for (size_t p = manager->time_bucket_count; ok && p-- > 0 && found < latest->n;) {
+        const TimeBucket* bucket = &manager->time_buckets[p];
+        for (size_t i = bucket->count; i-- > 0 && found < latest->n;) {
+            if (!time_ref_dead(bucket, i)) {
+                refs[found++] = bucket->refs[i];
+            }
+        }
+    }
+    if (ok) {
+        memset(latest->owned, 0, found * sizeof(bool));
+    }
+
+    // Resident visits are looked up in place; the others are grouped by user, keyed by user ID
+    // and result position.
+    size_t spilled_count = 0;
+    for (size_t i = 0; ok && i < found; i++) {
+        UserVisits* user = NULL;
+        if (manager->user_count > 0) {
+            user = manager->user_index[user_index_slot(manager, refs[i].user_id)];
+        }
+        if (!user) {
+            spilled[spilled_count++] = (uint64_t)refs[i].user_id << 32 | i;
+            continue;
         }
+        size_t k            = visit_index(user, refs[i].visit_id, refs[i].timestamp_ns);
+        ok                  = k != SIZE_MAX;
+        latest->visits[i]   = ok ? user->visits[k] : NULL;
+        latest->user_ids[i] = refs[i].user_id;
+    }
+    qsort(spilled, spilled_count, sizeof(uint64_t), compare_keys);
 
-        user = create_user(user_id, manager->max_visits);
-        if (!user) {
-            return false;
+    for (size_t g = 0, end; ok && g < spilled_count; g = end) {
+        uint32_t user_id = (uint32_t)(spilled[g] >> 32);
+        for (end = g + 1; end < spilled_count && (uint32_t)(spilled[end] >> 32) == user_id;) {
+            end++;
         }
 
-        manager->users[manager->user_count++] = user;
-    }
+        SpillEntry* entry = find_spill_entry(manager, user_id);
+        UserVisits* user  = entry ? read_spilled_user(manager, entry) : NULL;
+        ok                = user != NULL;
 
-    // If visit already exists, ignore it.
-    for (size_t i = 0; i < user->visit_count; i++) {
-        if (user->visits[i]->visit_id == visit_id) {
-            fprintf(stderr, "A visit with ID: %u already exists\n", visit_id);
-            return true;  // No need to report failure
+        // Find all of the user's visits before taking any, as taking one leaves a hole.
+        for (size_t j = g; ok && j < end; j++) {
+            const TimedVisitRef* ref = &refs[(uint32_t)spilled[j]];
+            positions[j]             = visit_index(user, ref->visit_id, ref->timestamp_ns);
+            ok                       = positions[j] != SIZE_MAX;
         }
+        for (size_t j = g; ok && j < end; j++) {
+            take_latest_visit(latest, (uint32_t)spilled[j], user, positions[j]);
+        }
+        free_user_visits(manager, user);
     }
 
-    // Create new visit
-    Visit* visit = create_visit(visit_id, url, text);
-    if (!visit) {
-        return false;
+    // On failure, only the visits already taken are freed.
+    for (size_t i = 0; !ok && i < found; i++) {
+        if (latest->owned[i]) {
+            free_visit(manager, latest->visits[i]);
+        }
     }
+    latest->count = ok ? found : 0;
+    free(refs);
+    free(spilled);
+    free(positions);
+    return ok;
+}
 
-    // Check if we need to make room (remove oldest visit)
-    if (user->visit_count >= manager->max_visits) {
-        // Find the oldest visit (assuming visits are not necessarily in order)
-        size_t oldest_idx           = 0;
-        struct timespec oldest_time = user->visits[0]->time;
+// Helper function to merge the visits of a user read with read_spilled_user into the newest
+// visits found so far, keeping at most n. Both lists are newest first, so they are merged in
+// place from their oldest ends; the visits that place are taken from the user.
+static void merge_latest_user(VisitManager* manager, LatestVisits* latest, UserVisits* user) {
+    order_visits(user);
+    size_t a    = latest->count;
+    size_t b    = user->visit_count;
+    size_t kept = a + b < latest->n ? a + b : latest->n;
 
-        for (size_t i = 1; i < user->visit_count; i++) {
-            if (user->visits[i]->time.tv_sec < oldest_time.tv_sec ||
-                (user->visits[i]->time.tv_sec == oldest_time.tv_sec &&
-                 user->visits[i]->time.tv_nsec < oldest_time.tv_nsec)) {
-                oldest_idx  = i;
-                oldest_time = user->visits[i]->time;
-            }
+    // Drop the oldest visits beyond the n newest, preferring to keep those found earlier.
+    for (size_t drop = a + b - kept; drop > 0; drop--) {
+        if (a == 0 || (b > 0 && compare_visits(&user->visits[b - 1], &latest->visits[a - 1]) >= 0)) {
+            b--;
+        } else if (latest->owned[--a]) {
+            free_visit(manager, latest->visits[a]);
         }
+    }
 
-        // Free oldest visit
-        free_visit(user->visits[oldest_idx]);
-
-        // Move the last visit to the removed position if not removing the last one
-        if (oldest_idx < user->visit_count - 1) {
-            user->visits[oldest_idx] = user->visits[user->visit_count - 1];
+    for (size_t w = a + b; w-- > 0;) {
+        if (a == 0 || (b > 0 && compare_visits(&user->visits[b - 1], &latest->visits[a - 1]) >= 0)) {
+            take_latest_visit(latest, w, user, --b);
+        } else {
+            a--;
+            latest->visits[w]   = latest->visits[a];
+            latest->user_ids[w] = latest->user_ids[a];
+            latest->owned[w]    = latest->owned[a];
         }
+    }
+    latest->count = kept;
+}
+
+// Comparison function for qsort ordering spill entries by their newest visit, newest first
+static int compare_spill_newest(const void* a, const void* b) {
+    return compare_times(&(*(SpillEntry* const*)a)->newest, &(*(SpillEntry* const*)b)->newest);
+}
 
-        user->visit_count--;
+// Helper function to find the newest visits by merging the users' ordered visit lists. Resident
+// users are merged with a heap. Spilled users follow one at a time, newest first, and only while
+// their newest visit is newer than the oldest found so far.
+static bool latest_from_users(VisitManager* manager, LatestVisits* latest) {
+    VisitStream* streams = (VisitStream*)malloc((manager->user_count + 1) * sizeof(VisitStream));
+    SpillEntry** entries = (SpillEntry**)malloc((manager->spill_count + 1) * sizeof(SpillEntry*));
+    bool ok              = streams && entries;
+    size_t stream_count  = 0;
+    for (size_t i = 0; ok && i < manager->user_count; i++) {
+        add_stream(streams, &stream_count, manager->users[i]);
+    }
+    if (ok) {
+        latest->count = merge_streams(streams, stream_count, latest->n, latest->visits, latest->user_ids);
+        memset(latest->owned, 0, latest->count * sizeof(bool));
     }
 
-    // Check if we need to resize visits array
-    if (user->visit_count >= user->capacity) {
-        size_t new_capacity = user->capacity * 2;
-        if (new_capacity > manager->max_visits) {
-            new_capacity = manager->max_visits;
+    size_t entry_count = 0;
+    for (size_t i = 0; ok && i < manager->spill_index_capacity; i++) {
+        if (manager->spill_index[i].length) {
+            entries[entry_count++] = &manager->spill_index[i];
         }
-
-        Visit** new_visits = (Visit**)realloc(user->visits, new_capacity * sizeof(Visit*));
-        if (!new_visits) {
-            free_visit(visit);
-            return false;
+    }
+    if (ok) {
+        qsort(entries, entry_count, sizeof(SpillEntry*), compare_spill_newest);
+    }
+    for (size_t i = 0; ok && i < entry_count; i++) {
+        if (latest->count == latest->n &&
+            compare_times(&entries[i]->newest, &latest->visits[latest->n - 1]->time) >= 0) {
+            break;
         }
 
-        user->visits   = new_visits;
-        user->capacity = new_capacity;
+        UserVisits* user = read_spilled_user(manager, entries[i]);
+        ok               = user != NULL;
+        if (user) {
+            merge_latest_user(manager, latest, user);
+            free_user_visits(manager, user);
+        }
     }
 
-    // Add the new visit
-    user->visits[user->visit_count++] = visit;
-
-    // Serialize changes to disk
-    serialize_manager(manager);
-
-    return true;
+    free(streams);
+    free(entries);
+    return ok;
 }
 
-// Comparison function for qsort
-static int compare_visits(const void* a, const void* b) {
-    struct timespec* time1 = &(((Visit*)a)->time);
-    struct timespec* time2 = &(((Visit*)b)->time);
+bool VisitManagerGetLatestVisits(VisitManager* manager, size_t n, ExportedVisit* visits, char* strings,
+                                 size_t string_capacity, size_t* visit_count, size_t* string_bytes) {
+    if (!manager || !visit_count || !string_bytes || (n > 0 && !visits)) {
+        return false;
+    }
 
-    // Compare timestamps (newer first)
-    if (time1->tv_sec > time2->tv_sec) {
-        return -1;  // time1 is newer, so it should come first
-    } else if (time1->tv_sec < time2->tv_sec) {
-        return 1;  // time2 is newer, so it should come first
-    } else {
-        if (time1->tv_nsec > time2->tv_nsec) {
-            return -1;  // time1 is newer
-        } else if (time1->tv_nsec < time2->tv_nsec) {
-            return 1;  // time2 is newer
-        } else {
-            return 0;  // times are equal
-        }
+    *visit_count  = 0;
+    *string_bytes = 0;
+    if (n == 0) {
+        return true;
     }
-}
 
-// Function to sort the visits by time (newest first)
-void sort_visits(Visit* visits[], size_t visit_count) {
-    qsort(visits, visit_count, sizeof(Visit*), compare_visits);
-}
+    LatestVisits latest = {.n = n};
+    latest.visits       = (Visit**)malloc(n * sizeof(Visit*));
+    latest.user_ids     = (uint32_t*)malloc(n * sizeof(uint32_t));
+    latest.owned        = (bool*)malloc(n * sizeof(bool));
+    bool ok             = latest.visits && latest.user_ids && latest.owned;
+    if (ok) {
+        ok = manager->time_index ? latest_from_time_index(manager, &latest) : latest_from_users(manager, &latest);
+    }
 
-Visit** VisitManagerGetRecentVisits(VisitManager* manager, uint32_t user_id, size_t* count) {
-    if (!manager || !count) {
-        return NULL;
+    // Strings are copied for the merged visits only, and only if all of them fit.
+    size_t total_strings = 0;
+    for (size_t i = 0; ok && i < latest.count; i++) {
+        total_strings += visit_url_len(latest.visits[i]) + visit_text_len(latest.visits[i]);
+    }
+    if (ok) {
+        *visit_count  = latest.count;
+        *string_bytes = total_strings;
+        ok            = total_strings <= string_capacity && (total_strings == 0 || strings);
     }
 
-    // Find user
-    UserVisits* user = find_user(manager, user_id);
-    if (!user) {
-        *count = 0;
-        return NULL;
+    size_t offset = 0;
+    for (size_t i = 0; ok && i < latest.count; i++) {
+        export_visit(latest.user_ids[i], latest.visits[i], &visits[i], strings, &offset);
     }
 
-    // Sort visits by time (newest first)
-    sort_visits(user->visits, user->visit_count);
-    *count = user->visit_count;
-    return user->visits;
+    for (size_t i = 0; i < latest.count; i++) {
+        if (latest.owned[i]) {
+            free_visit(manager, latest.visits[i]);
+        }
+    }
+    free(latest.visits);
+    free(latest.user_ids);
+    free(latest.owned);
+    return ok;
 }
 
+static bool delete_visits(VisitManager* manager, uint32_t user_id, uint32_t* visitIds, size_t visit_count);
+
 bool VisitManagerDelete(VisitManager* manager, uint32_t user_id, uint32_t* visitIds, size_t visit_count) {
     if (!manager || !visitIds || visit_count == 0) {
         return false;
     }
 
+    STATS_BEGIN();
+    bool ok = delete_visits(manager, user_id, visitIds, visit_count);
+    STATS_END(manager, VISIT_MANAGER_OP_DELETE, ok);
+    return ok;
+}
+
+// Helper function implementing VisitManagerDelete
+static bool delete_visits(VisitManager* manager, uint32_t user_id, uint32_t* visitIds, size_t visit_count) {
     // Find user
     UserVisits* user = find_user(manager, user_id);
     if (!user) {
@@ -516,17 +5180,8 @@ bool VisitManagerDelete(VisitManager* manager, uint32_t user_id, uint32_t* visit
         // Find the visit with this ID
         for (size_t j = 0; j < user->visit_count; j++) {
             if (user->visits[j]->visit_id == id_to_delete) {
-                // Free the visit
-                free_visit(user->visits[j]);
-
-                // Replace with the last visit (unless this is the last one)
-                // Swap-and-pop strategy.
-                if (j < user->visit_count - 1) {
-                    user->visits[j] = user->visits[user->visit_count - 1];
-                    j--;  // Recheck this position since we moved a new visit here
-                }
-
-                user->visit_count--;
+                // Free the visit and close the gap
+                remove_visit_at(manager, user, j);
                 found_any = true;
                 break;
             }
@@ -534,6 +5189,13 @@ bool VisitManagerDelete(VisitManager* manager, uint32_t user_id, uint32_t* visit
     }
 
     if (found_any) {
+        // Reclaim the user or the unused part of its visit array.
+        if (user->visit_count == 0) {
+            drop_user(manager, user);
+        } else {
+            shrink_user(manager, user);
+        }
+
         // Serialize changes to disk
         serialize_manager(manager);
         return true;
@@ -542,25 +5204,477 @@ bool VisitManagerDelete(VisitManager* manager, uint32_t user_id, uint32_t* visit
     return false;
 }
 
+static size_t delete_where(VisitManager* manager, const VisitPredicate* predicate, bool* ok);
+
+size_t VisitManagerDeleteWhere(VisitManager* manager, const VisitPredicate* predicate) {
+    if (!manager || !predicate) {
+        return 0;
+    }
+
+    // A valid predicate that matches nothing is not a failure.
+    STATS_BEGIN();
+    bool ok        = false;
+    size_t removed = delete_where(manager, predicate, &ok);
+    STATS_END(manager, VISIT_MANAGER_OP_DELETE, ok);
+    return removed;
+}
+
+// Helper function to find the host of a URL: what follows the scheme and any user info, up to
+// the port, path, query or fragment. *len receives its length.
+static const char* url_host(const char* url, size_t* len) {
+    const char* p = url;
+    while ((ascii_lower(*p) >= 'a' && ascii_lower(*p) <= 'z') || (*p >= '0' && *p <= '9') || *p == '+' || *p == '-' ||
+           *p == '.') {
+        p++;
+    }
+    const char* host = p > url && strncmp(p, "://", 3) == 0 ? p + 3 : url;
+    size_t n         = strcspn(host, "/?#");
+
+    const char* at = (const char*)memchr(host, '@', n);
+    if (at) {
+        n   -= (size_t)(at + 1 - host);
+        host = at + 1;
+    }
+
+    // An IPv6 address keeps its brackets; otherwise a colon starts the port.
+    const char* end = (const char*)(host[0] == '[' ? memchr(host, ']', n) : memchr(host, ':', n));
+    if (end) {
+        n = (size_t)(end - host) + (host[0] == '[');
+    }
+    *len = n;
+    return host;
+}
+
+// Helper function to check whether a URL is on host or one of its subdomains, ignoring case
+static bool url_on_host(const char* url, const char* host, size_t host_len) {
+    size_t len;
+    const char* start = url_host(url, &len);
+    if (len < host_len || (len > host_len && start[len - host_len - 1] != '.')) {
+        return false;
+    }
+
+    start += len - host_len;
+    for (size_t i = 0; i < host_len; i++) {
+        if (ascii_lower(start[i]) != ascii_lower(host[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Comparison function for qsort and bsearch ordering visit or user IDs
+static int compare_visit_ids(const void* a, const void* b) {
+    uint32_t id1 = *(const uint32_t*)a;
+    uint32_t id2 = *(const uint32_t*)b;
+    return id1 < id2 ? -1 : id1 > id2;
+}
+
+// Helper function to check whether a visit matches every criterion of a predicate. ids holds
+// the predicate's visit IDs sorted, and host_len the length of its host.
+static bool visit_matches(const VisitPredicate* predicate, const uint32_t* ids, size_t host_len, const Visit* visit) {
+    if ((predicate->flags & VISIT_MANAGER_DELETE_BEFORE) && visit_time_ns(visit) >= predicate->before_ns) {
+        return false;
+    }
+    if ((predicate->flags & VISIT_MANAGER_DELETE_VISIT_IDS) &&
+        !bsearch(&visit->visit_id, ids, predicate->visit_id_count, sizeof(uint32_t), compare_visit_ids)) {
+        return false;
+    }
+    return !(predicate->flags & VISIT_MANAGER_DELETE_HOST) || url_on_host(visit->url, predicate->host, host_len);
+}
+
+// Helper function to make room for needed user IDs in a growing buffer. Returns false if out of memory.
+static bool reserve_user_ids(uint32_t** user_ids, size_t* capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity ? *capacity * 2 : 64;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    uint32_t* grown = (uint32_t*)realloc(*user_ids, new_capacity * sizeof(uint32_t));
+    if (!grown) {
+        return false;
+    }
+    *user_ids = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+// Helper function to gather the IDs of the users who may have visits matching a predicate, sorted
+// and without duplicates. The time index narrows them down to those with visits before before_ns,
+// and the reverse URL index to those who visited the host; without either, every user, spilled
+// ones included, is a candidate. Returns NULL if out of memory.
+static uint32_t* delete_candidates(VisitManager* manager, const VisitPredicate* predicate, size_t host_len,
+                                   size_t* count) {
+    uint32_t* user_ids = NULL;
+    size_t found       = 0;
+    size_t capacity    = 0;
+    bool ok            = reserve_user_ids(&user_ids, &capacity, 1);
+    if ((predicate->flags & VISIT_MANAGER_DELETE_BEFORE) && manager->time_index) {
+        int64_t last = time_bucket_key(predicate->before_ns);
+        for (size_t p = 0; p < manager->time_bucket_count && manager->time_buckets[p].key <= last && ok; p++) {
+            const TimeBucket* bucket = &manager->time_buckets[p];
+            for (size_t i = 0; i < bucket->count && bucket->refs[i].timestamp_ns < predicate->before_ns && ok; i++) {
+                if (!time_ref_dead(bucket, i) && (ok = reserve_user_ids(&user_ids, &capacity, found + 1))) {
+                    user_ids[found++] = bucket->refs[i].user_id;
+                }
+            }
+        }
+    } else if ((predicate->flags & VISIT_MANAGER_DELETE_HOST) && manager->reverse_url_index) {
+        for (size_t i = 0; i < manager->url_users_capacity && ok; i++) {
+            const UrlUsers* set = &manager->url_users[i];
+            if (set->containers && url_on_host(set->url, predicate->host, host_len) &&
+                (ok = reserve_user_ids(&user_ids, &capacity, found + set->user_count))) {
+                found += list_url_users(set, &user_ids[found], set->user_count);
+            }
+        }
+    } else if ((ok = reserve_user_ids(&user_ids, &capacity, manager->user_count + manager->spill_count))) {
+        for (size_t i = 0; i < manager->user_count; i++) {
+            user_ids[found++] = manager->users[i]->user_id;
+        }
+        for (size_t i = 0; i < manager->spill_index_capacity; i++) {
+            if (manager->spill_index[i].length) {
+                user_ids[found++] = manager->spill_index[i].user_id;
+            }
+        }
+    }
+    if (!ok) {
+        free(user_ids);
+        return NULL;
+    }
+
+    // A user found through several visits or URLs is swept once.
+    qsort(user_ids, found, sizeof(uint32_t), compare_visit_ids);
+    size_t unique = 0;
+    for (size_t i = 0; i < found; i++) {
+        if (unique == 0 || user_ids[i] != user_ids[unique - 1]) {
+            user_ids[unique++] = user_ids[i];
+        }
+    }
+    *count = unique;
+    return user_ids;
+}
+
+// *ok is set to false for an invalid predicate, when memory runs out or when the snapshot can not
+// be written.
+static size_t delete_where(VisitManager* manager, const VisitPredicate* predicate, bool* ok) {
+    *ok = false;
+    uint32_t flags = predicate->flags;
+    if (!(flags & (VISIT_MANAGER_DELETE_BEFORE | VISIT_MANAGER_DELETE_HOST | VISIT_MANAGER_DELETE_VISIT_IDS)) ||
+        ((flags & VISIT_MANAGER_DELETE_HOST) && (!predicate->host || !predicate->host[0])) ||
+        ((flags & VISIT_MANAGER_DELETE_VISIT_IDS) && (!predicate->visit_ids || predicate->visit_id_count == 0))) {
+        return 0;
+    }
+
+    // Sort a copy of the visit IDs, so that each visit costs a binary search.
+    uint32_t* ids = NULL;
+    if (flags & VISIT_MANAGER_DELETE_VISIT_IDS) {
+        ids = (uint32_t*)malloc(predicate->visit_id_count * sizeof(uint32_t));
+        if (!ids) {
+            return 0;
+        }
+        memcpy(ids, predicate->visit_ids, predicate->visit_id_count * sizeof(uint32_t));
+        qsort(ids, predicate->visit_id_count, sizeof(uint32_t), compare_visit_ids);
+    }
+    size_t host_len = flags & VISIT_MANAGER_DELETE_HOST ? strlen(predicate->host) : 0;
+
+    // Gather the users first, as deleting drops users.
+    size_t user_count;
+    uint32_t* user_ids = delete_candidates(manager, predicate, host_len, &user_count);
+    if (!user_ids) {
+        free(ids);
+        return 0;
+    }
+
+    // Spilled users are not loaded back: a record is read, and rewritten only when some of its
+    // visits match. No user moves in the LRU list, so the sweep needs no budget enforcement.
+    size_t removed = 0;
+    for (size_t i = 0; i < user_count; i++) {
+        SpillEntry* entry;
+        UserVisits* user = begin_user_edit(manager, user_ids[i], &entry);
+        if (!user) {
+            continue;
+        }
+
+        // Going from the end, a removal only moves visits that have already been checked.
+        size_t before = user->visit_count;
+        for (size_t j = user->visit_count; j-- > 0;) {
+            if (visit_matches(predicate, ids, host_len, user->visits[j])) {
+                remove_visit_at(manager, user, j);
+            }
+        }
+        removed += before - user->visit_count;
+        end_user_edit(manager, user, entry, before - user->visit_count);
+    }
+
+    *ok = removed == 0 || serialize_manager(manager);
+    free(user_ids);
+    free(ids);
+    return removed;
+}
+
+static bool clear_user(VisitManager* manager, uint32_t user_id);
+
 void VisitManagerClear(VisitManager* manager, uint32_t user_id) {
     if (!manager) {
         return;
     }
 
+    STATS_BEGIN();
+    bool ok = clear_user(manager, user_id);
+    STATS_END(manager, VISIT_MANAGER_OP_CLEAR, ok);
+}
+
+// Helper function implementing VisitManagerClear. Returns false, leaving the user and the indexes
+// as they were, if a spilled user whose visits are indexed can not be loaded back.
+static bool clear_user(VisitManager* manager, uint32_t user_id) {
     // Find user
-    UserVisits* user = find_user(manager, user_id);
+    UserVisits* user = NULL;
+    if (manager->text_index || manager->time_index || manager->reverse_url_index ||
+        !find_spill_entry(manager, user_id)) {
+        user = find_user(manager, user_id);
+    }
+
+    // A spilled user is dropped without loading it back, unless its visits must leave an index.
+    if (!user && find_spill_entry(manager, user_id)) {
+        if (manager->text_index || manager->time_index || manager->reverse_url_index) {
+            return false;
+        }
+        remove_spill_entry(manager, user_id);
+        maybe_compact_spill_file(manager);
+        serialize_manager(manager);
+        return true;
+    }
     if (!user) {
-        return;
+        return true;
     }
 
-    // Free all visits
+    // Free the user with all its visits
     for (size_t i = 0; i < user->visit_count; i++) {
-        free_visit(user->visits[i]);
+        index_text(manager, user_id, user->visits[i], false);
+        index_time(manager, user_id, user->visits[i], false);
+        index_url_user(manager, user_id, user->visits[i]->url, false);
     }
-
-    // Reset count
-    user->visit_count = 0;
+    drop_user(manager, user);
 
     // Serialize changes to disk
     serialize_manager(manager);
+    return true;
+}
+
+bool VisitManagerCompact(VisitManager* manager) {
+    if (!manager) {
+        return false;
+    }
+
+    // Drop users without visits and fit visit arrays to their visits. Walk backwards because
+    // dropping a user moves the last one into its slot.
+    for (size_t i = manager->user_count; i-- > 0;) {
+        UserVisits* user = manager->users[i];
+        if (user->visit_count == 0) {
+            drop_user(manager, user);
+            continue;
+        }
+        if (user->visits != user->inline_visits && user->capacity > user->visit_count &&
+            !resize_visits(manager, user, user->visit_count)) {
+            return false;
+        }
+        size_t url_capacity = index_capacity_for(user->visit_count);
+        if (user->url_index && url_capacity < user->url_index_capacity &&
+            !resize_url_index(manager, user, url_capacity)) {
+            return false;
+        }
+        if (user->prefix_index) {
+            account_user(manager, user, -1);
+            free(user->prefix_index);
+            user->prefix_index    = NULL;
+            user->prefix_count    = 0;
+            user->prefix_capacity = 0;
+            user->prefix_valid    = false;
+            account_user(manager, user, 1);
+        }
+        ScoreTable* scores = user->scores;
+        if (scores && (scores->heap_capacity > scores->count ||
+                       scores->position_capacity > index_capacity_for(scores->count))) {
+            account_user(manager, user, -1);
+            bool ok = resize_scores(scores, scores->count, index_capacity_for(scores->count));
+            account_user(manager, user, 1);
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+
+    // Fit the user array and hash indexes to the remaining users.
+    size_t user_capacity = manager->user_count > 10 ? manager->user_count : 10;
+    if (user_capacity < manager->user_capacity) {
+        UserVisits** users = (UserVisits**)realloc(manager->users, user_capacity * sizeof(UserVisits*));
+        if (!users) {
+            return false;
+        }
+        manager->users         = users;
+        manager->user_capacity = user_capacity;
+    }
+
+    size_t index_capacity = index_capacity_for(manager->user_count);
+    if (index_capacity < manager->user_index_capacity && !resize_user_index(manager, index_capacity)) {
+        return false;
+    }
+
+    index_capacity = index_capacity_for(manager->spill_count);
+    if (index_capacity < manager->spill_index_capacity && !resize_spill_index(manager, index_capacity)) {
+        return false;
+    }
+
+    // Merge the pending changes of the text index; merging fits the posting lists.
+    for (size_t i = manager->text_term_capacity; i-- > 0 && manager->text_index;) {
+        TextTerm* term = manager->text_terms[i];
+        if (term && term->pending && !merge_term(manager, term)) {
+            return false;
+        }
+    }
+
+    // Drop the dead references of the time index and fit its bucket array.
+    for (size_t i = 0; i < manager->time_bucket_count; i++) {
+        if (manager->time_buckets[i].dead_count > 0) {
+            compact_time_bucket(manager, &manager->time_buckets[i]);
+        }
+    }
+    if (manager->time_bucket_count < manager->time_bucket_capacity && manager->time_bucket_count > 0) {
+        TimeBucket* buckets =
+            (TimeBucket*)realloc(manager->time_buckets, manager->time_bucket_count * sizeof(TimeBucket));
+        if (!buckets) {
+            return false;
+        }
+        manager->time_buckets         = buckets;
+        manager->time_bucket_capacity = manager->time_bucket_count;
+    }
+
+    index_capacity = index_capacity_for(manager->url_users_count);
+    if (manager->url_users && index_capacity < manager->url_users_capacity &&
+        !resize_url_users(manager, index_capacity)) {
+        return false;
+    }
+
+    return compact_spill_file(manager);
+}
+
+bool VisitManagerGetStats(VisitManager* manager, VisitManagerStats* stats) {
+    if (!stats) {
+        return false;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+#ifdef VISIT_MANAGER_STATS
+    if (!manager) {
+        return false;
+    }
+
+    for (size_t i = 0; i < STATS_SHARDS; i++) {
+        StatsShard* shard = __atomic_load_n(&manager->stats[i], __ATOMIC_ACQUIRE);
+        if (!shard) {
+            continue;
+        }
+
+        for (size_t op = 0; op < VISIT_MANAGER_OP_COUNT; op++) {
+            const VisitManagerOpStats* src = &shard->ops[op];
+            VisitManagerOpStats* dst       = &stats->ops[op];
+
+            dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+            dst->failures += __atomic_load_n(&src->failures, __ATOMIC_RELAXED);
+            dst->total_ns += __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+
+            uint64_t max = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+            if (max > dst->max_ns) {
+                dst->max_ns = max;
+            }
+
+            for (size_t b = 0; b < VISIT_MANAGER_LATENCY_BUCKETS; b++) {
+                dst->latency_buckets[b] += __atomic_load_n(&src->latency_buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return true;
+#else
+    (void)manager;
+    return false;
+#endif
+}
+
+void VisitManagerResetStats(VisitManager* manager) {
+    if (!manager) {
+        return;
+    }
+
+#ifdef VISIT_MANAGER_STATS
+    // Zeroing races with concurrent recording, which may keep a few in-flight samples.
+    for (size_t i = 0; i < STATS_SHARDS; i++) {
+        StatsShard* shard = __atomic_load_n(&manager->stats[i], __ATOMIC_ACQUIRE);
+        if (shard) {
+            memset(shard, 0, sizeof(*shard));
+        }
+    }
+#endif
+}
+
+uint64_t VisitManagerStatsPercentile(const VisitManagerOpStats* stats, double percentile) {
+    if (!stats || stats->count == 0) {
+        return 0;
+    }
+
+    // Rank of the requested sample, counting from 1.
+    uint64_t total = 0;
+    for (size_t b = 0; b < VISIT_MANAGER_LATENCY_BUCKETS; b++) {
+        total += stats->latency_buckets[b];
+    }
+    double rank = percentile / 100.0 * (double)total;
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t b = 0; b < VISIT_MANAGER_LATENCY_BUCKETS; b++) {
+        seen += stats->latency_buckets[b];
+        if ((double)seen >= rank) {
+            // Upper bound of bucket b, the inverse of latency_bucket().
+            const size_t sub = (size_t)1 << STATS_SUB_BITS;
+            if (b < sub) {
+                return b;
+            }
+            unsigned shift = (unsigned)(b >> STATS_SUB_BITS) - 1;
+            uint64_t upper = (((uint64_t)(sub + (b & (sub - 1))) + 1) << shift) - 1;
+            return upper < stats->max_ns ? upper : stats->max_ns;
+        }
+    }
+    return stats->max_ns;
+}
+
+bool VisitManagerGetMemory(VisitManager* manager, VisitManagerMemory* memory) {
+    if (!manager || !memory) {
+        return false;
+    }
+
+    *memory = manager->memory;
+
+    memory->manager_bytes = sizeof(VisitManager) + strlen(manager->path) + 1 + strlen(manager->spill_path) + 1;
+#ifdef VISIT_MANAGER_STATS
+    for (size_t i = 0; i < STATS_SHARDS; i++) {
+        if (__atomic_load_n(&manager->stats[i], __ATOMIC_ACQUIRE)) {
+            memory->manager_bytes += sizeof(StatsShard);
+        }
+    }
+#endif
+    memory->user_table_bytes = manager->user_capacity * sizeof(UserVisits*) +
+                               manager->user_index_capacity * sizeof(UserVisits*) +
+                               manager->spill_index_capacity * sizeof(SpillEntry) +
+                               manager->intern_capacity * sizeof(InternedString*);
+    memory->text_index_bytes += manager->text_term_capacity * sizeof(TextTerm*);
+    memory->time_index_bytes += manager->time_bucket_capacity * sizeof(TimeBucket);
+    memory->reverse_url_index_bytes += manager->url_users_capacity * sizeof(UrlUsers);
+    memory->spilled_user_count = manager->spill_count;
+    memory->spill_file_bytes   = manager->spill_bytes;
+    memory->total_bytes      = memory->manager_bytes + memory->user_table_bytes + memory->user_bytes +
+                          memory->visit_array_bytes + memory->visit_bytes + memory->string_bytes +
+                          memory->text_index_bytes + memory->time_index_bytes + memory->reverse_url_index_bytes;
+    return true;
 }
@@ -2,6 +2,7 @@
 #ifndef RECENT_VISITS_H
 #define RECENT_VISITS_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -16,6 +17,125 @@ typedef struct {
     struct timespec time;  // Timestamp
 } Visit;
 
+// Fixed-size header of one visit in a packed buffer (see VisitManagerPackRecentVisits).
+// Offsets are relative to the start of the buffer; strings are not null-terminated.
+typedef struct {
+    uint32_t visit_id;     // The ID of the visit
+    uint32_t url_offset;   // Offset of the URL bytes
+    uint32_t url_len;      // Length of the URL in bytes
+    uint32_t text_offset;  // Offset of the text bytes
+    uint32_t text_len;     // Length of the text in bytes
+    uint32_t reserved;     // Always zero
+    int64_t tv_sec;        // Timestamp seconds
+    int64_t tv_nsec;       // Timestamp nanoseconds
+} PackedVisit;
+
+// One visit in a bulk export (see VisitManagerExport). The layout matches an aligned
+// NumPy structured dtype so rows can be written directly into a NumPy array.
+// Offsets index the strings buffer of the export; strings are not null-terminated.
+typedef struct {
+    uint32_t user_id;       // The user the visit belongs to
+    uint32_t visit_id;      // The ID of the visit
+    int64_t timestamp_ns;   // Nanoseconds since the Unix epoch
+    uint64_t url_offset;    // Offset of the URL bytes
+    uint64_t text_offset;   // Offset of the text bytes
+    uint32_t url_len;       // Length of the URL in bytes
+    uint32_t text_len;      // Length of the text in bytes
+} ExportedVisit;
+
+// One URL ranked by VisitManagerGetTopByScore
+typedef struct {
+    const char* url;       // Null-terminated string owned by the manager
+    uint32_t visit_count;  // Visits to the URL while it has been in the user's history
+    double score;          // Visits weighted by age: each counts 2^(-age / half_life)
+} ScoredUrl;
+
+// One visit matched by VisitManagerSearchTextAll
+typedef struct {
+    uint32_t user_id;   // The user the visit belongs to
+    uint32_t visit_id;  // The ID of the visit
+} VisitRef;
+
+// One visit matched by VisitManagerGetWindow
+typedef struct {
+    uint32_t user_id;      // The user the visit belongs to
+    uint32_t visit_id;     // The ID of the visit
+    int64_t timestamp_ns;  // Nanoseconds since the Unix epoch
+} TimedVisitRef;
+
+// Criteria of VisitManagerDeleteWhere, selected by flags
+#define VISIT_MANAGER_DELETE_BEFORE 1     // Visits with timestamp_ns < before_ns
+#define VISIT_MANAGER_DELETE_HOST 2       // Visits to host or one of its subdomains, ignoring case
+#define VISIT_MANAGER_DELETE_VISIT_IDS 4  // Visits whose ID is one of visit_ids
+
+// Which visits VisitManagerDeleteWhere removes: those matching every criterion in flags
+typedef struct {
+    uint32_t flags;             // VISIT_MANAGER_DELETE_* criteria to apply
+    int64_t before_ns;          // Nanoseconds since the Unix epoch
+    const char* host;           // Host name, without scheme or port
+    const uint32_t* visit_ids;  // Visit IDs, of any user
+    size_t visit_id_count;      // Number of visit_ids
+} VisitPredicate;
+
+// Operations timed by the built-in statistics (see VisitManagerGetStats).
+typedef enum {
+    VISIT_MANAGER_OP_ADD_VISIT,
+    VISIT_MANAGER_OP_GET_RECENT_VISITS,
+    VISIT_MANAGER_OP_DELETE,
+    VISIT_MANAGER_OP_CLEAR,
+    VISIT_MANAGER_OP_SERIALIZE,
+    VISIT_MANAGER_OP_COUNT,
+} VisitManagerOp;
+
+// Number of buckets in a latency histogram. Buckets are log-linear: every power of two
+// of nanoseconds is split into 8 linear sub-buckets (at most 12.5% relative error).
+#define VISIT_MANAGER_LATENCY_BUCKETS 288
+
+// Counters and latency histogram of one operation
+typedef struct {
+    uint64_t count;     // Number of calls
+    uint64_t failures;  // Calls that reported failure
+    uint64_t total_ns;  // Sum of call latencies
+    uint64_t max_ns;    // Slowest call
+    uint64_t latency_buckets[VISIT_MANAGER_LATENCY_BUCKETS];
+} VisitManagerOpStats;
+
+// Statistics of a VisitManager, indexed by VisitManagerOp
+typedef struct {
+    VisitManagerOpStats ops[VISIT_MANAGER_OP_COUNT];
+} VisitManagerStats;
+
+// Number of buckets in the per-user visit count histogram of VisitManagerMemory.
+// Bucket 0 counts users without visits, bucket i users with [2^(i-1), 2^i) visits.
+#define VISIT_MANAGER_COUNT_BUCKETS 33
+
+// Memory held by a VisitManager, by category. Sizes are requested bytes and do not
+// include allocator overhead.
+typedef struct {
+    size_t manager_bytes;            // Manager struct, path and statistics shards
+    size_t user_table_bytes;         // Array of user pointers and the user, spill and string hash tables
+    size_t user_bytes;               // Per-user headers, including their inline visit slots
+    size_t visit_array_bytes;        // Per-user visit pointer arrays (full capacity), URL, prefix and score indexes
+    size_t visit_bytes;              // Visit records, including short texts stored inline
+    size_t string_bytes;             // Interned strings and heap texts, including terminators
+    size_t text_index_bytes;         // Text index words, posting lists and hash table
+    size_t time_index_bytes;         // Time index buckets and their visit references
+    size_t reverse_url_index_bytes;  // Reverse URL index hash table and user sets
+    size_t total_bytes;              // Sum of the above
+
+    size_t user_count;      // Number of users
+    size_t visit_count;     // Number of visits across all users
+    size_t capacity_slack;  // Visit slots allocated but unused (capacity - visit_count)
+    size_t deleted_slack;   // Part of capacity_slack left behind by deleted, cleared or evicted visits
+    size_t spilled_user_count;  // Users written to the spill file (not in user_count)
+    size_t spill_file_bytes;    // Size of the spill file, including records not yet compacted away
+    size_t interned_strings;    // Distinct URLs (and titles, if interned) stored once each
+    size_t text_terms;          // Distinct words in the text index
+    size_t time_buckets;        // Non-empty minutes in the time index
+    size_t indexed_urls;        // URLs in the reverse URL index
+    size_t visit_count_histogram[VISIT_MANAGER_COUNT_BUCKETS];  // Users by visit count
+} VisitManagerMemory;
+
 // The visit manager tracks most recent visits per user.
 // It uses a map where the key is the user ID. (uint32_t) and value is a dynamic array
 // of visits.
@@ -24,22 +144,206 @@ typedef struct VisitManager VisitManager;
 
 // Create and initialize a VisitManager.
 // If path, exists deserialization is done to populate the state.
+// Snapshots store each distinct URL (and interned title) once in a string dictionary;
+// files written by older versions without the dictionary are still read.
 VisitManager* VisitManagerCreate(const char* path, size_t max_visits);
 
 // Free memory allocated by visit manager.
 void VisitManagerFree(VisitManager* manager);
 
-// Add a visit for a user
+// Add a visit for a user. A visit ID the user already has is ignored; finding it scans the
+// user's visits, so an add costs O(max_visits) before the manager is persisted.
 bool VisitManagerAddVisit(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url,
                           const char* text);
 
+// Add a visit for a user from length-delimited strings.
+// url and text need not be null-terminated and may be NULL when their length is 0.
+// The bytes are copied, so the caller may release them as soon as this returns.
+bool VisitManagerAddVisitN(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url,
+                           size_t url_len, const char* text, size_t text_len);
+
 // Get recent visits for a user. The manager owns the memory pointed to by visits.
+// With a memory budget set, the user may be spilled (and the array freed) by the next call.
 Visit** VisitManagerGetRecentVisits(VisitManager* manager, uint32_t user_id, size_t* count);
 
+// Pack the recent visits of n users into one buffer: the PackedVisit headers of every user, in the
+// order of user_ids and newest first within a user, followed by all string bytes. counts[i]
+// receives the number of visits of user_ids[i] (0 for unknown users). Returns the number of bytes
+// needed; buf is only written when that fits in buf_size. Spilled users are read from the spill
+// file without being loaded back.
+size_t VisitManagerGetRecentVisitsMulti(VisitManager* manager, const uint32_t* user_ids, size_t n, void* buf,
+                                        size_t buf_size, size_t* counts);
+
+// Find the user's URLs starting with prefix, for autocomplete. results receives up to limit
+// visits in URL order, the newest visit of each distinct URL. Returns the number written.
+// The URL-sorted index behind it is built on the first search after the user's visits change,
+// so repeated searches cost a binary search each. Pointers are valid as for
+// VisitManagerGetRecentVisits.
+size_t VisitManagerPrefixSearch(VisitManager* manager, uint32_t user_id, const char* prefix, size_t limit,
+                                Visit** results);
+
+// Fields and options of VisitManagerSearch
+#define VISIT_MANAGER_SEARCH_URL 1          // Search URLs
+#define VISIT_MANAGER_SEARCH_TEXT 2         // Search texts
+#define VISIT_MANAGER_SEARCH_IGNORE_CASE 4  // Compare ASCII letters case-insensitively
+
+// Find the user's visits whose URL or text contains the needle_len bytes at needle, with a
+// vectorized scan on CPUs with AVX2. needle need not be null-terminated and may be NULL when
+// needle_len is 0. flags selects the fields (both when neither is set) and case-insensitivity.
+// visit_ids receives up to limit IDs, newest first. Returns the number written.
+size_t VisitManagerSearch(VisitManager* manager, uint32_t user_id, const char* needle, size_t needle_len,
+                          uint32_t flags, size_t limit, uint32_t* visit_ids);
+
+// Pack the recent visits for a user (newest first) into buf as an array of PackedVisit headers
+// followed by the string bytes they reference. Returns the number of bytes needed; buf is only
+// written when that fits in buf_size, so callers can retry with a larger buffer.
+// *count receives the number of visits. Returns 0 if the user has no visits.
+size_t VisitManagerPackRecentVisits(VisitManager* manager, uint32_t user_id, void* buf, size_t buf_size,
+                                    size_t* count);
+
+// Pack the results of VisitManagerPrefixSearch into buf, laid out as for
+// VisitManagerPackRecentVisits. prefix is prefix_len bytes and need not be null-terminated.
+// *count receives the number of visits. Returns the number of bytes needed, or 0 if none match.
+size_t VisitManagerPackPrefixSearch(VisitManager* manager, uint32_t user_id, const char* prefix, size_t prefix_len,
+                                    size_t limit, void* buf, size_t buf_size, size_t* count);
+
+// Export the visits of the given users, or of all users when user_ids is NULL, into visits
+// and strings. Visits are grouped by user in the order given, newest first within a user.
+// *visit_count and *string_bytes receive the sizes needed. Returns false without writing
+// anything when either buffer is too small, so calling with zero capacities sizes the export.
+// Spilled users are read from the spill file and stay spilled; if one can not be read, the
+// export stops there and returns false.
+bool VisitManagerExport(VisitManager* manager, const uint32_t* user_ids, size_t user_count, ExportedVisit* visits,
+                        size_t visit_capacity, char* strings, size_t string_capacity, size_t* visit_count,
+                        size_t* string_bytes);
+
+// Export the n most recent visits across all users, newest first, in the layout of
+// VisitManagerExport; visits must have room for n rows. The time index answers this when it is
+// on. Otherwise the users' ordered visit lists are merged, and spilled users are read one at a
+// time, only while their newest visit could place.
+// *visit_count and *string_bytes receive the sizes needed. Returns false without writing
+// anything when strings is too small.
+bool VisitManagerGetLatestVisits(VisitManager* manager, size_t n, ExportedVisit* visits, char* strings,
+                                 size_t string_capacity, size_t* visit_count, size_t* string_bytes);
+
 // Delete visit IDs and re-serialize.
 bool VisitManagerDelete(VisitManager* manager, uint32_t user_id, uint32_t* visitIds, size_t visit_count);
 
-// Clear visits for a user
+// Delete the visits of all users, spilled ones included, that match predicate, and re-serialize
+// once. Returns the number of visits deleted; 0 when predicate selects no criterion.
+// Spilled users stay spilled: their records are read, and rewritten when visits match. With
+// VISIT_MANAGER_DELETE_BEFORE and the time index on, only users with visits before before_ns are
+// swept; otherwise, with VISIT_MANAGER_DELETE_HOST and the reverse URL index on, only the users of
+// the host's URLs. Without either, every user is swept in turn, which costs one spill file read
+// per spilled user and is O(total visits) however few match.
+size_t VisitManagerDeleteWhere(VisitManager* manager, const VisitPredicate* predicate);
+
+// Clear visits for a user. The user entry is removed along with its visits. A spilled user
+// that can not be read back while an index is on is left as it is, and the clear is counted as
+// failed in the stats.
 void VisitManagerClear(VisitManager* manager, uint32_t user_id);
 
+// Release memory held for future growth: remove users without visits, fit every visit array,
+// the user table and the hash indexes to their contents, and drop dead records from the spill
+// file. Delete and Clear already reclaim empty and sparse users; this also trims the rest.
+bool VisitManagerCompact(VisitManager* manager);
+
+// Read the operation counters and latency histograms of the manager.
+// Returns false (and zeroes stats) when the library was built without VISIT_MANAGER_STATS.
+bool VisitManagerGetStats(VisitManager* manager, VisitManagerStats* stats);
+
+// Reset all counters and histograms to zero.
+void VisitManagerResetStats(VisitManager* manager);
+
+// Latency in nanoseconds at the given percentile (0-100) of an operation's histogram.
+// The upper bound of the matching bucket is returned; 0 if there are no samples.
+uint64_t VisitManagerStatsPercentile(const VisitManagerOpStats* stats, double percentile);
+
+// Store the text of visits added from now on in the shared string table, like URLs. Worth it
+// when many visits share a title. Off by default.
+bool VisitManagerSetInternTitles(VisitManager* manager, bool intern_titles);
+
+// Keep at most one visit per URL for each user. In this mode, adding a visit to a URL the user
+// already has replaces that visit: the new ID, text and timestamp take its place at the front
+// of the user's history instead of pushing out another visit. Off by default.
+bool VisitManagerSetDedupUrls(VisitManager* manager, bool dedup_urls);
+
+// Keep a frecency score for every URL in each user's history: its visit count, with each visit
+// weighing half as much every half_life seconds. Scores follow a URL while it has visits in the
+// history, so revisits raise it even after older visits are evicted, and they are stored in
+// snapshots with the half-life. A half_life of 0 (the default) disables scoring; changing it
+// recomputes scores from the visits held.
+bool VisitManagerSetFrecencyHalfLife(VisitManager* manager, double half_life);
+
+// Fill results with up to k of the user's URLs with the highest frecency, best first, without
+// sorting the rest. Returns the number written; 0 if scoring is disabled. URL pointers are valid
+// until the next call that modifies the manager.
+size_t VisitManagerGetTopByScore(VisitManager* manager, uint32_t user_id, size_t k, ScoredUrl* results);
+
+// Keep an inverted index from the words of visit texts to the visits containing them, across
+// all users, for VisitManagerSearchText. Words are runs of ASCII letters, digits and non-ASCII
+// bytes, compared case-insensitively. Only the first 64 bytes of a word are kept, in the index
+// and in queries alike, so words sharing those 64 bytes match each other. The index follows
+// adds, deletes and evictions, and is stored in snapshots so loading does not rebuild it. Off by
+// default; turning it on indexes the visits held, and it is turned off again if memory runs out
+// while updating it.
+bool VisitManagerSetTextIndex(VisitManager* manager, bool text_index);
+
+// Find the user's visits whose text contains every word of query. Only the part of each word's
+// postings holding the user's visits is decoded. visit_ids receives up to limit IDs in
+// increasing order. Returns the number written; 0 if the text index is off.
+size_t VisitManagerSearchText(VisitManager* manager, uint32_t user_id, const char* query, size_t limit,
+                              uint32_t* visit_ids);
+
+// Like VisitManagerSearchText, across all users, ordered by user ID and then visit ID.
+size_t VisitManagerSearchTextAll(VisitManager* manager, const char* query, size_t limit, VisitRef* results);
+
+// Keep a reference to every visit of every user in buckets of one minute, so that
+// VisitManagerGetWindow costs in proportion to the visits it finds. The index follows eviction,
+// Delete and Clear; snapshots record the setting and the index is rebuilt on load.
+// Returns false if the index could not be built, in which case it stays off, or when turning it
+// off while a TTL is set.
+bool VisitManagerSetTimeIndex(VisitManager* manager, bool time_index);
+
+// Find the visits of all users with start_ns <= timestamp_ns < end_ns, oldest first. refs
+// receives up to capacity of them. Returns the number of visits in the window, which may
+// exceed capacity; 0 if the time index is off.
+size_t VisitManagerGetWindow(VisitManager* manager, int64_t start_ns, int64_t end_ns, TimedVisitRef* refs,
+                             size_t capacity);
+
+// Keep, for every URL, the set of users with a visit to it, so that VisitManagerUsersForUrl
+// needs no scan of the users. Sets are stored as in roaring bitmaps: per 65536 user IDs, a
+// sorted array of 16-bit values, or an 8 KiB bitmap when that is smaller. The index follows
+// eviction, Delete and Clear and includes spilled users; snapshots record the setting and the
+// index is rebuilt on load. Returns false if the index could not be built, in which case it
+// stays off.
+bool VisitManagerSetReverseUrlIndex(VisitManager* manager, bool reverse_url_index);
+
+// Find the users with a visit to url, in increasing order of ID. user_ids receives up to
+// capacity of them. Returns the number of users, which may exceed capacity; 0 if the reverse
+// URL index is off.
+size_t VisitManagerUsersForUrl(VisitManager* manager, const char* url, uint32_t* user_ids, size_t capacity);
+
+// Drop visits once they are older than ttl seconds (0, the default, keeps them until evicted).
+// Expired visits are found through the time index, which is turned on and kept on while a TTL
+// is set; returns false if it can not be built. Every AddVisit first drops a small batch of
+// expired visits, oldest first, and persists them with its own change. Snapshots store the TTL.
+bool VisitManagerSetTTL(VisitManager* manager, double ttl);
+
+// Drop up to limit visits older than the TTL (all of them when limit is 0), oldest first, and
+// persist once. Returns the number dropped. The cost is proportional to that number.
+size_t VisitManagerExpire(VisitManager* manager, size_t limit);
+
+// Limit the bytes of per-user data (user headers, visit arrays, visits and strings) held in
+// memory. When the budget is exceeded, the least recently accessed users are written to a
+// spill file at path + ".spill" and freed; they are loaded back transparently on their next
+// access. The most recently accessed user always stays in memory. Snapshots still contain
+// every user, and the spill file is removed by VisitManagerFree. A budget of 0 (the default)
+// disables spilling. Returns false if users could not be spilled to meet the budget.
+bool VisitManagerSetMemoryBudget(VisitManager* manager, size_t budget);
+
+// Report the memory held by the manager. The counters are maintained incrementally,
+// so this is O(1) and cheap enough to call from a monitoring loop.
+bool VisitManagerGetMemory(VisitManager* manager, VisitManagerMemory* memory);
+
 #endif /* RECENT_VISITS_H */
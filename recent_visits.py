@@ -1,8 +1,16 @@
 from ctypes import *
 import os
+import struct
 from datetime import datetime, timezone
 from dataclasses import dataclass
-from typing import List
+from typing import List, NamedTuple, Optional, Sequence, Tuple
+
+# Prefer the compiled CFFI API-mode module (built with `make python`) and
+# fall back to ctypes when it is not available.
+try:
+    from _recent_visits_cffi import ffi, lib as clib
+except ImportError:
+    ffi = clib = None
 
 # Load the shared library
 lib_path = os.path.join(os.path.dirname(__file__), 'librv.so')
@@ -49,6 +57,86 @@ class Visit:
         cvisit.time.tv_nsec = int((ts - int(ts)) * 1e9)
         return cvisit
 
+# Operations timed by the built-in statistics, in VisitManagerOp order.
+STATS_OPS = ("add_visit", "get_recent_visits", "delete", "clear", "serialize")
+LATENCY_BUCKETS = 288
+
+# Flags of VisitManager.search, as in recent_visits.h.
+SEARCH_URL = 1
+SEARCH_TEXT = 2
+SEARCH_IGNORE_CASE = 4
+
+# Criteria of VisitManagerDeleteWhere, as in recent_visits.h.
+DELETE_BEFORE = 1
+DELETE_HOST = 2
+DELETE_VISIT_IDS = 4
+
+
+class COpStats(Structure):
+    _fields_ = [
+        ("count", c_uint64),
+        ("failures", c_uint64),
+        ("total_ns", c_uint64),
+        ("max_ns", c_uint64),
+        ("latency_buckets", c_uint64 * LATENCY_BUCKETS),
+    ]
+
+
+class CStats(Structure):
+    _fields_ = [("ops", COpStats * len(STATS_OPS))]
+
+
+COUNT_BUCKETS = 33
+
+
+class CMemory(Structure):
+    _fields_ = [
+        ("manager_bytes", c_size_t),
+        ("user_table_bytes", c_size_t),
+        ("user_bytes", c_size_t),
+        ("visit_array_bytes", c_size_t),
+        ("visit_bytes", c_size_t),
+        ("string_bytes", c_size_t),
+        ("text_index_bytes", c_size_t),
+        ("time_index_bytes", c_size_t),
+        ("reverse_url_index_bytes", c_size_t),
+        ("total_bytes", c_size_t),
+        ("user_count", c_size_t),
+        ("visit_count", c_size_t),
+        ("capacity_slack", c_size_t),
+        ("deleted_slack", c_size_t),
+        ("spilled_user_count", c_size_t),
+        ("spill_file_bytes", c_size_t),
+        ("interned_strings", c_size_t),
+        ("text_terms", c_size_t),
+        ("time_buckets", c_size_t),
+        ("indexed_urls", c_size_t),
+        ("visit_count_histogram", c_size_t * COUNT_BUCKETS),
+    ]
+
+
+class CScoredUrl(Structure):
+    _fields_ = [("url", c_char_p), ("visit_count", c_uint32), ("score", c_double)]
+
+
+class CVisitRef(Structure):
+    _fields_ = [("user_id", c_uint32), ("visit_id", c_uint32)]
+
+
+class CTimedVisitRef(Structure):
+    _fields_ = [("user_id", c_uint32), ("visit_id", c_uint32), ("timestamp_ns", c_int64)]
+
+
+class CVisitPredicate(Structure):
+    _fields_ = [
+        ("flags", c_uint32),
+        ("before_ns", c_int64),
+        ("host", c_char_p),
+        ("visit_ids", POINTER(c_uint32)),
+        ("visit_id_count", c_size_t),
+    ]
+
+
 # Function prototypes from the C API
 lib.VisitManagerCreate.restype = c_void_p
 lib.VisitManagerCreate.argtypes = [c_char_p, c_size_t]
@@ -60,6 +148,11 @@ lib.VisitManagerAddVisit.argtypes = [
 ]
 lib.VisitManagerAddVisit.restype = c_bool
 
+lib.VisitManagerAddVisitN.argtypes = [
+    c_void_p, c_uint32, c_uint32, c_char_p, c_size_t, c_char_p, c_size_t
+]
+lib.VisitManagerAddVisitN.restype = c_bool
+
 lib.VisitManagerGetRecentVisits.restype = POINTER(POINTER(CVisit))
 lib.VisitManagerGetRecentVisits.argtypes = [c_void_p, c_uint32, POINTER(c_size_t)]
 
@@ -68,32 +161,268 @@ lib.VisitManagerDelete.restype = c_bool
 
 lib.VisitManagerClear.argtypes = [c_void_p, c_uint32]
 
-class VisitManager:
-    def __init__(self, path: str, max_visits: int=10):
-        self._path = path.encode('utf-8')
-        self._max_visits = max_visits
-        self._ptr = lib.VisitManagerCreate(self._path, self._max_visits)
-        if not self._ptr:
-            raise RuntimeError("Failed to create VisitManager")
+lib.VisitManagerGetRecentVisitsMulti.argtypes = [
+    c_void_p, POINTER(c_uint32), c_size_t, c_void_p, c_size_t, POINTER(c_size_t)
+]
+lib.VisitManagerGetRecentVisitsMulti.restype = c_size_t
+
+lib.VisitManagerPrefixSearch.argtypes = [c_void_p, c_uint32, c_char_p, c_size_t, POINTER(POINTER(CVisit))]
+lib.VisitManagerPrefixSearch.restype = c_size_t
+
+lib.VisitManagerSearch.argtypes = [c_void_p, c_uint32, c_char_p, c_size_t, c_uint32, c_size_t, POINTER(c_uint32)]
+lib.VisitManagerSearch.restype = c_size_t
+
+lib.VisitManagerExport.argtypes = [
+    c_void_p, c_void_p, c_size_t, c_void_p, c_size_t, c_void_p, c_size_t, POINTER(c_size_t), POINTER(c_size_t)
+]
+lib.VisitManagerExport.restype = c_bool
+
+lib.VisitManagerGetLatestVisits.argtypes = [
+    c_void_p, c_size_t, c_void_p, c_void_p, c_size_t, POINTER(c_size_t), POINTER(c_size_t)
+]
+lib.VisitManagerGetLatestVisits.restype = c_bool
+
+lib.VisitManagerGetStats.argtypes = [c_void_p, POINTER(CStats)]
+lib.VisitManagerGetStats.restype = c_bool
+
+lib.VisitManagerResetStats.argtypes = [c_void_p]
+
+lib.VisitManagerStatsPercentile.argtypes = [POINTER(COpStats), c_double]
+lib.VisitManagerStatsPercentile.restype = c_uint64
 
+lib.VisitManagerCompact.argtypes = [c_void_p]
+lib.VisitManagerCompact.restype = c_bool
+
+lib.VisitManagerSetInternTitles.argtypes = [c_void_p, c_bool]
+lib.VisitManagerSetInternTitles.restype = c_bool
+
+lib.VisitManagerSetDedupUrls.argtypes = [c_void_p, c_bool]
+lib.VisitManagerSetDedupUrls.restype = c_bool
+
+lib.VisitManagerSetFrecencyHalfLife.argtypes = [c_void_p, c_double]
+lib.VisitManagerSetFrecencyHalfLife.restype = c_bool
+
+lib.VisitManagerSetTTL.argtypes = [c_void_p, c_double]
+lib.VisitManagerSetTTL.restype = c_bool
+
+lib.VisitManagerExpire.argtypes = [c_void_p, c_size_t]
+lib.VisitManagerExpire.restype = c_size_t
+
+lib.VisitManagerDeleteWhere.argtypes = [c_void_p, POINTER(CVisitPredicate)]
+lib.VisitManagerDeleteWhere.restype = c_size_t
+
+lib.VisitManagerGetTopByScore.argtypes = [c_void_p, c_uint32, c_size_t, POINTER(CScoredUrl)]
+lib.VisitManagerGetTopByScore.restype = c_size_t
+
+lib.VisitManagerSetTextIndex.argtypes = [c_void_p, c_bool]
+lib.VisitManagerSetTextIndex.restype = c_bool
+
+lib.VisitManagerSearchText.argtypes = [c_void_p, c_uint32, c_char_p, c_size_t, POINTER(c_uint32)]
+lib.VisitManagerSearchText.restype = c_size_t
+
+lib.VisitManagerSearchTextAll.argtypes = [c_void_p, c_char_p, c_size_t, POINTER(CVisitRef)]
+lib.VisitManagerSearchTextAll.restype = c_size_t
+
+lib.VisitManagerSetTimeIndex.argtypes = [c_void_p, c_bool]
+lib.VisitManagerSetTimeIndex.restype = c_bool
+
+lib.VisitManagerGetWindow.argtypes = [c_void_p, c_int64, c_int64, POINTER(CTimedVisitRef), c_size_t]
+lib.VisitManagerGetWindow.restype = c_size_t
+
+lib.VisitManagerSetReverseUrlIndex.argtypes = [c_void_p, c_bool]
+lib.VisitManagerSetReverseUrlIndex.restype = c_bool
+
+lib.VisitManagerUsersForUrl.argtypes = [c_void_p, c_char_p, POINTER(c_uint32), c_size_t]
+lib.VisitManagerUsersForUrl.restype = c_size_t
+
+lib.VisitManagerSetMemoryBudget.argtypes = [c_void_p, c_size_t]
+lib.VisitManagerSetMemoryBudget.restype = c_bool
+
+lib.VisitManagerGetMemory.argtypes = [c_void_p, POINTER(CMemory)]
+lib.VisitManagerGetMemory.restype = c_bool
+
+# Layout of PackedVisit, see recent_visits.h.
+_PACKED_VISIT = struct.Struct("=IIIIIIqq")
+
+
+def export_dtype():
+    """NumPy structured dtype matching ExportedVisit in recent_visits.h."""
+    import numpy as np
+    return np.dtype([
+        ("user_id", np.uint32),
+        ("visit_id", np.uint32),
+        ("timestamp_ns", np.int64),
+        ("url_offset", np.uint64),
+        ("text_offset", np.uint64),
+        ("url_len", np.uint32),
+        ("text_len", np.uint32),
+    ], align=True)
+
+
+class VisitExport(NamedTuple):
+    """Result of VisitManager.export_visits.
+
+    `visits` is a structured array (see export_dtype) whose url/text offsets
+    and lengths index `strings`, a uint8 array holding all string bytes.
+    """
+    visits: "numpy.ndarray"
+    strings: "numpy.ndarray"
+
+
+class ScoredUrl(NamedTuple):
+    """One URL ranked by VisitManager.get_top_by_score."""
+    url: str
+    visit_count: int
+    score: float
+
+
+def _op_stats(op, percentile) -> dict:
+    return {
+        "count": op.count,
+        "failures": op.failures,
+        "total_ns": op.total_ns,
+        "max_ns": op.max_ns,
+        "p50_ns": percentile(op, 50),
+        "p99_ns": percentile(op, 99),
+        "p999_ns": percentile(op, 99.9),
+    }
+
+
+class _VisitManagerBase:
     def __enter__(self):
         return self
 
     def __exit__(self, exc_type, exc_val, exc_tb):
         self.close()
 
+    def get_stats(self) -> Optional[dict]:
+        """Return per-operation counters and latency percentiles keyed by operation name.
+
+        Returns None when the C library was built without VISIT_MANAGER_STATS.
+        """
+        stats = self._get_stats()
+        if stats is None:
+            return None
+        return {name: _op_stats(stats.ops[i], self._percentile) for i, name in enumerate(STATS_OPS)}
+
+    def get_memory(self) -> dict:
+        """Return the memory held by the manager by category, plus occupancy counters.
+
+        `visit_count_histogram[i]` counts users with [2**(i-1), 2**i) visits
+        (index 0: users without visits).
+        """
+        memory = self._get_memory()
+        result = {name: getattr(memory, name) for name, _ in CMemory._fields_}
+        result["visit_count_histogram"] = list(memory.visit_count_histogram)
+        return result
+
+    def get_top_by_score(self, user_id: int, k: int) -> List[ScoredUrl]:
+        """Return up to k of the user's URLs with the highest frecency, best first.
+
+        Empty unless a half-life was set with set_frecency_half_life.
+        """
+        return [ScoredUrl(url.decode('utf-8'), count, score) for url, count, score in self._top_by_score(user_id, k)]
+
+    def get_recent_visits_multi(self, user_ids: Sequence[int]) -> List[List[Visit]]:
+        """Recent visits of several users, in the order given, fetched with one C call."""
+        data, counts = self._pack_multi(user_ids)
+        utc = timezone.utc
+        fromtimestamp = datetime.fromtimestamp
+        headers = _PACKED_VISIT.iter_unpack(data[:sum(counts) * _PACKED_VISIT.size])
+        return [
+            [
+                Visit(
+                    visit_id,
+                    data[url_off:url_off + url_len].decode('utf-8'),
+                    data[text_off:text_off + text_len].decode('utf-8'),
+                    fromtimestamp(sec + nsec / 1e9, tz=utc),
+                )
+                for visit_id, url_off, url_len, text_off, text_len, _, sec, nsec
+                in (next(headers) for _ in range(count))
+            ]
+            for count in counts
+        ]
+
+    def export_visits(self, user_ids: Optional[Sequence[int]] = None) -> VisitExport:
+        """Export visits of the given users (all users when None) into NumPy arrays.
+
+        The arrays are filled directly by the C library; no per-visit Python
+        objects are created.
+        """
+        import numpy as np
+
+        ids = None if user_ids is None else np.ascontiguousarray(user_ids, dtype=np.uint32)
+        visits = np.empty(0, dtype=export_dtype())
+        strings = np.empty(0, dtype=np.uint8)
+        while True:
+            ok, visit_count, string_bytes = self._export(ids, visits, strings)
+            if ok:
+                return VisitExport(visits[:visit_count], strings[:string_bytes])
+            visits = np.empty(visit_count, dtype=visits.dtype)
+            strings = np.empty(string_bytes, dtype=np.uint8)
+
+    def delete_where(self, before_ns: Optional[int] = None, host: Optional[str] = None,
+                     visit_ids: Optional[Sequence[int]] = None) -> int:
+        """Delete the visits of all users matching every criterion given, persisting once.
+
+        `before_ns` selects visits older than it, `host` visits to that host or
+        its subdomains (ignoring case) and `visit_ids` visits with one of those
+        IDs. Returns the number of visits deleted; 0 when no criterion is given.
+        """
+        flags = 0
+        if before_ns is not None:
+            flags |= DELETE_BEFORE
+        if host:
+            flags |= DELETE_HOST
+        if visit_ids:
+            flags |= DELETE_VISIT_IDS
+        if not flags:
+            return 0
+        return self._delete_where(flags, before_ns or 0, host.encode('utf-8') if host else None, list(visit_ids or ()))
+
+    def get_latest_visits(self, n: int) -> VisitExport:
+        """Export the n most recent visits across all users, newest first.
+
+        The result has the layout of export_visits, but only the strings of
+        the returned visits are copied.
+        """
+        import numpy as np
+
+        visits = np.empty(n, dtype=export_dtype())
+        strings = np.empty(0, dtype=np.uint8)
+        while True:
+            ok, visit_count, string_bytes = self._latest(visits, strings)
+            if ok:
+                return VisitExport(visits[:visit_count], strings[:string_bytes])
+            if string_bytes <= len(strings):
+                raise RuntimeError("Failed to merge the latest visits")
+            strings = np.empty(string_bytes, dtype=np.uint8)
+
+
+class CtypesVisitManager(_VisitManagerBase):
+    def __init__(self, path: str, max_visits: int=10):
+        self._path = path.encode('utf-8')
+        self._max_visits = max_visits
+        self._ptr = lib.VisitManagerCreate(self._path, self._max_visits)
+        if not self._ptr:
+            raise RuntimeError("Failed to create VisitManager")
+
     def close(self):
         if getattr(self, '_ptr', None):
             lib.VisitManagerFree(self._ptr)
             self._ptr = None
 
     def add_visit(self, user_id: int, visit_id: int, url: str, text: str) -> bool:
-        return lib.VisitManagerAddVisit(
+        url_b = url.encode('utf-8')
+        text_b = text.encode('utf-8')
+        return lib.VisitManagerAddVisitN(
             self._ptr,
             c_uint32(user_id),
             c_uint32(visit_id),
-            url.encode('utf-8'),
-            text.encode('utf-8')
+            url_b,
+            c_size_t(len(url_b)),
+            text_b,
+            c_size_t(len(text_b))
         )
 
     def get_recent_visits(self, user_id: int) -> List[Visit]:
@@ -111,6 +440,46 @@ class VisitManager:
             visits.append(Visit.from_cvisit(visit_ptr.contents))
         return visits
     
+    def prefix_search(self, user_id: int, prefix: str, limit: int) -> List[Visit]:
+        """Newest visit of each of the user's URLs starting with `prefix`, in URL order."""
+        results = (POINTER(CVisit) * limit)()
+        n = lib.VisitManagerPrefixSearch(self._ptr, user_id, prefix.encode('utf-8'), limit, results)
+        return [Visit.from_cvisit(results[i].contents) for i in range(n)]
+
+    def search(self, user_id: int, needle: str, flags: int = 0, limit: int = 100) -> List[int]:
+        """IDs of the user's visits whose URL or title contains `needle`, newest first (see SEARCH_*)."""
+        ids = (c_uint32 * limit)()
+        data = needle.encode('utf-8')
+        n = lib.VisitManagerSearch(self._ptr, user_id, data, len(data), flags, limit, ids)
+        return ids[:n]
+
+    def search_text(self, user_id: int, query: str, limit: int) -> List[int]:
+        """IDs of the user's visits whose title contains every word of `query`, in increasing order."""
+        ids = (c_uint32 * limit)()
+        n = lib.VisitManagerSearchText(self._ptr, user_id, query.encode('utf-8'), limit, ids)
+        return ids[:n]
+
+    def search_text_all(self, query: str, limit: int) -> List[Tuple[int, int]]:
+        """(user_id, visit_id) of visits of any user whose title contains every word of `query`."""
+        refs = (CVisitRef * limit)()
+        n = lib.VisitManagerSearchTextAll(self._ptr, query.encode('utf-8'), limit, refs)
+        return [(r.user_id, r.visit_id) for r in refs[:n]]
+
+    def get_window(self, start_ns: int, end_ns: int) -> List[Tuple[int, int, int]]:
+        """(user_id, visit_id, timestamp_ns) of all users' visits in [start_ns, end_ns), oldest first."""
+        n = lib.VisitManagerGetWindow(self._ptr, start_ns, end_ns, None, 0)
+        refs = (CTimedVisitRef * n)()
+        n = lib.VisitManagerGetWindow(self._ptr, start_ns, end_ns, refs, n)
+        return [(r.user_id, r.visit_id, r.timestamp_ns) for r in refs[:n]]
+
+    def users_for_url(self, url: str) -> List[int]:
+        """IDs of the users with a visit to `url`, in increasing order; needs set_reverse_url_index."""
+        url = url.encode('utf-8')
+        n = lib.VisitManagerUsersForUrl(self._ptr, url, None, 0)
+        ids = (c_uint32 * n)()
+        n = lib.VisitManagerUsersForUrl(self._ptr, url, ids, n)
+        return ids[:n]
+
     def delete_visits(self, user_id: int, visit_ids: List[int]) -> bool:
         if not visit_ids:
             return True
@@ -120,6 +489,317 @@ class VisitManager:
     def clear_user(self, user_id: int):
         lib.VisitManagerClear(self._ptr, c_uint32(user_id))
 
+    def reset_stats(self):
+        lib.VisitManagerResetStats(self._ptr)
+
+    def set_intern_titles(self, intern: bool) -> bool:
+        """Store titles of visits added from now on once per distinct title, like URLs."""
+        return lib.VisitManagerSetInternTitles(self._ptr, intern)
+
+    def set_dedup_urls(self, dedup: bool) -> bool:
+        """Keep one visit per URL per user; a revisit replaces the earlier visit."""
+        return lib.VisitManagerSetDedupUrls(self._ptr, dedup)
+
+    def set_frecency_half_life(self, half_life: float) -> bool:
+        """Score URLs by visits weighted 2**(-age / half_life) seconds (0 disables)."""
+        return lib.VisitManagerSetFrecencyHalfLife(self._ptr, half_life)
+
+    def set_ttl(self, ttl: float) -> bool:
+        """Drop visits older than `ttl` seconds (0 disables); each add drops a batch of them."""
+        return lib.VisitManagerSetTTL(self._ptr, ttl)
+
+    def expire(self, limit: int = 0) -> int:
+        """Drop up to `limit` expired visits (all when 0), oldest first; returns how many."""
+        return lib.VisitManagerExpire(self._ptr, limit)
+
+    def set_text_index(self, enabled: bool) -> bool:
+        """Index the words of visit titles across users for search_text; stored with the snapshot."""
+        return lib.VisitManagerSetTextIndex(self._ptr, enabled)
+
+    def set_time_index(self, enabled: bool) -> bool:
+        """Index every visit by minute for get_window; rebuilt when the snapshot is loaded."""
+        return lib.VisitManagerSetTimeIndex(self._ptr, enabled)
+
+    def set_reverse_url_index(self, enabled: bool) -> bool:
+        """Keep the users of every URL for users_for_url; rebuilt when the snapshot is loaded."""
+        return lib.VisitManagerSetReverseUrlIndex(self._ptr, enabled)
+
+    def set_memory_budget(self, budget: int) -> bool:
+        """Spill least recently used users to disk beyond `budget` bytes (0 disables)."""
+        return lib.VisitManagerSetMemoryBudget(self._ptr, budget)
+
+    def compact(self) -> bool:
+        """Release memory kept for growth: empty users, unused capacity and dead spill records."""
+        return lib.VisitManagerCompact(self._ptr)
+
+    def _get_memory(self):
+        memory = CMemory()
+        lib.VisitManagerGetMemory(self._ptr, byref(memory))
+        return memory
+
+    def _get_stats(self):
+        stats = CStats()
+        return stats if lib.VisitManagerGetStats(self._ptr, byref(stats)) else None
+
+    @staticmethod
+    def _percentile(op, p):
+        return lib.VisitManagerStatsPercentile(byref(op), p)
+
+    def _pack_multi(self, user_ids):
+        ids = (c_uint32 * len(user_ids))(*user_ids)
+        counts = (c_size_t * len(user_ids))()
+        needed = lib.VisitManagerGetRecentVisitsMulti(self._ptr, ids, len(user_ids), None, 0, counts)
+        buf = create_string_buffer(needed)
+        needed = lib.VisitManagerGetRecentVisitsMulti(self._ptr, ids, len(user_ids), buf, needed, counts)
+        return buf.raw[:needed], list(counts)
+
+    def _top_by_score(self, user_id, k):
+        results = (CScoredUrl * k)()
+        n = lib.VisitManagerGetTopByScore(self._ptr, user_id, k, results)
+        return [(r.url, r.visit_count, r.score) for r in results[:n]]
+
+    def _export(self, ids, visits, strings):
+        visit_count = c_size_t(0)
+        string_bytes = c_size_t(0)
+        ok = lib.VisitManagerExport(
+            self._ptr,
+            ids.ctypes.data if ids is not None else None,
+            len(ids) if ids is not None else 0,
+            visits.ctypes.data, len(visits),
+            strings.ctypes.data, len(strings),
+            byref(visit_count), byref(string_bytes)
+        )
+        return ok, visit_count.value, string_bytes.value
+
+    def _latest(self, visits, strings):
+        visit_count = c_size_t(0)
+        string_bytes = c_size_t(0)
+        ok = lib.VisitManagerGetLatestVisits(
+            self._ptr, len(visits), visits.ctypes.data, strings.ctypes.data, len(strings),
+            byref(visit_count), byref(string_bytes)
+        )
+        return ok, visit_count.value, string_bytes.value
+
+    def _delete_where(self, flags, before_ns, host, visit_ids):
+        ids = (c_uint32 * len(visit_ids))(*visit_ids)
+        predicate = CVisitPredicate(flags, before_ns, host, ids, len(visit_ids))
+        return lib.VisitManagerDeleteWhere(self._ptr, byref(predicate))
+
+
+class CffiVisitManager(_VisitManagerBase):
+    """VisitManager backed by the compiled `_recent_visits_cffi` module.
+
+    Arguments are converted natively by CFFI, and recent visits are fetched
+    with one packed call and decoded with `struct` instead of per-field
+    ctypes access.
+    """
+
+    def __init__(self, path: str, max_visits: int=10):
+        if clib is None:
+            raise RuntimeError("_recent_visits_cffi is not built; run `make python`")
+        self._ptr = clib.VisitManagerCreate(path.encode('utf-8'), max_visits)
+        if self._ptr == ffi.NULL:
+            raise RuntimeError("Failed to create VisitManager")
+        self._count = ffi.new("size_t*")
+        self._set_buffer(4096)
+
+    def _set_buffer(self, size: int):
+        self._buf = bytearray(size)
+        self._cbuf = ffi.from_buffer(self._buf)
+
+    def close(self):
+        if getattr(self, '_ptr', None):
+            clib.VisitManagerFree(self._ptr)
+            self._ptr = None
+
+    def add_visit(self, user_id: int, visit_id: int, url: str, text: str) -> bool:
+        url_b = url.encode('utf-8')
+        text_b = text.encode('utf-8')
+        return clib.VisitManagerAddVisitN(self._ptr, user_id, visit_id, url_b, len(url_b), text_b, len(text_b))
+
+    def get_recent_visits(self, user_id: int) -> List[Visit]:
+        count = self._count
+        while True:
+            needed = clib.VisitManagerPackRecentVisits(self._ptr, user_id, self._cbuf, len(self._buf), count)
+            if count[0] == 0:
+                return []
+            if needed <= len(self._buf):
+                break
+            self._set_buffer(needed + needed // 2)
+
+        data = bytes(self._buf[:needed])
+        utc = timezone.utc
+        fromtimestamp = datetime.fromtimestamp
+        return [
+            Visit(
+                visit_id,
+                data[url_off:url_off + url_len].decode('utf-8'),
+                data[text_off:text_off + text_len].decode('utf-8'),
+                fromtimestamp(sec + nsec / 1e9, tz=utc),
+            )
+            for visit_id, url_off, url_len, text_off, text_len, _, sec, nsec
+            in _PACKED_VISIT.iter_unpack(data[:count[0] * _PACKED_VISIT.size])
+        ]
+
+    def prefix_search(self, user_id: int, prefix: str, limit: int) -> List[Visit]:
+        """Newest visit of each of the user's URLs starting with `prefix`, in URL order."""
+        results = ffi.new("Visit*[]", limit)
+        n = clib.VisitManagerPrefixSearch(self._ptr, user_id, prefix.encode('utf-8'), limit, results)
+        utc = timezone.utc
+        return [
+            Visit(
+                v.visit_id,
+                ffi.string(v.url).decode('utf-8'),
+                ffi.string(v.text).decode('utf-8'),
+                datetime.fromtimestamp(v.time.tv_sec + v.time.tv_nsec / 1e9, tz=utc),
+            )
+            for v in results[0:n]
+        ]
+
+    def search(self, user_id: int, needle: str, flags: int = 0, limit: int = 100) -> List[int]:
+        """IDs of the user's visits whose URL or title contains `needle`, newest first (see SEARCH_*)."""
+        ids = ffi.new("uint32_t[]", limit)
+        data = needle.encode('utf-8')
+        n = clib.VisitManagerSearch(self._ptr, user_id, data, len(data), flags, limit, ids)
+        return list(ids[0:n])
+
+    def search_text(self, user_id: int, query: str, limit: int) -> List[int]:
+        """IDs of the user's visits whose title contains every word of `query`, in increasing order."""
+        ids = ffi.new("uint32_t[]", limit)
+        n = clib.VisitManagerSearchText(self._ptr, user_id, query.encode('utf-8'), limit, ids)
+        return list(ids[0:n])
+
+    def search_text_all(self, query: str, limit: int) -> List[Tuple[int, int]]:
+        """(user_id, visit_id) of visits of any user whose title contains every word of `query`."""
+        refs = ffi.new("VisitRef[]", limit)
+        n = clib.VisitManagerSearchTextAll(self._ptr, query.encode('utf-8'), limit, refs)
+        return [(r.user_id, r.visit_id) for r in refs[0:n]]
+
+    def get_window(self, start_ns: int, end_ns: int) -> List[Tuple[int, int, int]]:
+        """(user_id, visit_id, timestamp_ns) of all users' visits in [start_ns, end_ns), oldest first."""
+        n = clib.VisitManagerGetWindow(self._ptr, start_ns, end_ns, ffi.NULL, 0)
+        refs = ffi.new("TimedVisitRef[]", n)
+        n = clib.VisitManagerGetWindow(self._ptr, start_ns, end_ns, refs, n)
+        return [(r.user_id, r.visit_id, r.timestamp_ns) for r in refs[0:n]]
+
+    def users_for_url(self, url: str) -> List[int]:
+        """IDs of the users with a visit to `url`, in increasing order; needs set_reverse_url_index."""
+        url = url.encode('utf-8')
+        n = clib.VisitManagerUsersForUrl(self._ptr, url, ffi.NULL, 0)
+        ids = ffi.new("uint32_t[]", n)
+        n = clib.VisitManagerUsersForUrl(self._ptr, url, ids, n)
+        return list(ids[0:n])
+
+    def delete_visits(self, user_id: int, visit_ids: List[int]) -> bool:
+        if not visit_ids:
+            return True
+        return clib.VisitManagerDelete(self._ptr, user_id, visit_ids, len(visit_ids))
+
+    def clear_user(self, user_id: int):
+        clib.VisitManagerClear(self._ptr, user_id)
+
+    def reset_stats(self):
+        clib.VisitManagerResetStats(self._ptr)
+
+    def set_intern_titles(self, intern: bool) -> bool:
+        """Store titles of visits added from now on once per distinct title, like URLs."""
+        return bool(clib.VisitManagerSetInternTitles(self._ptr, intern))
+
+    def set_dedup_urls(self, dedup: bool) -> bool:
+        """Keep one visit per URL per user; a revisit replaces the earlier visit."""
+        return bool(clib.VisitManagerSetDedupUrls(self._ptr, dedup))
+
+    def set_frecency_half_life(self, half_life: float) -> bool:
+        """Score URLs by visits weighted 2**(-age / half_life) seconds (0 disables)."""
+        return bool(clib.VisitManagerSetFrecencyHalfLife(self._ptr, half_life))
+
+    def set_ttl(self, ttl: float) -> bool:
+        """Drop visits older than `ttl` seconds (0 disables); each add drops a batch of them."""
+        return bool(clib.VisitManagerSetTTL(self._ptr, ttl))
+
+    def expire(self, limit: int = 0) -> int:
+        """Drop up to `limit` expired visits (all when 0), oldest first; returns how many."""
+        return clib.VisitManagerExpire(self._ptr, limit)
+
+    def set_text_index(self, enabled: bool) -> bool:
+        """Index the words of visit titles across users for search_text; stored with the snapshot."""
+        return bool(clib.VisitManagerSetTextIndex(self._ptr, enabled))
+
+    def set_time_index(self, enabled: bool) -> bool:
+        """Index every visit by minute for get_window; rebuilt when the snapshot is loaded."""
+        return bool(clib.VisitManagerSetTimeIndex(self._ptr, enabled))
+
+    def set_reverse_url_index(self, enabled: bool) -> bool:
+        """Keep the users of every URL for users_for_url; rebuilt when the snapshot is loaded."""
+        return bool(clib.VisitManagerSetReverseUrlIndex(self._ptr, enabled))
+
+    def set_memory_budget(self, budget: int) -> bool:
+        """Spill least recently used users to disk beyond `budget` bytes (0 disables)."""
+        return bool(clib.VisitManagerSetMemoryBudget(self._ptr, budget))
+
+    def compact(self) -> bool:
+        """Release memory kept for growth: empty users, unused capacity and dead spill records."""
+        return bool(clib.VisitManagerCompact(self._ptr))
+
+    def _get_memory(self):
+        memory = ffi.new("VisitManagerMemory*")
+        clib.VisitManagerGetMemory(self._ptr, memory)
+        return memory
+
+    def _get_stats(self):
+        stats = ffi.new("VisitManagerStats*")
+        return stats if clib.VisitManagerGetStats(self._ptr, stats) else None
+
+    @staticmethod
+    def _percentile(op, p):
+        return clib.VisitManagerStatsPercentile(ffi.addressof(op), p)
+
+    def _pack_multi(self, user_ids):
+        counts = ffi.new("size_t[]", len(user_ids))
+        while True:
+            needed = clib.VisitManagerGetRecentVisitsMulti(
+                self._ptr, list(user_ids), len(user_ids), self._cbuf, len(self._buf), counts
+            )
+            if needed <= len(self._buf):
+                return bytes(self._buf[:needed]), list(counts)
+            self._set_buffer(needed + needed // 2)
+
+    def _top_by_score(self, user_id, k):
+        results = ffi.new("ScoredUrl[]", k)
+        n = clib.VisitManagerGetTopByScore(self._ptr, user_id, k, results)
+        return [(ffi.string(r.url), r.visit_count, r.score) for r in results[0:n]]
+
+    def _export(self, ids, visits, strings):
+        sizes = ffi.new("size_t[2]")
+        ok = clib.VisitManagerExport(
+            self._ptr,
+            ffi.from_buffer("uint32_t[]", ids) if ids is not None else ffi.NULL,
+            len(ids) if ids is not None else 0,
+            ffi.from_buffer("ExportedVisit[]", visits, require_writable=True), len(visits),
+            ffi.from_buffer(strings, require_writable=True), len(strings),
+            sizes, sizes + 1
+        )
+        return ok, sizes[0], sizes[1]
+
+    def _latest(self, visits, strings):
+        sizes = ffi.new("size_t[2]")
+        ok = clib.VisitManagerGetLatestVisits(
+            self._ptr, len(visits),
+            ffi.from_buffer("ExportedVisit[]", visits, require_writable=True),
+            ffi.from_buffer(strings, require_writable=True), len(strings),
+            sizes, sizes + 1
+        )
+        return ok, sizes[0], sizes[1]
+
+    def _delete_where(self, flags, before_ns, host, visit_ids):
+        host = ffi.new("char[]", host) if host else ffi.NULL
+        ids = ffi.new("uint32_t[]", visit_ids)
+        predicate = ffi.new("VisitPredicate*", (flags, before_ns, host, ids, len(visit_ids)))
+        return clib.VisitManagerDeleteWhere(self._ptr, predicate)
+
+
+VisitManager = CffiVisitManager if clib is not None else CtypesVisitManager
+
 
 if __name__ == "__main__":
     import sys
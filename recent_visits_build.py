@@ -0,0 +1,197 @@
+"""Build the CFFI API-mode extension module for recent_visits.py.
+
+Run via `make python`. The module `_recent_visits_cffi` links against
+librv.so and is loaded from the same directory; recent_visits.py falls back
+to ctypes when it has not been built.
+"""
+import glob
+import os
+import shutil
+
+from cffi import FFI
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+# Generated sources live outside the package directory so that cgo does not
+# pick them up when building the Go binding.
+BUILD_DIR = os.path.join(HERE, "_cffi_build")
+
+ffibuilder = FFI()
+
+ffibuilder.cdef(
+    """
+    struct timespec { long tv_sec; long tv_nsec; ...; };
+
+    typedef struct {
+        uint32_t visit_id;
+        char* url;
+        char* text;
+        struct timespec time;
+        ...;
+    } Visit;
+
+    typedef struct {
+        uint32_t visit_id;
+        uint32_t url_offset;
+        uint32_t url_len;
+        uint32_t text_offset;
+        uint32_t text_len;
+        uint32_t reserved;
+        int64_t tv_sec;
+        int64_t tv_nsec;
+        ...;
+    } PackedVisit;
+
+    typedef struct {
+        uint32_t user_id;
+        uint32_t visit_id;
+        int64_t timestamp_ns;
+        uint64_t url_offset;
+        uint64_t text_offset;
+        uint32_t url_len;
+        uint32_t text_len;
+        ...;
+    } ExportedVisit;
+
+    typedef struct {
+        const char* url;
+        uint32_t visit_count;
+        double score;
+        ...;
+    } ScoredUrl;
+
+    typedef struct {
+        uint32_t user_id;
+        uint32_t visit_id;
+        ...;
+    } VisitRef;
+
+    typedef struct {
+        uint32_t user_id;
+        uint32_t visit_id;
+        int64_t timestamp_ns;
+        ...;
+    } TimedVisitRef;
+
+    #define VISIT_MANAGER_DELETE_BEFORE ...
+    #define VISIT_MANAGER_DELETE_HOST ...
+    #define VISIT_MANAGER_DELETE_VISIT_IDS ...
+
+    typedef struct {
+        uint32_t flags;
+        int64_t before_ns;
+        const char* host;
+        const uint32_t* visit_ids;
+        size_t visit_id_count;
+        ...;
+    } VisitPredicate;
+
+    #define VISIT_MANAGER_LATENCY_BUCKETS ...
+    #define VISIT_MANAGER_OP_COUNT ...
+
+    typedef struct {
+        uint64_t count;
+        uint64_t failures;
+        uint64_t total_ns;
+        uint64_t max_ns;
+        uint64_t latency_buckets[...];
+        ...;
+    } VisitManagerOpStats;
+
+    typedef struct {
+        VisitManagerOpStats ops[...];
+        ...;
+    } VisitManagerStats;
+
+    #define VISIT_MANAGER_COUNT_BUCKETS ...
+
+    typedef struct {
+        size_t manager_bytes;
+        size_t user_table_bytes;
+        size_t user_bytes;
+        size_t visit_array_bytes;
+        size_t visit_bytes;
+        size_t string_bytes;
+        size_t text_index_bytes;
+        size_t time_index_bytes;
+        size_t reverse_url_index_bytes;
+        size_t total_bytes;
+        size_t user_count;
+        size_t visit_count;
+        size_t capacity_slack;
+        size_t deleted_slack;
+        size_t spilled_user_count;
+        size_t spill_file_bytes;
+        size_t interned_strings;
+        size_t text_terms;
+        size_t time_buckets;
+        size_t indexed_urls;
+        size_t visit_count_histogram[...];
+        ...;
+    } VisitManagerMemory;
+
+    typedef struct VisitManager VisitManager;
+
+    VisitManager* VisitManagerCreate(const char* path, size_t max_visits);
+    void VisitManagerFree(VisitManager* manager);
+    bool VisitManagerAddVisit(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url,
+                              const char* text);
+    bool VisitManagerAddVisitN(VisitManager* manager, uint32_t user_id, uint32_t visit_id, const char* url,
+                               size_t url_len, const char* text, size_t text_len);
+    Visit** VisitManagerGetRecentVisits(VisitManager* manager, uint32_t user_id, size_t* count);
+    size_t VisitManagerPackRecentVisits(VisitManager* manager, uint32_t user_id, void* buf, size_t buf_size,
+                                        size_t* count);
+    size_t VisitManagerPackPrefixSearch(VisitManager* manager, uint32_t user_id, const char* prefix,
+                                        size_t prefix_len, size_t limit, void* buf, size_t buf_size, size_t* count);
+    bool VisitManagerExport(VisitManager* manager, const uint32_t* user_ids, size_t user_count,
+                            ExportedVisit* visits, size_t visit_capacity, char* strings, size_t string_capacity,
+                            size_t* visit_count, size_t* string_bytes);
+    bool VisitManagerGetLatestVisits(VisitManager* manager, size_t n, ExportedVisit* visits, char* strings,
+                                     size_t string_capacity, size_t* visit_count, size_t* string_bytes);
+    bool VisitManagerDelete(VisitManager* manager, uint32_t user_id, uint32_t* visitIds, size_t visit_count);
+    size_t VisitManagerDeleteWhere(VisitManager* manager, const VisitPredicate* predicate);
+    void VisitManagerClear(VisitManager* manager, uint32_t user_id);
+    size_t VisitManagerSearch(VisitManager* manager, uint32_t user_id, const char* needle, size_t needle_len,
+                              uint32_t flags, size_t limit, uint32_t* visit_ids);
+    size_t VisitManagerGetRecentVisitsMulti(VisitManager* manager, const uint32_t* user_ids, size_t n, void* buf,
+                                            size_t buf_size, size_t* counts);
+    size_t VisitManagerPrefixSearch(VisitManager* manager, uint32_t user_id, const char* prefix, size_t limit,
+                                    Visit** results);
+    bool VisitManagerGetStats(VisitManager* manager, VisitManagerStats* stats);
+    void VisitManagerResetStats(VisitManager* manager);
+    uint64_t VisitManagerStatsPercentile(const VisitManagerOpStats* stats, double percentile);
+    bool VisitManagerCompact(VisitManager* manager);
+    bool VisitManagerSetInternTitles(VisitManager* manager, bool intern_titles);
+    bool VisitManagerSetDedupUrls(VisitManager* manager, bool dedup_urls);
+    bool VisitManagerSetFrecencyHalfLife(VisitManager* manager, double half_life);
+    bool VisitManagerSetTTL(VisitManager* manager, double ttl);
+    size_t VisitManagerExpire(VisitManager* manager, size_t limit);
+    size_t VisitManagerGetTopByScore(VisitManager* manager, uint32_t user_id, size_t k, ScoredUrl* results);
+    bool VisitManagerSetTextIndex(VisitManager* manager, bool text_index);
+    size_t VisitManagerSearchText(VisitManager* manager, uint32_t user_id, const char* query, size_t limit,
+                                  uint32_t* visit_ids);
+    size_t VisitManagerSearchTextAll(VisitManager* manager, const char* query, size_t limit, VisitRef* results);
+    bool VisitManagerSetTimeIndex(VisitManager* manager, bool time_index);
+    size_t VisitManagerGetWindow(VisitManager* manager, int64_t start_ns, int64_t end_ns, TimedVisitRef* refs,
+                                 size_t capacity);
+    bool VisitManagerSetReverseUrlIndex(VisitManager* manager, bool reverse_url_index);
+    size_t VisitManagerUsersForUrl(VisitManager* manager, const char* url, uint32_t* user_ids, size_t capacity);
+    bool VisitManagerSetMemoryBudget(VisitManager* manager, size_t budget);
+    bool VisitManagerGetMemory(VisitManager* manager, VisitManagerMemory* memory);
+    """
+)
+
+ffibuilder.set_source(
+    "_recent_visits_cffi",
+    '#include "recent_visits.h"',
+    include_dirs=[HERE],
+    library_dirs=[HERE],
+    libraries=["rv"],
+    # Find librv.so next to the extension module at runtime.
+    extra_link_args=["-Wl,-rpath,$ORIGIN"],
+)
+
+if __name__ == "__main__":
+    ffibuilder.compile(tmpdir=BUILD_DIR)
+    for module in glob.glob(os.path.join(BUILD_DIR, "_recent_visits_cffi*.so")):
+        shutil.copy(module, HERE)
@@ -0,0 +1,10 @@
+//go:build rvstats
+
+// stats.go
+// Building with -tags rvstats compiles the C library with VISIT_MANAGER_STATS,
+// so that Stats reports operation counters and latency histograms. Without the
+// tag the library skips the timing on every call.
+package cffi
+
+// #cgo CFLAGS: -DVISIT_MANAGER_STATS
+import "C"
@@ -0,0 +1,26 @@
+//go:build rvstats
+
+package cffi
+
+import "testing"
+
+func TestStats(t *testing.T) {
+	vm := newTestManager(t, 10)
+	vm.GetRecentVisits(1)
+
+	stats, ok := vm.Stats()
+	if !ok {
+		t.Fatal("Stats not available with the rvstats tag")
+	}
+	if got := stats.Ops[OpAddVisit].Count; got != 10 {
+		t.Errorf("AddVisit count = %d, want 10", got)
+	}
+	if got := stats.Ops[OpGetRecentVisits].Count; got == 0 {
+		t.Error("GetRecentVisits was not counted")
+	}
+
+	vm.ResetStats()
+	if stats, _ = vm.Stats(); stats.Ops[OpAddVisit].Count != 0 {
+		t.Errorf("AddVisit count after ResetStats = %d, want 0", stats.Ops[OpAddVisit].Count)
+	}
+}
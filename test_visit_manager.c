@@ -253,7 +253,1503 @@ void test_nonexistent_user(const char* test_file) {
     printf("Nonexistent user test completed.\n");
 }
 
+// Test adding visits from length-delimited strings
+void test_add_visit_n(const char* test_file) {
+    printf("\n=== LENGTH-DELIMITED ADD TEST ===\n");
+
+    // Create manager
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 5);
+    assert(manager != NULL);
+
+    // Only the first url_len / text_len bytes must be stored.
+    const char url[]  = "https://example.com/lengthXXXX";
+    const char text[] = "Length 1YYYY";
+    printf("Adding visit from non-terminated slices...\n");
+    assert(VisitManagerAddVisitN(manager, 7, 701, url, strlen(url) - 4, text, strlen(text) - 4));
+
+    // Empty strings may be passed as NULL with a zero length.
+    assert(VisitManagerAddVisitN(manager, 7, 702, NULL, 0, NULL, 0));
+    assert(!VisitManagerAddVisitN(manager, 7, 703, NULL, 1, "x", 1));
+
+    size_t count;
+    Visit** visits = VisitManagerGetRecentVisits(manager, 7, &count);
+    assert(count == 2);
+    for (size_t i = 0; i < count; i++) {
+        if (visits[i]->visit_id == 701) {
+            assert(strcmp(visits[i]->url, "https://example.com/length") == 0);
+            assert(strcmp(visits[i]->text, "Length 1") == 0);
+        } else {
+            assert(visits[i]->url[0] == '\0' && visits[i]->text[0] == '\0');
+        }
+    }
+    print_user_visits(manager, 7);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Length-delimited add test completed.\n");
+}
+
+// Test packing recent visits into a single buffer
+void test_pack_recent_visits(const char* test_file) {
+    printf("\n=== PACKED VISITS TEST ===\n");
+
+    // Create manager
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 5);
+    assert(manager != NULL);
+
+    printf("Adding visits for user 8...\n");
+    assert(VisitManagerAddVisit(manager, 8, 801, "https://example.com/pack1", "Pack 1"));
+    assert(VisitManagerAddVisit(manager, 8, 802, "https://example.com/pack2", "Pack 2"));
+
+    // A too-small buffer reports the size needed without writing.
+    size_t count;
+    size_t needed = VisitManagerPackRecentVisits(manager, 8, NULL, 0, &count);
+    assert(count == 2);
+    assert(needed == 2 * sizeof(PackedVisit) + 2 * (strlen("https://example.com/pack1") + strlen("Pack 1")));
+
+    char* buf = malloc(needed);
+    assert(buf != NULL);
+    assert(VisitManagerPackRecentVisits(manager, 8, buf, needed, &count) == needed);
+
+    // Packed entries match the visits returned by VisitManagerGetRecentVisits.
+    size_t visit_count;
+    Visit** visits = VisitManagerGetRecentVisits(manager, 8, &visit_count);
+    assert(visit_count == count);
+    for (size_t i = 0; i < count; i++) {
+        PackedVisit entry;
+        memcpy(&entry, buf + i * sizeof(PackedVisit), sizeof(entry));
+        printf("  Packed visit %u: %.*s (%.*s)\n", entry.visit_id, (int)entry.url_len, buf + entry.url_offset,
+               (int)entry.text_len, buf + entry.text_offset);
+        assert(entry.visit_id == visits[i]->visit_id);
+        assert(entry.url_len == strlen(visits[i]->url));
+        assert(memcmp(buf + entry.url_offset, visits[i]->url, entry.url_len) == 0);
+        assert(memcmp(buf + entry.text_offset, visits[i]->text, entry.text_len) == 0);
+        assert(entry.tv_sec == visits[i]->time.tv_sec && entry.tv_nsec == visits[i]->time.tv_nsec);
+    }
+    free(buf);
+
+    // Unknown users pack to nothing.
+    assert(VisitManagerPackRecentVisits(manager, 999, NULL, 0, &count) == 0 && count == 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Packed visits test completed.\n");
+}
+
+// Test bulk export of visits for several users
+void test_export(const char* test_file) {
+    printf("\n=== EXPORT TEST ===\n");
+
+    // Create manager
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 5);
+    assert(manager != NULL);
+
+    printf("Adding visits for users 9 and 10...\n");
+    assert(VisitManagerAddVisit(manager, 9, 901, "https://example.com/export1", "Export 1"));
+    assert(VisitManagerAddVisit(manager, 9, 902, "https://example.com/export2", "Export 2"));
+    assert(VisitManagerAddVisit(manager, 10, 1001, "https://example.org/export", "Export org"));
+
+    // Size the export for both users plus an unknown one.
+    uint32_t users[] = {10, 999, 9};
+    size_t visit_count, string_bytes;
+    assert(!VisitManagerExport(manager, users, 3, NULL, 0, NULL, 0, &visit_count, &string_bytes));
+    assert(visit_count == 3);
+
+    ExportedVisit* visits = malloc(visit_count * sizeof(ExportedVisit));
+    char* strings         = malloc(string_bytes);
+    assert(visits && strings);
+    assert(VisitManagerExport(manager, users, 3, visits, visit_count, strings, string_bytes, &visit_count,
+                              &string_bytes));
+
+    // Users come in the requested order, newest visit first.
+    assert(visits[0].user_id == 10 && visits[0].visit_id == 1001);
+    assert(visits[1].user_id == 9 && visits[1].visit_id == 902);
+    assert(visits[2].user_id == 9 && visits[2].visit_id == 901);
+    assert(visits[1].timestamp_ns >= visits[2].timestamp_ns);
+    for (size_t i = 0; i < visit_count; i++) {
+        printf("  User %u visit %u: %.*s (%.*s) at %lld\n", visits[i].user_id, visits[i].visit_id,
+               (int)visits[i].url_len, strings + visits[i].url_offset, (int)visits[i].text_len,
+               strings + visits[i].text_offset, (long long)visits[i].timestamp_ns);
+    }
+    assert(memcmp(strings + visits[0].url_offset, "https://example.org/export", visits[0].url_len) == 0);
+    assert(memcmp(strings + visits[2].text_offset, "Export 1", visits[2].text_len) == 0);
+    free(visits);
+    free(strings);
+
+    // Exporting all users covers at least the visits added here.
+    assert(!VisitManagerExport(manager, NULL, 0, NULL, 0, NULL, 0, &visit_count, &string_bytes));
+    assert(visit_count >= 3);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Export test completed.\n");
+}
+
+// Test operation counters and latency histograms
+void test_stats(const char* test_file) {
+    printf("\n=== STATS TEST ===\n");
+
+    // Create manager
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 5);
+    assert(manager != NULL);
+    VisitManagerResetStats(manager);
+
+    assert(VisitManagerAddVisit(manager, 11, 1101, "https://example.com/stats1", "Stats 1"));
+    assert(VisitManagerAddVisit(manager, 11, 1102, "https://example.com/stats2", "Stats 2"));
+    size_t count;
+    VisitManagerGetRecentVisits(manager, 11, &count);
+    uint32_t missing[] = {999};
+    assert(!VisitManagerDelete(manager, 11, missing, 1));
+    VisitManagerClear(manager, 11);
+
+    VisitManagerStats stats;
+    if (!VisitManagerGetStats(manager, &stats)) {
+        printf("Library built without VISIT_MANAGER_STATS, skipping.\n");
+        VisitManagerFree(manager);
+        return;
+    }
+
+    const char* names[] = {"add_visit", "get_recent_visits", "delete", "clear", "serialize"};
+    for (size_t op = 0; op < VISIT_MANAGER_OP_COUNT; op++) {
+        const VisitManagerOpStats* s = &stats.ops[op];
+        printf("  %-18s count=%llu failures=%llu p50=%lluns p99=%lluns max=%lluns\n", names[op],
+               (unsigned long long)s->count, (unsigned long long)s->failures,
+               (unsigned long long)VisitManagerStatsPercentile(s, 50),
+               (unsigned long long)VisitManagerStatsPercentile(s, 99), (unsigned long long)s->max_ns);
+    }
+
+    assert(stats.ops[VISIT_MANAGER_OP_ADD_VISIT].count == 2);
+    assert(stats.ops[VISIT_MANAGER_OP_GET_RECENT_VISITS].count == 1);
+    assert(stats.ops[VISIT_MANAGER_OP_DELETE].count == 1);
+    assert(stats.ops[VISIT_MANAGER_OP_DELETE].failures == 1);
+    assert(stats.ops[VISIT_MANAGER_OP_CLEAR].count == 1);
+    // Two adds and the clear persisted the manager.
+    assert(stats.ops[VISIT_MANAGER_OP_SERIALIZE].count == 3);
+
+    const VisitManagerOpStats* add = &stats.ops[VISIT_MANAGER_OP_ADD_VISIT];
+    assert(VisitManagerStatsPercentile(add, 100) <= add->max_ns);
+    assert(VisitManagerStatsPercentile(add, 50) > 0);
+
+    VisitManagerResetStats(manager);
+    assert(VisitManagerGetStats(manager, &stats));
+    assert(stats.ops[VISIT_MANAGER_OP_ADD_VISIT].count == 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Stats test completed.\n");
+}
+
+// Test memory accounting
+void test_memory(const char* test_file) {
+    printf("\n=== MEMORY TEST ===\n");
+
+    // Start from an empty file so the counts are exact.
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 4);
+    assert(manager != NULL);
+
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 0 && memory.visit_count == 0 && memory.string_bytes == 0);
+
+    printf("Adding visits for users 12 and 13...\n");
+    assert(VisitManagerAddVisit(manager, 12, 1201, "https://a.com", "A"));  // Text short enough to be stored inline
+    assert(VisitManagerAddVisit(manager, 12, 1202, "https://b.com", "B"));
+    assert(VisitManagerAddVisit(manager, 12, 1203, "https://c.com", "C"));
+    assert(VisitManagerAddVisit(manager, 13, 1301, "https://d.com", "D"));
+
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 2);
+    assert(memory.visit_count == 4);
+    assert(memory.interned_strings == 4);  // One per distinct URL
+    assert(memory.visit_bytes % 4 == 0 && memory.visit_bytes >= 4 * (sizeof(Visit) + 16));
+    size_t visit_size = memory.visit_bytes / 4;
+    assert(memory.capacity_slack == 2 * 4 - 4);
+    assert(memory.deleted_slack == 0);
+    assert(memory.visit_count_histogram[1] == 1);  // user 13: 1 visit
+    assert(memory.visit_count_histogram[2] == 1);  // user 12: 3 visits
+
+    // Deleting leaves capacity behind; clearing removes the user.
+    uint32_t to_delete[] = {1202};
+    assert(VisitManagerDelete(manager, 12, to_delete, 1));
+    VisitManagerClear(manager, 13);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 1);
+    assert(memory.visit_count == 2);
+    assert(memory.visit_bytes == 2 * visit_size);
+    assert(memory.interned_strings == 2);
+    assert(memory.deleted_slack == 1);
+    assert(memory.visit_count_histogram[0] == 0);
+    assert(memory.visit_count_histogram[2] == 1);
+
+    // Re-adding reuses the freed slot.
+    assert(VisitManagerAddVisit(manager, 12, 1204, "https://e.com", "E"));
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.deleted_slack == 0);
+
+    printf("  total=%zu users=%zu user_table=%zu visit_arrays=%zu visits=%zu strings=%zu slack=%zu deleted=%zu\n",
+           memory.total_bytes, memory.user_bytes, memory.user_table_bytes, memory.visit_array_bytes,
+           memory.visit_bytes, memory.string_bytes, memory.capacity_slack, memory.deleted_slack);
+    assert(memory.total_bytes == memory.manager_bytes + memory.user_table_bytes + memory.user_bytes +
+                                     memory.visit_array_bytes + memory.visit_bytes + memory.string_bytes);
+
+    // Reloading recomputes the same visit and string totals.
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 4);
+    assert(manager != NULL);
+    VisitManagerMemory loaded;
+    assert(VisitManagerGetMemory(manager, &loaded));
+    assert(loaded.visit_count == memory.visit_count && loaded.string_bytes == memory.string_bytes);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Memory test completed.\n");
+}
+
+// Test spilling least recently used users to disk under a memory budget
+void test_memory_budget(const char* test_file) {
+    printf("\n=== MEMORY BUDGET TEST ===\n");
+
+    // Start from an empty file so the counts are exact.
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 4);
+    assert(manager != NULL);
+
+    printf("Adding 3 visits for each of 100 users...\n");
+    char url[64], text[32];
+    for (uint32_t user = 1; user <= 100; user++) {
+        for (uint32_t i = 0; i < 3; i++) {
+            snprintf(url, sizeof(url), "https://example.com/%u/%u", user, i);
+            snprintf(text, sizeof(text), "Page %u", i);
+            assert(VisitManagerAddVisit(manager, user, user * 10 + i, url, text));
+        }
+    }
+
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 100 && memory.spilled_user_count == 0);
+
+    size_t budget = (memory.user_bytes + memory.visit_array_bytes + memory.visit_bytes + memory.string_bytes) / 10;
+    printf("Setting a budget of %zu bytes...\n", budget);
+    assert(VisitManagerSetMemoryBudget(manager, budget));
+    assert(VisitManagerGetMemory(manager, &memory));
+    printf("  resident=%zu spilled=%zu spill_file=%zu bytes\n", memory.user_count, memory.spilled_user_count,
+           memory.spill_file_bytes);
+    assert(memory.user_count + memory.spilled_user_count == 100);
+    assert(memory.spilled_user_count > 0 && memory.spill_file_bytes > 0);
+    assert(memory.user_bytes + memory.visit_array_bytes + memory.visit_bytes + memory.string_bytes <= budget);
+
+    // Spilled users are loaded back transparently.
+    printf("Reading and modifying spilled users...\n");
+    size_t count;
+    Visit** visits = VisitManagerGetRecentVisits(manager, 1, &count);
+    assert(visits != NULL && count == 3);
+    assert(visits[0]->visit_id == 12 && strcmp(visits[0]->url, "https://example.com/1/2") == 0);
+
+    uint32_t to_delete[] = {20};
+    assert(VisitManagerDelete(manager, 2, to_delete, 1));
+    assert(VisitManagerAddVisit(manager, 3, 33, "https://example.com/3/3", "Page 3"));
+
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count + memory.spilled_user_count == 100);
+    assert(memory.user_bytes + memory.visit_array_bytes + memory.visit_bytes + memory.string_bytes <= budget);
+
+    // Exporting all users includes the spilled ones, which stay spilled.
+    size_t spilled = memory.spilled_user_count;
+    size_t visit_count, string_bytes;
+    assert(!VisitManagerExport(manager, NULL, 0, NULL, 0, NULL, 0, &visit_count, &string_bytes));
+    assert(visit_count == 300);
+    ExportedVisit* rows = malloc(visit_count * sizeof(ExportedVisit));
+    char* strings       = malloc(string_bytes);
+    assert(rows && strings);
+    assert(VisitManagerExport(manager, NULL, 0, rows, visit_count, strings, string_bytes, &visit_count,
+                              &string_bytes));
+    assert(rows[visit_count - 1].text_offset + rows[visit_count - 1].text_len == string_bytes);
+    free(rows);
+    free(strings);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.spilled_user_count == spilled && spilled > 0);
+
+    // The snapshot holds every user and the spill file goes away with the manager.
+    printf("Reloading without a budget...\n");
+    VisitManagerFree(manager);
+    char spill_path[256];
+    snprintf(spill_path, sizeof(spill_path), "%s.spill", test_file);
+    assert(fopen(spill_path, "rb") == NULL);
+
+    manager = VisitManagerCreate(test_file, 4);
+    assert(manager != NULL);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 100 && memory.visit_count == 300 && memory.spilled_user_count == 0);
+    VisitManagerGetRecentVisits(manager, 2, &count);
+    assert(count == 2);
+    VisitManagerGetRecentVisits(manager, 3, &count);
+    assert(count == 4);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Memory budget test completed.\n");
+}
+
+// Test reclaiming cleared, emptied and sparse users
+void test_compact(const char* test_file) {
+    printf("\n=== COMPACT TEST ===\n");
+
+    // Start from an empty file so the counts are exact.
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 64);
+    assert(manager != NULL);
+
+    printf("Adding visits for 50 users...\n");
+    char url[64];
+    for (uint32_t user = 1; user <= 50; user++) {
+        for (uint32_t i = 0; i < 40; i++) {
+            snprintf(url, sizeof(url), "https://example.com/%u/%u", user, i);
+            assert(VisitManagerAddVisit(manager, user, user * 100 + i, url, "Compact"));
+        }
+    }
+
+    VisitManagerMemory before;
+    assert(VisitManagerGetMemory(manager, &before));
+    assert(before.user_count == 50);
+
+    printf("Clearing 40 users, emptying one and thinning another...\n");
+    for (uint32_t user = 1; user <= 40; user++) {
+        VisitManagerClear(manager, user);
+    }
+
+    uint32_t to_delete[40];
+    for (uint32_t i = 0; i < 40; i++) {
+        to_delete[i] = 4100 + i;
+    }
+    assert(VisitManagerDelete(manager, 41, to_delete, 40));
+    assert(VisitManagerDelete(manager, 42, to_delete, 1) == false);
+    for (uint32_t i = 0; i < 38; i++) {
+        to_delete[i] = 4200 + i;
+    }
+    assert(VisitManagerDelete(manager, 42, to_delete, 38));
+
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 9);
+    assert(memory.visit_count == 8 * 40 + 2);
+    assert(memory.visit_array_bytes < before.visit_array_bytes / 5);
+
+    printf("Compacting...\n");
+    assert(VisitManagerCompact(manager));
+    assert(VisitManagerGetMemory(manager, &memory));
+    printf("  total=%zu bytes (was %zu) user_table=%zu slack=%zu\n", memory.total_bytes, before.total_bytes,
+           memory.user_table_bytes, memory.capacity_slack);
+    assert(memory.visit_array_bytes == 8 * 40 * sizeof(Visit*));  // User 42 fits in its header
+    assert(memory.user_table_bytes < before.user_table_bytes);
+
+    // Visits survive compaction, and cleared users are gone from the snapshot.
+    size_t count;
+    Visit** visits = VisitManagerGetRecentVisits(manager, 42, &count);
+    assert(visits != NULL && count == 2);
+    assert(visits[0]->visit_id == 4239 && visits[1]->visit_id == 4238);
+    assert(VisitManagerAddVisit(manager, 42, 4240, "https://example.com/42/40", "Compact"));
+
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 64);
+    assert(manager != NULL);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 9 && memory.visit_count == 8 * 40 + 3);
+    VisitManagerGetRecentVisits(manager, 7, &count);
+    assert(count == 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Compact test completed.\n");
+}
+
+// Test that visit arrays start small and grow with the user
+void test_adaptive_capacity(const char* test_file) {
+    printf("\n=== ADAPTIVE CAPACITY TEST ===\n");
+
+    // Start from an empty file so the counts are exact.
+    remove(test_file);
+    printf("Creating visit manager with max_visits=1000...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 1000);
+    assert(manager != NULL);
+
+    printf("Adding 3 visits for each of 100 users...\n");
+    char url[64];
+    for (uint32_t user = 1; user <= 100; user++) {
+        for (uint32_t i = 0; i < 3; i++) {
+            snprintf(url, sizeof(url), "https://example.com/%u/%u", user, i);
+            assert(VisitManagerAddVisit(manager, user, user * 100 + i, url, "Small"));
+        }
+    }
+
+    // Small users keep their visits in the user header.
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    printf("  user headers=%zu visit arrays=%zu bytes\n", memory.user_bytes, memory.visit_array_bytes);
+    assert(memory.visit_array_bytes == 0);
+    assert(memory.user_bytes / 100 < 1000 * sizeof(Visit*) / 10);
+
+    printf("Growing user 1 to 20 visits...\n");
+    for (uint32_t i = 3; i < 20; i++) {
+        snprintf(url, sizeof(url), "https://example.com/1/%u", i);
+        assert(VisitManagerAddVisit(manager, 1, 100 + i, url, "Growing"));
+    }
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.visit_array_bytes >= 20 * sizeof(Visit*) && memory.visit_array_bytes <= 40 * sizeof(Visit*));
+
+    size_t count;
+    Visit** visits = VisitManagerGetRecentVisits(manager, 1, &count);
+    assert(visits != NULL && count == 20);
+    assert(visits[0]->visit_id == 119 && visits[19]->visit_id == 100);
+
+    printf("Shrinking user 1 back to 2 visits...\n");
+    uint32_t to_delete[18];
+    for (uint32_t i = 0; i < 18; i++) {
+        to_delete[i] = 102 + i;
+    }
+    assert(VisitManagerDelete(manager, 1, to_delete, 18));
+    assert(VisitManagerCompact(manager));
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.visit_array_bytes == 0);
+
+    visits = VisitManagerGetRecentVisits(manager, 1, &count);
+    assert(visits != NULL && count == 2);
+    assert(visits[0]->visit_id == 101 && visits[1]->visit_id == 100);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Adaptive capacity test completed.\n");
+}
+
+// Test that short texts are stored inline and long ones on the heap
+void test_inline_strings(const char* test_file) {
+    printf("\n=== INLINE STRINGS TEST ===\n");
+
+    // Start from an empty file so the counts are exact.
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+
+    char long_url[201], long_text[101];
+    memset(long_url, 'u', sizeof(long_url) - 1);
+    long_url[sizeof(long_url) - 1] = '\0';
+    memset(long_text, 't', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = '\0';
+
+    printf("Adding visits with short and long strings...\n");
+    VisitManagerMemory before, memory;
+    assert(VisitManagerAddVisit(manager, 14, 1401, "https://a.io", "Short"));
+    assert(VisitManagerAddVisit(manager, 14, 1402, long_url, "Short title"));
+    assert(VisitManagerGetMemory(manager, &before));
+    assert(VisitManagerAddVisit(manager, 14, 1403, "https://a.io", long_text));
+    assert(VisitManagerAddVisit(manager, 14, 1404, long_url, long_text));
+    assert(VisitManagerAddVisit(manager, 14, 1405, "", ""));
+
+    // Only long texts take separate heap blocks; repeated URLs are shared.
+    assert(VisitManagerGetMemory(manager, &memory));
+    printf("  visits=%zu strings=%zu bytes, %zu interned\n", memory.visit_bytes, memory.string_bytes,
+           memory.interned_strings);
+    assert(memory.interned_strings == 3);
+    assert(memory.string_bytes - before.string_bytes > 2 * sizeof(long_text));
+    assert(memory.string_bytes - before.string_bytes < 2 * sizeof(long_text) + sizeof(long_url));
+
+    for (int pass = 0; pass < 2; pass++) {
+        size_t count;
+        Visit** visits = VisitManagerGetRecentVisits(manager, 14, &count);
+        assert(visits != NULL && count == 5);
+        assert(strcmp(visits[0]->url, "") == 0 && strcmp(visits[0]->text, "") == 0);
+        assert(strcmp(visits[1]->url, long_url) == 0 && strcmp(visits[1]->text, long_text) == 0);
+        assert(strcmp(visits[2]->url, "https://a.io") == 0 && strcmp(visits[2]->text, long_text) == 0);
+        assert(strcmp(visits[3]->url, long_url) == 0 && strcmp(visits[3]->text, "Short title") == 0);
+        assert(strcmp(visits[4]->url, "https://a.io") == 0 && strcmp(visits[4]->text, "Short") == 0);
+        assert(visits[1]->url == visits[3]->url);
+
+        // Loading the snapshot places strings the same way.
+        VisitManagerFree(manager);
+        manager = VisitManagerCreate(test_file, 10);
+        assert(manager != NULL);
+        VisitManagerMemory loaded;
+        assert(VisitManagerGetMemory(manager, &loaded));
+        assert(loaded.string_bytes == memory.string_bytes && loaded.visit_bytes == memory.visit_bytes);
+        assert(loaded.interned_strings == memory.interned_strings);
+    }
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Inline strings test completed.\n");
+}
+
+// Helper function to write a format 1 snapshot (no magic, strings stored in full) with one visit
+static void write_legacy_snapshot(const char* path, uint32_t user_id, uint32_t visit_id, const char* url,
+                                  const char* text) {
+    FILE* file = fopen(path, "wb");
+    assert(file != NULL);
+
+    size_t max_visits = 10, user_count = 1, visit_count = 1;
+    size_t url_len = strlen(url) + 1, text_len = strlen(text) + 1;
+    struct timespec time = {.tv_sec = 1700000000, .tv_nsec = 5};
+    fwrite(&max_visits, sizeof(size_t), 1, file);
+    fwrite(&user_count, sizeof(size_t), 1, file);
+    fwrite(&user_id, sizeof(uint32_t), 1, file);
+    fwrite(&visit_count, sizeof(size_t), 1, file);
+    fwrite(&visit_id, sizeof(uint32_t), 1, file);
+    fwrite(&url_len, sizeof(size_t), 1, file);
+    fwrite(url, 1, url_len, file);
+    fwrite(&text_len, sizeof(size_t), 1, file);
+    fwrite(text, 1, text_len, file);
+    fwrite(&time, sizeof(time), 1, file);
+    fclose(file);
+}
+
+// Helper function to get the size of a file
+static long file_size(const char* path) {
+    FILE* file = fopen(path, "rb");
+    assert(file != NULL);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+// Test URL and title interning and the dictionary snapshot format
+void test_interning(const char* test_file) {
+    printf("\n=== INTERNING TEST ===\n");
+
+    // Snapshots in the legacy format still load.
+    printf("Loading a legacy snapshot...\n");
+    write_legacy_snapshot(test_file, 15, 1501, "https://legacy.example.com", "Legacy");
+    VisitManager* manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+
+    size_t count;
+    Visit** visits = VisitManagerGetRecentVisits(manager, 15, &count);
+    assert(visits != NULL && count == 1);
+    assert(visits[0]->visit_id == 1501 && strcmp(visits[0]->url, "https://legacy.example.com") == 0);
+    assert(strcmp(visits[0]->text, "Legacy") == 0 && visits[0]->time.tv_sec == 1700000000);
+    VisitManagerClear(manager, 15);
+
+    printf("Adding 100 users visiting the same 3 pages...\n");
+    const char* urls[]   = {"https://search.example.com/", "https://news.example.com/", "https://home.example.com/"};
+    const char* titles[] = {"Example Search - the search engine everybody uses", "Example News: today's headlines",
+                            "Welcome home"};
+    assert(VisitManagerSetInternTitles(manager, true));
+    for (uint32_t user = 1; user <= 100; user++) {
+        for (uint32_t i = 0; i < 3; i++) {
+            assert(VisitManagerAddVisit(manager, user, user * 10 + i, urls[i], titles[i]));
+        }
+    }
+
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    printf("  %zu interned strings, %zu string bytes, snapshot %ld bytes\n", memory.interned_strings,
+           memory.string_bytes, file_size(test_file));
+    assert(memory.interned_strings == 6);
+
+    // Each string is written once, so the snapshot is far smaller than the strings it holds.
+    long full_strings = 0;
+    for (int i = 0; i < 3; i++) {
+        full_strings += 100 * (long)(strlen(urls[i]) + strlen(titles[i]));
+    }
+    assert(file_size(test_file) < full_strings);
+
+    // Removing visits releases references; the last one frees the string.
+    for (uint32_t user = 1; user <= 100; user++) {
+        uint32_t to_delete[] = {user * 10 + 2};
+        assert(VisitManagerDelete(manager, user, to_delete, 1));
+    }
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.interned_strings == 4);
+
+    // Reloading shares strings again.
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.interned_strings == 2 && memory.visit_count == 200);
+
+    Visit** first  = VisitManagerGetRecentVisits(manager, 1, &count);
+    const char* shared = first[0]->url;
+    visits         = VisitManagerGetRecentVisits(manager, 2, &count);
+    assert(count == 2 && visits[0]->url == shared && strcmp(visits[1]->text, titles[0]) == 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Interning test completed.\n");
+}
+
+// Helper function to check the visit IDs of a user, newest first
+static void expect_visit_ids(VisitManager* manager, uint32_t user_id, const uint32_t* ids, size_t count) {
+    size_t actual;
+    Visit** visits = VisitManagerGetRecentVisits(manager, user_id, &actual);
+    assert(actual == count);
+    for (size_t i = 0; i < count; i++) {
+        assert(visits[i]->visit_id == ids[i]);
+    }
+}
+
+// Test that revisiting a URL in dedup mode replaces the earlier visit
+void test_dedup_urls(const char* test_file) {
+    printf("\n=== DEDUP URLS TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager with max_visits=3...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 3);
+    assert(manager != NULL);
+    assert(VisitManagerSetDedupUrls(manager, true));
+
+    printf("Revisiting a URL moves it to the front...\n");
+    assert(VisitManagerAddVisit(manager, 16, 1601, "https://a.com", "A"));
+    assert(VisitManagerAddVisit(manager, 16, 1602, "https://b.com", "B"));
+    assert(VisitManagerAddVisit(manager, 16, 1603, "https://c.com", "C"));
+    assert(VisitManagerAddVisit(manager, 16, 1604, "https://a.com", "A again"));
+    expect_visit_ids(manager, 16, (uint32_t[]){1604, 1603, 1602}, 3);
+
+    size_t count;
+    Visit** visits = VisitManagerGetRecentVisits(manager, 16, &count);
+    assert(strcmp(visits[0]->text, "A again") == 0);
+
+    // Distinct URLs still evict the oldest visit.
+    assert(VisitManagerAddVisit(manager, 16, 1605, "https://d.com", "D"));
+    expect_visit_ids(manager, 16, (uint32_t[]){1605, 1604, 1603}, 3);
+
+    // A deleted URL is new again.
+    assert(VisitManagerDelete(manager, 16, (uint32_t[]){1604}, 1));
+    assert(VisitManagerAddVisit(manager, 16, 1606, "https://a.com", "A"));
+    assert(VisitManagerAddVisit(manager, 16, 1607, "https://c.com", "C"));
+    expect_visit_ids(manager, 16, (uint32_t[]){1607, 1606, 1605}, 3);
+
+    printf("Enabling dedup with duplicates already stored...\n");
+    assert(VisitManagerSetDedupUrls(manager, false));
+    assert(VisitManagerAddVisit(manager, 17, 1701, "https://x.com", "X"));
+    assert(VisitManagerAddVisit(manager, 17, 1702, "https://x.com", "X"));
+    expect_visit_ids(manager, 17, (uint32_t[]){1702, 1701}, 2);
+
+    VisitManagerMemory before, memory;
+    assert(VisitManagerGetMemory(manager, &before));
+    assert(VisitManagerSetDedupUrls(manager, true));
+    assert(VisitManagerAddVisit(manager, 17, 1703, "https://x.com", "X"));
+    expect_visit_ids(manager, 17, (uint32_t[]){1703, 1701}, 2);
+
+    // The URL index is accounted with the visit arrays.
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.visit_array_bytes > before.visit_array_bytes);
+
+    // Deleting the newest leaves the older duplicate to be replaced next.
+    assert(VisitManagerDelete(manager, 17, (uint32_t[]){1703}, 1));
+    assert(VisitManagerAddVisit(manager, 17, 1704, "https://x.com", "X"));
+    expect_visit_ids(manager, 17, (uint32_t[]){1704}, 1);
+
+    // Turning dedup off releases the indexes.
+    assert(VisitManagerSetDedupUrls(manager, false));
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.visit_array_bytes == 0);
+
+    printf("Reloading and revisiting...\n");
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 3);
+    assert(manager != NULL);
+    expect_visit_ids(manager, 16, (uint32_t[]){1607, 1606, 1605}, 3);
+    assert(VisitManagerSetDedupUrls(manager, true));
+    assert(VisitManagerAddVisit(manager, 16, 1608, "https://d.com", "D"));
+    expect_visit_ids(manager, 16, (uint32_t[]){1608, 1607, 1606}, 3);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Dedup URLs test completed.\n");
+}
+
+// Test frecency scores and top-k retrieval
+void test_frecency(const char* test_file) {
+    printf("\n=== FRECENCY TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager with max_visits=5...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 5);
+    assert(manager != NULL);
+
+    // Scoring is off by default.
+    ScoredUrl top[10];
+    assert(VisitManagerAddVisit(manager, 18, 1800, "https://a.com", "A"));
+    assert(VisitManagerGetTopByScore(manager, 18, 10, top) == 0);
+
+    printf("Adding visits with a one-day half-life...\n");
+    assert(VisitManagerSetFrecencyHalfLife(manager, 86400));
+    assert(!VisitManagerSetFrecencyHalfLife(manager, -1));
+    assert(VisitManagerAddVisit(manager, 18, 1801, "https://b.com", "B"));
+    assert(VisitManagerAddVisit(manager, 18, 1802, "https://c.com", "C"));
+    assert(VisitManagerAddVisit(manager, 18, 1803, "https://a.com", "A"));
+    assert(VisitManagerAddVisit(manager, 18, 1804, "https://c.com", "C"));
+    assert(VisitManagerAddVisit(manager, 18, 1805, "https://a.com", "A"));  // Evicts 1800
+
+    // a keeps the count of its evicted visit.
+    assert(VisitManagerGetTopByScore(manager, 18, 2, top) == 2);
+    printf("  %s: %u visits, score %.4f\n", top[0].url, top[0].visit_count, top[0].score);
+    assert(strcmp(top[0].url, "https://a.com") == 0 && top[0].visit_count == 3);
+    assert(top[0].score > 2.99 && top[0].score <= 3.0);
+    assert(strcmp(top[1].url, "https://c.com") == 0 && top[1].visit_count == 2);
+    assert(VisitManagerGetTopByScore(manager, 18, 10, top) == 3);
+    assert(strcmp(top[2].url, "https://b.com") == 0);
+
+    // A URL leaves the ranking with its last visit.
+    assert(VisitManagerDelete(manager, 18, (uint32_t[]){1801}, 1));
+    assert(VisitManagerGetTopByScore(manager, 18, 10, top) == 2);
+
+    printf("Reloading keeps the scores...\n");
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 5);
+    assert(manager != NULL);
+    assert(VisitManagerGetTopByScore(manager, 18, 10, top) == 2);
+    assert(strcmp(top[0].url, "https://a.com") == 0 && top[0].visit_count == 3);
+
+    // Scores survive being spilled and loaded back.
+    assert(VisitManagerAddVisit(manager, 19, 1900, "https://z.com", "Z"));
+    assert(VisitManagerSetMemoryBudget(manager, 1));
+    assert(VisitManagerGetTopByScore(manager, 18, 10, top) == 2);
+    assert(top[0].visit_count == 3);
+    assert(VisitManagerSetMemoryBudget(manager, 0));
+
+    printf("Recent visits outweigh old ones with a short half-life...\n");
+    assert(VisitManagerSetFrecencyHalfLife(manager, 0.001));
+    assert(VisitManagerGetTopByScore(manager, 18, 1, top) == 1);
+    assert(top[0].visit_count == 2);  // Rebuilt from the visits held
+    assert(VisitManagerAddVisit(manager, 18, 1806, "https://d.com", "D"));
+    assert(VisitManagerAddVisit(manager, 18, 1807, "https://d.com", "D"));
+    nanosleep(&(struct timespec){.tv_nsec = 20000000}, NULL);
+    assert(VisitManagerAddVisit(manager, 18, 1808, "https://e.com", "E"));
+    assert(VisitManagerGetTopByScore(manager, 18, 2, top) == 2);
+    assert(strcmp(top[0].url, "https://e.com") == 0 && strcmp(top[1].url, "https://d.com") == 0);
+
+    // Disabling scores frees them.
+    VisitManagerMemory before, memory;
+    assert(VisitManagerGetMemory(manager, &before));
+    assert(VisitManagerSetFrecencyHalfLife(manager, 0));
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.visit_array_bytes < before.visit_array_bytes);
+    assert(VisitManagerGetTopByScore(manager, 18, 10, top) == 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Frecency test completed.\n");
+}
+
+// Test prefix search over a user's URLs
+void test_prefix_search(const char* test_file) {
+    printf("\n=== PREFIX SEARCH TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+
+    assert(VisitManagerAddVisit(manager, 20, 2001, "https://news.example.com/", "News"));
+    assert(VisitManagerAddVisit(manager, 20, 2002, "https://mail.example.com/", "Mail"));
+    assert(VisitManagerAddVisit(manager, 20, 2003, "https://news.example.com/world", "World"));
+    assert(VisitManagerAddVisit(manager, 20, 2004, "https://news.example.com/", "News again"));
+    assert(VisitManagerAddVisit(manager, 20, 2005, "http://news.example.com/", "Plain"));
+
+    printf("Searching...\n");
+    Visit* results[10];
+    size_t count = VisitManagerPrefixSearch(manager, 20, "https://news", 10, results);
+    assert(count == 2);
+    assert(results[0]->visit_id == 2004);  // Newest visit of the URL
+    assert(strcmp(results[1]->url, "https://news.example.com/world") == 0);
+
+    assert(VisitManagerPrefixSearch(manager, 20, "https://news", 1, results) == 1);
+    assert(VisitManagerPrefixSearch(manager, 20, "", 10, results) == 4);
+    assert(strcmp(results[0]->url, "http://news.example.com/") == 0);
+    assert(VisitManagerPrefixSearch(manager, 20, "https://news.example.com/world/", 10, results) == 0);
+    assert(VisitManagerPrefixSearch(manager, 20, "zzz", 10, results) == 0);
+    assert(VisitManagerPrefixSearch(manager, 21, "", 10, results) == 0);
+
+    // Changes to the visits are reflected in the next search.
+    assert(VisitManagerAddVisit(manager, 20, 2006, "https://newsletter.example.com/", "Letter"));
+    assert(VisitManagerDelete(manager, 20, (uint32_t[]){2001, 2004}, 2));
+    count = VisitManagerPrefixSearch(manager, 20, "https://news", 10, results);
+    assert(count == 2);
+    assert(results[0]->visit_id == 2003 && results[1]->visit_id == 2006);
+
+    // Packed results match, with the prefix given by length.
+    size_t packed_count;
+    size_t needed = VisitManagerPackPrefixSearch(manager, 20, "https://newsXYZ", 12, 10, NULL, 0, &packed_count);
+    assert(packed_count == 2);
+    assert(needed == 2 * sizeof(PackedVisit) + strlen("https://news.example.com/worldWorld") +
+                         strlen("https://newsletter.example.com/Letter"));
+    uint8_t buf[256];
+    assert(VisitManagerPackPrefixSearch(manager, 20, "https://newsXYZ", 12, 10, buf, sizeof(buf), &packed_count) ==
+           needed);
+    for (size_t i = 0; i < packed_count; i++) {
+        PackedVisit entry;
+        memcpy(&entry, buf + i * sizeof(PackedVisit), sizeof(entry));
+        assert(entry.visit_id == results[i]->visit_id);
+        assert(entry.url_len == strlen(results[i]->url));
+        assert(memcmp(buf + entry.url_offset, results[i]->url, entry.url_len) == 0);
+        assert(memcmp(buf + entry.text_offset, results[i]->text, entry.text_len) == 0);
+    }
+    assert(VisitManagerPackPrefixSearch(manager, 20, "https://news", 12, 1, buf, sizeof(buf), &packed_count) > 0);
+    assert(packed_count == 1);
+    assert(VisitManagerPackPrefixSearch(manager, 20, NULL, 0, 10, NULL, 0, &packed_count) > 0);
+    assert(packed_count == 4);
+    assert(VisitManagerPackPrefixSearch(manager, 20, "zzz", 3, 10, NULL, 0, &packed_count) == 0);
+    assert(packed_count == 0);
+
+    // URLs with NUL bytes sort by all their bytes, so prefixes past the NUL still match.
+    assert(VisitManagerAddVisitN(manager, 22, 2201, "a\0c", 3, "C", 1));
+    assert(VisitManagerAddVisitN(manager, 22, 2202, "a", 1, "A", 1));
+    assert(VisitManagerAddVisitN(manager, 22, 2203, "a\0b", 3, "B", 1));
+    assert(VisitManagerAddVisitN(manager, 22, 2204, "a\0bb", 4, "BB", 2));
+    assert(VisitManagerPackPrefixSearch(manager, 22, "a\0b", 3, 10, NULL, 0, &packed_count) > 0);
+    assert(packed_count == 2);
+    assert(VisitManagerPackPrefixSearch(manager, 22, "a\0c", 3, 10, buf, sizeof(buf), &packed_count) > 0);
+    PackedVisit entry;
+    memcpy(&entry, buf, sizeof(entry));
+    assert(packed_count == 1 && entry.visit_id == 2201);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Prefix search test completed.\n");
+}
+
 #ifdef BUILD_TEST
+void test_text_index(const char* test_file) {
+    printf("\n=== TEXT INDEX TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 3);
+    assert(manager != NULL);
+    assert(VisitManagerAddVisit(manager, 30, 3001, "https://a.example.com/", "Breaking news: Rain"));
+    assert(VisitManagerSetTextIndex(manager, true));  // Indexes the visit already held
+
+    assert(VisitManagerAddVisit(manager, 30, 3002, "https://b.example.com/", "Sports NEWS"));
+    assert(VisitManagerAddVisit(manager, 31, 3101, "https://c.example.com/", "news, news and weather"));
+    assert(VisitManagerAddVisit(manager, 31, 3102, "https://d.example.com/", "Weather radar"));
+
+    printf("Searching...\n");
+    uint32_t ids[10];
+    assert(VisitManagerSearchText(manager, 30, "news", 10, ids) == 2);
+    assert(ids[0] == 3001 && ids[1] == 3002);
+    assert(VisitManagerSearchText(manager, 30, "News", 1, ids) == 1);
+    assert(VisitManagerSearchText(manager, 31, "weather NEWS", 10, ids) == 1 && ids[0] == 3101);
+    assert(VisitManagerSearchText(manager, 30, "news weather", 10, ids) == 0);
+    assert(VisitManagerSearchText(manager, 30, "new", 10, ids) == 0);
+    assert(VisitManagerSearchText(manager, 30, " ,", 10, ids) == 0);
+
+    VisitRef refs[10];
+    assert(VisitManagerSearchTextAll(manager, "news", 10, refs) == 3);
+    assert(refs[2].user_id == 31 && refs[2].visit_id == 3101);
+
+    // Evicted, deleted and cleared visits leave the index.
+    assert(VisitManagerAddVisit(manager, 30, 3003, "https://e.example.com/", "Radar"));
+    assert(VisitManagerAddVisit(manager, 30, 3004, "https://f.example.com/", "Radar"));
+    assert(VisitManagerSearchText(manager, 30, "news", 10, ids) == 1 && ids[0] == 3002);
+    assert(VisitManagerDelete(manager, 30, (uint32_t[]){3002}, 1));
+    assert(VisitManagerSearchText(manager, 30, "news", 10, ids) == 0);
+    VisitManagerClear(manager, 31);
+    assert(VisitManagerSearchTextAll(manager, "weather", 10, refs) == 0);
+    assert(VisitManagerSearchTextAll(manager, "radar", 10, refs) == 2);
+
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.text_terms == 1);  // Only "radar" is left
+    assert(memory.text_index_bytes > 0);
+
+    // The index is stored in the snapshot.
+    printf("Reloading...\n");
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 3);
+    assert(manager != NULL);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.text_terms == 1);
+    assert(VisitManagerSearchText(manager, 30, "RADAR", 10, ids) == 2);
+    assert(ids[0] == 3003 && ids[1] == 3004);
+
+    assert(VisitManagerSetTextIndex(manager, false));
+    assert(VisitManagerSearchText(manager, 30, "radar", 10, ids) == 0);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.text_terms == 0 && memory.text_index_bytes == 0);
+
+    // A search for one user finds its visits in the middle of long posting lists, before and
+    // after reloading.
+    assert(VisitManagerSetTextIndex(manager, true));
+    for (uint32_t user = 100; user < 1100; user++) {
+        assert(VisitManagerAddVisit(manager, user, user, "https://g.example.com/", user % 2 ? "odd page" : "page"));
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        assert(VisitManagerSearchText(manager, 777, "page ODD", 10, ids) == 1 && ids[0] == 777);
+        assert(VisitManagerSearchText(manager, 778, "page odd", 10, ids) == 0);
+        assert(VisitManagerSearchText(manager, 1099, "page", 10, ids) == 1 && ids[0] == 1099);
+        assert(VisitManagerSearchTextAll(manager, "odd", 10, refs) == 10 && refs[9].user_id == 119);
+        VisitManagerFree(manager);
+        manager = VisitManagerCreate(test_file, 3);
+        assert(manager != NULL);
+    }
+
+    // Words are cut to their first 64 bytes.
+    char long_word[80];
+    memset(long_word, 'w', 70);
+    long_word[70] = '\0';
+    assert(VisitManagerAddVisit(manager, 30, 3005, "https://h.example.com/", long_word));
+    long_word[65] = '\0';
+    assert(VisitManagerSearchText(manager, 30, long_word, 10, ids) == 1 && ids[0] == 3005);
+    long_word[63] = '\0';
+    assert(VisitManagerSearchText(manager, 30, long_word, 10, ids) == 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Text index test completed.\n");
+}
+
+void test_substring_search(const char* test_file) {
+    printf("\n=== SUBSTRING SEARCH TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+
+    // Long strings go through full vector blocks as well as the tail.
+    assert(VisitManagerAddVisit(manager, 40, 4001, "https://docs.example.com/reference/api/v2/visits/search",
+                                "Search API reference for the visit manager service"));
+    assert(VisitManagerAddVisit(manager, 40, 4002, "https://mail.example.com/", "Inbox (3) - Mail"));
+    assert(VisitManagerAddVisit(manager, 40, 4003, "https://example.com/SEARCH", "Results"));
+
+    printf("Searching...\n");
+    uint32_t ids[10];
+    assert(VisitManagerSearch(manager, 40, "search", 6, 0, 10, ids) == 1 && ids[0] == 4001);
+    assert(VisitManagerSearch(manager, 40, "search", 6, VISIT_MANAGER_SEARCH_IGNORE_CASE, 10, ids) == 2);
+    assert(ids[0] == 4003);  // Newest first
+    assert(VisitManagerSearch(manager, 40, "search", 6, VISIT_MANAGER_SEARCH_IGNORE_CASE, 1, ids) == 1);
+
+    // Fields can be searched on their own.
+    assert(VisitManagerSearch(manager, 40, "Mail", 4, VISIT_MANAGER_SEARCH_TEXT, 10, ids) == 1 && ids[0] == 4002);
+    assert(VisitManagerSearch(manager, 40, "Mail", 4, VISIT_MANAGER_SEARCH_URL, 10, ids) == 0);
+    assert(VisitManagerSearch(manager, 40, "visit manager service", 21, VISIT_MANAGER_SEARCH_TEXT, 10, ids) == 1);
+    assert(VisitManagerSearch(manager, 40, "visit manager service", 21, VISIT_MANAGER_SEARCH_URL, 10, ids) == 0);
+
+    assert(VisitManagerSearch(manager, 40, "", 0, 0, 10, ids) == 3);
+    assert(VisitManagerSearch(manager, 40, "nothing", 7, 0, 10, ids) == 0);
+    assert(VisitManagerSearch(manager, 41, "search", 6, 0, 10, ids) == 0);
+
+    // The needle is taken by length, so it may be part of a longer string, or NULL when empty.
+    assert(VisitManagerSearch(manager, 40, "Mailbox", 4, VISIT_MANAGER_SEARCH_TEXT, 10, ids) == 1);
+    assert(VisitManagerSearch(manager, 40, NULL, 0, 0, 10, ids) == 3);
+
+    // Matches at the very end of short strings and of strings just past a full block.
+    assert(VisitManagerSearch(manager, 40, "(3) - Mail", 10, VISIT_MANAGER_SEARCH_TEXT, 10, ids) == 1);
+    assert(VisitManagerSearch(manager, 40, "example.com/", 12, VISIT_MANAGER_SEARCH_URL, 10, ids) == 3);
+    assert(VisitManagerSearch(manager, 40, "v2/visits/search", 16, VISIT_MANAGER_SEARCH_URL, 10, ids) == 1);
+    assert(VisitManagerSearch(manager, 40, "Search API reference for the visit manager", 42, 0, 10, ids) == 1);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Substring search test completed.\n");
+}
+
+void test_get_recent_visits_multi(const char* test_file) {
+    printf("\n=== BATCH RETRIEVAL TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 5);
+    assert(manager != NULL);
+    for (uint32_t user_id = 50; user_id < 60; user_id++) {
+        for (uint32_t j = 0; j < user_id % 3 + 1; j++) {
+            char url[64];
+            snprintf(url, sizeof(url), "https://example.com/%u/%u", user_id, j);
+            assert(VisitManagerAddVisit(manager, user_id, user_id * 100 + j, url, "Batch"));
+        }
+    }
+
+    // A tight budget spills users; the batch reads them without loading them back and still
+    // packs all of them.
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    VisitManagerSetMemoryBudget(manager, memory.user_bytes / 4);
+    assert(VisitManagerGetMemory(manager, &memory));
+    size_t spilled = memory.spilled_user_count;
+    assert(spilled > 0);
+
+    uint32_t user_ids[] = {57, 999, 50, 57, 53};
+    size_t counts[5];
+    size_t needed = VisitManagerGetRecentVisitsMulti(manager, user_ids, 5, NULL, 0, counts);
+    assert(counts[0] == 1 && counts[1] == 0 && counts[2] == 3 && counts[3] == 1 && counts[4] == 3);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.spilled_user_count == spilled);
+
+    char* buf = malloc(needed);
+    assert(buf != NULL);
+    assert(VisitManagerGetRecentVisitsMulti(manager, user_ids, 5, buf, needed, counts) == needed);
+
+    // Headers follow the batch order and match the single-user packing.
+    size_t header = 0;
+    for (size_t i = 0; i < 5; i++) {
+        char single[1024];
+        size_t count;
+        VisitManagerPackRecentVisits(manager, user_ids[i], single, sizeof(single), &count);
+        assert(count == counts[i]);
+        for (size_t j = 0; j < count; j++, header++) {
+            PackedVisit entry, expected;
+            memcpy(&entry, buf + header * sizeof(PackedVisit), sizeof(entry));
+            memcpy(&expected, single + j * sizeof(PackedVisit), sizeof(expected));
+            assert(entry.visit_id == expected.visit_id && entry.url_len == expected.url_len);
+            assert(memcmp(buf + entry.url_offset, single + expected.url_offset, entry.url_len) == 0);
+            assert(memcmp(buf + entry.text_offset, "Batch", entry.text_len) == 0);
+        }
+    }
+    free(buf);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Batch retrieval test completed.\n");
+}
+
+// Test the site-wide timeline merged across users, including spilled ones
+void test_get_latest_visits(const char* test_file) {
+    printf("\n=== LATEST VISITS TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 5);
+    assert(manager != NULL);
+
+    // Users 70-79 visit in turn; user 70 makes the last three visits.
+    uint32_t visit_id = 0;
+    for (uint32_t round = 0; round < 3; round++) {
+        for (uint32_t user_id = 70; user_id < 80; user_id++) {
+            assert(VisitManagerAddVisit(manager, user_id, ++visit_id, "https://example.com/page", "Latest"));
+        }
+    }
+    for (uint32_t i = 0; i < 3; i++) {
+        assert(VisitManagerAddVisit(manager, 70, ++visit_id, "https://example.com/last", "Latest"));
+    }
+
+    // Using the other users spills user 70 under a tight budget.
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    VisitManagerSetMemoryBudget(manager, memory.user_bytes / 3);
+    for (uint32_t user_id = 71; user_id < 80; user_id++) {
+        size_t count;
+        VisitManagerGetRecentVisits(manager, user_id, &count);
+    }
+    assert(VisitManagerGetMemory(manager, &memory));
+    size_t spilled = memory.spilled_user_count;
+    assert(spilled > 0);
+
+    // Sizing with no string buffer fails but reports what is needed.
+    ExportedVisit rows[8];
+    size_t count, string_bytes;
+    assert(!VisitManagerGetLatestVisits(manager, 8, rows, NULL, 0, &count, &string_bytes));
+    assert(count == 8 && string_bytes == 3 * (24 + 6) + 5 * (24 + 6));
+
+    char strings[256];
+    assert(VisitManagerGetLatestVisits(manager, 8, rows, strings, sizeof(strings), &count, &string_bytes));
+    assert(count == 8);
+    for (size_t i = 0; i < count; i++) {
+        assert(i == 0 || rows[i].timestamp_ns <= rows[i - 1].timestamp_ns);
+        assert(rows[i].visit_id > visit_id - 8);
+        assert(rows[i].user_id == (rows[i].visit_id > visit_id - 3 ? 70 : 70 + (rows[i].visit_id - 1) % 10));
+        assert(memcmp(strings + rows[i].text_offset, "Latest", rows[i].text_len) == 0);
+    }
+
+    // The spilled users were read without being loaded back.
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.spilled_user_count == spilled);
+
+    // The time index gives the same rows, still without loading the spilled users.
+    ExportedVisit indexed_rows[8];
+    char indexed_strings[256];
+    assert(VisitManagerSetTimeIndex(manager, true));
+    assert(VisitManagerGetLatestVisits(manager, 8, indexed_rows, indexed_strings, sizeof(indexed_strings),
+                                       &count, &string_bytes));
+    assert(count == 8);
+    for (size_t i = 0; i < count; i++) {
+        assert(indexed_rows[i].visit_id == rows[i].visit_id && indexed_rows[i].user_id == rows[i].user_id);
+        assert(memcmp(indexed_strings + indexed_rows[i].text_offset, "Latest", indexed_rows[i].text_len) == 0);
+    }
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.spilled_user_count == spilled);
+    assert(VisitManagerSetTimeIndex(manager, false));
+
+    // Asking for more than exist returns every visit held; user 70 evicted its oldest.
+    ExportedVisit all[64];
+    char all_strings[2048];
+    assert(VisitManagerGetLatestVisits(manager, 64, all, all_strings, sizeof(all_strings), &count, &string_bytes));
+    assert(count == visit_id - 1);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Latest visits test completed.\n");
+}
+
+// Test window queries over the time index, across eviction, delete, clear, spilling and reload
+void test_time_index(const char* test_file) {
+    printf("\n=== TIME INDEX TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 3);
+    assert(manager != NULL);
+    assert(VisitManagerAddVisit(manager, 80, 1, "https://example.com/early", "Early"));
+    assert(VisitManagerSetTimeIndex(manager, true));
+
+    // Users 80-84 make four visits each; each keeps its last three.
+    for (uint32_t round = 0; round < 4; round++) {
+        for (uint32_t user_id = 80; user_id < 85; user_id++) {
+            assert(VisitManagerAddVisit(manager, user_id, 10 + round, "https://example.com/page", "Window"));
+        }
+    }
+
+    TimedVisitRef refs[32];
+    size_t count = VisitManagerGetWindow(manager, 0, INT64_MAX, refs, 32);
+    assert(count == 15);
+    for (size_t i = 0; i < count; i++) {
+        assert(refs[i].visit_id >= 11 && refs[i].user_id >= 80 && refs[i].user_id < 85);
+        assert(i == 0 || refs[i].timestamp_ns >= refs[i - 1].timestamp_ns);
+    }
+
+    // A window from the middle holds the later visits only, and a small buffer still counts all.
+    int64_t middle = refs[5].timestamp_ns;
+    assert(VisitManagerGetWindow(manager, middle, INT64_MAX, refs, 2) == 10);
+    assert(refs[0].timestamp_ns == middle);
+    assert(VisitManagerGetWindow(manager, middle, middle, refs, 32) == 0);
+
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.time_buckets > 0 && memory.time_index_bytes > 0);
+
+    // Deleted and cleared visits leave the index, spilled users stay in it.
+    uint32_t deleted = 13;
+    assert(VisitManagerDelete(manager, 81, &deleted, 1));
+    VisitManagerSetMemoryBudget(manager, memory.user_bytes / 2);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.spilled_user_count > 0);
+    VisitManagerClear(manager, 80);
+    count = VisitManagerGetWindow(manager, 0, INT64_MAX, refs, 32);
+    assert(count == 11);
+    for (size_t i = 0; i < count; i++) {
+        assert(refs[i].user_id != 80 && !(refs[i].user_id == 81 && refs[i].visit_id == 13));
+    }
+
+    // The index is rebuilt when the snapshot is loaded.
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 3);
+    assert(manager != NULL);
+    TimedVisitRef reloaded[32];
+    assert(VisitManagerGetWindow(manager, 0, INT64_MAX, reloaded, 32) == 11);
+    assert(memcmp(reloaded, refs, 11 * sizeof(TimedVisitRef)) == 0);
+
+    // Turning the index off empties it.
+    assert(VisitManagerSetTimeIndex(manager, false));
+    assert(VisitManagerGetWindow(manager, 0, INT64_MAX, refs, 32) == 0);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.time_buckets == 0 && memory.time_index_bytes == 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Time index test completed.\n");
+}
+
+// Test TTL expiry: a batch per add, a full sweep, and persistence of the result
+void test_ttl_expiry(const char* test_file) {
+    printf("\n=== TTL EXPIRY TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+    assert(!VisitManagerSetTTL(manager, -1));
+    assert(VisitManagerSetTTL(manager, 0.2));
+    assert(!VisitManagerSetTimeIndex(manager, false));
+
+    // Users 90-93 make five visits each, which expire while the process sleeps.
+    for (uint32_t user_id = 90; user_id < 94; user_id++) {
+        for (uint32_t j = 0; j < 5; j++) {
+            assert(VisitManagerAddVisit(manager, user_id, j + 1, "https://example.com/old", "Old"));
+        }
+    }
+    assert(VisitManagerExpire(manager, 0) == 0);
+    struct timespec sleep_time = {0, 250000000};  // 250 milliseconds
+    nanosleep(&sleep_time, NULL);
+
+    // An add drops a batch of the oldest expired visits before adding its own.
+    assert(VisitManagerAddVisit(manager, 94, 1, "https://example.com/new", "New"));
+    size_t count;
+    VisitManagerGetRecentVisits(manager, 90, &count);
+    assert(count == 0);
+    VisitManagerGetRecentVisits(manager, 93, &count);
+    assert(count == 4);
+
+    // A sweep drops the rest, and the emptied users with them.
+    assert(VisitManagerExpire(manager, 2) == 2);
+    assert(VisitManagerExpire(manager, 0) == 2);
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 1 && memory.visit_count == 1);
+
+    // The sweep was persisted.
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 1 && memory.visit_count == 1);
+    assert(VisitManagerExpire(manager, 0) == 0);
+
+    // So was the TTL, and the reloaded manager keeps expiring visits.
+    assert(!VisitManagerSetTimeIndex(manager, false));
+    nanosleep(&sleep_time, NULL);
+    assert(VisitManagerExpire(manager, 0) == 1);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 0 && memory.visit_count == 0);
+
+    // Visits dropped by an add are persisted even when the add is a duplicate.
+    assert(VisitManagerAddVisit(manager, 96, 1, "https://example.com/old", "Old"));
+    nanosleep(&sleep_time, NULL);
+    assert(VisitManagerSetTTL(manager, 0));
+    assert(VisitManagerAddVisit(manager, 97, 1, "https://example.com/new", "New"));
+    assert(VisitManagerSetTTL(manager, 0.2));
+    assert(VisitManagerAddVisit(manager, 97, 1, "https://example.com/new", "New"));
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 1 && memory.visit_count == 1);
+
+    // Expiry rewrites the records of spilled users instead of loading them back.
+    assert(VisitManagerSetTTL(manager, 0));
+    assert(VisitManagerAddVisit(manager, 98, 1, "https://example.com/old", "Old"));
+    nanosleep(&sleep_time, NULL);
+    assert(VisitManagerAddVisit(manager, 98, 2, "https://example.com/new", "New"));
+    assert(VisitManagerAddVisit(manager, 95, 1, "https://example.com/new", "New"));
+    assert(VisitManagerSetMemoryBudget(manager, 1));
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.spilled_user_count == 2);
+    assert(VisitManagerSetTTL(manager, 0.2));
+    assert(VisitManagerExpire(manager, 0) == 2);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.spilled_user_count == 1 && memory.user_count == 1);
+
+    // Loading user 98 back finds the rewritten record, and spills user 95 in turn.
+    Visit** visits = VisitManagerGetRecentVisits(manager, 98, &count);
+    assert(count == 1 && visits[0]->visit_id == 2);
+
+    // Clearing a spilled user that can not be read back fails, leaving the time index in place.
+    char spill_path[256];
+    snprintf(spill_path, sizeof(spill_path), "%s.spill", test_file);
+    fclose(fopen(spill_path, "w"));
+    VisitManagerResetStats(manager);
+    VisitManagerClear(manager, 95);
+    VisitManagerStats stats;
+    if (VisitManagerGetStats(manager, &stats)) {
+        assert(stats.ops[VISIT_MANAGER_OP_CLEAR].failures == 1);
+    }
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.spilled_user_count == 1 && memory.time_buckets > 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("TTL expiry test completed.\n");
+}
+
+void test_delete_where(const char* test_file) {
+    printf("\n=== DELETE WHERE TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+
+    // Users 100-103 visit the same five URLs; only the first three are on example.com.
+    const char* urls[] = {"https://Mail.Example.com/inbox", "http://me@example.com:8080/x", "https://notexample.com/",
+                          "example.com/path?next=https://other.org", "https://other.org/example.com"};
+    struct timespec cutoff;
+    for (uint32_t user_id = 100; user_id < 104; user_id++) {
+        for (uint32_t j = 0; j < 5; j++) {
+            assert(VisitManagerAddVisit(manager, user_id, j + 1, urls[j], "Page"));
+        }
+        if (user_id == 101) {
+            timespec_get(&cutoff, TIME_UTC);
+        }
+    }
+
+    // Spill all but the last user, so that the others are matched from the spill file.
+    assert(VisitManagerSetMemoryBudget(manager, 1));
+
+    VisitPredicate predicate = {0};
+    assert(VisitManagerDeleteWhere(manager, &predicate) == 0);
+    predicate.flags = VISIT_MANAGER_DELETE_HOST;
+    predicate.host  = "";
+    assert(VisitManagerDeleteWhere(manager, &predicate) == 0);
+
+    // Criteria combine: visit 2 of every user.
+    uint32_t visit_ids[] = {9, 2, 3};
+    predicate.host           = "EXAMPLE.com";
+    predicate.flags          = VISIT_MANAGER_DELETE_HOST | VISIT_MANAGER_DELETE_VISIT_IDS;
+    predicate.visit_ids      = visit_ids;
+    predicate.visit_id_count = 3;
+    assert(VisitManagerDeleteWhere(manager, &predicate) == 4);
+
+    // The rest of example.com and its subdomains: visits 1 and 4, found through the reverse URL
+    // index. The spilled users are rewritten in place, not loaded back.
+    assert(VisitManagerSetReverseUrlIndex(manager, true));
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    size_t spilled  = memory.spilled_user_count;
+    predicate.flags = VISIT_MANAGER_DELETE_HOST;
+    assert(VisitManagerDeleteWhere(manager, &predicate) == 8);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(spilled == 3 && memory.spilled_user_count == spilled);
+    size_t count;
+    Visit** visits = VisitManagerGetRecentVisits(manager, 100, &count);
+    assert(count == 2);
+    assert(visits[0]->visit_id == 5 && visits[1]->visit_id == 3);
+
+    // Users 100 and 101 visited before the cutoff, and go with their visits. The time index picks
+    // them out without reading the other users.
+    assert(VisitManagerSetTimeIndex(manager, true));
+    predicate.flags     = VISIT_MANAGER_DELETE_BEFORE;
+    predicate.before_ns = (int64_t)cutoff.tv_sec * 1000000000 + cutoff.tv_nsec;
+    assert(VisitManagerDeleteWhere(manager, &predicate) == 4);
+
+    // A predicate that matches nothing is not counted as a failure.
+    VisitManagerResetStats(manager);
+    assert(VisitManagerDeleteWhere(manager, &predicate) == 0);
+    VisitManagerStats stats;
+    if (VisitManagerGetStats(manager, &stats)) {
+        assert(stats.ops[VISIT_MANAGER_OP_DELETE].count == 1 && stats.ops[VISIT_MANAGER_OP_DELETE].failures == 0);
+    }
+
+    // The deletions were persisted.
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.user_count == 2 && memory.visit_count == 4);
+    VisitManagerGetRecentVisits(manager, 101, &count);
+    assert(count == 0);
+    VisitManagerGetRecentVisits(manager, 102, &count);
+    assert(count == 2);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Delete where test completed.\n");
+}
+
+void test_reverse_url_index(const char* test_file) {
+    printf("\n=== REVERSE URL INDEX TEST ===\n");
+
+    remove(test_file);
+    printf("Creating visit manager...\n");
+    VisitManager* manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+
+    // Users 110-113 visit a.com, before the index is on; 110 and 111 visit b.com twice.
+    for (uint32_t user_id = 110; user_id < 114; user_id++) {
+        assert(VisitManagerAddVisit(manager, user_id, 1, "https://a.com/", "A"));
+    }
+    assert(VisitManagerUsersForUrl(manager, "https://a.com/", NULL, 0) == 0);
+    assert(VisitManagerSetReverseUrlIndex(manager, true));
+    for (uint32_t user_id = 110; user_id < 112; user_id++) {
+        assert(VisitManagerAddVisit(manager, user_id, 2, "https://b.com/", "B"));
+        assert(VisitManagerAddVisit(manager, user_id, 3, "https://b.com/", "B"));
+    }
+
+    uint32_t user_ids[8];
+    assert(VisitManagerUsersForUrl(manager, "https://a.com/", user_ids, 2) == 4);
+    assert(user_ids[0] == 110 && user_ids[1] == 111);
+    assert(VisitManagerUsersForUrl(manager, "https://b.com/", user_ids, 8) == 2);
+    assert(VisitManagerUsersForUrl(manager, "https://c.com/", user_ids, 8) == 0);
+
+    // A user stays in the set while it has a visit to the URL.
+    uint32_t visit_id = 2;
+    assert(VisitManagerDelete(manager, 110, &visit_id, 1));
+    assert(VisitManagerUsersForUrl(manager, "https://b.com/", user_ids, 8) == 2);
+    visit_id = 3;
+    assert(VisitManagerDelete(manager, 110, &visit_id, 1));
+    assert(VisitManagerUsersForUrl(manager, "https://b.com/", user_ids, 8) == 1);
+    assert(user_ids[0] == 111);
+    VisitManagerClear(manager, 111);
+    assert(VisitManagerUsersForUrl(manager, "https://b.com/", user_ids, 8) == 0);
+
+    // Eviction takes user 113 out of the set of a.com.
+    for (uint32_t j = 0; j < 10; j++) {
+        assert(VisitManagerAddVisit(manager, 113, j + 10, "https://c.com/", "C"));
+    }
+    assert(VisitManagerUsersForUrl(manager, "https://a.com/", user_ids, 8) == 2);
+
+    // IDs with different upper bits land in different containers, and come out in order.
+    assert(VisitManagerAddVisit(manager, 70000, 1, "https://c.com/", "C"));
+    assert(VisitManagerAddVisit(manager, 5, 1, "https://c.com/", "C"));
+    assert(VisitManagerUsersForUrl(manager, "https://c.com/", user_ids, 8) == 3);
+    assert(user_ids[0] == 5 && user_ids[1] == 113 && user_ids[2] == 70000);
+
+    VisitManagerMemory memory;
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.indexed_urls == 2 && memory.reverse_url_index_bytes > 0);
+
+    // URLs with the same hash keep separate sets.
+    assert(VisitManagerAddVisit(manager, 6, 1, "https://c.com/1562789", "C"));
+    assert(VisitManagerAddVisit(manager, 7, 1, "https://c.com/1779192", "C"));
+    assert(VisitManagerUsersForUrl(manager, "https://c.com/1562789", user_ids, 8) == 1 && user_ids[0] == 6);
+    assert(VisitManagerUsersForUrl(manager, "https://c.com/1779192", user_ids, 8) == 1 && user_ids[0] == 7);
+    VisitManagerClear(manager, 6);
+    VisitManagerClear(manager, 7);
+
+    // A set keeps its URL alive while only a spilled user has visited it.
+    assert(VisitManagerAddVisit(manager, 8, 1, "https://d.com/", "D"));
+    assert(VisitManagerSetMemoryBudget(manager, 1));
+    assert(VisitManagerUsersForUrl(manager, "https://d.com/", user_ids, 8) == 1 && user_ids[0] == 8);
+    assert(VisitManagerSetMemoryBudget(manager, 0));
+    VisitManagerClear(manager, 8);
+    assert(VisitManagerUsersForUrl(manager, "https://d.com/", user_ids, 8) == 0);
+
+    // The setting is persisted and the index rebuilt on load.
+    VisitManagerFree(manager);
+    manager = VisitManagerCreate(test_file, 10);
+    assert(manager != NULL);
+    assert(VisitManagerUsersForUrl(manager, "https://c.com/", user_ids, 8) == 3);
+    assert(user_ids[0] == 5 && user_ids[1] == 113 && user_ids[2] == 70000);
+    assert(VisitManagerUsersForUrl(manager, "https://a.com/", user_ids, 8) == 2);
+    assert(user_ids[0] == 110 && user_ids[1] == 112);
+
+    assert(VisitManagerSetReverseUrlIndex(manager, false));
+    assert(VisitManagerUsersForUrl(manager, "https://c.com/", user_ids, 8) == 0);
+    assert(VisitManagerGetMemory(manager, &memory));
+    assert(memory.indexed_urls == 0 && memory.reverse_url_index_bytes == 0);
+
+    // Clean up
+    printf("Freeing visit manager...\n");
+    VisitManagerFree(manager);
+    printf("Reverse URL index test completed.\n");
+}
+
 int main() {
     printf("=== VISIT MANAGER TEST PROGRAM ===\n");
 
@@ -264,6 +1760,27 @@ int main() {
     test_clear("clear_test.dat");
     test_multiple_delete("multi_delete_test.dat");
     test_nonexistent_user("nonexistent_test.dat");
+    test_add_visit_n("add_visit_n_test.dat");
+    test_pack_recent_visits("pack_test.dat");
+    test_export("export_test.dat");
+    test_stats("stats_test.dat");
+    test_memory("memory_test.dat");
+    test_memory_budget("memory_budget_test.dat");
+    test_compact("compact_test.dat");
+    test_adaptive_capacity("adaptive_capacity_test.dat");
+    test_inline_strings("inline_strings_test.dat");
+    test_interning("interning_test.dat");
+    test_dedup_urls("dedup_urls_test.dat");
+    test_frecency("frecency_test.dat");
+    test_prefix_search("prefix_search_test.dat");
+    test_text_index("text_index_test.dat");
+    test_substring_search("substring_search_test.dat");
+    test_get_recent_visits_multi("batch_test.dat");
+    test_get_latest_visits("latest_test.dat");
+    test_time_index("time_index_test.dat");
+    test_ttl_expiry("ttl_test.dat");
+    test_delete_where("delete_where_test.dat");
+    test_reverse_url_index("reverse_url_index_test.dat");
 
     printf("\nAll tests completed successfully!\n");
     printf("Run make clean to remove all .dat files\n");
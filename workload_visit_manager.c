@@ -0,0 +1,562 @@
+// Workload generator and trace replayer for the VisitManager C API.
+//
+//   workload_visit_manager gen TRACE [options]     write a synthetic trace
+//   workload_visit_manager replay TRACE [options]  drive a VisitManager from a trace
+//
+// Users are drawn from a Zipf or uniform distribution, operations from a
+// configurable add/get/delete/clear mix, and URL and text lengths from a
+// fixed, uniform or exponential distribution.
+//
+// Trace format (native byte order):
+//   header: char magic[8] = "RVTRACE1", uint64_t op_count
+//   record: uint8_t op, uint32_t user_id, uint32_t visit_id,
+//           uint16_t url_len, uint16_t text_len, url bytes, text bytes
+// Only add records carry strings; the others have zero lengths.
+//
+// Replay runs as fast as possible or at a fixed --rate. At a fixed rate,
+// latency is measured from each operation's scheduled start so that stalls
+// are not hidden (no coordinated omission).
+#ifdef BUILD_WORKLOAD
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "bench_util.h"
+#include "recent_visits.h"
+
+#define TRACE_MAGIC "RVTRACE1"
+#define MAX_STRING_LEN 65535
+
+enum {
+    OP_ADD,
+    OP_GET,
+    OP_DELETE,
+    OP_CLEAR,
+    OP_COUNT,
+};
+
+static const char* const op_names[OP_COUNT] = {"add_visit", "get_recent_visits", "delete", "clear"};
+
+// One trace record, strings excluded
+typedef struct {
+    uint8_t op;
+    uint32_t user_id;
+    uint32_t visit_id;
+    uint16_t url_len;
+    uint16_t text_len;
+} TraceRecord;
+
+// Length distribution of generated strings
+typedef struct {
+    enum { LEN_FIXED, LEN_UNIFORM, LEN_EXP } kind;
+    double a;  // Fixed length, uniform minimum or exponential mean
+    double b;  // Uniform maximum
+} LengthDist;
+
+typedef struct {
+    uint64_t ops;          // Number of operations to generate
+    uint64_t users;        // Number of distinct users
+    bool zipf;             // Zipf (true) or uniform user distribution
+    double zipf_s;         // Zipf exponent
+    double mix[OP_COUNT];  // Relative weights of the operations
+    LengthDist url_len;    // URL length distribution
+    LengthDist text_len;   // Text length distribution
+    uint64_t seed;         // Random seed
+} GenConfig;
+
+// Zipf sampler using rejection-inversion (Hörmann & Derflinger), O(1) per
+// sample for any number of elements.
+typedef struct {
+    double n;
+    double s;
+    double h_integral_x1;
+    double h_integral_n;
+    double threshold;
+} ZipfSampler;
+
+static double zipf_helper1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - x * 0.25));
+}
+
+static double zipf_helper2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + x * 0.25));
+}
+
+static double zipf_h(const ZipfSampler* z, double x) {
+    return exp(-z->s * log(x));
+}
+
+static double zipf_h_integral(const ZipfSampler* z, double x) {
+    double log_x = log(x);
+    return zipf_helper2((1 - z->s) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inverse(const ZipfSampler* z, double x) {
+    double t = x * (1 - z->s);
+    if (t < -1) {
+        t = -1;
+    }
+    return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(ZipfSampler* z, uint64_t n, double s) {
+    z->n             = (double)n;
+    z->s             = s;
+    z->h_integral_x1 = zipf_h_integral(z, 1.5) - 1;
+    z->h_integral_n  = zipf_h_integral(z, z->n + 0.5);
+    z->threshold     = 2 - zipf_h_integral_inverse(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+// Sample a rank in [1, n]; rank 1 is the most popular.
+static uint64_t zipf_next(const ZipfSampler* z, uint64_t* rng) {
+    for (;;) {
+        double u = z->h_integral_n + next_random_double(rng) * (z->h_integral_x1 - z->h_integral_n);
+        double x = zipf_h_integral_inverse(z, u);
+        double k = floor(x + 0.5);
+        if (k < 1) {
+            k = 1;
+        } else if (k > z->n) {
+            k = z->n;
+        }
+        if (k - x <= z->threshold || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k)) {
+            return (uint64_t)k;
+        }
+    }
+}
+
+static uint16_t sample_length(const LengthDist* dist, uint64_t* rng) {
+    double len;
+    switch (dist->kind) {
+        case LEN_UNIFORM:
+            len = dist->a + next_random_double(rng) * (dist->b - dist->a + 1);
+            break;
+        case LEN_EXP:
+            len = -dist->a * log(1 - next_random_double(rng));
+            break;
+        default:
+            len = dist->a;
+            break;
+    }
+    if (len < 1) {
+        len = 1;
+    }
+    return len > MAX_STRING_LEN ? MAX_STRING_LEN : (uint16_t)len;
+}
+
+// Parse "fixed:N", "uniform:MIN:MAX" or "exp:MEAN".
+static bool parse_length(const char* arg, LengthDist* dist) {
+    if (sscanf(arg, "fixed:%lf", &dist->a) == 1) {
+        dist->kind = LEN_FIXED;
+        return dist->a >= 1;
+    }
+    if (sscanf(arg, "uniform:%lf:%lf", &dist->a, &dist->b) == 2) {
+        dist->kind = LEN_UNIFORM;
+        return dist->a >= 1 && dist->b >= dist->a;
+    }
+    if (sscanf(arg, "exp:%lf", &dist->a) == 1) {
+        dist->kind = LEN_EXP;
+        return dist->a > 0;
+    }
+    return false;
+}
+
+// Parse "ADD:GET:DELETE:CLEAR" weights.
+static bool parse_mix(const char* arg, double mix[OP_COUNT]) {
+    if (sscanf(arg, "%lf:%lf:%lf:%lf", &mix[OP_ADD], &mix[OP_GET], &mix[OP_DELETE], &mix[OP_CLEAR]) != 4) {
+        return false;
+    }
+    double total = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (mix[i] < 0) {
+            return false;
+        }
+        total += mix[i];
+    }
+    return total > 0;
+}
+
+static void write_record(FILE* file, const TraceRecord* rec, const char* url, const char* text) {
+    fwrite(&rec->op, sizeof(rec->op), 1, file);
+    fwrite(&rec->user_id, sizeof(rec->user_id), 1, file);
+    fwrite(&rec->visit_id, sizeof(rec->visit_id), 1, file);
+    fwrite(&rec->url_len, sizeof(rec->url_len), 1, file);
+    fwrite(&rec->text_len, sizeof(rec->text_len), 1, file);
+    fwrite(url, 1, rec->url_len, file);
+    fwrite(text, 1, rec->text_len, file);
+}
+
+static bool read_record(FILE* file, TraceRecord* rec, char* url, char* text) {
+    return fread(&rec->op, sizeof(rec->op), 1, file) == 1 &&
+           fread(&rec->user_id, sizeof(rec->user_id), 1, file) == 1 &&
+           fread(&rec->visit_id, sizeof(rec->visit_id), 1, file) == 1 &&
+           fread(&rec->url_len, sizeof(rec->url_len), 1, file) == 1 &&
+           fread(&rec->text_len, sizeof(rec->text_len), 1, file) == 1 && rec->op < OP_COUNT &&
+           fread(url, 1, rec->url_len, file) == rec->url_len && fread(text, 1, rec->text_len, file) == rec->text_len;
+}
+
+// Helper function to fill buf with len bytes that look like a URL or title
+static void fill_string(char* buf, uint16_t len, const char* prefix, uint64_t id) {
+    char head[64];
+    int n = snprintf(head, sizeof(head), "%s%llu/", prefix, (unsigned long long)id);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = i < (size_t)n ? head[i] : (char)('a' + (id + i) % 26);
+    }
+}
+
+static int generate(const char* path, const GenConfig* config) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    // The last visit ID added for each user, so deletes target a real visit.
+    uint32_t* last_visit = calloc(config->users + 1, sizeof(uint32_t));
+    char* url            = malloc(MAX_STRING_LEN);
+    char* text           = malloc(MAX_STRING_LEN);
+    if (!last_visit || !url || !text) {
+        free(last_visit);
+        free(url);
+        free(text);
+        fclose(file);
+        return 1;
+    }
+
+    double total = 0;
+    for (int i = 0; i < OP_COUNT; i++) {
+        total += config->mix[i];
+    }
+
+    ZipfSampler zipf;
+    zipf_init(&zipf, config->users, config->zipf_s);
+    uint64_t rng = config->seed ? config->seed : 1;
+
+    fwrite(TRACE_MAGIC, 1, 8, file);
+    fwrite(&config->ops, sizeof(uint64_t), 1, file);
+
+    uint32_t next_visit_id = 1;
+    for (uint64_t i = 0; i < config->ops; i++) {
+        uint64_t user = config->zipf ? zipf_next(&zipf, &rng) : next_random(&rng) % config->users + 1;
+
+        double pick    = next_random_double(&rng) * total;
+        TraceRecord rec = {.op = OP_CLEAR, .user_id = (uint32_t)user};
+        for (int op = 0; op < OP_COUNT; op++) {
+            if (pick < config->mix[op]) {
+                rec.op = (uint8_t)op;
+                break;
+            }
+            pick -= config->mix[op];
+        }
+
+        if (rec.op == OP_ADD) {
+            // URLs come from a shared set; each URL ID always yields the same bytes.
+            uint64_t url_id  = next_random(&rng) % 100000;
+            uint64_t url_rng = url_id * 0x9E3779B97F4A7C15ULL + 1;
+            rec.visit_id     = next_visit_id++;
+            rec.url_len      = sample_length(&config->url_len, &url_rng);
+            rec.text_len     = sample_length(&config->text_len, &rng);
+            last_visit[user] = rec.visit_id;
+            fill_string(url, rec.url_len, "https://example.com/", url_id);
+            fill_string(text, rec.text_len, "Page ", rec.visit_id);
+        } else if (rec.op == OP_DELETE) {
+            rec.visit_id = last_visit[user];
+        }
+
+        write_record(file, &rec, url, text);
+    }
+
+    free(last_visit);
+    free(url);
+    free(text);
+    if (fclose(file) != 0) {
+        fprintf(stderr, "failed to write %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char* db;       // VisitManager file; a temporary file when NULL
+    size_t max_visits;    // max_visits passed to VisitManagerCreate
+    double rate;          // Target operations per second, 0 for maximum
+    bool keep;            // Keep the VisitManager file after the replay
+    bool csv;             // Print CSV instead of JSON lines
+} ReplayConfig;
+
+// Latency samples of one operation type
+typedef struct {
+    uint64_t* samples;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+static bool samples_add(Samples* s, uint64_t value) {
+    if (s->count == s->capacity) {
+        size_t capacity   = s->capacity ? s->capacity * 2 : 1024;
+        uint64_t* samples = realloc(s->samples, capacity * sizeof(uint64_t));
+        if (!samples) {
+            return false;
+        }
+        s->samples  = samples;
+        s->capacity = capacity;
+    }
+    s->samples[s->count++] = value;
+    return true;
+}
+
+static void report(const char* op, Samples* s, double seconds, const ReplayConfig* config) {
+    qsort(s->samples, s->count, sizeof(uint64_t), compare_u64);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    double rate   = seconds > 0 ? (double)s->count / seconds : 0;
+    uint64_t p50  = percentile(s->samples, s->count, 0.50);
+    uint64_t p99  = percentile(s->samples, s->count, 0.99);
+    uint64_t p999 = percentile(s->samples, s->count, 0.999);
+    uint64_t pmax = s->count ? s->samples[s->count - 1] : 0;
+
+    if (config->csv) {
+        printf("%s,%zu,%.6f,%.1f,%.1f,%llu,%llu,%llu,%llu,%ld\n", op, s->count, seconds, rate, config->rate,
+               (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)p999, (unsigned long long)pmax,
+               usage.ru_maxrss);
+    } else {
+        printf("{\"op\":\"%s\",\"ops\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"target_rate\":%.1f,"
+               "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu,\"peak_rss_kb\":%ld}\n",
+               op, s->count, seconds, rate, config->rate, (unsigned long long)p50, (unsigned long long)p99,
+               (unsigned long long)p999, (unsigned long long)pmax, usage.ru_maxrss);
+    }
+}
+
+static void sleep_until(uint64_t deadline) {
+    uint64_t now = now_ns();
+    if (deadline > now) {
+        uint64_t wait         = deadline - now;
+        struct timespec delay = {(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)};
+        nanosleep(&delay, NULL);
+    }
+}
+
+static int replay(const char* path, const ReplayConfig* config) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    char magic[8];
+    uint64_t op_count;
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+        fread(&op_count, sizeof(uint64_t), 1, file) != 1) {
+        fprintf(stderr, "%s is not a visit manager trace\n", path);
+        fclose(file);
+        return 1;
+    }
+
+    char db[4096];
+    if (config->db) {
+        snprintf(db, sizeof(db), "%s", config->db);
+    } else {
+        const char* tmpdir = getenv("TMPDIR");
+        snprintf(db, sizeof(db), "%s/workload_visit_manager_%ld.dat", tmpdir ? tmpdir : "/tmp", (long)getpid());
+    }
+
+    VisitManager* manager = VisitManagerCreate(db, config->max_visits);
+    char* url             = malloc(MAX_STRING_LEN);
+    char* text            = malloc(MAX_STRING_LEN);
+    if (!manager || !url || !text) {
+        fprintf(stderr, "failed to create a visit manager at %s\n", db);
+        VisitManagerFree(manager);
+        free(url);
+        free(text);
+        fclose(file);
+        return 1;
+    }
+
+    Samples samples[OP_COUNT] = {0};
+    Samples all               = {0};
+    uint64_t interval         = config->rate > 0 ? (uint64_t)(1e9 / config->rate) : 0;
+    uint64_t start            = now_ns();
+    int status                = 0;
+
+    TraceRecord rec;
+    for (uint64_t i = 0; i < op_count; i++) {
+        if (!read_record(file, &rec, url, text)) {
+            fprintf(stderr, "trace is truncated after %llu operations\n", (unsigned long long)i);
+            status = 1;
+            break;
+        }
+
+        // At a fixed rate, latency counts from when the operation was due.
+        uint64_t begin = now_ns();
+        if (interval) {
+            uint64_t due = start + i * interval;
+            sleep_until(due);
+            begin = due;
+        }
+
+        size_t count;
+        switch (rec.op) {
+            case OP_ADD:
+                VisitManagerAddVisitN(manager, rec.user_id, rec.visit_id, url, rec.url_len, text, rec.text_len);
+                break;
+            case OP_GET:
+                VisitManagerGetRecentVisits(manager, rec.user_id, &count);
+                break;
+            case OP_DELETE:
+                VisitManagerDelete(manager, rec.user_id, &rec.visit_id, 1);
+                break;
+            case OP_CLEAR:
+                VisitManagerClear(manager, rec.user_id);
+                break;
+        }
+
+        uint64_t latency = now_ns() - begin;
+        if (!samples_add(&samples[rec.op], latency) || !samples_add(&all, latency)) {
+            fprintf(stderr, "out of memory recording latencies\n");
+            status = 1;
+            break;
+        }
+    }
+
+    double seconds = (double)(now_ns() - start) / 1e9;
+    if (config->csv) {
+        printf("op,ops,seconds,ops_per_sec,target_rate,p50_ns,p99_ns,p999_ns,max_ns,peak_rss_kb\n");
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        report(op_names[op], &samples[op], seconds, config);
+        free(samples[op].samples);
+    }
+    report("all", &all, seconds, config);
+    free(all.samples);
+
+    VisitManagerFree(manager);
+    if (!config->keep) {
+        remove(db);
+    }
+    free(url);
+    free(text);
+    fclose(file);
+    return status;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s gen TRACE [options]\n"
+            "  --ops N           operations to generate (default 1000000)\n"
+            "  --users N         distinct users (default 100000)\n"
+            "  --dist zipf|uniform  user distribution (default zipf)\n"
+            "  --zipf-s S        Zipf exponent (default 1.0)\n"
+            "  --mix A:G:D:C     add:get:delete:clear weights (default 30:65:4:1)\n"
+            "  --url-len DIST    fixed:N, uniform:MIN:MAX or exp:MEAN (default exp:64)\n"
+            "  --text-len DIST   same as --url-len (default exp:24)\n"
+            "  --seed N          random seed (default 42)\n"
+            "\n"
+            "Usage: %s replay TRACE [options]\n"
+            "  --db PATH         visit manager file (default: temporary, removed afterwards)\n"
+            "  --keep            keep the visit manager file\n"
+            "  --max-visits N    max visits per user (default 100)\n"
+            "  --rate R          target operations per second (default: as fast as possible)\n"
+            "  --csv             print CSV instead of JSON lines\n",
+            prog, prog);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const char* mode = argv[1];
+    const char* path = argv[2];
+
+    if (strcmp(mode, "gen") == 0) {
+        GenConfig config = {
+            .ops      = 1000000,
+            .users    = 100000,
+            .zipf     = true,
+            .zipf_s   = 1.0,
+            .mix      = {30, 65, 4, 1},
+            .url_len  = {LEN_EXP, 64, 0},
+            .text_len = {LEN_EXP, 24, 0},
+            .seed     = 42,
+        };
+
+        for (int i = 3; i < argc; i++) {
+            const char* arg   = argv[i];
+            const char* value = i + 1 < argc ? argv[++i] : NULL;
+            bool ok           = true;
+
+            if (!value) {
+                ok = false;
+            } else if (strcmp(arg, "--ops") == 0) {
+                config.ops = strtoull(value, NULL, 10);
+            } else if (strcmp(arg, "--users") == 0) {
+                config.users = strtoull(value, NULL, 10);
+                ok           = config.users > 0 && config.users <= UINT32_MAX;
+            } else if (strcmp(arg, "--dist") == 0) {
+                config.zipf = strcmp(value, "zipf") == 0;
+                ok          = config.zipf || strcmp(value, "uniform") == 0;
+            } else if (strcmp(arg, "--zipf-s") == 0) {
+                config.zipf_s = strtod(value, NULL);
+                ok            = config.zipf_s > 0;
+            } else if (strcmp(arg, "--mix") == 0) {
+                ok = parse_mix(value, config.mix);
+            } else if (strcmp(arg, "--url-len") == 0) {
+                ok = parse_length(value, &config.url_len);
+            } else if (strcmp(arg, "--text-len") == 0) {
+                ok = parse_length(value, &config.text_len);
+            } else if (strcmp(arg, "--seed") == 0) {
+                config.seed = strtoull(value, NULL, 10);
+            } else {
+                ok = false;
+            }
+
+            if (!ok) {
+                usage(argv[0]);
+                return 2;
+            }
+        }
+        return generate(path, &config);
+    }
+
+    if (strcmp(mode, "replay") == 0) {
+        ReplayConfig config = {.max_visits = 100};
+
+        for (int i = 3; i < argc; i++) {
+            const char* arg = argv[i];
+            bool ok         = true;
+
+            if (strcmp(arg, "--keep") == 0) {
+                config.keep = true;
+            } else if (strcmp(arg, "--csv") == 0) {
+                config.csv = true;
+            } else if (i + 1 >= argc) {
+                ok = false;
+            } else if (strcmp(arg, "--db") == 0) {
+                config.db = argv[++i];
+            } else if (strcmp(arg, "--max-visits") == 0) {
+                config.max_visits = strtoull(argv[++i], NULL, 10);
+                ok                = config.max_visits > 0;
+            } else if (strcmp(arg, "--rate") == 0) {
+                config.rate = strtod(argv[++i], NULL);
+                ok          = config.rate >= 0;
+            } else {
+                ok = false;
+            }
+
+            if (!ok) {
+                usage(argv[0]);
+                return 2;
+            }
+        }
+        return replay(path, &config);
+    }
+
+    usage(argv[0]);
+    return 2;
+}
+
+#endif /* BUILD_WORKLOAD */